@@ -3,7 +3,9 @@
 # cython: nonecheck=False
 # cython: infer_types=True
 
-__all__ = ["LinearIndexer", "LSHIndexer"]
+__all__ = ["LinearIndexer", "LSHIndexer", "HNSWIndexer", "SparseIndexer", "HammingIndexer",
+           "MinHashIndexer", "SpaceIndexer",
+           "MultiVectorIndexer"]
 
 import numpy as np
 cimport numpy as np
@@ -14,7 +16,9 @@ from libcpp.string cimport string
 from libcpp.vector cimport vector
 
 cimport space
-from space cimport Space, LinearSpace, LSHSpace, SpaceInput, SpaceResult
+from space cimport MakeSpace, Space, LinearSpace, LSHSpace, HNSWSpace, SpaceInput, SpaceResult, SpaceFilter
+from space cimport SparseSpace, SparseInput, HammingSpace, MinHashSpace, SetInput
+from space cimport MultiVectorSpace
 
 np.import_array()
 
@@ -30,6 +34,10 @@ cdef class Indexer:
     def clear(self):
         self._indexer.Clear()
 
+    def build(self):
+        if not self._indexer.Build():
+            raise RuntimeError("build failed")
+
     def size(self):
         return self._indexer.Size()
 
@@ -66,6 +74,26 @@ cdef class Indexer:
         self._indexer.GetNeighborsByPt(<const float*>vec.data, n_neighbors, results)
         return self._query_result(results)
 
+    def query_filtered(self, np.ndarray[np.float32_t, ndim=1, mode='c'] vec not None,
+                       ids, uint32_t n_neighbors=10, bint exclude=False):
+        """Query only among ids, or among all other items if exclude."""
+        cdef vector[uint64_t] c_ids = ids
+        cdef SpaceFilter[uint64_t]* filter = new SpaceFilter[uint64_t](c_ids, exclude)
+        cdef vector[SpaceResult[uint64_t]] results
+        try:
+            self._indexer.GetNeighborsFiltered(<const float*>vec.data, n_neighbors,
+                                               filter[0], results)
+        finally:
+            del filter
+        return self._query_result(results)
+
+    def query_within(self, np.ndarray[np.float32_t, ndim=1, mode='c'] vec not None,
+                     float max_dist):
+        """Query all items within max_dist, closest first."""
+        cdef vector[SpaceResult[uint64_t]] results
+        self._indexer.GetNeighborsWithin(<const float*>vec.data, max_dist, results)
+        return self._query_result(results)
+
     def make_graph(self, output, uint32_t nb_neighbors=10):
         cdef string path
         if isinstance(output, basestring):
@@ -95,3 +123,144 @@ cdef class LinearIndexer(Indexer):
 
     def __dealloc__(self):
         del self._indexer
+
+
+cdef class HNSWIndexer(Indexer):
+
+    def __cinit__(self, uint32_t rank, uint32_t M=16, uint32_t ef_construction=200, uint32_t ef_search=50, uint64_t seed=0):
+        self._indexer = new HNSWSpace[uint64_t](seed)
+        (<HNSWSpace[uint64_t] *>self._indexer).Config(rank, M, ef_construction, ef_search)
+        self._rank = rank
+
+    def __dealloc__(self):
+        del self._indexer
+
+
+cdef class SparseIndexer(Indexer):
+
+    def __cinit__(self, uint32_t rank, uint32_t block_size=64):
+        self._indexer = new SparseSpace[uint64_t]()
+        (<SparseSpace[uint64_t] *>self._indexer).Config(rank, block_size)
+        self._rank = rank
+
+    def __dealloc__(self):
+        del self._indexer
+
+    def upsert_sparse(self, uint64_t id,
+                      np.ndarray[np.uint32_t, ndim=1, mode='c'] indices not None,
+                      np.ndarray[np.float32_t, ndim=1, mode='c'] values not None):
+        assert(len(indices) == len(values))
+        cdef SparseInput[uint64_t] input
+        input.id = id
+        input.indices = <const uint32_t*>indices.data
+        input.values = <const float*>values.data
+        input.nnz = len(indices)
+        return (<SparseSpace[uint64_t] *>self._indexer).UpsertSparse(input)
+
+    def query_sparse(self, np.ndarray[np.uint32_t, ndim=1, mode='c'] indices not None,
+                     np.ndarray[np.float32_t, ndim=1, mode='c'] values not None,
+                     uint32_t n_neighbors=10):
+        assert(len(indices) == len(values))
+        cdef vector[SpaceResult[uint64_t]] results
+        (<SparseSpace[uint64_t] *>self._indexer).GetNeighborsSparse(
+            <const uint32_t*>indices.data, <const float*>values.data, len(indices),
+            n_neighbors, results)
+        return self._query_result(results)
+
+
+cdef class HammingIndexer(Indexer):
+
+    def __cinit__(self, uint32_t rank, uint32_t tables=0):
+        self._indexer = new HammingSpace[uint64_t]()
+        (<HammingSpace[uint64_t] *>self._indexer).Config(rank, tables)
+        self._rank = rank
+
+    def __dealloc__(self):
+        del self._indexer
+
+    def upsert_code(self, uint64_t id, np.ndarray[np.uint64_t, ndim=1, mode='c'] code not None):
+        assert(len(code) == (self._rank + 63) // 64)
+        return (<HammingSpace[uint64_t] *>self._indexer).UpsertCode(
+            id, <const uint64_t*>code.data)
+
+    def query_code(self, np.ndarray[np.uint64_t, ndim=1, mode='c'] code not None,
+                   uint32_t n_neighbors=10):
+        assert(len(code) == (self._rank + 63) // 64)
+        cdef vector[SpaceResult[uint64_t]] results
+        (<HammingSpace[uint64_t] *>self._indexer).GetNeighborsCode(
+            <const uint64_t*>code.data, n_neighbors, results)
+        return self._query_result(results)
+
+
+cdef class MinHashIndexer(Indexer):
+
+    def __cinit__(self, uint32_t rank=0, uint32_t hashes=128, uint32_t L=32, uint32_t b=8,
+                  uint32_t search_k=0, uint64_t seed=0):
+        self._indexer = new MinHashSpace[uint64_t](seed)
+        (<MinHashSpace[uint64_t] *>self._indexer).Config(rank, hashes, L, b, search_k)
+        self._rank = rank
+
+    def __dealloc__(self):
+        del self._indexer
+
+    def upsert_set(self, uint64_t id, np.ndarray[np.uint64_t, ndim=1, mode='c'] elems not None):
+        cdef SetInput[uint64_t] input
+        input.id = id
+        input.elems = <const uint64_t*>elems.data
+        input.nb_elems = len(elems)
+        return (<MinHashSpace[uint64_t] *>self._indexer).UpsertSet(input)
+
+    def query_set(self, np.ndarray[np.uint64_t, ndim=1, mode='c'] elems not None,
+                  uint32_t n_neighbors=10):
+        cdef vector[SpaceResult[uint64_t]] results
+        (<MinHashSpace[uint64_t] *>self._indexer).GetNeighborsSet(
+            <const uint64_t*>elems.data, len(elems), n_neighbors, results)
+        return self._query_result(results)
+
+    def jaccard(self, uint64_t id1, uint64_t id2):
+        return (<MinHashSpace[uint64_t] *>self._indexer).Jaccard(id1, id2)
+
+
+cdef class SpaceIndexer(Indexer):
+
+    def __cinit__(self, uint32_t rank, spec):
+        cdef string c_spec
+        if not isinstance(spec, basestring):
+            raise TypeError(spec)
+        c_spec = spec.encode("utf-8")
+        if not MakeSpace[uint64_t](c_spec, &self._indexer, rank):
+            raise ValueError(spec)
+        self._rank = rank
+
+    def __dealloc__(self):
+        del self._indexer
+
+
+cdef class MultiVectorIndexer(Indexer):
+
+    def __cinit__(self, uint32_t rank, inner="linear", agg="max", uint32_t candidates=0):
+        cdef string c_spec
+        spec = "multi:agg=%s,candidates=%d+%s" % (agg, candidates, inner)
+        c_spec = spec.encode("utf-8")
+        if not MakeSpace[uint64_t](c_spec, &self._indexer, rank):
+            raise ValueError(spec)
+        self._rank = rank
+
+    def __dealloc__(self):
+        del self._indexer
+
+    def upsert_multi(self, uint64_t id, np.ndarray[np.float32_t, ndim=2, mode='c'] vecs not None):
+        assert(vecs.shape[1] == self._rank)
+        return (<MultiVectorSpace[uint64_t] *>self._indexer).UpsertMulti(
+            id, <const float*>vecs.data, vecs.shape[0])
+
+    def query_multi(self, np.ndarray[np.float32_t, ndim=2, mode='c'] vecs not None,
+                    uint32_t n_neighbors=10):
+        assert(vecs.shape[1] == self._rank)
+        cdef vector[SpaceResult[uint64_t]] results
+        (<MultiVectorSpace[uint64_t] *>self._indexer).GetNeighborsMulti(
+            <const float*>vecs.data, vecs.shape[0], n_neighbors, results)
+        return self._query_result(results)
+
+    def nb_vectors(self):
+        return (<MultiVectorSpace[uint64_t] *>self._indexer).NbVectors()
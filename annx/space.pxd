@@ -17,22 +17,37 @@ cdef extern from "ann/space.h" nogil:
         bint operator <  (SpaceResult&, SpaceResult&)
         bint operator == (SpaceResult&, SpaceResult&)
 
+    cdef cppclass SpaceFilter[T]:
+        SpaceFilter()
+        SpaceFilter(vector[T] ids, bint exclude)
+        bint Allows(const T& id)
+
 
 cdef extern from "ann/space.h" nogil:
     cdef cppclass Space[T]:
         Space()
         void Init(size_t nb_dims)
         void Clear()
+        bint Build()
         uint32_t Delete(const T& id)
         uint32_t Upsert(const SpaceInput[T]& input)
         void GetNeighborsById "GetNeighbors" (const T& id, size_t nb_results,
                           vector[SpaceResult[T]]& results)
         void GetNeighborsByPt "GetNeighbors" (const float* point, size_t nb_results,
                           vector[SpaceResult[T]]& results)
+        void GetNeighborsFiltered(const float* point, size_t nb_results,
+                                  const SpaceFilter[T]& filter,
+                                  vector[SpaceResult[T]]& results)
+        void GetNeighborsWithin(const float* point, float max_dist,
+                                vector[SpaceResult[T]]& results)
         void GraphToPath(const string& path, size_t nb_results)
         size_t Size()
 
 
+cdef extern from "ann/space_registry.h" nogil:
+    bint MakeSpace[T](const string& spec, Space[T]** space, size_t nb_dims)
+
+
 cdef extern from "ann/gauss_lsh.h" nogil:
     cdef cppclass LSHSpace[T](Space[T]):
         LSHSpace(uint64_t seed)
@@ -62,3 +77,66 @@ cdef extern from "ann/linear_space.h" nogil:
                           vector[SpaceResult[T]]& results)
         void GraphToPath(const string& path, size_t nb_results)
         size_t Size()
+
+
+cdef extern from "ann/hnsw_space.h" nogil:
+    cdef cppclass HNSWSpace[T](Space[T]):
+        HNSWSpace(uint64_t seed)
+        void Config(size_t nb_dims, size_t M, size_t ef_construction, size_t ef_search)
+        void Init(size_t nb_dims)
+        void Clear()
+        uint32_t Delete(const T& id)
+        uint32_t Upsert(const SpaceInput[T]& input)
+        void GetNeighborsById "GetNeighbors" (const T& id, size_t nb_results,
+                          vector[SpaceResult[T]]& results)
+        void GetNeighborsByPt "GetNeighbors" (const float* point, size_t nb_results,
+                          vector[SpaceResult[T]]& results)
+        void GraphToPath(const string& path, size_t nb_results)
+        size_t Size()
+
+
+cdef extern from "ann/sparse_space.h" nogil:
+    cdef cppclass SparseInput[T]:
+        T id
+        const uint32_t* indices
+        const float* values
+        size_t nnz
+
+    cdef cppclass SparseSpace[T](Space[T]):
+        SparseSpace()
+        void Config(size_t nb_dims, size_t block_size)
+        uint32_t UpsertSparse(const SparseInput[T]& input)
+        void GetNeighborsSparse(const uint32_t* indices, const float* values, size_t nnz,
+                                size_t nb_results, vector[SpaceResult[T]]& results)
+
+
+cdef extern from "ann/hamming_space.h" nogil:
+    cdef cppclass HammingSpace[T](Space[T]):
+        HammingSpace()
+        void Config(size_t nb_bits, size_t nb_tables)
+        uint32_t UpsertCode(const T& id, const uint64_t* code)
+        void GetNeighborsCode(const uint64_t* code, size_t nb_results,
+                              vector[SpaceResult[T]]& results)
+
+
+cdef extern from "ann/minhash_space.h" nogil:
+    cdef cppclass SetInput[T]:
+        T id
+        const uint64_t* elems
+        size_t nb_elems
+
+    cdef cppclass MinHashSpace[T](Space[T]):
+        MinHashSpace(uint64_t seed)
+        void Config(size_t nb_dims, size_t nb_hashes, size_t L, size_t b, size_t search_k)
+        uint32_t UpsertSet(const SetInput[T]& input)
+        void GetNeighborsSet(const uint64_t* elems, size_t nb_elems, size_t nb_results,
+                             vector[SpaceResult[T]]& results)
+        float Jaccard(const T& id1, const T& id2)
+
+
+cdef extern from "ann/multi_vector_space.h" nogil:
+    cdef cppclass MultiVectorSpace[T](Space[T]):
+        uint32_t UpsertMulti(const T& id, const float* points, size_t nb_points)
+        void GetNeighborsMulti(const float* points, size_t nb_points, size_t nb_results,
+                               vector[SpaceResult[T]]& results)
+        size_t NbVectors()
@@ -158,7 +158,7 @@ DEPENDENCY_LINKS = list(set(itertools.chain(
 CXXFLAGS_UNIX = u"""
 -DNDEBUG
 -O3
--std=c++11
+-std=c++14
 -msse4.2
 -ffast-math
 -fexceptions
@@ -277,6 +277,8 @@ def define_extensions(use_cython=False):
             ] + sources,
             depends=[
                 "src/c++/src/ann/gauss_lsh.h",
+                "src/c++/src/ann/hnsw_space.h",
+                "src/c++/src/ann/linear_space.h",
                 "src/c++/src/ann/space.h",
                 "src/c++/src/common/ann_util.h",
             ],
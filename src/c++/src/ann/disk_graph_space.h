@@ -0,0 +1,834 @@
+#pragma once
+
+// SSD-resident graph index in the style of DiskANN.
+//
+// Subramanya et al., "DiskANN: Fast Accurate Billion-point Nearest
+// Neighbor Search on a Single Node" (2019).
+//
+// Rows are staged in memory through Upsert (so spark::LoadFiles can feed
+// the builder) and are scanned exactly until Build(path) runs.  Build
+// constructs a Vamana graph of degree at most R over the staged rows and
+// writes one fixed-size record per node (full vector, degree, neighbors),
+// packed into 4 KiB sectors, followed by the IDs and a product quantizer.
+// The staged rows are then dropped and the file is opened for serving.
+//
+// When serving, only the PQ codes and codebooks are kept in memory.  A
+// query runs a beam search: the beam_width closest unexpanded candidates
+// by PQ distance are fetched together, their exact distances recorded and
+// their neighbors scored by PQ.  Expanded nodes are finally ranked by
+// exact distance.  Records are read from a memory mapping of the file, or
+// with io_threads > 0 through a pool of threads issuing pread, which keeps
+// a whole beam of reads in flight.  Served files are read-only.
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// unix headers
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/align/aligned_allocator.hpp>
+#include <boost/random.hpp>
+
+#include "common/ann_util.h"
+#include "ann/kmeans.h"
+#include "ann/read_pool.h"
+#include "ann/space.h"
+
+using std::unordered_map;
+using std::unordered_set;
+using std::vector;
+using boost::alignment::aligned_allocator;
+using ann::util::ProgressBar;
+
+const size_t kDiskSector = 4096;
+const size_t kDiskCodewords = 256;
+
+struct DiskGraphHeader {
+    char magic[8];
+    uint64_t ndim;
+    uint64_t nb_rows;
+    uint64_t R;
+    uint64_t medoid;
+    uint64_t pq_m;
+    uint64_t id_size;
+    uint64_t record_bytes;
+    uint64_t nodes_per_sector;
+    uint64_t ids_offset;
+    uint64_t codebooks_offset;
+    uint64_t codes_offset;
+    uint64_t file_bytes;
+};
+
+const char kDiskGraphMagic[8] = {'A', 'N', 'N', 'D', 'S', 'K', '1', '\0'};
+
+inline size_t DiskSectorAlign(size_t offset) {
+    return (offset + kDiskSector - 1) / kDiskSector * kDiskSector;
+}
+
+template <typename ID>
+class DiskGraphSpace : public Space<ID> {
+  public:
+    DiskGraphSpace(uint64_t seed=0)
+        : fd_(-1), map_(nullptr), prng_(seed)
+    {};
+    ~DiskGraphSpace();
+
+    void Init(size_t nb_dims) override;
+
+    // R: largest out-degree
+    // L_build: candidate list size while building
+    // alpha: pruning slack of the second build pass (>= 1)
+    // pq_m: one-byte PQ sub-codes per row kept in memory
+    // L_search: candidate list size while querying
+    // beam_width: records fetched together per search step
+    // io_threads: pread threads (if 0, records are read through mmap)
+    // path: file Build() writes the graph to
+    void Config(size_t nb_dims, size_t R=64, size_t L_build=100, float alpha=1.2,
+                size_t pq_m=32, size_t L_search=100, size_t beam_width=4,
+                size_t io_threads=8, const std::string& path="");
+
+    // Build the graph over the staged rows, write it to path and serve
+    // from it.  Returns false on I/O errors.
+    bool Build(const std::string& path);
+    bool Build() override;
+
+    // Serve from a file written by Build.
+    bool Open(const std::string& path);
+
+    void Clear() override;
+
+    unsigned int Delete(const ID& id) override;
+
+    unsigned int Upsert(const SpaceInput<ID>& input) override;
+
+    void GetNeighbors(const float* point, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    void GetNeighbors(const ID& id, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    bool GetPoint(const ID& id, float* point) const override;
+
+    void GetIds(vector<ID>& ids) const override;
+
+    // Get the number of elements stored.
+    size_t Size() const override { return id2row_.size(); }
+
+    // Get Dimensionality
+    size_t Dim() const override { return ndim_; }
+
+    void Info(FILE* log, size_t indent=2, size_t indent_incr=4) const override;
+
+  private:
+    typedef std::pair<float, uint32_t> Candidate;
+
+    bool _Serving() const { return fd_ >= 0; }
+    size_t _SubBegin(size_t j) const { return j * ndim_ / pq_m_; }
+    float _Dist(uint32_t a, uint32_t b) const {
+        return 1.0 - DotProduct(&point_floats_[a * ndim_], &point_floats_[b * ndim_], ndim_);
+    }
+    std::mutex& _Lock(uint32_t row) const { return locks_[row % locks_.size()]; }
+
+    // building
+    void _GreedySearch(const float* point, uint32_t start, size_t L,
+            const vector<vector<uint32_t>>& graph, vector<Candidate>& visited) const;
+    void _RobustPrune(uint32_t row, vector<Candidate>& candidates, float alpha,
+            vector<uint32_t>& out) const;
+    void _TrainPQ(vector<vector<float>>& codebooks, vector<uint8_t>& codes);
+    bool _Write(const std::string& path, const vector<vector<uint32_t>>& graph,
+            uint32_t medoid, const vector<vector<float>>& codebooks,
+            const vector<uint8_t>& codes) const;
+
+    // serving
+    off_t _RecordOffset(uint32_t row) const;
+    bool _ReadRecords(const vector<uint32_t>& rows, char* buffer) const;
+    void _GetNeighbors(const float* point, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const;
+
+    size_t ndim_;
+
+    // staged rows, before Build
+    vector<ID> ids_;
+    vector<float, aligned_allocator<float, 32>> point_floats_;
+
+    // ID to row, staged or served
+    unordered_map<ID, uint32_t> id2row_;
+
+    // served file, and what stays in memory
+    DiskGraphHeader header_;
+    int fd_;
+    void* map_;
+    vector<vector<float>> codebooks_;
+    vector<uint8_t> codes_;
+    vector<ID> row_ids_;
+    std::unique_ptr<ReadPool> pool_;
+
+    // constructor params
+    size_t R_;
+    size_t L_build_;
+    float alpha_;
+    size_t pq_m_;
+    size_t L_search_;
+    size_t beam_width_;
+    size_t io_threads_;
+    std::string path_;
+
+    mutable vector<std::mutex> locks_ = vector<std::mutex>(4096);
+    boost::mt19937_64 prng_;
+};
+
+template <typename ID>
+DiskGraphSpace<ID>::~DiskGraphSpace() {
+    Clear();
+}
+
+template <typename ID>
+void DiskGraphSpace<ID>::Config(size_t nb_dims, size_t R, size_t L_build, float alpha,
+                                size_t pq_m, size_t L_search, size_t beam_width,
+                                size_t io_threads, const std::string& path) {
+    Clear();
+    ndim_ = nb_dims;
+    R_ = std::max<size_t>(R, 1);
+    L_build_ = std::max(L_build, R_);
+    alpha_ = std::max(alpha, 1.0f);
+    pq_m_ = std::max<size_t>(std::min(pq_m, ndim_), 1);
+    L_search_ = std::max<size_t>(L_search, 1);
+    beam_width_ = std::max<size_t>(beam_width, 1);
+    io_threads_ = io_threads;
+    path_ = path;
+}
+
+template <typename ID>
+void DiskGraphSpace<ID>::Init(size_t nb_dims) {
+    Config(nb_dims);
+}
+
+template <typename ID>
+void DiskGraphSpace<ID>::Clear() {
+    pool_.reset();
+    if (map_) {
+        munmap(map_, header_.file_bytes);
+        map_ = nullptr;
+    }
+    if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+    }
+    ids_.clear();
+    point_floats_.clear();
+    id2row_.clear();
+    codebooks_.clear();
+    codes_.clear();
+    row_ids_.clear();
+}
+
+template <typename ID>
+unsigned int DiskGraphSpace<ID>::Delete(const ID& id) {
+    if (_Serving()) {
+        std::cerr << "DiskGraphSpace: served file is read-only" << std::endl;
+        return 0;
+    }
+
+    // Look up the ID.
+    auto it = id2row_.find(id);
+    if (it == id2row_.end()) {
+        return 0;
+    }
+
+    // Swap with the end and resize by one.
+    size_t index = it->second;
+    size_t last = ids_.size() - 1;
+    id2row_[ids_[last]] = index;
+    id2row_.erase(id);
+
+    ids_[index] = ids_[last];
+    ids_.resize(last);
+
+    std::copy(point_floats_.begin() + last * ndim_,
+              point_floats_.begin() + (last + 1) * ndim_,
+              point_floats_.begin() + index * ndim_);
+    point_floats_.resize(last * ndim_);
+    return 1;
+}
+
+template <typename ID>
+unsigned int DiskGraphSpace<ID>::Upsert(const SpaceInput<ID>& input) {
+    if (_Serving()) {
+        std::cerr << "DiskGraphSpace: served file is read-only" << std::endl;
+        return 0;
+    }
+    Delete(input.id);
+
+    // Reject NaN entries.
+    if (!isfinite_xf(input.point, ndim_)) {
+        return 0;
+    }
+
+    float tmp[ndim_];
+
+    // Reject inputs whose norm equals zero
+    if (!normalize(tmp, input.point, ndim_)) {
+        return 0;
+    }
+
+    id2row_[input.id] = ids_.size();
+    ids_.emplace_back(input.id);
+    point_floats_.insert(point_floats_.end(), tmp, tmp + ndim_);
+    return 1;
+}
+
+template <typename ID>
+void DiskGraphSpace<ID>::_GreedySearch(const float* point, uint32_t start, size_t L,
+        const vector<vector<uint32_t>>& graph, vector<Candidate>& visited) const
+{
+    // Candidate list sorted by distance, with an expanded flag per entry.
+    vector<std::pair<Candidate, bool>> list;
+    unordered_set<uint32_t> seen;
+    float dist = 1.0 - DotProduct(&point_floats_[start * ndim_], point, ndim_);
+    list.emplace_back(Candidate(dist, start), false);
+    seen.insert(start);
+    visited.clear();
+
+    vector<uint32_t> neighbors;
+    while (true) {
+        size_t next = 0;
+        while (next < list.size() && list[next].second) {
+            ++next;
+        }
+        if (next == list.size()) {
+            break;
+        }
+        list[next].second = true;
+        uint32_t row = list[next].first.second;
+        visited.emplace_back(list[next].first);
+        {
+            std::lock_guard<std::mutex> guard(_Lock(row));
+            neighbors = graph[row];
+        }
+        for (auto neighbor : neighbors) {
+            if (!seen.insert(neighbor).second) {
+                continue;
+            }
+            float d = 1.0 - DotProduct(&point_floats_[neighbor * ndim_], point, ndim_);
+            if (list.size() == L && d >= list.back().first.first) {
+                continue;
+            }
+            auto entry = std::make_pair(Candidate(d, neighbor), false);
+            list.insert(std::upper_bound(list.begin(), list.end(), entry), entry);
+            if (list.size() > L) {
+                list.pop_back();
+            }
+        }
+    }
+}
+
+template <typename ID>
+void DiskGraphSpace<ID>::_RobustPrune(uint32_t row, vector<Candidate>& candidates,
+        float alpha, vector<uint32_t>& out) const
+{
+    std::sort(candidates.begin(), candidates.end());
+    out.clear();
+    vector<bool> pruned(candidates.size(), false);
+    for (size_t i = 0; i < candidates.size() && out.size() < R_; ++i) {
+        uint32_t c = candidates[i].second;
+        if (pruned[i] || c == row ||
+                std::find(out.begin(), out.end(), c) != out.end()) {
+            continue;
+        }
+        out.emplace_back(c);
+
+        // Drop candidates that are much closer to c than to row.
+        for (size_t j = i + 1; j < candidates.size(); ++j) {
+            if (!pruned[j] && alpha * _Dist(c, candidates[j].second) <= candidates[j].first) {
+                pruned[j] = true;
+            }
+        }
+    }
+}
+
+template <typename ID>
+void DiskGraphSpace<ID>::_TrainPQ(vector<vector<float>>& codebooks, vector<uint8_t>& codes) {
+    size_t total = ids_.size();
+    codebooks.assign(pq_m_, vector<float>());
+    for (size_t j = 0; j < pq_m_; ++j) {
+        size_t begin = _SubBegin(j);
+        KMeans(&point_floats_[begin], total, _SubBegin(j + 1) - begin, ndim_,
+               kDiskCodewords, codebooks[j], prng_, false);
+    }
+    codes.resize(total * pq_m_);
+    #pragma omp parallel for
+    for (size_t i = 0; i < total; ++i) {
+        for (size_t j = 0; j < pq_m_; ++j) {
+            size_t begin = _SubBegin(j);
+            codes[i * pq_m_ + j] = NearestCentroid(&point_floats_[i * ndim_ + begin],
+                    codebooks[j], _SubBegin(j + 1) - begin, false);
+        }
+    }
+}
+
+template <typename ID>
+bool DiskGraphSpace<ID>::Build() {
+    if (path_.empty()) {
+        std::cerr << "DiskGraphSpace: no path configured to build to" << std::endl;
+        return false;
+    }
+    return Build(path_);
+}
+
+template <typename ID>
+bool DiskGraphSpace<ID>::Build(const std::string& path) {
+    if (_Serving()) {
+        std::cerr << "DiskGraphSpace: served file is read-only" << std::endl;
+        return false;
+    }
+    size_t total = ids_.size();
+    if (total == 0) {
+        std::cerr << "DiskGraphSpace: nothing to build" << std::endl;
+        return false;
+    }
+
+    // Start from the row closest to the mean direction.
+    vector<float> mean(ndim_, 0.0);
+    for (size_t i = 0; i < total; ++i) {
+        for (size_t d = 0; d < ndim_; ++d) {
+            mean[d] += point_floats_[i * ndim_ + d];
+        }
+    }
+    uint32_t medoid = 0;
+    float best = -std::numeric_limits<float>::max();
+    for (size_t i = 0; i < total; ++i) {
+        float dot = DotProduct(&point_floats_[i * ndim_], mean.data(), ndim_);
+        if (dot > best) {
+            best = dot;
+            medoid = i;
+        }
+    }
+
+    // Random initial graph, then one pass with alpha = 1 and one with
+    // alpha, as in Vamana.
+    vector<vector<uint32_t>> graph(total);
+    size_t degree = std::min(R_, total - 1);
+    boost::uniform_int<uint32_t> pick(0, total - 1);
+    for (uint32_t i = 0; i < total; ++i) {
+        while (graph[i].size() < degree) {
+            uint32_t j = pick(prng_);
+            if (j != i && std::find(graph[i].begin(), graph[i].end(), j) == graph[i].end()) {
+                graph[i].emplace_back(j);
+            }
+        }
+    }
+    vector<uint32_t> order(total);
+    for (uint32_t i = 0; i < total; ++i) {
+        order[i] = i;
+    }
+    auto progBar = ProgressBar(2 * total);
+    for (float alpha : {1.0f, alpha_}) {
+        for (size_t i = total; i > 1; --i) {
+            std::swap(order[i - 1], order[boost::uniform_int<size_t>(0, i - 1)(prng_)]);
+        }
+        #pragma omp parallel for schedule(dynamic, 64) shared(progBar)
+        for (size_t i = 0; i < total; ++i) {
+            uint32_t row = order[i];
+            vector<Candidate> candidates;
+            _GreedySearch(&point_floats_[row * ndim_], medoid, L_build_, graph, candidates);
+            {
+                std::lock_guard<std::mutex> guard(_Lock(row));
+                for (auto neighbor : graph[row]) {
+                    candidates.emplace_back(_Dist(row, neighbor), neighbor);
+                }
+            }
+            vector<uint32_t> pruned;
+            _RobustPrune(row, candidates, alpha, pruned);
+            {
+                std::lock_guard<std::mutex> guard(_Lock(row));
+                graph[row] = pruned;
+            }
+
+            // Add the reverse edges, pruning neighbors that overflow.
+            for (auto neighbor : pruned) {
+                std::lock_guard<std::mutex> guard(_Lock(neighbor));
+                auto& links = graph[neighbor];
+                if (std::find(links.begin(), links.end(), row) != links.end()) {
+                    continue;
+                }
+                if (links.size() < R_) {
+                    links.emplace_back(row);
+                    continue;
+                }
+                vector<Candidate> overflow;
+                overflow.emplace_back(_Dist(neighbor, row), row);
+                for (auto link : links) {
+                    overflow.emplace_back(_Dist(neighbor, link), link);
+                }
+                _RobustPrune(neighbor, overflow, alpha, links);
+            }
+            #pragma omp critical
+            {
+            progBar.update();
+            }
+        }
+    }
+
+    vector<vector<float>> codebooks;
+    vector<uint8_t> codes;
+    _TrainPQ(codebooks, codes);
+    if (!_Write(path, graph, medoid, codebooks, codes)) {
+        return false;
+    }
+    Clear();
+    return Open(path);
+}
+
+template <typename ID>
+bool DiskGraphSpace<ID>::_Write(const std::string& path, const vector<vector<uint32_t>>& graph,
+        uint32_t medoid, const vector<vector<float>>& codebooks,
+        const vector<uint8_t>& codes) const
+{
+    size_t total = ids_.size();
+    DiskGraphHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, kDiskGraphMagic, sizeof(header.magic));
+    header.ndim = ndim_;
+    header.nb_rows = total;
+    header.R = R_;
+    header.medoid = medoid;
+    header.pq_m = pq_m_;
+    header.id_size = sizeof(ID);
+    header.record_bytes = ndim_ * sizeof(float) + (R_ + 1) * sizeof(uint32_t);
+    header.nodes_per_sector = kDiskSector / header.record_bytes;
+    size_t record_span = header.record_bytes;
+    if (header.nodes_per_sector == 0) {
+        // Large records start on their own sector.
+        record_span = DiskSectorAlign(header.record_bytes);
+    }
+
+    std::ofstream out(path, std::ofstream::binary | std::ofstream::trunc);
+    if (!out) {
+        std::cerr << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    auto pad_to = [&out] (size_t offset) {
+        size_t pad = offset - out.tellp();
+        out.write(string(pad, '\0').data(), pad);
+    };
+
+    // Header sector, then node records.
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    pad_to(kDiskSector);
+    vector<char> record(header.record_bytes);
+    for (size_t i = 0; i < total; ++i) {
+        if (header.nodes_per_sector > 0 && i % header.nodes_per_sector == 0) {
+            pad_to(kDiskSector * (1 + i / header.nodes_per_sector));
+        } else if (header.nodes_per_sector == 0) {
+            pad_to(kDiskSector + i * record_span);
+        }
+        std::fill(record.begin(), record.end(), 0);
+        std::memcpy(record.data(), &point_floats_[i * ndim_], ndim_ * sizeof(float));
+        uint32_t degree = graph[i].size();
+        char* links = record.data() + ndim_ * sizeof(float);
+        std::memcpy(links, &degree, sizeof(degree));
+        std::memcpy(links + sizeof(degree), graph[i].data(), degree * sizeof(uint32_t));
+        out.write(record.data(), record.size());
+    }
+
+    header.ids_offset = DiskSectorAlign(out.tellp());
+    pad_to(header.ids_offset);
+    out.write(reinterpret_cast<const char*>(ids_.data()), total * sizeof(ID));
+
+    header.codebooks_offset = DiskSectorAlign(out.tellp());
+    pad_to(header.codebooks_offset);
+    for (size_t j = 0; j < pq_m_; ++j) {
+        // Codebooks have fewer than 256 rows when there are few rows.
+        vector<float> padded(codebooks[j]);
+        padded.resize(kDiskCodewords * (_SubBegin(j + 1) - _SubBegin(j)), 0.0);
+        out.write(reinterpret_cast<const char*>(padded.data()), padded.size() * sizeof(float));
+    }
+
+    header.codes_offset = DiskSectorAlign(out.tellp());
+    pad_to(header.codes_offset);
+    out.write(reinterpret_cast<const char*>(codes.data()), codes.size());
+    header.file_bytes = out.tellp();
+
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (!out) {
+        std::cerr << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+template <typename ID>
+bool DiskGraphSpace<ID>::Open(const std::string& path) {
+    Clear();
+    fd_ = open(path.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+        std::cerr << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (pread(fd_, &header_, sizeof(header_), 0) != sizeof(header_) ||
+            std::memcmp(header_.magic, kDiskGraphMagic, sizeof(header_.magic)) != 0 ||
+            fstat(fd_, &st) != 0 || (uint64_t) st.st_size < header_.file_bytes ||
+            header_.ndim != ndim_ || header_.id_size != sizeof(ID)) {
+        std::cerr << path << ": graph file does not match this space" << std::endl;
+        Clear();
+        return false;
+    }
+
+    // IDs, codebooks and codes are read into memory.
+    size_t total = header_.nb_rows;
+    pq_m_ = header_.pq_m;
+    R_ = header_.R;
+    row_ids_.resize(total);
+    codebooks_.assign(pq_m_, vector<float>());
+    codes_.resize(total * pq_m_);
+    vector<ReadRequest> requests;
+    requests.push_back({fd_, (off_t) header_.ids_offset, total * sizeof(ID), row_ids_.data()});
+    off_t offset = header_.codebooks_offset;
+    for (size_t j = 0; j < pq_m_; ++j) {
+        size_t len = _SubBegin(j + 1) - _SubBegin(j);
+        codebooks_[j].resize(kDiskCodewords * len);
+        requests.push_back({fd_, offset, codebooks_[j].size() * sizeof(float), codebooks_[j].data()});
+        offset += codebooks_[j].size() * sizeof(float);
+    }
+    requests.push_back({fd_, (off_t) header_.codes_offset, codes_.size(), codes_.data()});
+    {
+        ReadPool loader(4);
+        if (!loader.Read(requests)) {
+            std::cerr << path << ": " << strerror(errno) << std::endl;
+            Clear();
+            return false;
+        }
+    }
+    for (size_t i = 0; i < total; ++i) {
+        id2row_[row_ids_[i]] = i;
+    }
+
+    if (io_threads_ > 0) {
+        pool_.reset(new ReadPool(io_threads_));
+    } else {
+        map_ = mmap(nullptr, header_.file_bytes, PROT_READ, MAP_SHARED, fd_, 0);
+        if (map_ == MAP_FAILED) {
+            map_ = nullptr;
+            std::cerr << "mmap: " << strerror(errno) << std::endl;
+            Clear();
+            return false;
+        }
+        madvise(map_, header_.file_bytes, MADV_RANDOM);
+    }
+    return true;
+}
+
+template <typename ID>
+off_t DiskGraphSpace<ID>::_RecordOffset(uint32_t row) const {
+    if (header_.nodes_per_sector == 0) {
+        return kDiskSector + row * DiskSectorAlign(header_.record_bytes);
+    }
+    return kDiskSector * (1 + row / header_.nodes_per_sector) +
+           (row % header_.nodes_per_sector) * header_.record_bytes;
+}
+
+template <typename ID>
+bool DiskGraphSpace<ID>::_ReadRecords(const vector<uint32_t>& rows, char* buffer) const {
+    size_t bytes = header_.record_bytes;
+    if (map_) {
+        for (size_t i = 0; i < rows.size(); ++i) {
+            std::memcpy(buffer + i * bytes,
+                        static_cast<const char*>(map_) + _RecordOffset(rows[i]), bytes);
+        }
+        return true;
+    }
+    vector<ReadRequest> requests;
+    for (size_t i = 0; i < rows.size(); ++i) {
+        requests.push_back({fd_, _RecordOffset(rows[i]), bytes, buffer + i * bytes});
+    }
+    return pool_->Read(requests);
+}
+
+template <typename ID>
+void DiskGraphSpace<ID>::_GetNeighbors(const float* point, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    results.clear();
+    if (!_Serving()) {
+        for (size_t i = 0; i < ids_.size(); ++i) {
+            SpaceResult<ID> r;
+            r.id = ids_[i];
+            r.dist = 1.0 - DotProduct(&point_floats_[i * ndim_], point, ndim_);
+            PushTopK(results, r, nb_results);
+        }
+        std::sort_heap(results.begin(), results.end());
+        return;
+    }
+    if (header_.nb_rows == 0) {
+        return;
+    }
+
+    // Dot products of each query subvector with every codeword.
+    vector<float> table(pq_m_ * kDiskCodewords);
+    for (size_t j = 0; j < pq_m_; ++j) {
+        size_t begin = _SubBegin(j);
+        size_t len = _SubBegin(j + 1) - begin;
+        for (size_t k = 0; k < kDiskCodewords; ++k) {
+            table[j * kDiskCodewords + k] =
+                DotProduct(&codebooks_[j][k * len], point + begin, len);
+        }
+    }
+    auto pq_dist = [&] (uint32_t row) {
+        const uint8_t* code = &codes_[row * pq_m_];
+        float dot = 0.0;
+        for (size_t j = 0; j < pq_m_; ++j) {
+            dot += table[j * kDiskCodewords + code[j]];
+        }
+        return 1.0f - dot;
+    };
+
+    // Candidate list sorted by PQ distance, with an expanded flag.
+    vector<std::pair<Candidate, bool>> list;
+    unordered_set<uint32_t> seen;
+    uint32_t medoid = header_.medoid;
+    list.emplace_back(Candidate(pq_dist(medoid), medoid), false);
+    seen.insert(medoid);
+
+    size_t bytes = header_.record_bytes;
+    vector<char> buffer(beam_width_ * bytes);
+    vector<uint32_t> beam;
+    vector<SpaceResult<uint32_t>> expanded;
+    while (true) {
+        beam.clear();
+        for (auto& entry : list) {
+            if (!entry.second) {
+                entry.second = true;
+                beam.emplace_back(entry.first.second);
+                if (beam.size() == beam_width_) {
+                    break;
+                }
+            }
+        }
+        if (beam.empty()) {
+            break;
+        }
+        if (!_ReadRecords(beam, buffer.data())) {
+            std::cerr << "DiskGraphSpace: " << strerror(errno) << std::endl;
+            break;
+        }
+
+        for (size_t b = 0; b < beam.size(); ++b) {
+            const char* record = buffer.data() + b * bytes;
+            const float* vec = reinterpret_cast<const float*>(record);
+            SpaceResult<uint32_t> r;
+            r.id = beam[b];
+            r.dist = 1.0 - DotProduct(vec, point, ndim_);
+            expanded.emplace_back(r);
+
+            uint32_t degree;
+            const char* links = record + ndim_ * sizeof(float);
+            std::memcpy(&degree, links, sizeof(degree));
+            const uint32_t* neighbors = reinterpret_cast<const uint32_t*>(links + sizeof(degree));
+            for (uint32_t n = 0; n < degree; ++n) {
+                uint32_t neighbor = neighbors[n];
+                if (!seen.insert(neighbor).second) {
+                    continue;
+                }
+                float d = pq_dist(neighbor);
+                if (list.size() == L_search_ && d >= list.back().first.first) {
+                    continue;
+                }
+                auto entry = std::make_pair(Candidate(d, neighbor), false);
+                list.insert(std::upper_bound(list.begin(), list.end(), entry), entry);
+                if (list.size() > L_search_) {
+                    list.pop_back();
+                }
+            }
+        }
+    }
+
+    for (auto& e : expanded) {
+        SpaceResult<ID> r;
+        r.id = row_ids_[e.id];
+        r.dist = e.dist;
+        PushTopK(results, r, nb_results);
+    }
+    std::sort_heap(results.begin(), results.end());
+}
+
+template <typename ID>
+void DiskGraphSpace<ID>::GetNeighbors(const float* point, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    float tmp[ndim_];
+    if (!normalize(tmp, point, ndim_)) {
+        results.clear();
+        return;
+    }
+    _GetNeighbors(tmp, nb_results, results);
+}
+
+template <typename ID>
+void DiskGraphSpace<ID>::GetNeighbors(const ID& id, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    auto it = id2row_.find(id);
+    if (it == id2row_.end()) {
+        return;
+    }
+    if (!_Serving()) {
+        _GetNeighbors(&point_floats_[it->second * ndim_], nb_results, results);
+        return;
+    }
+    vector<char> record(header_.record_bytes);
+    if (_ReadRecords({it->second}, record.data())) {
+        _GetNeighbors(reinterpret_cast<const float*>(record.data()), nb_results, results);
+    }
+}
+
+template <typename ID>
+bool DiskGraphSpace<ID>::GetPoint(const ID& id, float* point) const {
+    auto it = id2row_.find(id);
+    if (it == id2row_.end()) {
+        return false;
+    }
+    if (!_Serving()) {
+        std::copy_n(&point_floats_[it->second * ndim_], ndim_, point);
+        return true;
+    }
+    vector<char> record(header_.record_bytes);
+    if (!_ReadRecords({it->second}, record.data())) {
+        return false;
+    }
+    std::copy_n(reinterpret_cast<const float*>(record.data()), ndim_, point);
+    return true;
+}
+
+template <typename ID>
+void DiskGraphSpace<ID>::GetIds(vector<ID>& ids) const {
+    ids = _Serving() ? row_ids_ : ids_;
+}
+
+template <typename ID>
+void DiskGraphSpace<ID>::Info(FILE* log, size_t indent, size_t indent_incr) const {
+    Space<ID>::Info(log, indent, indent_incr);
+    string zero(indent, ' ');
+    fprintf(log, "%sserving: %s\n", zero.c_str(), _Serving() ? "yes" : "no");
+    if (_Serving()) {
+        fprintf(log, "%srecord bytes: %zu\n", zero.c_str(), (size_t) header_.record_bytes);
+        fprintf(log, "%sin-memory code bytes: %zu\n", zero.c_str(), codes_.size());
+    }
+}
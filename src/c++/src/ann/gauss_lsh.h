@@ -77,6 +77,20 @@ class LSHSpace : public Space<ID> {
         void GetNeighbors(const ID& id, size_t nb_results,
                 vector<SpaceResult<ID>>& results) const override;
 
+        // Count only the bucket hits the filter allows.  A filter allowing
+        // no more items than the candidate budget is answered exactly.
+        void GetNeighborsFiltered(const float* point, size_t nb_results,
+                const SpaceFilter<ID>& filter, vector<SpaceResult<ID>>& results) const override;
+
+        // Score every item sharing a bucket with the point; items within
+        // max_dist but in no common bucket are missed.
+        void GetNeighborsWithin(const float* point, float max_dist,
+                vector<SpaceResult<ID>>& results) const override;
+
+        bool GetPoint(const ID& id, float* point) const override;
+
+        void GetIds(vector<ID>& ids) const override;
+
         void GraphToStream(std::ostream& out, size_t nb_results) const override;
 
         // Get the number of elements stored.
@@ -98,7 +112,7 @@ class LSHSpace : public Space<ID> {
                 std::function<void(size_t, const std::string&)> func) const;
 
         void GetNeighbors(const Eigen::VectorXf &vec, size_t nb_results,
-            vector<SpaceResult<ID>>& results) const;
+            vector<SpaceResult<ID>>& results, const SpaceFilter<ID>* filter=nullptr) const;
 
         // dynamically allocated members
         // actual data stored
@@ -167,7 +181,7 @@ unsigned int LSHSpace<ID>::Delete(const ID& id) {
     }
     size_t curr_idx = it->second;
     size_t last_idx = ids_.size() - 1;
-    auto& last_id = ids_[last_idx];
+    ID last_id = ids_[last_idx];
     auto& curr_point = points_[curr_idx];
 
     _IterBuckets(curr_point, [this, &id] (size_t bucket_idx, const std::string &key) {
@@ -183,10 +197,12 @@ unsigned int LSHSpace<ID>::Delete(const ID& id) {
     });
 
     // Swap with the end and resize by one.
+    id2index_.erase(it);
+    if (curr_idx != last_idx) {
+        id2index_[last_id] = curr_idx;
+    }
     ids_[curr_idx] = last_id;
     ids_.resize(last_idx);
-    id2index_.erase(it);
-    id2index_[last_id] = curr_idx;
 
     points_[curr_idx] = points_[last_idx];
     points_.resize(last_idx);
@@ -274,16 +290,19 @@ unsigned int LSHSpace<ID>::Upsert(const SpaceInput<ID>& input) {
 
 template <typename ID>
 void LSHSpace<ID>::GetNeighbors(const Eigen::VectorXf& evec, size_t nb_results,
-        vector<SpaceResult<ID>>& results) const
+        vector<SpaceResult<ID>>& results, const SpaceFilter<ID>* filter) const
 {
     std::unordered_map<ID, uint32_t> counter;
 
-    _IterBuckets(evec, [this, &counter] (size_t bucket_idx, const std::string &key) {
+    _IterBuckets(evec, [this, &counter, filter] (size_t bucket_idx, const std::string &key) {
         auto& bucket = this->buckets_[bucket_idx];
         auto it = bucket.find(key);
         if (it != bucket.end()) {
             auto& ids = it->second;
             for (auto& id : ids) {
+                if (filter && !filter->Allows(id)) {
+                    continue;
+                }
                 counter[id]++;
             }
         }
@@ -310,15 +329,11 @@ void LSHSpace<ID>::GetNeighbors(const Eigen::VectorXf& evec, size_t nb_results,
         }
         ++tmp_it;
     }
-    // next sort by distances in ascending order
+    // next sort by distances in ascending order, and keep the nb_results
+    // first in place of whatever results held
     std::sort(candidates.begin(), candidates.end());
-    results.reserve(nb_results);
-    auto limit = std::min(candidates.size(), results.capacity());
-    auto it = candidates.begin();
-    for (i = 0; i < limit; ++i) {
-        results.emplace_back(*it);
-        ++it;
-    }
+    auto limit = std::min(candidates.size(), nb_results);
+    results.assign(candidates.begin(), candidates.begin() + limit);
 }
 
 template <typename ID>
@@ -346,7 +361,86 @@ void LSHSpace<ID>::GetNeighbors(const ID& id, size_t nb_results,
         auto index = it->second;
         auto& vec = points_[index];
         GetNeighbors(vec, nb_results, results);
+    } else {
+        results.clear();
+    }
+}
+
+template <typename ID>
+void LSHSpace<ID>::GetNeighborsFiltered(const float* point, size_t nb_results,
+        const SpaceFilter<ID>& filter, vector<SpaceResult<ID>>& results) const
+{
+    results.clear();
+    std::vector<float> vec(point, point + ndim_);
+    auto evec = Eigen::Map<Eigen::VectorXf>(vec.data(), ndim_);
+    evec.normalize();
+
+    // Few allowed items rarely share buckets with the query, so counting
+    // would find too few of them: score them all when they fit the budget.
+    size_t search_k = (search_k_ == 0) ? L_ * nb_results : search_k_;
+    if (filter.NbAllowed(ids_.size()) > search_k) {
+        GetNeighbors(evec, nb_results, results, &filter);
+        return;
+    }
+    filter.ForEachSlot(ids_, id2index_, [&] (size_t slot) {
+        SpaceResult<ID> r;
+        r.id = ids_[slot];
+        r.dist = 1.0 - evec.dot(points_[slot]);
+        PushTopK(results, r, nb_results);
+    });
+    std::sort_heap(results.begin(), results.end());
+}
+
+template <typename ID>
+void LSHSpace<ID>::GetNeighborsWithin(const float* point, float max_dist,
+        vector<SpaceResult<ID>>& results) const
+{
+    results.clear();
+    std::vector<float> vec(point, point + ndim_);
+    auto evec = Eigen::Map<Eigen::VectorXf>(vec.data(), ndim_);
+    evec.normalize();
+
+    std::unordered_set<ID> seen;
+    _IterBuckets(evec, [this, &evec, &seen, &results, max_dist] (size_t bucket_idx,
+                                                                const std::string &key) {
+        auto& bucket = this->buckets_[bucket_idx];
+        auto it = bucket.find(key);
+        if (it == bucket.end()) {
+            return;
+        }
+        for (auto& id : it->second) {
+            if (!seen.insert(id).second) {
+                continue;
+            }
+            auto idx = this->id2index_.find(id);
+            if (idx == this->id2index_.end()) {
+                continue;
+            }
+            SpaceResult<ID> r;
+            r.id = id;
+            r.dist = 1.0 - evec.dot(this->points_[idx->second]);
+            if (r.dist <= max_dist) {
+                results.emplace_back(r);
+            }
+        }
+    });
+    std::sort(results.begin(), results.end());
+}
+
+template <typename ID>
+bool LSHSpace<ID>::GetPoint(const ID& id, float* point) const {
+    auto it = id2index_.find(id);
+    if (it == id2index_.end()) {
+        return false;
     }
+    auto& vec = points_[it->second];
+    std::copy(vec.data(), vec.data() + ndim_, point);
+    return true;
+}
+
+template <typename ID>
+void LSHSpace<ID>::GetIds(vector<ID>& ids) const {
+    ids.assign(ids_.begin(), ids_.end());
 }
 
 template <typename ID>
@@ -0,0 +1,479 @@
+#pragma once
+
+// Nearest neighbors of binary codes under Hamming distance.
+//
+// Codes of nb_bits bits are stored packed, BitWords(nb_bits) words per
+// item, so a 256-bit code takes 32 bytes instead of the 1 KiB of its
+// floats.  UpsertCode takes packed codes; dense points given to Upsert are
+// packed from the signs of their components (see SignBits).  Distances
+// are reported as the number of differing bits.
+//
+// Without tables, queries scan every code (POPCNT, or VPOPCNTDQ with
+// AVX-512).  With nb_tables > 0, codes are also indexed by multi-index
+// hashing (Norouzi et al., "Fast search in Hamming space with multi-index
+// hashing", 2012): codes are split into nb_tables substrings of at most 64
+// bits, each keying an exact-match table.  A code within distance d of
+// the query has a substring within d / nb_tables of the query's, so
+// probing every table at substring radius 0, 1, 2... finds the exact k
+// nearest, stopping once the k-th distance is below what the radius
+// covers.  Lookups cost far more than scanning a code, so queries whose
+// probing would cost more than a scan fall back to scanning: tables pay
+// off when the k-th neighbor is close, as with near-duplicates.  About
+// nb_bits / log2(Size()) tables works best.
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__AVX512VPOPCNTDQ__)
+#include <immintrin.h>
+#endif
+
+#include "common/ann_util.h"
+#include "ann/space.h"
+
+using std::vector;
+using std::unordered_map;
+using ann::util::ProgressBar;
+
+// Hamming distances from query to nb_rows codes of words words each.
+inline void HammingScan(const uint64_t* codes, size_t nb_rows, size_t words,
+                        const uint64_t* query, uint32_t* dists) {
+#if defined(__AVX512VPOPCNTDQ__)
+    for (size_t r = 0; r < nb_rows; ++r) {
+        const uint64_t* code = codes + r * words;
+        __m512i acc = _mm512_setzero_si512();
+        for (size_t w = 0; w < words; w += 8) {
+            __mmask8 mask = (words - w >= 8) ? 0xff : (__mmask8) ((1u << (words - w)) - 1);
+            __m512i x = _mm512_xor_si512(_mm512_maskz_loadu_epi64(mask, code + w),
+                                         _mm512_maskz_loadu_epi64(mask, query + w));
+            acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(x));
+        }
+        dists[r] = _mm512_reduce_add_epi64(acc);
+    }
+#else
+    for (size_t r = 0; r < nb_rows; ++r) {
+        dists[r] = HammingDistance(codes + r * words, query, words);
+    }
+#endif
+}
+
+template <typename ID>
+class HammingSpace : public Space<ID> {
+  public:
+    HammingSpace() {};
+    ~HammingSpace() {}
+
+    void Init(size_t nb_dims) override;
+
+    // nb_bits: code length (the dimension of dense points)
+    // nb_tables: multi-index hashing tables, 0 to always scan; raised to
+    //     at least nb_bits / 64
+    void Config(size_t nb_bits, size_t nb_tables=0);
+
+    void Clear() override;
+
+    unsigned int Delete(const ID& id) override;
+
+    unsigned int Upsert(const SpaceInput<ID>& input) override;
+
+    // code holds BitWords(Dim()) words; bits past Dim() are ignored.
+    unsigned int UpsertCode(const ID& id, const uint64_t* code);
+
+    void GetNeighbors(const float* point, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    void GetNeighbors(const ID& id, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    void GetNeighborsCode(const uint64_t* code, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const;
+
+    // Write the code of an ID as components of +1 (set bits) and -1.
+    // These are not the points given, so wrappers do not accept hamming.
+    bool GetPoint(const ID& id, float* point) const override;
+    bool KeepsPoints() const override { return false; }
+
+    bool GetCode(const ID& id, uint64_t* code) const;
+
+    void GetIds(vector<ID>& ids) const override;
+
+    // Get the number of elements stored.
+    size_t Size() const override;
+
+    // Get Dimensionality
+    size_t Dim() const override { return nb_bits_; }
+
+    const char* MetricName() const override { return "hamming"; }
+
+    void Info(FILE* log, size_t indent=2, size_t indent_incr=4) const override;
+
+  private:
+    typedef unordered_map<uint64_t, vector<uint32_t>> Table;
+
+    void _Mask(vector<uint64_t>& code) const;
+    uint64_t _Substring(const uint64_t* code, size_t t) const;
+    void _Scan(const uint64_t* code, size_t nb_results, vector<SpaceResult<ID>>& results) const;
+    // Returns false if probing got more expensive than scanning.
+    bool _Probe(const uint64_t* code, size_t nb_results, vector<SpaceResult<ID>>& results) const;
+    void _Search(const uint64_t* code, size_t nb_results, vector<SpaceResult<ID>>& results) const;
+    void _AddToTables(uint32_t slot);
+    void _MoveInTables(uint32_t from, uint32_t to);
+
+    size_t nb_bits_ = 0;
+    size_t words_ = 0;
+
+    vector<ID> ids_;
+    unordered_map<ID, size_t> id2index_;
+    vector<uint64_t> codes_;  // words_ per slot
+
+    // substring t covers bits [bounds_[t], bounds_[t + 1])
+    vector<size_t> bounds_;
+    vector<Table> tables_;
+
+    mutable std::shared_timed_mutex mutex_;
+};
+
+template <typename ID>
+void HammingSpace<ID>::Init(size_t nb_dims) {
+    Config(nb_dims);
+}
+
+template <typename ID>
+void HammingSpace<ID>::Config(size_t nb_bits, size_t nb_tables) {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    nb_bits_ = nb_bits;
+    words_ = BitWords(nb_bits_);
+    if (nb_tables > 0) {
+        nb_tables = std::min(std::max(nb_tables, (nb_bits_ + 63) / 64), nb_bits_);
+    }
+    bounds_.clear();
+    for (size_t t = 0; nb_tables > 0 && t <= nb_tables; ++t) {
+        bounds_.emplace_back(t * nb_bits_ / nb_tables);
+    }
+    tables_.clear();
+    tables_.resize(nb_tables);
+    ids_.clear();
+    id2index_.clear();
+    codes_.clear();
+}
+
+template <typename ID>
+void HammingSpace<ID>::Clear() {
+    Config(nb_bits_, tables_.size());
+}
+
+template <typename ID>
+size_t HammingSpace<ID>::Size() const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    return ids_.size();
+}
+
+template <typename ID>
+void HammingSpace<ID>::_Mask(vector<uint64_t>& code) const {
+    if (nb_bits_ % 64 != 0) {
+        code.back() &= (uint64_t(1) << (nb_bits_ % 64)) - 1;
+    }
+}
+
+template <typename ID>
+uint64_t HammingSpace<ID>::_Substring(const uint64_t* code, size_t t) const {
+    size_t begin = bounds_[t];
+    size_t len = bounds_[t + 1] - begin;
+    size_t shift = begin & 63;
+    uint64_t key = code[begin >> 6] >> shift;
+    if (64 - shift < len) {
+        key |= code[(begin >> 6) + 1] << (64 - shift);
+    }
+    return (len < 64) ? key & ((uint64_t(1) << len) - 1) : key;
+}
+
+template <typename ID>
+void HammingSpace<ID>::_AddToTables(uint32_t slot) {
+    for (size_t t = 0; t < tables_.size(); ++t) {
+        tables_[t][_Substring(&codes_[slot * words_], t)].emplace_back(slot);
+    }
+}
+
+template <typename ID>
+void HammingSpace<ID>::_MoveInTables(uint32_t from, uint32_t to) {
+    // Remove to, then relabel from as to.
+    for (size_t t = 0; t < tables_.size(); ++t) {
+        auto it = tables_[t].find(_Substring(&codes_[to * words_], t));
+        auto& bucket = it->second;
+        bucket.erase(std::find(bucket.begin(), bucket.end(), to));
+        if (bucket.empty()) {
+            tables_[t].erase(it);
+        }
+        if (from != to) {
+            auto& moved = tables_[t][_Substring(&codes_[from * words_], t)];
+            *std::find(moved.begin(), moved.end(), from) = to;
+        }
+    }
+}
+
+template <typename ID>
+unsigned int HammingSpace<ID>::Delete(const ID& id) {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    auto it = id2index_.find(id);
+    if (it == id2index_.end()) {
+        return 0;
+    }
+    size_t slot = it->second;
+    size_t last = ids_.size() - 1;
+    _MoveInTables(last, slot);
+    if (slot != last) {
+        std::copy(&codes_[last * words_], &codes_[(last + 1) * words_], &codes_[slot * words_]);
+        ids_[slot] = ids_[last];
+        id2index_[ids_[slot]] = slot;
+    }
+    ids_.pop_back();
+    codes_.resize(ids_.size() * words_);
+    id2index_.erase(id);
+    return 1;
+}
+
+template <typename ID>
+unsigned int HammingSpace<ID>::UpsertCode(const ID& id, const uint64_t* code) {
+    vector<uint64_t> masked(code, code + words_);
+    _Mask(masked);
+
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    auto it = id2index_.find(id);
+    if (it != id2index_.end()) {
+        size_t slot = it->second;
+        _MoveInTables(slot, slot);
+        std::copy(masked.begin(), masked.end(), &codes_[slot * words_]);
+        _AddToTables(slot);
+        return 1;
+    }
+    size_t slot = ids_.size();
+    ids_.emplace_back(id);
+    codes_.insert(codes_.end(), masked.begin(), masked.end());
+    id2index_[id] = slot;
+    _AddToTables(slot);
+    return 1;
+}
+
+template <typename ID>
+unsigned int HammingSpace<ID>::Upsert(const SpaceInput<ID>& input) {
+    // Reject NaN entries.
+    if (!isfinite_xf(input.point, nb_bits_)) {
+        return 0;
+    }
+    vector<uint64_t> code(words_);
+    SignBits(code.data(), input.point, nb_bits_);
+    return UpsertCode(input.id, code.data());
+}
+
+template <typename ID>
+void HammingSpace<ID>::_Scan(const uint64_t* code, size_t nb_results,
+                             vector<SpaceResult<ID>>& results) const {
+    results.clear();
+    size_t total = ids_.size();
+    const size_t chunk = 1024;
+    #pragma omp parallel
+    {
+        vector<SpaceResult<ID>> heap;
+        vector<uint32_t> dists(chunk);
+        #pragma omp for schedule(static) nowait
+        for (size_t begin = 0; begin < total; begin += chunk) {
+            size_t nb_rows = std::min(chunk, total - begin);
+            HammingScan(&codes_[begin * words_], nb_rows, words_, code, dists.data());
+            for (size_t r = 0; r < nb_rows; ++r) {
+                if (heap.size() < nb_results || dists[r] < heap.front().dist) {
+                    PushTopK(heap, SpaceResult<ID>{ids_[begin + r], (float) dists[r]}, nb_results);
+                }
+            }
+        }
+        #pragma omp critical
+        {
+        for (auto& r : heap) {
+            PushTopK(results, r, nb_results);
+        }
+        }
+    }
+    std::sort_heap(results.begin(), results.end());
+}
+
+template <typename ID>
+bool HammingSpace<ID>::_Probe(const uint64_t* code, size_t nb_results,
+                              vector<SpaceResult<ID>>& results) const {
+    results.clear();
+    size_t total = ids_.size();
+    size_t nb_tables = tables_.size();
+    vector<uint64_t> keys(nb_tables);
+    size_t longest = 0;
+    for (size_t t = 0; t < nb_tables; ++t) {
+        keys[t] = _Substring(code, t);
+        longest = std::max(longest, bounds_[t + 1] - bounds_[t]);
+    }
+
+    vector<uint64_t> seen(BitWords(total), 0);
+    size_t nb_seen = 0;
+    // Work is counted in codes scanned; a table lookup costs about as much
+    // as scanning kProbeCost codes.
+    const double kProbeCost = 32.0;
+    double budget = total;
+    for (size_t radius = 0; radius <= longest; ++radius) {
+        // Keys at this radius: sum over tables of C(len, radius).
+        double cost = 0.0;
+        for (size_t t = 0; t < nb_tables; ++t) {
+            size_t len = bounds_[t + 1] - bounds_[t];
+            double count = (radius <= len) ? 1.0 : 0.0;
+            for (size_t i = 0; i < radius && count > 0; ++i) {
+                count = count * (len - i) / (i + 1);
+            }
+            cost += count;
+        }
+        budget -= cost * kProbeCost;
+        if (budget < 0) {
+            return false;
+        }
+
+        for (size_t t = 0; t < nb_tables; ++t) {
+            auto& table = tables_[t];
+            size_t len = bounds_[t + 1] - bounds_[t];
+            if (radius > len) {
+                continue;
+            }
+            auto visit = [&] (uint64_t flips) {
+                auto it = table.find(keys[t] ^ flips);
+                if (it == table.end()) {
+                    return;
+                }
+                for (auto slot : it->second) {
+                    if (TestBit(seen, slot)) {
+                        continue;
+                    }
+                    SetBit(seen, slot);
+                    ++nb_seen;
+                    budget -= 1;
+                    float dist = HammingDistance(&codes_[slot * words_], code, words_);
+                    PushTopK(results, SpaceResult<ID>{ids_[slot], dist}, nb_results);
+                }
+            };
+            if (radius == 0) {
+                visit(0);
+                continue;
+            }
+            // Every len-bit mask with radius bits set, in increasing order.
+            uint64_t flips = (radius == 64) ? ~uint64_t(0) : (uint64_t(1) << radius) - 1;
+            while (true) {
+                visit(flips);
+                uint64_t low = flips & -flips;
+                uint64_t next = flips + low;
+                if (next == 0) {
+                    break;
+                }
+                flips = (((next ^ flips) >> 2) / low) | next;
+                if (len < 64 && (flips >> len) != 0) {
+                    break;
+                }
+            }
+        }
+
+        // All codes within nb_tables * (radius + 1) - 1 have been seen.
+        if (nb_seen == total || (results.size() == nb_results &&
+                results.front().dist < nb_tables * (radius + 1))) {
+            break;
+        }
+    }
+    std::sort_heap(results.begin(), results.end());
+    return true;
+}
+
+template <typename ID>
+void HammingSpace<ID>::_Search(const uint64_t* code, size_t nb_results,
+                               vector<SpaceResult<ID>>& results) const {
+    if (nb_results == 0) {
+        results.clear();
+        return;
+    }
+    if (tables_.empty() || !_Probe(code, nb_results, results)) {
+        _Scan(code, nb_results, results);
+    }
+}
+
+template <typename ID>
+void HammingSpace<ID>::GetNeighborsCode(const uint64_t* code, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    vector<uint64_t> masked(code, code + words_);
+    _Mask(masked);
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    _Search(masked.data(), nb_results, results);
+}
+
+template <typename ID>
+void HammingSpace<ID>::GetNeighbors(const float* point, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    vector<uint64_t> code(words_);
+    SignBits(code.data(), point, nb_bits_);
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    _Search(code.data(), nb_results, results);
+}
+
+template <typename ID>
+void HammingSpace<ID>::GetNeighbors(const ID& id, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    auto it = id2index_.find(id);
+    if (it == id2index_.end()) {
+        results.clear();
+        return;
+    }
+    vector<uint64_t> code(&codes_[it->second * words_], &codes_[(it->second + 1) * words_]);
+    _Search(code.data(), nb_results, results);
+}
+
+template <typename ID>
+bool HammingSpace<ID>::GetCode(const ID& id, uint64_t* code) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    auto it = id2index_.find(id);
+    if (it == id2index_.end()) {
+        return false;
+    }
+    std::copy(&codes_[it->second * words_], &codes_[(it->second + 1) * words_], code);
+    return true;
+}
+
+template <typename ID>
+bool HammingSpace<ID>::GetPoint(const ID& id, float* point) const {
+    vector<uint64_t> code(words_);
+    if (!GetCode(id, code.data())) {
+        return false;
+    }
+    for (size_t i = 0; i < nb_bits_; ++i) {
+        point[i] = ((code[i >> 6] >> (i & 63)) & 1) ? 1.0 : -1.0;
+    }
+    return true;
+}
+
+template <typename ID>
+void HammingSpace<ID>::GetIds(vector<ID>& ids) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    ids = ids_;
+}
+
+template <typename ID>
+void HammingSpace<ID>::Info(FILE* log, size_t indent, size_t indent_incr) const {
+    Space<ID>::Info(log, indent, indent_incr);
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    string zero(indent, ' ');
+    fprintf(log, "%sbits: %zu (%zu bytes per code)\n", zero.c_str(), nb_bits_, words_ * 8);
+    for (size_t t = 0; t < tables_.size(); ++t) {
+        size_t largest = 0;
+        for (auto& bucket : tables_[t]) {
+            largest = std::max(largest, bucket.second.size());
+        }
+        fprintf(log, "%stable %zu: bits %zu-%zu, %zu keys, largest bucket %zu\n", zero.c_str(),
+                t, bounds_[t], bounds_[t + 1] - 1, tables_[t].size(), largest);
+    }
+}
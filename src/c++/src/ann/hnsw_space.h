@@ -0,0 +1,631 @@
+#pragma once
+
+// Hierarchical Navigable Small World graph index.
+//
+// Malkov & Yashunin, "Efficient and robust approximate nearest neighbor
+// search using Hierarchical Navigable Small World graphs" (2016).
+//
+// Deleting an ID marks its slot: the node stays traversable but is never
+// returned, and the nodes that linked to it are reconnected to its
+// neighbors.  Later inserts reuse freed slots, keeping their level, as
+// hnswlib does with replace_deleted.  Links into a reused slot that the
+// repair missed then lead to the new node, which only costs the search a
+// detour.
+//
+// UpsertMany links its nodes in parallel, under the exclusive lock, with
+// striped locks guarding the neighbor lists.
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <shared_mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/align/aligned_allocator.hpp>
+#include <boost/random.hpp>
+
+#include "common/ann_util.h"
+#include "ann/metric.h"
+#include "ann/space.h"
+
+using std::unordered_map;
+using std::vector;
+using boost::alignment::aligned_allocator;
+using ann::util::ProgressBar;
+
+namespace /**** begin namespace ****/
+{
+
+// (distance, slot) pairs, ordered by distance
+typedef std::pair<float, uint32_t> HNSWCandidate;
+
+// Per-thread visited marks.  A slot was visited by the current search if
+// its mark equals the current epoch, so marks never need to be cleared.
+inline vector<uint32_t>& HNSWVisited(size_t size, uint32_t& epoch) {
+    thread_local vector<uint32_t> marks;
+    thread_local uint32_t current = 0;
+    if (marks.size() < size) {
+        marks.resize(size, 0);
+    }
+    if (++current == 0) {
+        std::fill(marks.begin(), marks.end(), 0);
+        current = 1;
+    }
+    epoch = current;
+    return marks;
+}
+
+} /**** end namespace ****/
+
+template <typename ID, typename Metric = CosineMetric>
+class HNSWSpace : public Space<ID> {
+  public:
+    HNSWSpace(uint64_t seed=0)
+        : prng_(seed)
+    {};
+    ~HNSWSpace();
+
+    void Init(size_t nb_dims) override;
+
+    // M: links per node on upper layers (2 * M on the bottom layer)
+    // ef_construction: candidate list size when inserting
+    // ef_search: candidate list size when querying
+    void Config(size_t nb_dims, size_t M=16, size_t ef_construction=200, size_t ef_search=50);
+
+    void Clear() override;
+
+    unsigned int Delete(const ID& id) override;
+
+    unsigned int Upsert(const SpaceInput<ID>& input) override;
+
+    // Append all inputs, then link them into the graph in parallel.
+    unsigned int UpsertMany(const vector<SpaceInput<ID>>& inputs) override;
+
+    void GetNeighbors(const float* point, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    void GetNeighbors(const ID& id, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    bool GetPoint(const ID& id, float* point) const override;
+
+    void GetIds(vector<ID>& ids) const override;
+
+    void GraphToStream(std::ostream& out, size_t nb_results) const override;
+
+    // Get the number of elements stored.
+    size_t Size() const override;
+
+    // Get Dimensionality
+    size_t Dim() const override { return ndim_; }
+
+    const char* MetricName() const override { return Metric::Name(); }
+
+  private:
+    unsigned int _Delete(const ID& id);
+    // Store the input in a free slot, or a new one; returns the slot.
+    size_t _Append(const SpaceInput<ID>& input, const float* prepared);
+    void _Link(uint32_t node);
+    void _Repair(uint32_t node);
+    void _MoveEntryPoint(uint32_t node);
+    size_t _MaxLinks(size_t level) const { return (level == 0) ? 2 * M_ : M_; }
+    float _Distance(const float* point, uint32_t node) const;
+    vector<uint32_t> _Links(uint32_t node, size_t level) const;
+    std::mutex& _LinkLock(uint32_t node) const { return link_locks_[node % link_locks_.size()]; }
+
+    vector<HNSWCandidate> _SearchLayer(const float* point, const vector<uint32_t>& entry_points,
+            size_t ef, size_t level, bool skip_deleted) const;
+    void _SelectNeighbors(vector<HNSWCandidate>& candidates, size_t nb_links,
+            vector<uint32_t>& links) const;
+    void _GetNeighbors(const float* point, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const;
+
+    size_t ndim_;
+    vector<ID> ids_;
+    unordered_map<ID, size_t> id2index_;
+    vector<float, aligned_allocator<float, 32>> point_floats_;
+    vector<uint64_t> deleted_;
+    vector<uint32_t> free_slots_;
+
+    // links_[node][level] lists the node's neighbors on that level
+    vector<vector<vector<uint32_t>>> links_;
+    vector<uint8_t> levels_;
+    uint32_t entry_point_ = 0;
+    int max_level_ = -1;
+
+    // constructor params
+    size_t M_ = 16;
+    size_t ef_construction_ = 200;
+    size_t ef_search_ = 50;
+    double level_mult_;
+
+    // Neighbor lists are guarded by striped locks, the entry point by
+    // entry_lock_.
+    mutable vector<std::mutex> link_locks_ = vector<std::mutex>(4096);
+    std::mutex entry_lock_;
+    mutable std::shared_timed_mutex mutex_;
+
+    boost::mt19937_64 prng_;
+};
+
+template <typename ID, typename Metric>
+HNSWSpace<ID, Metric>::~HNSWSpace() {}
+
+template <typename ID, typename Metric>
+void HNSWSpace<ID, Metric>::Config(size_t nb_dims, size_t M, size_t ef_construction, size_t ef_search) {
+    ndim_ = nb_dims;
+    M_ = std::max<size_t>(M, 2);
+    ef_construction_ = std::max(ef_construction, M_);
+    ef_search_ = ef_search;
+    level_mult_ = 1.0 / std::log((double)M_);
+    Clear();
+}
+
+template <typename ID, typename Metric>
+void HNSWSpace<ID, Metric>::Init(size_t nb_dims) {
+    Config(nb_dims);
+}
+
+template <typename ID, typename Metric>
+void HNSWSpace<ID, Metric>::Clear() {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    id2index_.clear();
+    ids_.clear();
+    point_floats_.clear();
+    deleted_.clear();
+    free_slots_.clear();
+    links_.clear();
+    levels_.clear();
+    entry_point_ = 0;
+    max_level_ = -1;
+}
+
+template <typename ID, typename Metric>
+size_t HNSWSpace<ID, Metric>::Size() const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    return id2index_.size();
+}
+
+template <typename ID, typename Metric>
+float HNSWSpace<ID, Metric>::_Distance(const float* point, uint32_t node) const {
+    return Metric::Distance(&point_floats_[(size_t)node * ndim_], point, ndim_);
+}
+
+template <typename ID, typename Metric>
+vector<uint32_t> HNSWSpace<ID, Metric>::_Links(uint32_t node, size_t level) const {
+    std::lock_guard<std::mutex> guard(_LinkLock(node));
+    return links_[node][level];
+}
+
+template <typename ID, typename Metric>
+vector<HNSWCandidate> HNSWSpace<ID, Metric>::_SearchLayer(const float* point,
+        const vector<uint32_t>& entry_points, size_t ef, size_t level, bool skip_deleted) const
+{
+    uint32_t epoch;
+    auto& visited = HNSWVisited(ids_.size(), epoch);
+
+    // closest unexpanded nodes first
+    std::priority_queue<HNSWCandidate, vector<HNSWCandidate>,
+        std::greater<HNSWCandidate>> candidates;
+    // worst of the ef best on top
+    std::priority_queue<HNSWCandidate> top;
+
+    for (auto ep : entry_points) {
+        if (visited[ep] == epoch) {
+            continue;
+        }
+        visited[ep] = epoch;
+        HNSWCandidate c(_Distance(point, ep), ep);
+        candidates.push(c);
+        if (!skip_deleted || !TestBit(deleted_, ep)) {
+            top.push(c);
+        }
+    }
+
+    while (!candidates.empty()) {
+        HNSWCandidate current = candidates.top();
+        if (top.size() >= ef && current.first > top.top().first) {
+            break;
+        }
+        candidates.pop();
+
+        for (auto next : _Links(current.second, level)) {
+            if (visited[next] == epoch) {
+                continue;
+            }
+            visited[next] = epoch;
+            float dist = _Distance(point, next);
+            if (top.size() < ef || dist < top.top().first) {
+                candidates.emplace(dist, next);
+                if (skip_deleted && TestBit(deleted_, next)) {
+                    continue;
+                }
+                top.emplace(dist, next);
+                if (top.size() > ef) {
+                    top.pop();
+                }
+            }
+        }
+    }
+
+    vector<HNSWCandidate> results(top.size());
+    for (size_t i = top.size(); i-- > 0; ) {
+        results[i] = top.top();
+        top.pop();
+    }
+    return results;
+}
+
+template <typename ID, typename Metric>
+void HNSWSpace<ID, Metric>::_SelectNeighbors(vector<HNSWCandidate>& candidates, size_t nb_links,
+        vector<uint32_t>& links) const
+{
+    // Keep a candidate only if it is closer to the base node than to any
+    // neighbor kept so far, which spreads links over several directions.
+    std::sort(candidates.begin(), candidates.end());
+    links.clear();
+    for (auto& c : candidates) {
+        if (links.size() >= nb_links) {
+            break;
+        }
+        const float* point = &point_floats_[(size_t)c.second * ndim_];
+        bool good = true;
+        for (auto kept : links) {
+            if (_Distance(point, kept) < c.first) {
+                good = false;
+                break;
+            }
+        }
+        if (good) {
+            links.emplace_back(c.second);
+        }
+    }
+}
+
+template <typename ID, typename Metric>
+size_t HNSWSpace<ID, Metric>::_Append(const SpaceInput<ID>& input, const float* prepared) {
+    if (!free_slots_.empty()) {
+        size_t idx = free_slots_.back();
+        free_slots_.pop_back();
+        ids_[idx] = input.id;
+        id2index_[input.id] = idx;
+        std::copy(prepared, prepared + ndim_, &point_floats_[idx * ndim_]);
+        ClearBit(deleted_, idx);
+        // Unlinked until _Link, like a new node.
+        for (auto& links : links_[idx]) {
+            links.clear();
+        }
+        return idx;
+    }
+
+    size_t idx = ids_.size();
+    ids_.emplace_back(input.id);
+    id2index_[input.id] = idx;
+    point_floats_.insert(point_floats_.end(), prepared, prepared + ndim_);
+    deleted_.resize(BitWords(ids_.size()));
+
+    boost::uniform_01<boost::mt19937_64&> uniform(prng_);
+    double u = std::max(uniform(), 1e-12);
+    int level = std::min(255, (int)(-std::log(u) * level_mult_));
+    levels_.emplace_back(level);
+    links_.emplace_back(level + 1);
+    return idx;
+}
+
+template <typename ID, typename Metric>
+void HNSWSpace<ID, Metric>::_Link(uint32_t node) {
+    const float* point = &point_floats_[(size_t)node * ndim_];
+    int level = levels_[node];
+
+    std::unique_lock<std::mutex> entry_guard(entry_lock_);
+    if (max_level_ < 0) {
+        entry_point_ = node;
+        max_level_ = level;
+        return;
+    }
+    uint32_t entry_point = entry_point_;
+    int max_level = max_level_;
+    // Only an insert that raises the top level keeps the entry lock.
+    if (level <= max_level) {
+        entry_guard.unlock();
+    }
+
+    // Greedy descent through the levels above the node's own.
+    vector<uint32_t> entry_points(1, entry_point);
+    for (int l = max_level; l > level; --l) {
+        auto closest = _SearchLayer(point, entry_points, 1, l, false);
+        entry_points[0] = closest[0].second;
+    }
+
+    for (int l = std::min(level, max_level); l >= 0; --l) {
+        auto found = _SearchLayer(point, entry_points, ef_construction_, l, true);
+        // a concurrent insert may already have linked back to this node
+        found.erase(std::remove_if(found.begin(), found.end(),
+                    [node] (const HNSWCandidate& c) { return c.second == node; }),
+                found.end());
+        entry_points.clear();
+        for (auto& c : found) {
+            entry_points.emplace_back(c.second);
+        }
+        if (entry_points.empty()) {
+            entry_points.emplace_back(entry_point);
+        }
+
+        vector<uint32_t> links;
+        _SelectNeighbors(found, M_, links);
+        {
+            std::lock_guard<std::mutex> guard(_LinkLock(node));
+            links_[node][l] = links;
+        }
+
+        // Add the reverse links, shrinking lists that grow too long.
+        size_t max_links = _MaxLinks(l);
+        for (auto other : links) {
+            if (other == node) {
+                continue;
+            }
+            std::lock_guard<std::mutex> guard(_LinkLock(other));
+            auto& other_links = links_[other][l];
+            if (std::find(other_links.begin(), other_links.end(), node) != other_links.end()) {
+                continue;
+            }
+            if (other_links.size() < max_links) {
+                other_links.emplace_back(node);
+                continue;
+            }
+            const float* other_point = &point_floats_[(size_t)other * ndim_];
+            vector<HNSWCandidate> candidates;
+            candidates.emplace_back(_Distance(other_point, node), node);
+            for (auto n : other_links) {
+                candidates.emplace_back(_Distance(other_point, n), n);
+            }
+            _SelectNeighbors(candidates, max_links, other_links);
+        }
+    }
+
+    if (level > max_level) {
+        entry_point_ = node;
+        max_level_ = level;
+    }
+}
+
+template <typename ID, typename Metric>
+void HNSWSpace<ID, Metric>::_Repair(uint32_t node) {
+    // Reconnect every neighbor that links back to the deleted node, using
+    // the deleted node's own neighbors as replacement candidates.
+    for (int l = levels_[node]; l >= 0; --l) {
+        vector<uint32_t> removed = links_[node][l];
+        size_t max_links = _MaxLinks(l);
+        for (auto other : removed) {
+            auto& other_links = links_[other][l];
+            auto it = std::find(other_links.begin(), other_links.end(), node);
+            if (it == other_links.end()) {
+                continue;
+            }
+            other_links.erase(it);
+
+            const float* other_point = &point_floats_[(size_t)other * ndim_];
+            vector<HNSWCandidate> candidates;
+            for (auto n : other_links) {
+                candidates.emplace_back(_Distance(other_point, n), n);
+            }
+            for (auto n : removed) {
+                if (n == other || TestBit(deleted_, n) ||
+                        std::find(other_links.begin(), other_links.end(), n) != other_links.end()) {
+                    continue;
+                }
+                candidates.emplace_back(_Distance(other_point, n), n);
+            }
+            _SelectNeighbors(candidates, max_links, other_links);
+        }
+    }
+}
+
+template <typename ID, typename Metric>
+unsigned int HNSWSpace<ID, Metric>::Delete(const ID& id) {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    return _Delete(id);
+}
+
+template <typename ID, typename Metric>
+unsigned int HNSWSpace<ID, Metric>::_Delete(const ID& id) {
+
+    // Look up the ID.
+    auto it = id2index_.find(id);
+    if (it == id2index_.end()) {
+        return 0;
+    }
+    uint32_t node = it->second;
+    id2index_.erase(it);
+    SetBit(deleted_, node);
+    _Repair(node);
+    _MoveEntryPoint(node);
+    free_slots_.emplace_back(node);
+    return 1;
+}
+
+template <typename ID, typename Metric>
+void HNSWSpace<ID, Metric>::_MoveEntryPoint(uint32_t node) {
+    // New nodes only link to live ones, so a deleted entry point would
+    // leave them unreachable once all the nodes it leads to are deleted.
+    // Move it to the live neighbor on the highest level, else to the
+    // highest linked live node, else start over with the next insert.
+    std::lock_guard<std::mutex> entry_guard(entry_lock_);
+    if (max_level_ < 0 || entry_point_ != node) {
+        return;
+    }
+    for (int l = levels_[node]; l >= 0; --l) {
+        for (auto other : links_[node][l]) {
+            if (!TestBit(deleted_, other)) {
+                entry_point_ = other;
+                max_level_ = levels_[other];
+                return;
+            }
+        }
+    }
+    max_level_ = -1;
+    for (size_t i = 0; i < ids_.size(); ++i) {
+        // nodes appended by UpsertMany but not linked yet have no links
+        if (!TestBit(deleted_, i) && !links_[i][0].empty() && levels_[i] > max_level_) {
+            entry_point_ = i;
+            max_level_ = levels_[i];
+        }
+    }
+}
+
+template <typename ID, typename Metric>
+unsigned int HNSWSpace<ID, Metric>::Upsert(const SpaceInput<ID>& input) {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    _Delete(input.id);
+
+    // Reject NaN entries.
+    if (!isfinite_xf(input.point, ndim_)) {
+        return 0;
+    }
+
+    float tmp[ndim_];
+
+    // Reject inputs the metric cannot use (zero norm for cosine)
+    if (!Metric::Prepare(tmp, input.point, ndim_)) {
+        return 0;
+    }
+
+    _Link(_Append(input, tmp));
+    return 1;
+}
+
+template <typename ID, typename Metric>
+unsigned int HNSWSpace<ID, Metric>::UpsertMany(const vector<SpaceInput<ID>>& inputs) {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+
+    // Storage only changes while appending, so linking can run concurrently.
+    size_t count = 0;
+    float tmp[ndim_];
+    vector<uint32_t> appended;
+    for (auto& input : inputs) {
+        _Delete(input.id);
+        if (!isfinite_xf(input.point, ndim_) || !Metric::Prepare(tmp, input.point, ndim_)) {
+            continue;
+        }
+        appended.emplace_back(_Append(input, tmp));
+        count++;
+    }
+    // A slot freed by a later input with the same ID may have been reused
+    // within the batch; link it once, and skip slots left deleted.
+    std::sort(appended.begin(), appended.end());
+    appended.erase(std::unique(appended.begin(), appended.end()), appended.end());
+    appended.erase(std::remove_if(appended.begin(), appended.end(),
+                [this] (uint32_t node) { return TestBit(deleted_, node); }),
+            appended.end());
+
+    // Link the first node alone so that there is an entry point.
+    size_t first = 0;
+    if (!appended.empty() && max_level_ < 0) {
+        _Link(appended[first++]);
+    }
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (size_t i = first; i < appended.size(); ++i) {
+        _Link(appended[i]);
+    }
+    return count;
+}
+
+template <typename ID, typename Metric>
+void HNSWSpace<ID, Metric>::_GetNeighbors(const float* point, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    results.clear();
+    if (max_level_ < 0) {
+        return;
+    }
+
+    vector<uint32_t> entry_points(1, entry_point_);
+    for (int l = max_level_; l > 0; --l) {
+        auto closest = _SearchLayer(point, entry_points, 1, l, false);
+        entry_points[0] = closest[0].second;
+    }
+    auto found = _SearchLayer(point, entry_points, std::max(ef_search_, nb_results), 0, true);
+
+    size_t limit = std::min(nb_results, found.size());
+    results.reserve(limit);
+    for (size_t i = 0; i < limit; ++i) {
+        SpaceResult<ID> r;
+        r.id = ids_[found[i].second];
+        r.dist = found[i].first;
+        results.emplace_back(r);
+    }
+    std::sort(results.begin(), results.end());
+}
+
+template <typename ID, typename Metric>
+void HNSWSpace<ID, Metric>::GetNeighbors(const float* point, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    float tmp[ndim_];
+    if (!Metric::Prepare(tmp, point, ndim_)) {
+        results.clear();
+        return;
+    }
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    _GetNeighbors(tmp, nb_results, results);
+}
+
+template <typename ID, typename Metric>
+void HNSWSpace<ID, Metric>::GetNeighbors(const ID& id, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    auto it = id2index_.find(id);
+    if (it != id2index_.end()) {
+        _GetNeighbors(&point_floats_[it->second * ndim_], nb_results, results);
+    }
+}
+
+template <typename ID, typename Metric>
+bool HNSWSpace<ID, Metric>::GetPoint(const ID& id, float* point) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    auto it = id2index_.find(id);
+    if (it == id2index_.end()) {
+        return false;
+    }
+    std::copy_n(&point_floats_[it->second * ndim_], ndim_, point);
+    return true;
+}
+
+template <typename ID, typename Metric>
+void HNSWSpace<ID, Metric>::GetIds(vector<ID>& ids) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    ids.clear();
+    ids.reserve(id2index_.size());
+    for (size_t i = 0; i < ids_.size(); ++i) {
+        if (!TestBit(deleted_, i)) {
+            ids.emplace_back(ids_[i]);
+        }
+    }
+}
+
+template <typename ID, typename Metric>
+void HNSWSpace<ID, Metric>::GraphToStream(std::ostream& out, size_t nb_results) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    // Iterate over all ids stored
+    size_t total = ids_.size();
+    auto progBar = ProgressBar(total);
+    #pragma omp parallel for shared(progBar)
+    for (size_t i = 0; i < total; ++i) {
+        if (TestBit(deleted_, i)) {
+            continue;
+        }
+        const ID& id = ids_[i];
+        vector<SpaceResult<ID>> results;
+        _GetNeighbors(&point_floats_[i * ndim_], nb_results, results);
+        #pragma omp critical
+        {
+        progBar.update();
+        WriteResults(out, id, results);
+        }
+    }
+}
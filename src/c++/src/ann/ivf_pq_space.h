@@ -0,0 +1,578 @@
+#pragma once
+
+// Inverted-file index over product-quantized residuals (IVF-PQ).
+//
+// Each vector is assigned to its nearest coarse centroid c, and the
+// residual x - c is split into m subvectors, each replaced by the index of
+// its nearest codeword in a 2^nbits-entry codebook.  A row then costs
+// m * nbits / 8 bytes plus its ID.  Since
+//
+//     dot(q, x) ~= dot(q, c) + sum_j dot(q_j, codebook_j[code_j])
+//
+// a query fills one m x 2^nbits table of subspace dot products and scores
+// each row with m table lookups (asymmetric distance computation).  Jegou et
+// al., "Product quantization for nearest neighbor search" (2011).
+//
+// With nbits = 4 each subspace has 16 codewords and lists are scanned with
+// the in-register lookups of pq_fastscan.h on uint8-quantized tables; the
+// kept candidates are then rescored with the float tables.
+//
+// With rerank > 0 full vectors are also kept, and that many candidates
+// ranked by the codes are rescored exactly.  Until train_size vectors have
+// been inserted there are no codebooks and rows are scanned exactly.
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/align/aligned_allocator.hpp>
+#include <boost/random.hpp>
+
+#include "common/ann_util.h"
+#include "ann/kmeans.h"
+#include "ann/pq_fastscan.h"
+#include "ann/space.h"
+
+using std::unordered_map;
+using std::vector;
+using boost::alignment::aligned_allocator;
+using ann::util::ProgressBar;
+
+template <typename ID>
+struct IVFPQList {
+    vector<ID> ids;
+    vector<uint8_t> codes;
+    // full vectors, kept before training or when reranking
+    vector<float, aligned_allocator<float, 32>> point_floats;
+};
+
+template <typename ID>
+class IVFPQSpace : public Space<ID> {
+  public:
+    IVFPQSpace(uint64_t seed=0)
+        : prng_(seed)
+    {};
+    ~IVFPQSpace();
+
+    void Init(size_t nb_dims) override;
+
+    // nlist: number of coarse centroids
+    // nprobe: number of lists scanned per query
+    // m: number of sub-codes per vector (at most nb_dims)
+    // rerank: candidates rescored from full vectors (if 0, keep codes only)
+    // train_size: vectors to collect before training (if 0, 64 * nlist,
+    //             and at least 64 codewords)
+    // nbits: bits per sub-code, 8 or 4 (fast scan)
+    void Config(size_t nb_dims, size_t nlist=1024, size_t nprobe=8, size_t m=16,
+                size_t rerank=0, size_t train_size=0, size_t nbits=8);
+
+    // Train the coarse centroids and codebooks on a sample of the stored
+    // vectors and encode all of them.  Called automatically once
+    // train_size vectors are in.
+    void Train();
+
+    void Clear() override;
+
+    unsigned int Delete(const ID& id) override;
+
+    unsigned int Upsert(const SpaceInput<ID>& input) override;
+
+    void GetNeighbors(const float* point, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    void GetNeighbors(const ID& id, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    // Without kept floats, this is the PQ reconstruction of the point.
+    bool GetPoint(const ID& id, float* point) const override;
+
+    // Floats outlive training only with rerank > 0; wrappers rebuilding
+    // from PQ reconstructions would compound their error.
+    bool KeepsPoints() const override { return rerank_ > 0; }
+
+    void GetIds(vector<ID>& ids) const override;
+
+    void GraphToStream(std::ostream& out, size_t nb_results) const override;
+
+    // Get the number of elements stored.
+    size_t Size() const override { return id2pos_.size(); }
+
+    // Get Dimensionality
+    size_t Dim() const override { return ndim_; }
+
+    void Info(FILE* log, size_t indent=2, size_t indent_incr=4) const override;
+
+  private:
+    bool _Trained() const { return !codebooks_.empty(); }
+    bool _KeepFloats() const { return !_Trained() || rerank_ > 0; }
+    size_t _SubBegin(size_t j) const { return j * ndim_ / m_; }
+    size_t _CodeBytes(size_t nb_rows) const {
+        return (nbits_ == 4) ? PQ4CodeBytes(nb_rows, m_) : nb_rows * m_;
+    }
+    void _GetCode(const IVFPQList<ID>& posting, size_t row, uint8_t* code) const;
+    void _SetCode(IVFPQList<ID>& posting, size_t row, const uint8_t* code) const;
+
+    void _Append(size_t list, const ID& id, const float* point);
+    void _Encode(const float* point, size_t list, uint8_t* code) const;
+    void _Decode(size_t list, size_t offset, float* point) const;
+    void _Probe(const float* point, vector<size_t>& lists) const;
+    void _GetNeighbors(const float* point, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const;
+
+    size_t ndim_;
+
+    // posting list and offset within it, per ID
+    unordered_map<ID, std::pair<size_t, size_t>> id2pos_;
+    vector<IVFPQList<ID>> lists_;
+    vector<float> centroids_;
+
+    // m_ codebooks of codewords_ rows each, over subspace j's dimensions
+    vector<vector<float>> codebooks_;
+
+    // constructor params
+    size_t nlist_;
+    size_t nprobe_;
+    size_t m_;
+    size_t nbits_;
+    size_t codewords_;
+    size_t rerank_;
+    size_t train_size_;
+
+    boost::mt19937_64 prng_;
+};
+
+template <typename ID>
+IVFPQSpace<ID>::~IVFPQSpace() {}
+
+template <typename ID>
+void IVFPQSpace<ID>::Config(size_t nb_dims, size_t nlist, size_t nprobe, size_t m,
+                            size_t rerank, size_t train_size, size_t nbits) {
+    ndim_ = nb_dims;
+    nlist_ = std::max<size_t>(nlist, 1);
+    nprobe_ = std::max<size_t>(nprobe, 1);
+    m_ = std::max<size_t>(std::min(m, ndim_), 1);
+    if (nbits != 4 && nbits != 8) {
+        std::cerr << "nbits must be 4 or 8, using 8" << std::endl;
+        nbits = 8;
+    }
+    nbits_ = nbits;
+    codewords_ = size_t(1) << nbits_;
+    rerank_ = rerank;
+    train_size_ = (train_size == 0) ? std::max(64 * nlist_, 64 * codewords_) : train_size;
+    Clear();
+}
+
+template <typename ID>
+void IVFPQSpace<ID>::Init(size_t nb_dims) {
+    Config(nb_dims);
+}
+
+template <typename ID>
+void IVFPQSpace<ID>::Clear() {
+    id2pos_.clear();
+    centroids_.clear();
+    codebooks_.clear();
+    lists_.clear();
+    lists_.resize(1);
+}
+
+template <typename ID>
+void IVFPQSpace<ID>::_GetCode(const IVFPQList<ID>& posting, size_t row, uint8_t* code) const {
+    if (nbits_ == 4) {
+        PQ4GetCode(posting.codes.data(), m_, row, code);
+    } else {
+        std::copy(&posting.codes[row * m_], &posting.codes[(row + 1) * m_], code);
+    }
+}
+
+template <typename ID>
+void IVFPQSpace<ID>::_SetCode(IVFPQList<ID>& posting, size_t row, const uint8_t* code) const {
+    if (nbits_ == 4) {
+        PQ4SetCode(posting.codes.data(), m_, row, code);
+    } else {
+        std::copy(code, code + m_, &posting.codes[row * m_]);
+    }
+}
+
+template <typename ID>
+void IVFPQSpace<ID>::_Encode(const float* point, size_t list, uint8_t* code) const {
+    const float* centroid = &centroids_[list * ndim_];
+    float residual[ndim_];
+    for (size_t i = 0; i < ndim_; ++i) {
+        residual[i] = point[i] - centroid[i];
+    }
+    for (size_t j = 0; j < m_; ++j) {
+        size_t begin = _SubBegin(j);
+        code[j] = NearestCentroid(residual + begin, codebooks_[j], _SubBegin(j + 1) - begin, false);
+    }
+}
+
+template <typename ID>
+void IVFPQSpace<ID>::_Decode(size_t list, size_t offset, float* point) const {
+    auto& posting = lists_[list];
+    if (_KeepFloats()) {
+        std::copy(posting.point_floats.begin() + offset * ndim_,
+                  posting.point_floats.begin() + (offset + 1) * ndim_, point);
+        return;
+    }
+    const float* centroid = &centroids_[list * ndim_];
+    uint8_t code[m_];
+    _GetCode(posting, offset, code);
+    for (size_t j = 0; j < m_; ++j) {
+        size_t begin = _SubBegin(j);
+        size_t len = _SubBegin(j + 1) - begin;
+        const float* codeword = &codebooks_[j][code[j] * len];
+        for (size_t i = 0; i < len; ++i) {
+            point[begin + i] = centroid[begin + i] + codeword[i];
+        }
+    }
+}
+
+template <typename ID>
+void IVFPQSpace<ID>::_Append(size_t list, const ID& id, const float* point) {
+    auto& posting = lists_[list];
+    id2pos_[id] = std::make_pair(list, posting.ids.size());
+    posting.ids.emplace_back(id);
+    if (_KeepFloats()) {
+        posting.point_floats.insert(posting.point_floats.end(), point, point + ndim_);
+    }
+    if (_Trained()) {
+        uint8_t code[m_];
+        _Encode(point, list, code);
+        posting.codes.resize(_CodeBytes(posting.ids.size()));
+        _SetCode(posting, posting.ids.size() - 1, code);
+    }
+}
+
+template <typename ID>
+void IVFPQSpace<ID>::Train() {
+    // Gather every stored vector; posting lists are rebuilt from scratch.
+    // Training needs full vectors, so it only runs once.
+    if (_Trained()) {
+        std::cerr << "IVFPQSpace is already trained" << std::endl;
+        return;
+    }
+    vector<ID> ids;
+    vector<float> points;
+    ids.reserve(id2pos_.size());
+    points.reserve(id2pos_.size() * ndim_);
+    for (auto& posting : lists_) {
+        ids.insert(ids.end(), posting.ids.begin(), posting.ids.end());
+        points.insert(points.end(), posting.point_floats.begin(), posting.point_floats.end());
+    }
+    size_t total = ids.size();
+    if (total == 0) {
+        return;
+    }
+
+    // Train on a random sample of at most train_size rows.
+    size_t sample_size = std::min(train_size_, total);
+    vector<float> sample(sample_size * ndim_);
+    vector<size_t> rows(total);
+    for (size_t i = 0; i < total; ++i) {
+        rows[i] = i;
+    }
+    for (size_t i = 0; i < sample_size; ++i) {
+        std::swap(rows[i], rows[boost::uniform_int<size_t>(i, total - 1)(prng_)]);
+        std::copy(&points[rows[i] * ndim_], &points[(rows[i] + 1) * ndim_], &sample[i * ndim_]);
+    }
+    KMeans(sample.data(), sample_size, ndim_, ndim_, nlist_, centroids_, prng_, true);
+
+    // Codebooks are trained on the sample's residuals.
+    #pragma omp parallel for
+    for (size_t i = 0; i < sample_size; ++i) {
+        float* row = &sample[i * ndim_];
+        const float* centroid = &centroids_[NearestCentroid(row, centroids_, ndim_, true) * ndim_];
+        for (size_t d = 0; d < ndim_; ++d) {
+            row[d] -= centroid[d];
+        }
+    }
+    vector<vector<float>> codebooks(m_);
+    for (size_t j = 0; j < m_; ++j) {
+        size_t begin = _SubBegin(j);
+        KMeans(&sample[begin], sample_size, _SubBegin(j + 1) - begin, ndim_,
+               codewords_, codebooks[j], prng_, false);
+    }
+    codebooks_.swap(codebooks);
+
+    size_t nb_lists = centroids_.size() / ndim_;
+    vector<size_t> assignment(total);
+    #pragma omp parallel for
+    for (size_t i = 0; i < total; ++i) {
+        assignment[i] = NearestCentroid(&points[i * ndim_], centroids_, ndim_, true);
+    }
+
+    lists_.clear();
+    lists_.resize(nb_lists);
+    id2pos_.clear();
+    for (size_t i = 0; i < total; ++i) {
+        _Append(assignment[i], ids[i], &points[i * ndim_]);
+    }
+}
+
+template <typename ID>
+unsigned int IVFPQSpace<ID>::Delete(const ID& id) {
+
+    // Look up the ID.
+    auto it = id2pos_.find(id);
+    if (it == id2pos_.end()) {
+        return 0;
+    }
+
+    // Swap with the end of its list and resize by one.
+    auto& posting = lists_[it->second.first];
+    size_t index = it->second.second;
+    size_t last = posting.ids.size() - 1;
+    id2pos_.erase(it);
+    if (index != last) {
+        posting.ids[index] = posting.ids[last];
+        id2pos_[posting.ids[index]].second = index;
+        if (_KeepFloats()) {
+            std::copy(posting.point_floats.begin() + last * ndim_,
+                      posting.point_floats.begin() + (last + 1) * ndim_,
+                      posting.point_floats.begin() + index * ndim_);
+        }
+        if (_Trained()) {
+            uint8_t code[m_];
+            _GetCode(posting, last, code);
+            _SetCode(posting, index, code);
+        }
+    }
+    posting.ids.resize(last);
+    if (_KeepFloats()) {
+        posting.point_floats.resize(last * ndim_);
+    }
+    if (_Trained()) {
+        posting.codes.resize(_CodeBytes(last));
+    }
+    return 1;
+}
+
+template <typename ID>
+unsigned int IVFPQSpace<ID>::Upsert(const SpaceInput<ID>& input) {
+    Delete(input.id);
+
+    // Reject NaN entries.
+    if (!isfinite_xf(input.point, ndim_)) {
+        return 0;
+    }
+
+    float tmp[ndim_];
+
+    // Reject inputs whose norm equals zero
+    if (!normalize(tmp, input.point, ndim_)) {
+        return 0;
+    }
+
+    if (!_Trained()) {
+        _Append(0, input.id, tmp);
+        if (id2pos_.size() >= train_size_) {
+            Train();
+        }
+    } else {
+        _Append(NearestCentroid(tmp, centroids_, ndim_, true), input.id, tmp);
+    }
+    return 1;
+}
+
+template <typename ID>
+void IVFPQSpace<ID>::_Probe(const float* point, vector<size_t>& lists) const {
+    size_t nb_lists = lists_.size();
+    lists.clear();
+    if (!_Trained()) {
+        lists.emplace_back(0);
+        return;
+    }
+
+    vector<std::pair<float, size_t>> scores(nb_lists);
+    for (size_t c = 0; c < nb_lists; ++c) {
+        scores[c] = std::make_pair(-DotProduct(&centroids_[c * ndim_], point, ndim_), c);
+    }
+    size_t nprobe = std::min(nprobe_, nb_lists);
+    std::partial_sort(scores.begin(), scores.begin() + nprobe, scores.end());
+    for (size_t i = 0; i < nprobe; ++i) {
+        lists.emplace_back(scores[i].second);
+    }
+}
+
+template <typename ID>
+void IVFPQSpace<ID>::_GetNeighbors(const float* point, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    results.clear();
+    vector<size_t> lists;
+    _Probe(point, lists);
+
+    if (!_Trained()) {
+        auto& posting = lists_[0];
+        for (size_t i = 0; i < posting.ids.size(); ++i) {
+            SpaceResult<ID> r;
+            r.id = posting.ids[i];
+            r.dist = 1.0 - DotProduct(&posting.point_floats[i * ndim_], point, ndim_);
+            PushTopK(results, r, nb_results);
+        }
+        std::sort_heap(results.begin(), results.end());
+        return;
+    }
+
+    // Dot products of each query subvector with every codeword.  The table
+    // does not depend on the list since codes are residuals.
+    vector<float> table(m_ * codewords_, 0.0);
+    for (size_t j = 0; j < m_; ++j) {
+        size_t begin = _SubBegin(j);
+        size_t len = _SubBegin(j + 1) - begin;
+        const vector<float>& codebook = codebooks_[j];
+        for (size_t k = 0; k < codebook.size() / len; ++k) {
+            table[j * codewords_ + k] = DotProduct(&codebook[k * len], point + begin, len);
+        }
+    }
+
+    // For fast scan, the negated table quantized to uint8.
+    vector<uint8_t> lut;
+    vector<uint16_t> sums;
+    float scale = 1.0;
+    float bias = 0.0;
+    if (nbits_ == 4) {
+        vector<float> negated(table.size());
+        for (size_t i = 0; i < table.size(); ++i) {
+            negated[i] = -table[i];
+        }
+        lut.resize(PQ4Subspaces(m_) * kPQ4Codewords);
+        PQ4QuantizeTables(negated.data(), m_, lut.data(), scale, bias);
+    }
+
+    // Candidates are kept as (list, offset) pairs while reranking.
+    size_t nb_candidates = std::max(nb_results, rerank_);
+    vector<SpaceResult<size_t>> candidates;
+    for (auto list : lists) {
+        auto& posting = lists_[list];
+        size_t total = posting.ids.size();
+        float base = 1.0 - DotProduct(&centroids_[list * ndim_], point, ndim_);
+        SpaceResult<size_t> r;
+        if (nbits_ == 4) {
+            size_t nb_blocks = (total + kPQ4Block - 1) / kPQ4Block;
+            sums.resize(nb_blocks * kPQ4Block);
+            PQ4FastScan(posting.codes.data(), nb_blocks, m_, lut.data(), sums.data());
+            for (size_t i = 0; i < total; ++i) {
+                r.id = (list << 32) | i;
+                r.dist = base + bias + sums[i] / scale;
+                PushTopK(candidates, r, nb_candidates);
+            }
+            continue;
+        }
+        for (size_t i = 0; i < total; ++i) {
+            const uint8_t* code = &posting.codes[i * m_];
+            float dot = 0.0;
+            for (size_t j = 0; j < m_; ++j) {
+                dot += table[j * codewords_ + code[j]];
+            }
+            r.id = (list << 32) | i;
+            r.dist = base - dot;
+            PushTopK(candidates, r, nb_candidates);
+        }
+    }
+
+    for (auto& c : candidates) {
+        size_t list = c.id >> 32;
+        auto& posting = lists_[list];
+        size_t i = c.id & 0xffffffff;
+        SpaceResult<ID> r;
+        r.id = posting.ids[i];
+        if (rerank_ > 0) {
+            r.dist = 1.0 - DotProduct(&posting.point_floats[i * ndim_], point, ndim_);
+        } else if (nbits_ == 4) {
+            uint8_t code[m_];
+            _GetCode(posting, i, code);
+            r.dist = 1.0 - DotProduct(&centroids_[list * ndim_], point, ndim_);
+            for (size_t j = 0; j < m_; ++j) {
+                r.dist -= table[j * codewords_ + code[j]];
+            }
+        } else {
+            r.dist = c.dist;
+        }
+        PushTopK(results, r, nb_results);
+    }
+    std::sort_heap(results.begin(), results.end());
+}
+
+template <typename ID>
+void IVFPQSpace<ID>::GetNeighbors(const float* point, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    float tmp[ndim_];
+    if (!normalize(tmp, point, ndim_)) {
+        results.clear();
+        return;
+    }
+    _GetNeighbors(tmp, nb_results, results);
+}
+
+template <typename ID>
+void IVFPQSpace<ID>::GetNeighbors(const ID& id, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    auto it = id2pos_.find(id);
+    if (it != id2pos_.end()) {
+        float tmp[ndim_];
+        _Decode(it->second.first, it->second.second, tmp);
+        _GetNeighbors(tmp, nb_results, results);
+    }
+}
+
+template <typename ID>
+bool IVFPQSpace<ID>::GetPoint(const ID& id, float* point) const {
+    auto it = id2pos_.find(id);
+    if (it == id2pos_.end()) {
+        return false;
+    }
+    _Decode(it->second.first, it->second.second, point);
+    return true;
+}
+
+template <typename ID>
+void IVFPQSpace<ID>::GetIds(vector<ID>& ids) const {
+    ids.clear();
+    ids.reserve(id2pos_.size());
+    for (auto& posting : lists_) {
+        ids.insert(ids.end(), posting.ids.begin(), posting.ids.end());
+    }
+}
+
+template <typename ID>
+void IVFPQSpace<ID>::GraphToStream(std::ostream& out, size_t nb_results) const {
+    // Iterate over all lists, then over the ids in each
+    auto progBar = ProgressBar(id2pos_.size());
+    for (size_t list = 0; list < lists_.size(); ++list) {
+        auto& posting = lists_[list];
+        size_t total = posting.ids.size();
+        #pragma omp parallel for shared(progBar)
+        for (size_t i = 0; i < total; ++i) {
+            const ID& id = posting.ids[i];
+            float tmp[ndim_];
+            _Decode(list, i, tmp);
+            vector<SpaceResult<ID>> results;
+            _GetNeighbors(tmp, nb_results, results);
+            #pragma omp critical
+            {
+            progBar.update();
+            WriteResults(out, id, results);
+            }
+        }
+    }
+}
+
+template <typename ID>
+void IVFPQSpace<ID>::Info(FILE* log, size_t indent, size_t indent_incr) const {
+    Space<ID>::Info(log, indent, indent_incr);
+    size_t largest = 0;
+    for (auto& posting : lists_) {
+        largest = std::max(largest, posting.ids.size());
+    }
+    string zero(indent, ' ');
+    fprintf(log, "%slists: %zu\n", zero.c_str(), lists_.size());
+    fprintf(log, "%slargest list: %zu\n", zero.c_str(), largest);
+    fprintf(log, "%sbits per code: %zu\n", zero.c_str(), _Trained() ? m_ * nbits_ : 0);
+}
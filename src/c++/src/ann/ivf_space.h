@@ -0,0 +1,343 @@
+#pragma once
+
+// Inverted-file index with a k-means coarse quantizer (IVF-Flat).
+//
+// Vectors are grouped by their nearest centroid into posting lists whose
+// rows are stored contiguously.  Queries scan only the nprobe lists whose
+// centroids are closest.  Until train_size vectors have been inserted
+// there are no centroids yet and everything lives in a single list.
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/align/aligned_allocator.hpp>
+#include <boost/random.hpp>
+
+#include "common/ann_util.h"
+#include "ann/kmeans.h"
+#include "ann/space.h"
+
+using std::unordered_map;
+using std::vector;
+using boost::alignment::aligned_allocator;
+using ann::util::ProgressBar;
+
+template <typename ID>
+struct IVFList {
+    vector<ID> ids;
+    vector<float, aligned_allocator<float, 32>> point_floats;
+};
+
+template <typename ID>
+class IVFSpace : public Space<ID> {
+  public:
+    IVFSpace(uint64_t seed=0)
+        : prng_(seed)
+    {};
+    ~IVFSpace();
+
+    void Init(size_t nb_dims) override;
+
+    // nlist: number of centroids
+    // nprobe: number of lists scanned per query
+    // train_size: vectors to collect before training (if 0, 64 * nlist)
+    void Config(size_t nb_dims, size_t nlist=1024, size_t nprobe=8, size_t train_size=0);
+
+    // Train the centroids on a sample of the stored vectors and reassign
+    // all of them.  Called automatically once train_size vectors are in.
+    void Train();
+
+    void Clear() override;
+
+    unsigned int Delete(const ID& id) override;
+
+    unsigned int Upsert(const SpaceInput<ID>& input) override;
+
+    void GetNeighbors(const float* point, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    void GetNeighbors(const ID& id, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    bool GetPoint(const ID& id, float* point) const override;
+
+    void GetIds(vector<ID>& ids) const override;
+
+    void GraphToStream(std::ostream& out, size_t nb_results) const override;
+
+    // Get the number of elements stored.
+    size_t Size() const override { return id2pos_.size(); }
+
+    // Get Dimensionality
+    size_t Dim() const override { return ndim_; }
+
+    void Info(FILE* log, size_t indent=2, size_t indent_incr=4) const override;
+
+  private:
+    void _Append(size_t list, const ID& id, const float* point);
+    void _Probe(const float* point, vector<size_t>& lists) const;
+    void _GetNeighbors(const float* point, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const;
+
+    size_t ndim_;
+
+    // posting list and offset within it, per ID
+    unordered_map<ID, std::pair<size_t, size_t>> id2pos_;
+    vector<IVFList<ID>> lists_;
+    vector<float> centroids_;
+
+    // constructor params
+    size_t nlist_;
+    size_t nprobe_;
+    size_t train_size_;
+
+    boost::mt19937_64 prng_;
+};
+
+template <typename ID>
+IVFSpace<ID>::~IVFSpace() {}
+
+template <typename ID>
+void IVFSpace<ID>::Config(size_t nb_dims, size_t nlist, size_t nprobe, size_t train_size) {
+    ndim_ = nb_dims;
+    nlist_ = std::max<size_t>(nlist, 1);
+    nprobe_ = std::max<size_t>(nprobe, 1);
+    train_size_ = (train_size == 0) ? 64 * nlist_ : train_size;
+    Clear();
+}
+
+template <typename ID>
+void IVFSpace<ID>::Init(size_t nb_dims) {
+    Config(nb_dims);
+}
+
+template <typename ID>
+void IVFSpace<ID>::Clear() {
+    id2pos_.clear();
+    centroids_.clear();
+    lists_.clear();
+    lists_.resize(1);
+}
+
+template <typename ID>
+void IVFSpace<ID>::_Append(size_t list, const ID& id, const float* point) {
+    auto& posting = lists_[list];
+    id2pos_[id] = std::make_pair(list, posting.ids.size());
+    posting.ids.emplace_back(id);
+    posting.point_floats.insert(posting.point_floats.end(), point, point + ndim_);
+}
+
+template <typename ID>
+void IVFSpace<ID>::Train() {
+    // Gather every stored vector; posting lists are rebuilt from scratch.
+    vector<ID> ids;
+    vector<float> points;
+    ids.reserve(id2pos_.size());
+    points.reserve(id2pos_.size() * ndim_);
+    for (auto& posting : lists_) {
+        ids.insert(ids.end(), posting.ids.begin(), posting.ids.end());
+        points.insert(points.end(), posting.point_floats.begin(), posting.point_floats.end());
+    }
+    size_t total = ids.size();
+    if (total == 0) {
+        return;
+    }
+
+    // Train on a random sample of at most train_size rows.
+    size_t sample_size = std::min(train_size_, total);
+    vector<float> sample(sample_size * ndim_);
+    vector<size_t> rows(total);
+    for (size_t i = 0; i < total; ++i) {
+        rows[i] = i;
+    }
+    for (size_t i = 0; i < sample_size; ++i) {
+        std::swap(rows[i], rows[boost::uniform_int<size_t>(i, total - 1)(prng_)]);
+        std::copy(&points[rows[i] * ndim_], &points[(rows[i] + 1) * ndim_], &sample[i * ndim_]);
+    }
+    KMeans(sample.data(), sample_size, ndim_, ndim_, nlist_, centroids_, prng_, true);
+
+    size_t nb_lists = centroids_.size() / ndim_;
+    vector<size_t> assignment(total);
+    #pragma omp parallel for
+    for (size_t i = 0; i < total; ++i) {
+        assignment[i] = NearestCentroid(&points[i * ndim_], centroids_, ndim_, true);
+    }
+
+    lists_.clear();
+    lists_.resize(nb_lists);
+    id2pos_.clear();
+    for (size_t i = 0; i < total; ++i) {
+        _Append(assignment[i], ids[i], &points[i * ndim_]);
+    }
+}
+
+template <typename ID>
+unsigned int IVFSpace<ID>::Delete(const ID& id) {
+
+    // Look up the ID.
+    auto it = id2pos_.find(id);
+    if (it == id2pos_.end()) {
+        return 0;
+    }
+
+    // Swap with the end of its list and resize by one.
+    auto& posting = lists_[it->second.first];
+    size_t index = it->second.second;
+    size_t last = posting.ids.size() - 1;
+    id2pos_.erase(it);
+    if (index != last) {
+        posting.ids[index] = posting.ids[last];
+        id2pos_[posting.ids[index]].second = index;
+        std::copy(posting.point_floats.begin() + last * ndim_,
+                  posting.point_floats.begin() + (last + 1) * ndim_,
+                  posting.point_floats.begin() + index * ndim_);
+    }
+    posting.ids.resize(last);
+    posting.point_floats.resize(last * ndim_);
+    return 1;
+}
+
+template <typename ID>
+unsigned int IVFSpace<ID>::Upsert(const SpaceInput<ID>& input) {
+    Delete(input.id);
+
+    // Reject NaN entries.
+    if (!isfinite_xf(input.point, ndim_)) {
+        return 0;
+    }
+
+    float tmp[ndim_];
+
+    // Reject inputs whose norm equals zero
+    if (!normalize(tmp, input.point, ndim_)) {
+        return 0;
+    }
+
+    if (centroids_.empty()) {
+        _Append(0, input.id, tmp);
+        if (id2pos_.size() >= train_size_) {
+            Train();
+        }
+    } else {
+        _Append(NearestCentroid(tmp, centroids_, ndim_, true), input.id, tmp);
+    }
+    return 1;
+}
+
+template <typename ID>
+void IVFSpace<ID>::_Probe(const float* point, vector<size_t>& lists) const {
+    size_t nb_lists = lists_.size();
+    lists.clear();
+    if (centroids_.empty()) {
+        lists.emplace_back(0);
+        return;
+    }
+
+    vector<std::pair<float, size_t>> scores(nb_lists);
+    for (size_t c = 0; c < nb_lists; ++c) {
+        scores[c] = std::make_pair(-DotProduct(&centroids_[c * ndim_], point, ndim_), c);
+    }
+    size_t nprobe = std::min(nprobe_, nb_lists);
+    std::partial_sort(scores.begin(), scores.begin() + nprobe, scores.end());
+    for (size_t i = 0; i < nprobe; ++i) {
+        lists.emplace_back(scores[i].second);
+    }
+}
+
+template <typename ID>
+void IVFSpace<ID>::_GetNeighbors(const float* point, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    results.clear();
+    vector<size_t> lists;
+    _Probe(point, lists);
+    for (auto list : lists) {
+        auto& posting = lists_[list];
+        for (size_t i = 0; i < posting.ids.size(); ++i) {
+            SpaceResult<ID> r;
+            r.id = posting.ids[i];
+            r.dist = 1.0 - DotProduct(&posting.point_floats[i * ndim_], point, ndim_);
+            PushTopK(results, r, nb_results);
+        }
+    }
+    std::sort_heap(results.begin(), results.end());
+}
+
+template <typename ID>
+void IVFSpace<ID>::GetNeighbors(const float* point, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    float tmp[ndim_];
+    if (!normalize(tmp, point, ndim_)) {
+        results.clear();
+        return;
+    }
+    _GetNeighbors(tmp, nb_results, results);
+}
+
+template <typename ID>
+void IVFSpace<ID>::GetNeighbors(const ID& id, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    auto it = id2pos_.find(id);
+    if (it != id2pos_.end()) {
+        auto& posting = lists_[it->second.first];
+        _GetNeighbors(&posting.point_floats[it->second.second * ndim_], nb_results, results);
+    }
+}
+
+template <typename ID>
+bool IVFSpace<ID>::GetPoint(const ID& id, float* point) const {
+    auto it = id2pos_.find(id);
+    if (it == id2pos_.end()) {
+        return false;
+    }
+    auto& posting = lists_[it->second.first];
+    std::copy_n(&posting.point_floats[it->second.second * ndim_], ndim_, point);
+    return true;
+}
+
+template <typename ID>
+void IVFSpace<ID>::GetIds(vector<ID>& ids) const {
+    ids.clear();
+    ids.reserve(id2pos_.size());
+    for (auto& posting : lists_) {
+        ids.insert(ids.end(), posting.ids.begin(), posting.ids.end());
+    }
+}
+
+template <typename ID>
+void IVFSpace<ID>::GraphToStream(std::ostream& out, size_t nb_results) const {
+    // Iterate over all lists, then over the ids in each
+    auto progBar = ProgressBar(id2pos_.size());
+    for (auto& posting : lists_) {
+        size_t total = posting.ids.size();
+        #pragma omp parallel for shared(progBar)
+        for (size_t i = 0; i < total; ++i) {
+            const ID& id = posting.ids[i];
+            vector<SpaceResult<ID>> results;
+            _GetNeighbors(&posting.point_floats[i * ndim_], nb_results, results);
+            #pragma omp critical
+            {
+            progBar.update();
+            WriteResults(out, id, results);
+            }
+        }
+    }
+}
+
+template <typename ID>
+void IVFSpace<ID>::Info(FILE* log, size_t indent, size_t indent_incr) const {
+    Space<ID>::Info(log, indent, indent_incr);
+    size_t largest = 0;
+    for (auto& posting : lists_) {
+        largest = std::max(largest, posting.ids.size());
+    }
+    string zero(indent, ' ');
+    fprintf(log, "%slists: %zu\n", zero.c_str(), lists_.size());
+    fprintf(log, "%slargest list: %zu\n", zero.c_str(), largest);
+}
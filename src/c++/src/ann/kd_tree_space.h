@@ -0,0 +1,499 @@
+#pragma once
+
+// Exact search with a k-d tree, for low-dimensional points (up to a few
+// dozen dimensions; beyond that, boxes stop pruning and LinearSpace scans
+// faster).
+//
+// Build() splits the rows with the sliding-midpoint rule (Maneewongvatana
+// & Mount, "It's okay to be skinny, if your friends are fat", 1999): a
+// node's cell is cut at the middle of its longest side, and if all rows
+// fall on one side the cut slides to the nearest row.  Unlike median
+// splits, cells stay fat, which keeps the number of leaves a query visits
+// logarithmic even for clustered data.
+//
+// Nodes are stored in depth-first order, so a node's left child is the
+// next node and only the right one is recorded, and rows are reordered so
+// that every node covers a contiguous range of them: leaves are scanned
+// sequentially.  Each node keeps the bounding box of its rows, and queries
+// visit nodes nearest box first, skipping those whose Metric::BoxBound
+// shows they cannot hold a better result.  All metrics are exact: cosine
+// runs on the normalized points, where it is half the squared Euclidean
+// distance.
+//
+// Rows upserted after Build() are scanned until the next Build(); deleted
+// rows are skipped, then dropped by it.
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "common/ann_util.h"
+#include "ann/metric.h"
+#include "ann/space.h"
+
+using std::unordered_map;
+using std::vector;
+using ann::util::ProgressBar;
+
+// The left child of a node is the next one; right is 0 for leaves.
+struct KDNode {
+    uint32_t begin;
+    uint32_t end;
+    uint32_t right;
+};
+
+// Subtrees with more rows than this are built in parallel.
+const size_t kKDTaskRows = 16384;
+
+template <typename ID, typename Metric = CosineMetric>
+class KDTreeSpace : public Space<ID> {
+  public:
+    KDTreeSpace() {};
+    ~KDTreeSpace() {}
+
+    void Init(size_t nb_dims) override;
+
+    // leaf_size: largest number of rows in a leaf
+    void Config(size_t nb_dims, size_t leaf_size=16);
+
+    // Drop deleted rows and build the tree over all rows.
+    bool Build() override;
+
+    void Clear() override;
+
+    unsigned int Delete(const ID& id) override;
+
+    unsigned int Upsert(const SpaceInput<ID>& input) override;
+
+    void GetNeighbors(const float* point, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    void GetNeighbors(const ID& id, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    // Disallowed rows are skipped during the search, so results are exact.
+    void GetNeighborsFiltered(const float* point, size_t nb_results,
+            const SpaceFilter<ID>& filter, vector<SpaceResult<ID>>& results) const override;
+
+    void GetNeighborsWithin(const float* point, float max_dist,
+            vector<SpaceResult<ID>>& results) const override;
+
+    bool GetPoint(const ID& id, float* point) const override;
+
+    void GetIds(vector<ID>& ids) const override;
+
+    // Get the number of elements stored.
+    size_t Size() const override;
+
+    // Get Dimensionality
+    size_t Dim() const override { return ndim_; }
+
+    const char* MetricName() const override { return Metric::Name(); }
+
+    void Info(FILE* log, size_t indent=2, size_t indent_incr=4) const override;
+
+  private:
+    const float* _Point(size_t row) const { return &point_floats_[row * ndim_]; }
+
+    // Append the subtree over order[begin, end) to nodes and boxes.  Right
+    // children are numbered from the start of nodes.
+    void _BuildNode(vector<uint32_t>& order, size_t begin, size_t end,
+            const vector<float>& cell_lo, const vector<float>& cell_hi,
+            vector<KDNode>& nodes, vector<float>& boxes) const;
+    // k nearest rows if nb_results > 0, else all rows within max_dist.
+    void _Search(const float* point, size_t nb_results, float max_dist,
+            const vector<uint64_t>& skip, vector<SpaceResult<ID>>& results) const;
+    bool _PrepareQuery(const float* point, vector<float>& prepared) const;
+
+    size_t ndim_ = 0;
+    size_t leaf_size_ = 16;
+
+    // rows [0, nb_indexed_) are in the tree, in tree order; the rest are
+    // scanned
+    unordered_map<ID, size_t> id2index_;
+    vector<ID> ids_;
+    vector<float> point_floats_;
+    vector<uint64_t> deleted_;
+    size_t nb_deleted_ = 0;
+    size_t nb_indexed_ = 0;
+
+    vector<KDNode> nodes_;
+    vector<float> boxes_;  // per node, ndim_ lower then ndim_ upper bounds
+
+    mutable std::shared_timed_mutex mutex_;
+};
+
+template <typename ID, typename Metric>
+void KDTreeSpace<ID, Metric>::Config(size_t nb_dims, size_t leaf_size) {
+    ndim_ = nb_dims;
+    leaf_size_ = std::max<size_t>(leaf_size, 1);
+    Clear();
+}
+
+template <typename ID, typename Metric>
+void KDTreeSpace<ID, Metric>::Init(size_t nb_dims) {
+    Config(nb_dims);
+}
+
+template <typename ID, typename Metric>
+void KDTreeSpace<ID, Metric>::Clear() {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    id2index_.clear();
+    ids_.clear();
+    point_floats_.clear();
+    deleted_.clear();
+    nb_deleted_ = 0;
+    nb_indexed_ = 0;
+    nodes_.clear();
+    boxes_.clear();
+}
+
+template <typename ID, typename Metric>
+size_t KDTreeSpace<ID, Metric>::Size() const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    return id2index_.size();
+}
+
+template <typename ID, typename Metric>
+unsigned int KDTreeSpace<ID, Metric>::Delete(const ID& id) {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    auto it = id2index_.find(id);
+    if (it == id2index_.end()) {
+        return 0;
+    }
+
+    // Rows are covered by node ranges, so only mark them.
+    SetBit(deleted_, it->second);
+    ++nb_deleted_;
+    id2index_.erase(it);
+    return 1;
+}
+
+template <typename ID, typename Metric>
+unsigned int KDTreeSpace<ID, Metric>::Upsert(const SpaceInput<ID>& input) {
+    Delete(input.id);
+
+    // Reject NaN entries.
+    if (!isfinite_xf(input.point, ndim_)) {
+        return 0;
+    }
+
+    // Reject inputs the metric cannot use (zero norm for cosine)
+    vector<float> tmp(ndim_);
+    if (!Metric::Prepare(tmp.data(), input.point, ndim_)) {
+        return 0;
+    }
+
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    size_t row = ids_.size();
+    ids_.emplace_back(input.id);
+    id2index_[input.id] = row;
+    point_floats_.insert(point_floats_.end(), tmp.begin(), tmp.end());
+    deleted_.resize(BitWords(row + 1), 0);
+    return 1;
+}
+
+template <typename ID, typename Metric>
+void KDTreeSpace<ID, Metric>::_BuildNode(vector<uint32_t>& order, size_t begin, size_t end,
+        const vector<float>& cell_lo, const vector<float>& cell_hi,
+        vector<KDNode>& nodes, vector<float>& boxes) const
+{
+    size_t index = nodes.size();
+    nodes.emplace_back(KDNode{(uint32_t) begin, (uint32_t) end, 0});
+    size_t box = boxes.size();
+    boxes.resize(box + 2 * ndim_);
+    float* lo = &boxes[box];
+    float* hi = &boxes[box + ndim_];
+    std::copy(_Point(order[begin]), _Point(order[begin]) + ndim_, lo);
+    std::copy(_Point(order[begin]), _Point(order[begin]) + ndim_, hi);
+    for (size_t i = begin + 1; i < end; ++i) {
+        const float* p = _Point(order[i]);
+        for (size_t d = 0; d < ndim_; ++d) {
+            lo[d] = std::min(lo[d], p[d]);
+            hi[d] = std::max(hi[d], p[d]);
+        }
+    }
+    if (end - begin <= leaf_size_) {
+        return;
+    }
+
+    // Cut the longest side of the cell along which rows differ; a node
+    // whose rows are all equal stays a leaf.
+    size_t dim = ndim_;
+    for (size_t d = 0; d < ndim_; ++d) {
+        if (hi[d] > lo[d] && (dim == ndim_ ||
+                cell_hi[d] - cell_lo[d] > cell_hi[dim] - cell_lo[dim])) {
+            dim = d;
+        }
+    }
+    if (dim == ndim_) {
+        return;
+    }
+    float split = (cell_lo[dim] + cell_hi[dim]) / 2;
+    auto below = [&] (uint32_t row) { return _Point(row)[dim] < split; };
+    size_t middle = std::partition(order.begin() + begin, order.begin() + end, below)
+                    - order.begin();
+    if (middle == begin || middle == end) {
+        // Slide the cut to the nearest row, which gets a side to itself.
+        auto less = [&] (uint32_t a, uint32_t b) { return _Point(a)[dim] < _Point(b)[dim]; };
+        size_t nth = (middle == begin) ? begin : end - 1;
+        std::nth_element(order.begin() + begin, order.begin() + nth, order.begin() + end, less);
+        split = _Point(order[nth])[dim];
+        middle = (middle == begin) ? begin + 1 : end - 1;
+    }
+    vector<float> left_hi(cell_hi);
+    left_hi[dim] = split;
+    vector<float> right_lo(cell_lo);
+    right_lo[dim] = split;
+
+    // Build the right subtree aside, as a task when it is large, then
+    // append it after the left one.
+    vector<KDNode> right_nodes;
+    vector<float> right_boxes;
+    #pragma omp task shared(order, right_nodes, right_boxes) if (end - middle > kKDTaskRows)
+    _BuildNode(order, middle, end, right_lo, cell_hi, right_nodes, right_boxes);
+    _BuildNode(order, begin, middle, cell_lo, left_hi, nodes, boxes);
+    #pragma omp taskwait
+    uint32_t right = nodes.size();
+    nodes[index].right = right;
+    for (auto node : right_nodes) {
+        if (node.right != 0) {
+            node.right += right;
+        }
+        nodes.emplace_back(node);
+    }
+    boxes.insert(boxes.end(), right_boxes.begin(), right_boxes.end());
+}
+
+template <typename ID, typename Metric>
+bool KDTreeSpace<ID, Metric>::Build() {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+
+    // Compact away deleted rows.
+    if (nb_deleted_ > 0) {
+        size_t kept = 0;
+        for (size_t row = 0; row < ids_.size(); ++row) {
+            if (TestBit(deleted_, row)) {
+                continue;
+            }
+            ids_[kept] = ids_[row];
+            std::copy(_Point(row), _Point(row) + ndim_, &point_floats_[kept * ndim_]);
+            ++kept;
+        }
+        ids_.resize(kept);
+        point_floats_.resize(kept * ndim_);
+        deleted_.assign(BitWords(kept), 0);
+        nb_deleted_ = 0;
+    }
+    size_t total = ids_.size();
+    nodes_.clear();
+    boxes_.clear();
+    nb_indexed_ = 0;
+    if (total == 0) {
+        id2index_.clear();
+        return true;
+    }
+
+    vector<uint32_t> order(total);
+    for (size_t i = 0; i < total; ++i) {
+        order[i] = i;
+    }
+    vector<float> cell_lo(_Point(0), _Point(0) + ndim_);
+    vector<float> cell_hi(cell_lo);
+    for (size_t row = 1; row < total; ++row) {
+        for (size_t d = 0; d < ndim_; ++d) {
+            cell_lo[d] = std::min(cell_lo[d], _Point(row)[d]);
+            cell_hi[d] = std::max(cell_hi[d], _Point(row)[d]);
+        }
+    }
+    #pragma omp parallel
+    #pragma omp single
+    _BuildNode(order, 0, total, cell_lo, cell_hi, nodes_, boxes_);
+
+    // Store rows in tree order.
+    vector<ID> ids(total);
+    vector<float> points(total * ndim_);
+    for (size_t i = 0; i < total; ++i) {
+        ids[i] = ids_[order[i]];
+        std::copy(_Point(order[i]), _Point(order[i]) + ndim_, &points[i * ndim_]);
+        id2index_[ids[i]] = i;
+    }
+    ids_.swap(ids);
+    point_floats_.swap(points);
+    nb_indexed_ = total;
+    return true;
+}
+
+template <typename ID, typename Metric>
+void KDTreeSpace<ID, Metric>::_Search(const float* point, size_t nb_results, float max_dist,
+        const vector<uint64_t>& skip, vector<SpaceResult<ID>>& results) const
+{
+    results.clear();
+    bool knn = nb_results > 0;
+    auto scan = [&] (size_t begin, size_t end) {
+        for (size_t row = begin; row < end; ++row) {
+            if (TestBit(skip, row)) {
+                continue;
+            }
+            SpaceResult<ID> r;
+            r.id = ids_[row];
+            r.dist = Metric::Distance(_Point(row), point, ndim_);
+            if (knn) {
+                PushTopK(results, r, nb_results);
+            } else if (r.dist <= max_dist) {
+                results.emplace_back(r);
+            }
+        }
+    };
+    // Nodes whose bound exceeds this cannot hold a result.
+    auto limit = [&] () {
+        if (!knn) {
+            return max_dist;
+        }
+        return (results.size() < nb_results) ? std::numeric_limits<float>::max()
+                                             : results.front().dist;
+    };
+
+    // Rows not in the tree yet go first: they tighten the limit for free.
+    scan(nb_indexed_, ids_.size());
+
+    // Depth first, nearest child first.
+    vector<std::pair<float, uint32_t>> stack;
+    if (!nodes_.empty()) {
+        stack.emplace_back(Metric::BoxBound(point, &boxes_[0], &boxes_[ndim_], ndim_), 0);
+    }
+    while (!stack.empty()) {
+        float bound = stack.back().first;
+        size_t index = stack.back().second;
+        const KDNode& node = nodes_[index];
+        stack.pop_back();
+        if (bound > limit()) {
+            continue;
+        }
+        if (node.right == 0) {
+            scan(node.begin, node.end);
+            continue;
+        }
+        size_t left = index + 1;
+        const float* box = &boxes_[left * 2 * ndim_];
+        float left_bound = Metric::BoxBound(point, box, box + ndim_, ndim_);
+        box = &boxes_[node.right * 2 * ndim_];
+        float right_bound = Metric::BoxBound(point, box, box + ndim_, ndim_);
+        if (left_bound < right_bound) {
+            stack.emplace_back(right_bound, node.right);
+            stack.emplace_back(left_bound, left);
+        } else {
+            stack.emplace_back(left_bound, left);
+            stack.emplace_back(right_bound, node.right);
+        }
+    }
+    if (knn) {
+        std::sort_heap(results.begin(), results.end());
+    } else {
+        std::sort(results.begin(), results.end());
+    }
+}
+
+template <typename ID, typename Metric>
+bool KDTreeSpace<ID, Metric>::_PrepareQuery(const float* point, vector<float>& prepared) const {
+    prepared.resize(ndim_);
+    return Metric::Prepare(prepared.data(), point, ndim_);
+}
+
+template <typename ID, typename Metric>
+void KDTreeSpace<ID, Metric>::GetNeighbors(const float* point, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    vector<float> prepared;
+    if (nb_results == 0 || !_PrepareQuery(point, prepared)) {
+        results.clear();
+        return;
+    }
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    _Search(prepared.data(), nb_results, 0.0, deleted_, results);
+}
+
+template <typename ID, typename Metric>
+void KDTreeSpace<ID, Metric>::GetNeighbors(const ID& id, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    vector<float> point(ndim_);
+    if (!GetPoint(id, point.data())) {
+        results.clear();
+        return;
+    }
+    GetNeighbors(point.data(), nb_results, results);
+}
+
+template <typename ID, typename Metric>
+void KDTreeSpace<ID, Metric>::GetNeighborsFiltered(const float* point, size_t nb_results,
+        const SpaceFilter<ID>& filter, vector<SpaceResult<ID>>& results) const
+{
+    vector<float> prepared;
+    if (nb_results == 0 || !_PrepareQuery(point, prepared)) {
+        results.clear();
+        return;
+    }
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    vector<uint64_t> skip = filter.SlotBits(ids_, id2index_);
+    for (size_t w = 0; w < skip.size(); ++w) {
+        skip[w] = ~skip[w] | deleted_[w];
+    }
+    _Search(prepared.data(), nb_results, 0.0, skip, results);
+}
+
+template <typename ID, typename Metric>
+void KDTreeSpace<ID, Metric>::GetNeighborsWithin(const float* point, float max_dist,
+        vector<SpaceResult<ID>>& results) const
+{
+    vector<float> prepared;
+    if (!_PrepareQuery(point, prepared)) {
+        results.clear();
+        return;
+    }
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    _Search(prepared.data(), 0, max_dist, deleted_, results);
+}
+
+template <typename ID, typename Metric>
+bool KDTreeSpace<ID, Metric>::GetPoint(const ID& id, float* point) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    auto it = id2index_.find(id);
+    if (it == id2index_.end()) {
+        return false;
+    }
+    std::copy(_Point(it->second), _Point(it->second) + ndim_, point);
+    return true;
+}
+
+template <typename ID, typename Metric>
+void KDTreeSpace<ID, Metric>::GetIds(vector<ID>& ids) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    ids.clear();
+    for (size_t row = 0; row < ids_.size(); ++row) {
+        if (!TestBit(deleted_, row)) {
+            ids.emplace_back(ids_[row]);
+        }
+    }
+}
+
+template <typename ID, typename Metric>
+void KDTreeSpace<ID, Metric>::Info(FILE* log, size_t indent, size_t indent_incr) const {
+    Space<ID>::Info(log, indent, indent_incr);
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    string zero(indent, ' ');
+    size_t nb_leaves = 0;
+    for (auto& node : nodes_) {
+        nb_leaves += (node.right == 0);
+    }
+    fprintf(log, "%snodes: %zu (%zu leaves of up to %zu rows)\n", zero.c_str(),
+            nodes_.size(), nb_leaves, leaf_size_);
+    fprintf(log, "%sunindexed rows: %zu, deleted rows: %zu\n", zero.c_str(),
+            ids_.size() - nb_indexed_, nb_deleted_);
+}
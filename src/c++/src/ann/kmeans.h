@@ -0,0 +1,110 @@
+#pragma once
+
+// Mini-batch k-means, used to train coarse quantizers and PQ codebooks.
+//
+// Sculley, "Web-Scale K-Means Clustering" (2010).
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <boost/random.hpp>
+
+#include "ann/space.h"
+
+using std::vector;
+
+// Index of the centroid nearest to point.  Spherical centroids are unit
+// vectors compared by dot product, the others by squared L2 distance.
+inline size_t NearestCentroid(const float* point, const vector<float>& centroids,
+                              size_t dim, bool spherical) {
+    size_t k = centroids.size() / dim;
+    size_t best = 0;
+    float best_score = std::numeric_limits<float>::max();
+    for (size_t c = 0; c < k; ++c) {
+        const float* centroid = &centroids[c * dim];
+        float score;
+        if (spherical) {
+            score = -DotProduct(centroid, point, dim);
+        } else {
+            score = 0.0;
+            for (size_t i = 0; i < dim; ++i) {
+                float d = centroid[i] - point[i];
+                score += d * d;
+            }
+        }
+        if (score < best_score) {
+            best_score = score;
+            best = c;
+        }
+    }
+    return best;
+}
+
+// Cluster n rows of dim floats (stride apart) into k centroids, written
+// row after row to centroids.  Batches are assigned in parallel.
+inline void KMeans(const float* data, size_t n, size_t dim, size_t stride, size_t k,
+                   vector<float>& centroids, boost::mt19937_64& prng,
+                   bool spherical, size_t nb_iters=100, size_t batch_size=0) {
+    k = std::min(k, n);
+    centroids.assign(k * dim, 0.0);
+    if (k == 0) {
+        return;
+    }
+    if (batch_size == 0) {
+        batch_size = std::max<size_t>(1024, 4 * k);
+    }
+    batch_size = std::min(batch_size, n);
+    boost::uniform_int<size_t> pick(0, n - 1);
+
+    // Seed with distinct random rows.
+    vector<size_t> rows(n);
+    for (size_t i = 0; i < n; ++i) {
+        rows[i] = i;
+    }
+    for (size_t c = 0; c < k; ++c) {
+        std::swap(rows[c], rows[boost::uniform_int<size_t>(c, n - 1)(prng)]);
+        std::copy(data + rows[c] * stride, data + rows[c] * stride + dim, &centroids[c * dim]);
+    }
+
+    vector<size_t> counts(k, 0);
+    vector<size_t> batch(batch_size);
+    vector<size_t> assignment(batch_size);
+    for (size_t iter = 0; iter < nb_iters; ++iter) {
+        for (auto& row : batch) {
+            row = pick(prng);
+        }
+        #pragma omp parallel for
+        for (size_t b = 0; b < batch_size; ++b) {
+            assignment[b] = NearestCentroid(data + batch[b] * stride, centroids, dim, spherical);
+        }
+
+        // Per-centroid learning rate 1 / count.
+        for (size_t b = 0; b < batch_size; ++b) {
+            size_t c = assignment[b];
+            float eta = 1.0 / ++counts[c];
+            float* centroid = &centroids[c * dim];
+            const float* point = data + batch[b] * stride;
+            for (size_t i = 0; i < dim; ++i) {
+                centroid[i] += eta * (point[i] - centroid[i]);
+            }
+        }
+        if (spherical) {
+            for (size_t c = 0; c < k; ++c) {
+                float tmp[dim];
+                if (normalize(tmp, &centroids[c * dim], dim)) {
+                    std::copy(tmp, tmp + dim, &centroids[c * dim]);
+                }
+            }
+        }
+    }
+
+    // Centroids that never won a point are moved onto random rows.
+    for (size_t c = 0; c < k; ++c) {
+        if (counts[c] == 0) {
+            const float* point = data + pick(prng) * stride;
+            std::copy(point, point + dim, &centroids[c * dim]);
+        }
+    }
+}
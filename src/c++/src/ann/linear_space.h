@@ -1,18 +1,25 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <iostream>
 #include <fstream>
+#include <mutex>
 #include <pthread.h>
 #include <set>
+#include <shared_mutex>
 #include <string>
 #include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include <boost/align/aligned_allocator.hpp>
+#include <Eigen/Dense>
+
 #include "common/ann_util.h"
+#include "ann/metric.h"
+#include "ann/nn_descent.h"
 #include "ann/space.h"
 
 using std::unordered_map;
@@ -21,7 +28,7 @@ using std::set;
 using boost::alignment::aligned_allocator;
 using ann::util::ProgressBar;
 
-template <typename ID>
+template <typename ID, typename Metric = CosineMetric>
 class LinearSpace : public Space<ID> {
   public:
     LinearSpace();
@@ -29,8 +36,39 @@ class LinearSpace : public Space<ID> {
 
     void Init(size_t nb_dims) override;
 
+    // With tombstones enabled, Delete only marks the row as dead and scans
+    // skip it.  Dead rows are reclaimed by Compact, which is started in the
+    // background once their fraction exceeds max_dead_ratio.
+    //
+    // A non-zero shortlist keeps a sign-bit signature per row.  Queries then
+    // rank all rows by Hamming distance between signatures and compute the
+    // exact distance only for the shortlist closest ones.  Signatures
+    // approximate the angle, so this suits cosine best.
+    //
+    // A non-zero abandon_block makes scans evaluate dot products in blocks
+    // of that many dimensions.  After each block, a row is abandoned once
+    // the bound on its remaining dimensions (Cauchy-Schwarz for cosine and
+    // inner product, the partial sum for L2) shows it cannot beat the
+    // current k-th distance.  Call ReorderDims to move the
+    // high-variance dimensions first, which makes abandoning happen early.
+    //
+    // A non-zero descent_iters makes GraphToStream build an approximate
+    // graph with at most that many rounds of NN-Descent instead of the
+    // exact blocked scan.
+    void Config(size_t nb_dims, bool tombstones=false, float max_dead_ratio=0.25,
+                size_t shortlist=0, size_t abandon_block=0, size_t descent_iters=0);
+
     void Clear() override;
 
+    // Drop dead rows.  Readers and writers are blocked only while the
+    // compacted arrays are swapped in.  Does nothing without tombstones.
+    void Compact();
+
+    // Permute the stored dimensions by decreasing variance over the current
+    // rows.  Query points are permuted the same way, so results are
+    // unchanged.
+    void ReorderDims();
+
     unsigned int Delete(const ID& id) override;
 
     unsigned int Upsert(const SpaceInput<ID>& input) override;
@@ -41,46 +79,166 @@ class LinearSpace : public Space<ID> {
     void GetNeighbors(const ID& id, size_t nb_results,
             vector<SpaceResult<ID>>& results) const override;
 
+    // Scan only the slots the filter allows.
+    void GetNeighborsFiltered(const float* point, size_t nb_results,
+            const SpaceFilter<ID>& filter, vector<SpaceResult<ID>>& results) const override;
+
+    // Exact scan, ignoring shortlist.  With abandon_block, rows are
+    // abandoned as soon as their bound exceeds max_dist.
+    void GetNeighborsWithin(const float* point, float max_dist,
+            vector<SpaceResult<ID>>& results) const override;
+
+    bool GetPoint(const ID& id, float* point) const override;
+
+    void GetIds(vector<ID>& ids) const override;
+
     void GraphToStream(std::ostream& out, size_t nb_results) const override;
 
+    // Exact kNN graph over all stored items: graph[i] holds the neighbors
+    // of ids[i].  The corpus is processed in symmetric blocks: each distance
+    // tile is computed once with a GEMM and used to update the top-k heaps
+    // of both its row and its column block.
+    void BuildGraph(size_t nb_results, vector<ID>& ids,
+            vector<vector<SpaceResult<ID>>>& graph) const;
+
+    // Approximate kNN graph over all stored items, in the same format as
+    // BuildGraph, by NN-Descent.
+    void BuildGraphDescent(size_t nb_results, vector<ID>& ids,
+            vector<vector<SpaceResult<ID>>>& graph) const;
+
     // Get the number of elements stored.
-    size_t Size() const override { return ids_.size(); }
+    size_t Size() const override;
 
     // Get Dimensionality
     size_t Dim() const override { return ndim_; }
 
+    const char* MetricName() const override { return Metric::Name(); }
+
   private:
+    bool _PrepareQuery(const float* point, vector<float>& prepared) const;
+    // skip has the bits of the slots to leave out set (deleted_ at least).
+    void _GetNeighbors(const float* point, size_t nb_results,
+                   vector<SpaceResult<ID>>& results, const vector<uint64_t>& skip) const;
+    void _GetNeighborsShortlist(const float* point, size_t nb_results,
+                   vector<SpaceResult<ID>>& results, const vector<uint64_t>& skip) const;
+    // Run func on one slice of the rows per thread and concatenate the
+    // per-thread results.
+    void _ScanMT(void* (*func)(void*), const float* point, size_t nb_results, float max_dist,
+                 const vector<uint64_t>& skip, vector<SpaceResult<ID>>& results) const;
+    unsigned int _Delete(const ID& id);
+    void _JoinCompactor();
+    void _ComputeTails(size_t idx);
+
     size_t ndim_;
     vector<ID> ids_;
     unordered_map<ID, size_t> id2index_;
     vector<float, aligned_allocator<float, 32>> point_floats_;
+
+    // one bit per row, set for tombstoned rows
+    vector<uint64_t> deleted_;
+    size_t nb_deleted_ = 0;
+    bool tombstones_ = false;
+    float max_dead_ratio_ = 0.25;
+
+    // BitWords(ndim_) words of sign bits per row, if shortlist_ > 0
+    vector<uint64_t> signatures_;
+    size_t shortlist_ = 0;
+
+    // If abandon_block_ > 0, tails_ holds per row and per dimension block
+    // the norm of the dimensions after that block.  Stored rows have their
+    // dimensions in dim_order_ (identity when empty).
+    size_t abandon_block_ = 0;
+    size_t nb_blocks_ = 0;
+    vector<float> tails_;
+    vector<size_t> dim_order_;
+
+    // Whatever rewrites all rows (Compact, ReorderDims, Clear) holds
+    // compact_mutex_ before mutex_, and compactor_mutex_ guards the
+    // compactor_ thread object.
+    mutable std::shared_timed_mutex mutex_;
+    std::mutex compact_mutex_;
+    std::atomic<bool> compacting_{false};
+    std::mutex compactor_mutex_;
+    std::thread compactor_;
+
+    // rows per tile side in BuildGraph
+    size_t graph_block_ = 256;
+
+    // NN-Descent rounds in GraphToStream (exact graph if 0)
+    size_t descent_iters_ = 0;
 };
 
-template <typename ID>
-LinearSpace<ID>::LinearSpace() {
+template <typename ID, typename Metric>
+LinearSpace<ID, Metric>::LinearSpace() {
 }
 
-template <typename ID>
-LinearSpace<ID>::~LinearSpace() {
+template <typename ID, typename Metric>
+LinearSpace<ID, Metric>::~LinearSpace() {
+    _JoinCompactor();
 }
 
-template <typename ID>
-void LinearSpace<ID>::Init(size_t nb_dims) {
+template <typename ID, typename Metric>
+void LinearSpace<ID, Metric>::_JoinCompactor() {
+    // Join outside compactor_mutex_: the compactor may wait on mutex_, held
+    // by a _Delete that wants compactor_mutex_.
+    std::thread compactor;
+    {
+        std::lock_guard<std::mutex> guard(compactor_mutex_);
+        compactor.swap(compactor_);
+    }
+    if (compactor.joinable()) {
+        compactor.join();
+    }
+}
+
+template <typename ID, typename Metric>
+void LinearSpace<ID, Metric>::Config(size_t nb_dims, bool tombstones, float max_dead_ratio,
+                             size_t shortlist, size_t abandon_block, size_t descent_iters) {
+    Clear();
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
     ndim_ = nb_dims;
-    id2index_.clear();
-    ids_.clear();
-    point_floats_.clear();
+    tombstones_ = tombstones;
+    max_dead_ratio_ = max_dead_ratio;
+    shortlist_ = shortlist;
+    abandon_block_ = abandon_block;
+    descent_iters_ = descent_iters;
+    nb_blocks_ = (abandon_block > 0) ? (nb_dims + abandon_block - 1) / abandon_block : 0;
+    dim_order_.clear();
 }
 
-template <typename ID>
-void LinearSpace<ID>::Clear() {
+template <typename ID, typename Metric>
+void LinearSpace<ID, Metric>::Init(size_t nb_dims) {
+    Config(nb_dims);
+}
+
+template <typename ID, typename Metric>
+void LinearSpace<ID, Metric>::Clear() {
+    _JoinCompactor();
+    std::lock_guard<std::mutex> compact_guard(compact_mutex_);
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
     id2index_.clear();
     ids_.clear();
     point_floats_.clear();
+    deleted_.clear();
+    nb_deleted_ = 0;
+    signatures_.clear();
+    tails_.clear();
 }
 
-template <typename ID>
-unsigned int LinearSpace<ID>::Delete(const ID& id) {
+template <typename ID, typename Metric>
+size_t LinearSpace<ID, Metric>::Size() const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    return ids_.size() - nb_deleted_;
+}
+
+template <typename ID, typename Metric>
+unsigned int LinearSpace<ID, Metric>::Delete(const ID& id) {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    return _Delete(id);
+}
+
+template <typename ID, typename Metric>
+unsigned int LinearSpace<ID, Metric>::_Delete(const ID& id) {
 
     // Look up the ID.
     auto it = id2index_.find(id);
@@ -88,8 +246,26 @@ unsigned int LinearSpace<ID>::Delete(const ID& id) {
         return 0;
     }
 
+    if (tombstones_) {
+        SetBit(deleted_, it->second);
+        id2index_.erase(it);
+        nb_deleted_++;
+
+        if (nb_deleted_ > max_dead_ratio_ * ids_.size() && !compacting_) {
+            compacting_ = true;
+            // The previous compactor cleared compacting_ as it finished,
+            // so joining it does not wait on mutex_.
+            std::lock_guard<std::mutex> guard(compactor_mutex_);
+            if (compactor_.joinable()) {
+                compactor_.join();
+            }
+            compactor_ = std::thread([this] { this->Compact(); });
+        }
+        return 1;
+    }
+
     // Swap with the end and resize by one.
-    auto& index = it->second;
+    size_t index = it->second;
     id2index_[ids_[ids_.size() - 1]] = index;
     id2index_.erase(it);
 
@@ -108,12 +284,104 @@ unsigned int LinearSpace<ID>::Delete(const ID& id) {
         point_floats_[to_index] = point_floats_[from_index];
     }
     point_floats_.resize(ids_.size() * ndim_);
+    deleted_.resize(BitWords(ids_.size()));
+
+    if (shortlist_ > 0) {
+        size_t words = BitWords(ndim_);
+        std::copy(signatures_.begin() + ids_.size() * words,
+                  signatures_.begin() + (ids_.size() + 1) * words,
+                  signatures_.begin() + index * words);
+        signatures_.resize(ids_.size() * words);
+    }
+    if (abandon_block_ > 0) {
+        std::copy(tails_.begin() + ids_.size() * nb_blocks_,
+                  tails_.begin() + (ids_.size() + 1) * nb_blocks_,
+                  tails_.begin() + index * nb_blocks_);
+        tails_.resize(ids_.size() * nb_blocks_);
+    }
     return 1;
 }
 
-template <typename ID>
-unsigned int LinearSpace<ID>::Upsert(const SpaceInput<ID>& input) {
-    Delete(input.id);
+template <typename ID, typename Metric>
+void LinearSpace<ID, Metric>::Compact() {
+    std::lock_guard<std::mutex> compact_guard(compact_mutex_);
+
+    // Copy live rows while scans keep running.
+    const size_t npos = (size_t)-1;
+    vector<ID> ids;
+    vector<float, aligned_allocator<float, 32>> point_floats;
+    vector<uint64_t> signatures;
+    vector<float> tails;
+    vector<size_t> remap;
+    size_t snapshot_size;
+    size_t words = (shortlist_ > 0) ? BitWords(ndim_) : 0;
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+        // Without tombstones there is nothing to drop, and a swap-Delete
+        // would move rows under the snapshot.
+        if (!tombstones_) {
+            return;
+        }
+        snapshot_size = ids_.size();
+        remap.assign(snapshot_size, npos);
+        ids.reserve(snapshot_size - nb_deleted_);
+        point_floats.reserve((snapshot_size - nb_deleted_) * ndim_);
+        for (size_t i = 0; i < snapshot_size; ++i) {
+            if (TestBit(deleted_, i)) {
+                continue;
+            }
+            remap[i] = ids.size();
+            ids.emplace_back(ids_[i]);
+            point_floats.insert(point_floats.end(),
+                    &point_floats_[i * ndim_], &point_floats_[(i + 1) * ndim_]);
+            signatures.insert(signatures.end(),
+                    signatures_.begin() + i * words, signatures_.begin() + (i + 1) * words);
+            tails.insert(tails.end(),
+                    tails_.begin() + i * nb_blocks_, tails_.begin() + (i + 1) * nb_blocks_);
+        }
+    }
+
+    // Replay what happened since the snapshot and swap the arrays in.
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+        size_t total = ids_.size();
+        for (size_t i = snapshot_size; i < total; ++i) {
+            remap.emplace_back(ids.size());
+            ids.emplace_back(ids_[i]);
+            point_floats.insert(point_floats.end(),
+                    &point_floats_[i * ndim_], &point_floats_[(i + 1) * ndim_]);
+            signatures.insert(signatures.end(),
+                    signatures_.begin() + i * words, signatures_.begin() + (i + 1) * words);
+            tails.insert(tails.end(),
+                    tails_.begin() + i * nb_blocks_, tails_.begin() + (i + 1) * nb_blocks_);
+        }
+
+        vector<uint64_t> deleted(BitWords(ids.size()), 0);
+        size_t nb_deleted = 0;
+        for (size_t i = 0; i < total; ++i) {
+            if (remap[i] != npos && TestBit(deleted_, i)) {
+                SetBit(deleted, remap[i]);
+                nb_deleted++;
+            }
+        }
+        for (auto& it : id2index_) {
+            it.second = remap[it.second];
+        }
+
+        ids_.swap(ids);
+        point_floats_.swap(point_floats);
+        signatures_.swap(signatures);
+        tails_.swap(tails);
+        deleted_.swap(deleted);
+        nb_deleted_ = nb_deleted;
+    }
+    compacting_ = false;
+}
+
+template <typename ID, typename Metric>
+unsigned int LinearSpace<ID, Metric>::Upsert(const SpaceInput<ID>& input) {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    _Delete(input.id);
 
     // Reject NaN entries.
     if (!isfinite_xf(input.point, ndim_)) {
@@ -122,10 +390,17 @@ unsigned int LinearSpace<ID>::Upsert(const SpaceInput<ID>& input) {
 
     float tmp[ndim_];
 
-    // Reject inputs whose norm equals zero
-    if (!normalize(tmp, input.point, ndim_)) {
+    // Reject inputs the metric cannot use (zero norm for cosine)
+    if (!Metric::Prepare(tmp, input.point, ndim_)) {
         return 0;
     }
+    if (!dim_order_.empty()) {
+        float prepared[ndim_];
+        std::copy(tmp, tmp + ndim_, prepared);
+        for (size_t i = 0; i < ndim_; ++i) {
+            tmp[i] = prepared[dim_order_[i]];
+        }
+    }
 
     size_t idx = ids_.size();
     ids_.emplace_back(input.id);
@@ -134,13 +409,100 @@ unsigned int LinearSpace<ID>::Upsert(const SpaceInput<ID>& input) {
     for (size_t i = 0; i < ndim_; ++i) {
         point_floats_.emplace_back(tmp[i]);
     }
+    deleted_.resize(BitWords(ids_.size()));
+
+    if (shortlist_ > 0) {
+        size_t words = BitWords(ndim_);
+        signatures_.resize((idx + 1) * words);
+        SignBits(&signatures_[idx * words], tmp, ndim_);
+    }
+    if (abandon_block_ > 0) {
+        tails_.resize((idx + 1) * nb_blocks_);
+        _ComputeTails(idx);
+    }
 
     return 1;
 }
 
+template <typename ID, typename Metric>
+void LinearSpace<ID, Metric>::_ComputeTails(size_t idx) {
+    const float* row = &point_floats_[idx * ndim_];
+    float* tails = &tails_[idx * nb_blocks_];
+    float sq = 0.0;
+    for (size_t b = nb_blocks_; b-- > 0; ) {
+        tails[b] = std::sqrt(sq);
+        size_t begin = b * abandon_block_;
+        size_t end = std::min(ndim_, begin + abandon_block_);
+        for (size_t i = begin; i < end; ++i) {
+            sq += row[i] * row[i];
+        }
+    }
+}
+
+template <typename ID, typename Metric>
+void LinearSpace<ID, Metric>::ReorderDims() {
+    // A compaction running from an earlier snapshot would swap unpermuted
+    // rows back in.
+    std::lock_guard<std::mutex> compact_guard(compact_mutex_);
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    size_t total = ids_.size();
+    if (total == nb_deleted_) {
+        return;
+    }
+
+    vector<double> sum(ndim_, 0.0);
+    vector<double> sum_sq(ndim_, 0.0);
+    for (size_t i = 0; i < total; ++i) {
+        if (TestBit(deleted_, i)) {
+            continue;
+        }
+        const float* row = &point_floats_[i * ndim_];
+        for (size_t j = 0; j < ndim_; ++j) {
+            sum[j] += row[j];
+            sum_sq[j] += row[j] * row[j];
+        }
+    }
+    size_t live = total - nb_deleted_;
+    vector<double> variance(ndim_);
+    for (size_t j = 0; j < ndim_; ++j) {
+        variance[j] = sum_sq[j] / live - (sum[j] / live) * (sum[j] / live);
+    }
+
+    // perm[j] is the current position of what becomes position j
+    vector<size_t> perm(ndim_);
+    for (size_t j = 0; j < ndim_; ++j) {
+        perm[j] = j;
+    }
+    std::stable_sort(perm.begin(), perm.end(), [&variance] (size_t a, size_t b) {
+        return variance[a] > variance[b];
+    });
+
+    vector<float> row(ndim_);
+    size_t words = BitWords(ndim_);
+    for (size_t i = 0; i < total; ++i) {
+        float* dst = &point_floats_[i * ndim_];
+        std::copy(dst, dst + ndim_, row.begin());
+        for (size_t j = 0; j < ndim_; ++j) {
+            dst[j] = row[perm[j]];
+        }
+        if (shortlist_ > 0) {
+            SignBits(&signatures_[i * words], dst, ndim_);
+        }
+        if (abandon_block_ > 0) {
+            _ComputeTails(i);
+        }
+    }
+
+    vector<size_t> dim_order(ndim_);
+    for (size_t j = 0; j < ndim_; ++j) {
+        dim_order[j] = dim_order_.empty() ? perm[j] : dim_order_[perm[j]];
+    }
+    dim_order_.swap(dim_order);
+}
+
 /*
-template <typename ID>
-void LinearSpace<ID>::GetNeighbors(const float* point, size_t nb_results,
+template <typename ID, typename Metric>
+void LinearSpace<ID, Metric>::GetNeighbors(const float* point, size_t nb_results,
                                 vector<SpaceResult<ID>>* results) const {
     results->clear();
     results->reserve(ids_.size());
@@ -171,11 +533,19 @@ struct LinearSpaceThreadData {
     size_t nb_dims;
     const vector<ID>* ids;
     const vector<float, aligned_allocator<float, 32>>* point_floats;
+    const vector<uint64_t>* skip;  // deleted or filtered out
+    float max_dist;  // range scans
+
+    // early abandoning
+    size_t block;
+    size_t nb_blocks;
+    const float* tails;
+    const float* point_tails;
 
     vector<SpaceResult<ID>>* results;
 };
 
-template <typename ID>
+template <typename ID, typename Metric>
 void* NeighborsSortMT(void* arg) {
     LinearSpaceThreadData<ID>* data = (LinearSpaceThreadData<ID>*)arg;
     data->results->clear();
@@ -183,10 +553,13 @@ void* NeighborsSortMT(void* arg) {
     size_t end = (data->id + 1) * data->ids->size() / data->nb_threads;
     data->results->reserve(end - begin);
     for (size_t i = begin; i < end; ++i) {
+        if (TestBit(*data->skip, i)) {
+            continue;
+        }
         SpaceResult<ID> r;
         r.id = (*data->ids)[i];
         const float* aligned_point = &(*(data->point_floats))[i * data->nb_dims];
-        r.dist = CosineDistance(aligned_point, data->point, data->nb_dims);
+        r.dist = Metric::Distance(aligned_point, data->point, data->nb_dims);
         data->results->emplace_back(r);
     }
     sort(data->results->begin(), data->results->end());
@@ -196,7 +569,7 @@ void* NeighborsSortMT(void* arg) {
     pthread_exit(nullptr);
 }
 
-template <typename ID>
+template <typename ID, typename Metric>
 void* NeighborsKBestSetMT(void* arg) {
     LinearSpaceThreadData<ID>* data = (LinearSpaceThreadData<ID>*)arg;
     data->results->clear();
@@ -205,10 +578,13 @@ void* NeighborsKBestSetMT(void* arg) {
 
     set<SpaceResult<ID>> best;
     for (size_t i = begin; i < end; ++i) {
+        if (TestBit(*data->skip, i)) {
+            continue;
+        }
         SpaceResult<ID> r;
         r.id = (*data->ids)[i];
         const float* aligned_point = &(*(data->point_floats))[i * data->nb_dims];
-        r.dist = CosineDistance(aligned_point, data->point, data->nb_dims);
+        r.dist = Metric::Distance(aligned_point, data->point, data->nb_dims);
         if (best.size() < data->nb_results) {
             best.insert(r);
         } else {
@@ -231,7 +607,7 @@ void* NeighborsKBestSetMT(void* arg) {
     pthread_exit(nullptr);
 }
 
-template <typename ID>
+template <typename ID, typename Metric>
 void* NeighborsKBestVectorMT(void* arg) {
     LinearSpaceThreadData<ID>* data = (LinearSpaceThreadData<ID>*)arg;
     data->results->clear();
@@ -241,10 +617,13 @@ void* NeighborsKBestVectorMT(void* arg) {
     vector<SpaceResult<ID>> bests;
     bests.reserve(data->nb_results);
     for (size_t i = begin; i < end; ++i) {
+        if (TestBit(*data->skip, i)) {
+            continue;
+        }
         SpaceResult<ID> r;
         r.id = (*data->ids)[i];
         const float* aligned_point = &(*(data->point_floats))[i * data->nb_dims];
-        r.dist = CosineDistance(aligned_point, data->point, data->nb_dims);
+        r.dist = Metric::Distance(aligned_point, data->point, data->nb_dims);
         if (bests.size() < data->nb_results) {
             bests.emplace_back(r);
             sort(bests.begin(), bests.end());
@@ -267,13 +646,190 @@ void* NeighborsKBestVectorMT(void* arg) {
     pthread_exit(nullptr);
 }
 
+template <typename ID, typename Metric>
+void* NeighborsAbandonMT(void* arg) {
+    LinearSpaceThreadData<ID>* data = (LinearSpaceThreadData<ID>*)arg;
+    data->results->clear();
+    size_t begin = data->id * data->ids->size() / data->nb_threads;
+    size_t end = (data->id + 1) * data->ids->size() / data->nb_threads;
+    size_t nb_dims = data->nb_dims;
+
+    vector<SpaceResult<ID>>& bests = *data->results;
+    bests.reserve(data->nb_results);
+    for (size_t i = begin; i < end; ++i) {
+        if (TestBit(*data->skip, i)) {
+            continue;
+        }
+        const float* aligned_point = &(*(data->point_floats))[i * nb_dims];
+        SpaceResult<ID> r;
+        r.id = (*data->ids)[i];
+        if (bests.size() < data->nb_results) {
+            r.dist = Metric::Distance(aligned_point, data->point, nb_dims);
+            PushTopK(bests, r, data->nb_results);
+            continue;
+        }
+
+        // dot(a, b) <= dot over the blocks seen + |a_tail| * |b_tail|
+        float threshold = bests.front().dist;
+        const float* tails = data->tails + i * data->nb_blocks;
+        float acc = 0.0;
+        bool abandoned = false;
+        for (size_t b = 0; b < data->nb_blocks; ++b) {
+            size_t offset = b * data->block;
+            size_t len = std::min(data->block, nb_dims - offset);
+            acc += Metric::Accumulate(aligned_point + offset, data->point + offset, len);
+            if (Metric::Bound(acc, tails[b], data->point_tails[b]) > threshold) {
+                abandoned = true;
+                break;
+            }
+        }
+        if (!abandoned) {
+            r.dist = Metric::Finish(acc);
+            PushTopK(bests, r, data->nb_results);
+        }
+    }
+    std::sort_heap(bests.begin(), bests.end());
+    pthread_exit(nullptr);
+}
+
+template <typename ID, typename Metric>
+void* NeighborsWithinMT(void* arg) {
+    LinearSpaceThreadData<ID>* data = (LinearSpaceThreadData<ID>*)arg;
+    data->results->clear();
+    size_t begin = data->id * data->ids->size() / data->nb_threads;
+    size_t end = (data->id + 1) * data->ids->size() / data->nb_threads;
+    size_t nb_dims = data->nb_dims;
+
+    for (size_t i = begin; i < end; ++i) {
+        if (TestBit(*data->skip, i)) {
+            continue;
+        }
+        const float* aligned_point = &(*(data->point_floats))[i * nb_dims];
+        SpaceResult<ID> r;
+        r.id = (*data->ids)[i];
+        if (data->nb_blocks == 0) {
+            r.dist = Metric::Distance(aligned_point, data->point, nb_dims);
+            if (r.dist <= data->max_dist) {
+                data->results->emplace_back(r);
+            }
+            continue;
+        }
+
+        // Same bound as NeighborsAbandonMT, against the fixed radius.
+        const float* tails = data->tails + i * data->nb_blocks;
+        float acc = 0.0;
+        bool abandoned = false;
+        for (size_t b = 0; b < data->nb_blocks; ++b) {
+            size_t offset = b * data->block;
+            size_t len = std::min(data->block, nb_dims - offset);
+            acc += Metric::Accumulate(aligned_point + offset, data->point + offset, len);
+            if (Metric::Bound(acc, tails[b], data->point_tails[b]) > data->max_dist) {
+                abandoned = true;
+                break;
+            }
+        }
+        r.dist = Metric::Finish(acc);
+        if (!abandoned && r.dist <= data->max_dist) {
+            data->results->emplace_back(r);
+        }
+    }
+    pthread_exit(nullptr);
+}
+
 }  // namespace
 
-template <typename ID>
-void LinearSpace<ID>::GetNeighbors(const float* point, size_t nb_results,
+template <typename ID, typename Metric>
+bool LinearSpace<ID, Metric>::_PrepareQuery(const float* point, vector<float>& prepared) const {
+    prepared.resize(ndim_);
+    if (!Metric::Prepare(prepared.data(), point, ndim_)) {
+        return false;
+    }
+    if (!dim_order_.empty()) {
+        vector<float> permuted(ndim_);
+        for (size_t i = 0; i < ndim_; ++i) {
+            permuted[i] = prepared[dim_order_[i]];
+        }
+        prepared.swap(permuted);
+    }
+    return true;
+}
+
+template <typename ID, typename Metric>
+void LinearSpace<ID, Metric>::GetNeighbors(const float* point, size_t nb_results,
                                 vector<SpaceResult<ID>>& results) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    vector<float> prepared;
+    if (!_PrepareQuery(point, prepared)) {
+        results.clear();
+        return;
+    }
+    _GetNeighbors(prepared.data(), nb_results, results, deleted_);
+}
+
+template <typename ID, typename Metric>
+void LinearSpace<ID, Metric>::GetNeighborsFiltered(const float* point, size_t nb_results,
+        const SpaceFilter<ID>& filter, vector<SpaceResult<ID>>& results) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    vector<float> prepared;
+    if (!_PrepareQuery(point, prepared)) {
+        results.clear();
+        return;
+    }
+    vector<uint64_t> skip = filter.SlotBits(ids_, id2index_);
+    for (size_t w = 0; w < skip.size(); ++w) {
+        skip[w] = ~skip[w] | deleted_[w];
+    }
+    _GetNeighbors(prepared.data(), nb_results, results, skip);
+}
+
+template <typename ID, typename Metric>
+void LinearSpace<ID, Metric>::GetNeighborsWithin(const float* point, float max_dist,
+        vector<SpaceResult<ID>>& results) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    vector<float> prepared;
+    if (!_PrepareQuery(point, prepared)) {
+        results.clear();
+        return;
+    }
+    _ScanMT(NeighborsWithinMT<ID, Metric>, prepared.data(), 0, max_dist, deleted_, results);
+    sort(results.begin(), results.end());
+}
+
+template <typename ID, typename Metric>
+void LinearSpace<ID, Metric>::_GetNeighbors(const float* point, size_t nb_results,
+                                vector<SpaceResult<ID>>& results, const vector<uint64_t>& skip) const {
+    if (shortlist_ > 0) {
+        _GetNeighborsShortlist(point, nb_results, results, skip);
+        return;
+    }
+    _ScanMT((abandon_block_ > 0) ? NeighborsAbandonMT<ID, Metric> : NeighborsKBestVectorMT<ID, Metric>,
+            point, nb_results, 0.0, skip, results);
+    sort(results.begin(), results.end());
+    if (nb_results < results.size()) {
+        results.resize(nb_results);
+    }
+}
+
+template <typename ID, typename Metric>
+void LinearSpace<ID, Metric>::_ScanMT(void* (*func)(void*), const float* point,
+        size_t nb_results, float max_dist, const vector<uint64_t>& skip,
+        vector<SpaceResult<ID>>& results) const
+{
     results.clear();
 
+    // Norms of the query past each dimension block, for early abandoning.
+    vector<float> point_tails(nb_blocks_);
+    float sq = 0.0;
+    for (size_t b = nb_blocks_; b-- > 0; ) {
+        point_tails[b] = std::sqrt(sq);
+        size_t end = std::min(ndim_, (b + 1) * abandon_block_);
+        for (size_t i = b * abandon_block_; i < end; ++i) {
+            sq += point[i] * point[i];
+        }
+    }
+
     size_t nb_threads = std::thread::hardware_concurrency();
 
     vector<pthread_t> threads;
@@ -291,8 +847,14 @@ void LinearSpace<ID>::GetNeighbors(const float* point, size_t nb_results,
         info.nb_dims = ndim_;
         info.ids = &ids_;
         info.point_floats = &point_floats_;
+        info.skip = &skip;
+        info.max_dist = max_dist;
+        info.block = abandon_block_;
+        info.nb_blocks = nb_blocks_;
+        info.tails = tails_.data();
+        info.point_tails = point_tails.data();
         info.results = &results_per_thread[i];
-        pthread_create(&threads[i], nullptr, NeighborsKBestVectorMT<ID>, &info);
+        pthread_create(&threads[i], nullptr, func, &info);
     }
 
     for (size_t i = 0; i < nb_threads; ++i) {
@@ -304,34 +866,247 @@ void LinearSpace<ID>::GetNeighbors(const float* point, size_t nb_results,
             results.emplace_back(r);
         }
     }
-    sort(results.begin(), results.end());
-    if (nb_results < results.size()) {
-        results.resize(nb_results);
+}
+
+template <typename ID, typename Metric>
+void LinearSpace<ID, Metric>::_GetNeighborsShortlist(const float* point, size_t nb_results,
+                                vector<SpaceResult<ID>>& results, const vector<uint64_t>& skip) const {
+    results.clear();
+    size_t total = ids_.size();
+    size_t words = BitWords(ndim_);
+    vector<uint64_t> query(words);
+    SignBits(query.data(), point, ndim_);
+
+    // First pass: Hamming distance between sign signatures.  Candidates are
+    // (distance, row) pairs kept in a bounded max-heap per thread.
+    typedef std::pair<uint32_t, size_t> Candidate;
+    size_t shortlist = std::max(shortlist_, nb_results);
+    vector<Candidate> candidates;
+    #pragma omp parallel shared(candidates)
+    {
+        vector<Candidate> heap;
+        heap.reserve(shortlist + 1);
+        #pragma omp for nowait
+        for (size_t i = 0; i < total; ++i) {
+            if (TestBit(skip, i)) {
+                continue;
+            }
+            Candidate c(HammingDistance(&signatures_[i * words], query.data(), words), i);
+            if (heap.size() < shortlist) {
+                heap.emplace_back(c);
+                std::push_heap(heap.begin(), heap.end());
+            } else if (c < heap.front()) {
+                std::pop_heap(heap.begin(), heap.end());
+                heap.back() = c;
+                std::push_heap(heap.begin(), heap.end());
+            }
+        }
+        #pragma omp critical
+        {
+        candidates.insert(candidates.end(), heap.begin(), heap.end());
+        }
+    }
+    if (candidates.size() > shortlist) {
+        std::nth_element(candidates.begin(), candidates.begin() + shortlist, candidates.end());
+        candidates.resize(shortlist);
     }
+
+    // Second pass: exact distances for the shortlist only.
+    for (auto& c : candidates) {
+        SpaceResult<ID> r;
+        r.id = ids_[c.second];
+        r.dist = Metric::Distance(&point_floats_[c.second * ndim_], point, ndim_);
+        PushTopK(results, r, nb_results);
+    }
+    std::sort_heap(results.begin(), results.end());
 }
 
-template <typename ID>
-void LinearSpace<ID>::GetNeighbors(const ID& id, size_t nb_results,
+template <typename ID, typename Metric>
+void LinearSpace<ID, Metric>::GetNeighbors(const ID& id, size_t nb_results,
         vector<SpaceResult<ID>>& results) const
 {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
     auto it = id2index_.find(id);
     if (it != id2index_.end()) {
         auto i = it->second;
         const float* vec = &(point_floats_[i * ndim_]);
-        GetNeighbors(vec, nb_results, results);
+        _GetNeighbors(vec, nb_results, results, deleted_);
     }
 }
 
-template <typename ID>
-void LinearSpace<ID>::GraphToStream(std::ostream& out, size_t nb_results) const {
-    // Iterate over all ids stored
+template <typename ID, typename Metric>
+bool LinearSpace<ID, Metric>::GetPoint(const ID& id, float* point) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    auto it = id2index_.find(id);
+    if (it == id2index_.end()) {
+        return false;
+    }
+    const float* vec = &point_floats_[it->second * ndim_];
+    for (size_t i = 0; i < ndim_; ++i) {
+        point[dim_order_.empty() ? i : dim_order_[i]] = vec[i];
+    }
+    return true;
+}
+
+template <typename ID, typename Metric>
+void LinearSpace<ID, Metric>::GetIds(vector<ID>& ids) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    ids.clear();
+    ids.reserve(ids_.size() - nb_deleted_);
+    for (size_t i = 0; i < ids_.size(); ++i) {
+        if (!TestBit(deleted_, i)) {
+            ids.emplace_back(ids_[i]);
+        }
+    }
+}
+
+template <typename ID, typename Metric>
+void LinearSpace<ID, Metric>::BuildGraph(size_t nb_results, vector<ID>& ids,
+        vector<vector<SpaceResult<ID>>>& graph) const
+{
+    typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrixXf;
+
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
     size_t total = ids_.size();
-    auto progBar = ProgressBar(total);
-    for (size_t i = 0; i < total; ++i) {
-        auto id = ids_[i];
-        vector<SpaceResult<ID>> results;
-        GetNeighbors(id, nb_results, results);
+    ids.clear();
+    graph.clear();
+    graph.resize(total);
+    if (total == 0) {
+        return;
+    }
+    for (auto& heap : graph) {
+        heap.reserve(nb_results);
+    }
+
+    size_t nb_blocks = (total + graph_block_ - 1) / graph_block_;
+    vector<std::mutex> locks(nb_blocks);
+    Eigen::Map<const RowMatrixXf> points(point_floats_.data(), total, ndim_);
+    Eigen::VectorXf sq_norms = points.rowwise().squaredNorm();
+
+    auto progBar = ProgressBar(nb_blocks);
+    #pragma omp parallel for schedule(dynamic, 1) shared(progBar, locks, graph)
+    for (size_t bi = 0; bi < nb_blocks; ++bi) {
+        size_t i0 = bi * graph_block_;
+        size_t ni = std::min(graph_block_, total - i0);
+        auto rows = points.middleRows(i0, ni);
+        Eigen::MatrixXf tile;
+
+        // Only the upper triangle of block pairs is computed; the lower
+        // triangle is covered by updating column heaps from the same tile.
+        for (size_t bj = bi; bj < nb_blocks; ++bj) {
+            size_t j0 = bj * graph_block_;
+            size_t nj = std::min(graph_block_, total - j0);
+            tile.noalias() = rows * points.middleRows(j0, nj).transpose();
+
+            {
+                std::lock_guard<std::mutex> guard(locks[bi]);
+                for (size_t i = 0; i < ni; ++i) {
+                    if (TestBit(deleted_, i0 + i)) {
+                        continue;
+                    }
+                    auto& heap = graph[i0 + i];
+                    for (size_t j = 0; j < nj; ++j) {
+                        if (TestBit(deleted_, j0 + j)) {
+                            continue;
+                        }
+                        SpaceResult<ID> r;
+                        r.id = ids_[j0 + j];
+                        r.dist = Metric::FromDot(tile(i, j), sq_norms[i0 + i], sq_norms[j0 + j]);
+                        PushTopK(heap, r, nb_results);
+                    }
+                }
+            }
+            if (bj == bi) {
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> guard(locks[bj]);
+                for (size_t j = 0; j < nj; ++j) {
+                    if (TestBit(deleted_, j0 + j)) {
+                        continue;
+                    }
+                    auto& heap = graph[j0 + j];
+                    for (size_t i = 0; i < ni; ++i) {
+                        if (TestBit(deleted_, i0 + i)) {
+                            continue;
+                        }
+                        SpaceResult<ID> r;
+                        r.id = ids_[i0 + i];
+                        r.dist = Metric::FromDot(tile(i, j), sq_norms[i0 + i], sq_norms[j0 + j]);
+                        PushTopK(heap, r, nb_results);
+                    }
+                }
+            }
+        }
+        #pragma omp critical
+        {
         progBar.update();
-        WriteResults(out, id, results);
+        }
+    }
+
+    // Drop the rows of dead items.
+    size_t live = 0;
+    for (size_t i = 0; i < total; ++i) {
+        if (TestBit(deleted_, i)) {
+            continue;
+        }
+        ids.emplace_back(ids_[i]);
+        graph[live].swap(graph[i]);
+        std::sort_heap(graph[live].begin(), graph[live].end());
+        live++;
+    }
+    graph.resize(live);
+}
+
+template <typename ID, typename Metric>
+void LinearSpace<ID, Metric>::BuildGraphDescent(size_t nb_results, vector<ID>& ids,
+        vector<vector<SpaceResult<ID>>>& graph) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    size_t total = ids_.size();
+    ids.clear();
+    graph.clear();
+    if (nb_results == 0) {
+        return;
+    }
+
+    // Each item is its own nearest neighbor, as in the exact graph.
+    vector<vector<SpaceResult<uint32_t>>> rows;
+    boost::mt19937_64 prng(0);
+    NNDescent<Metric>(point_floats_.data(), total, ndim_, nb_results - 1, rows, prng,
+              descent_iters_, 0.5, 0.001, &deleted_);
+    for (size_t i = 0; i < total; ++i) {
+        if (TestBit(deleted_, i)) {
+            continue;
+        }
+        const float* point = &point_floats_[i * ndim_];
+        ids.emplace_back(ids_[i]);
+        graph.emplace_back();
+        auto& results = graph.back();
+        results.reserve(rows[i].size() + 1);
+        SpaceResult<ID> self;
+        self.id = ids_[i];
+        self.dist = Metric::Distance(point, point, ndim_);
+        results.emplace_back(self);
+        for (auto& row : rows[i]) {
+            SpaceResult<ID> r;
+            r.id = ids_[row.id];
+            r.dist = row.dist;
+            results.emplace_back(r);
+        }
+    }
+}
+
+template <typename ID, typename Metric>
+void LinearSpace<ID, Metric>::GraphToStream(std::ostream& out, size_t nb_results) const {
+    vector<ID> ids;
+    vector<vector<SpaceResult<ID>>> graph;
+    if (descent_iters_ > 0) {
+        BuildGraphDescent(nb_results, ids, graph);
+    } else {
+        BuildGraph(nb_results, ids, graph);
+    }
+    for (size_t i = 0; i < graph.size(); ++i) {
+        WriteResults(out, ids[i], graph[i]);
     }
 }
@@ -0,0 +1,143 @@
+#pragma once
+
+// Distance policies, picked by spaces as a template parameter so that
+// their inner loops are resolved at compile time.
+//
+//   CosineMetric        1 - cos(a, b); points are stored normalized
+//   InnerProductMetric  -<a, b>; points are stored as given
+//   EuclideanMetric     |a - b|; points are stored as given
+//
+// Distances grow as points get less similar, so results sort the same way
+// under every metric.  Scans that work on blocks of dimensions add up
+// Accumulate over the blocks seen, use Bound for a lower bound on the
+// final distance given the norms of the blocks left (tail_a, tail_b) and
+// Finish for the distance itself.  Scans working on dot products (GEMM
+// tiles) use FromDot with the squared norms of both points.  Trees use
+// BoxBound, a lower bound on the distance from a prepared query to any
+// prepared point within the axis-aligned box [lo, hi].
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+#include "ann/space.h"
+
+// Squared Euclidean distance from q to the box [lo, hi].
+inline float SqDistanceToBox(const float* q, const float* lo, const float* hi, size_t dim) {
+    float result = 0.0;
+    for (size_t i = 0; i < dim; ++i) {
+        float d = std::max(lo[i] - q[i], 0.0f) + std::max(q[i] - hi[i], 0.0f);
+        result += d * d;
+    }
+    return result;
+}
+
+// Slack of CosineMetric::BoxBound: float rounding in the norms and dot
+// products of unit vectors moves 1 - cos by a few 1e-6 at thousands of
+// dimensions.
+const float kCosineBoxSlack = 1e-4;
+
+struct CosineMetric {
+    static const char* Name() { return "cosine"; }
+
+    // Copy src into dst the way the space stores it.  Returns false if the
+    // point cannot be used (here, zero norm).
+    static bool Prepare(float* dst, const float* src, size_t dim) {
+        return normalize(dst, src, dim);
+    }
+
+    static float Distance(const float* a, const float* b, size_t dim) {
+        return 1.0 - DotProduct(a, b, dim);
+    }
+
+    static float Accumulate(const float* a, const float* b, size_t dim) {
+        return DotProduct(a, b, dim);
+    }
+
+    static float Bound(float acc, float tail_a, float tail_b) {
+        return 1.0 - acc - tail_a * tail_b;
+    }
+
+    static float Finish(float acc) { return 1.0 - acc; }
+
+    static float FromDot(float dot, float sq_a, float sq_b) { return 1.0 - dot; }
+
+    // Between unit vectors, 1 - cos = |a - b|^2 / 2.  Normalized floats
+    // are only unit up to rounding, and Distance rounds differently, so
+    // the bound is loosened a bit not to exceed a distance it covers.
+    static float BoxBound(const float* q, const float* lo, const float* hi, size_t dim) {
+        return std::max(0.0f, SqDistanceToBox(q, lo, hi, dim) / 2 - kCosineBoxSlack);
+    }
+};
+
+struct InnerProductMetric {
+    static const char* Name() { return "ip"; }
+
+    static bool Prepare(float* dst, const float* src, size_t dim) {
+        std::copy(src, src + dim, dst);
+        return true;
+    }
+
+    static float Distance(const float* a, const float* b, size_t dim) {
+        return -DotProduct(a, b, dim);
+    }
+
+    static float Accumulate(const float* a, const float* b, size_t dim) {
+        return DotProduct(a, b, dim);
+    }
+
+    static float Bound(float acc, float tail_a, float tail_b) {
+        return -acc - tail_a * tail_b;
+    }
+
+    static float Finish(float acc) { return -acc; }
+
+    static float FromDot(float dot, float sq_a, float sq_b) { return -dot; }
+
+    // The largest dot product is at the corner of the box the query
+    // points to.
+    static float BoxBound(const float* q, const float* lo, const float* hi, size_t dim) {
+        float result = 0.0;
+        for (size_t i = 0; i < dim; ++i) {
+            result += std::max(q[i] * lo[i], q[i] * hi[i]);
+        }
+        return -result;
+    }
+};
+
+struct EuclideanMetric {
+    static const char* Name() { return "l2"; }
+
+    static bool Prepare(float* dst, const float* src, size_t dim) {
+        std::copy(src, src + dim, dst);
+        return true;
+    }
+
+    static float Distance(const float* a, const float* b, size_t dim) {
+        return EuclideanDistance(a, b, dim);
+    }
+
+    // Squared distance over the block; it only grows, so the bound needs
+    // no tails.
+    static float Accumulate(const float* a, const float* b, size_t dim) {
+        float result = 0.0;
+        #pragma omp simd reduction(+:result)
+        for (size_t i = 0; i < dim; ++i) {
+            float d = a[i] - b[i];
+            result += d * d;
+        }
+        return result;
+    }
+
+    static float Bound(float acc, float tail_a, float tail_b) { return std::sqrt(acc); }
+
+    static float Finish(float acc) { return std::sqrt(acc); }
+
+    static float FromDot(float dot, float sq_a, float sq_b) {
+        return std::sqrt(std::max(0.0f, sq_a + sq_b - 2 * dot));
+    }
+
+    static float BoxBound(const float* q, const float* lo, const float* hi, size_t dim) {
+        return std::sqrt(SqDistanceToBox(q, lo, hi, dim));
+    }
+};
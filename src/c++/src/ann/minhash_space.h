@@ -0,0 +1,469 @@
+#pragma once
+
+// Jaccard similarity search over sets, by MinHash LSH.
+//
+// Items are sets of uint64_t elements, such as the item IDs of a basket.
+// Each set gets a signature of nb_hashes MinHash values computed in one
+// pass by one permutation hashing (Li et al., "One permutation hashing",
+// 2012): a universal hash of each element picks one of nb_hashes bins, and
+// every bin keeps the smallest hash it got.  Bins no element fell in copy
+// a non-empty bin picked by a fixed random probe sequence (Shrivastava,
+// "Optimal densification for fast and accurate minwise hashing", 2017),
+// so two signatures agree at a position with probability the Jaccard
+// similarity of their sets.
+//
+// As LSHSpace does with Gaussian projections, signatures are cut into L
+// bands of nb_hashes / L values, each keying a bucket table.  Candidates
+// are the items sharing most buckets with the query, ranked by the Jaccard
+// similarity estimated from their signatures.  Only the low b bits of each
+// value are stored (Li & Konig, "b-Bit minwise hashing", 2010); they also
+// agree by chance once in 2^b, which the estimate corrects for.  Distances
+// are 1 - estimated Jaccard.
+//
+// Sets themselves are not kept, so GetPoint fails and the wrappers of
+// space_registry.h do not accept minhash as their inner space.  Dense
+// points given to Upsert and GetNeighbors are read as the set of their
+// non-zero dimensions.
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/random.hpp>
+
+#include "common/ann_util.h"
+#include "ann/gauss_lsh.h"
+#include "ann/space.h"
+
+using std::vector;
+using std::unordered_map;
+using ann::util::ProgressBar;
+
+// A set: nb_elems elements, in any order and possibly repeated.
+template <typename ID>
+struct SetInput {
+    ID id;
+    const uint64_t* elems;
+    size_t nb_elems;
+};
+
+template <typename ID>
+class MinHashSpace : public Space<ID> {
+  public:
+    MinHashSpace(uint64_t seed=0)
+        : prng_(seed)
+    {};
+    ~MinHashSpace() {}
+
+    void Init(size_t nb_dims) override;
+
+    // nb_dims: dimension of dense points, when using them
+    // nb_hashes: signature length
+    // L: bands (bucket tables), of nb_hashes / L values each
+    // b: bits kept per value, rounded down to a power of two up to 32
+    // search_k: candidates ranked, 0 for L * nb_results
+    void Config(size_t nb_dims, size_t nb_hashes=128, size_t L=32, size_t b=8,
+                size_t search_k=0);
+
+    void Clear() override;
+
+    unsigned int Delete(const ID& id) override;
+
+    unsigned int Upsert(const SpaceInput<ID>& input) override;
+
+    // Returns 0 for an empty set.
+    unsigned int UpsertSet(const SetInput<ID>& input);
+
+    void GetNeighbors(const float* point, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    void GetNeighbors(const ID& id, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    void GetNeighborsSet(const uint64_t* elems, size_t nb_elems, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const;
+
+    // Jaccard similarity of two stored sets estimated from their
+    // signatures, or -1 if either is not stored.
+    float Jaccard(const ID& id1, const ID& id2) const;
+
+    bool GetPoint(const ID& id, float* point) const override { return false; }
+    bool KeepsPoints() const override { return false; }
+
+    void GetIds(vector<ID>& ids) const override;
+
+    // Get the number of elements stored.
+    size_t Size() const override;
+
+    // Get Dimensionality
+    size_t Dim() const override { return ndim_; }
+
+    const char* MetricName() const override { return "jaccard"; }
+
+    void Info(FILE* log, size_t indent=2, size_t indent_incr=4) const override;
+
+  private:
+    static uint64_t _Mix(uint64_t x);
+    uint32_t _Hash(uint64_t elem) const;
+    // Compute the packed signature and band keys of a set; false if empty.
+    bool _Sketch(const uint64_t* elems, size_t nb_elems, uint64_t* sig, uint64_t* keys) const;
+    void _SetOf(const float* point, vector<uint64_t>& elems) const;
+    float _Similarity(const uint64_t* sig1, const uint64_t* sig2) const;
+    void _Search(const uint64_t* sig, const uint64_t* keys, size_t nb_results,
+                 vector<SpaceResult<ID>>& results) const;
+    void _AddToBuckets(const ID& id, const uint64_t* keys);
+    void _RemoveFromBuckets(const ID& id, const uint64_t* keys);
+
+    size_t ndim_ = 0;
+    size_t nb_hashes_ = 0;
+    size_t L_ = 0;
+    size_t rows_ = 0;
+    size_t bits_ = 0;
+    size_t search_k_ = 0;
+    size_t sig_words_ = 0;
+    // bit 0 of every b-bit field of a word
+    uint64_t field_mask_ = 0;
+
+    // element hash ((a_lo_ * lo + a_hi_ * hi + c_) mod 2^64) >> 32, and
+    // the seed of the densification probes
+    uint64_t a_lo_ = 0;
+    uint64_t a_hi_ = 0;
+    uint64_t c_ = 0;
+    uint64_t probe_seed_ = 0;
+
+    vector<ID> ids_;
+    unordered_map<ID, size_t> id2index_;
+    vector<uint64_t> sigs_;  // sig_words_ per slot
+    vector<uint64_t> keys_;  // L_ band keys per slot
+    vector<Bucket<ID>> buckets_;
+
+    boost::mt19937_64 prng_;
+
+    mutable std::shared_timed_mutex mutex_;
+};
+
+template <typename ID>
+void MinHashSpace<ID>::Init(size_t nb_dims) {
+    Config(nb_dims);
+}
+
+template <typename ID>
+void MinHashSpace<ID>::Config(size_t nb_dims, size_t nb_hashes, size_t L, size_t b,
+                              size_t search_k) {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    ndim_ = nb_dims;
+    nb_hashes_ = std::max<size_t>(nb_hashes, 1);
+    L_ = std::min(std::max<size_t>(L, 1), nb_hashes_);
+    rows_ = nb_hashes_ / L_;
+    bits_ = 1;
+    while (bits_ * 2 <= std::min<size_t>(b, 32)) {
+        bits_ *= 2;
+    }
+    search_k_ = search_k;
+    sig_words_ = (nb_hashes_ * bits_ + 63) / 64;
+    field_mask_ = 0;
+    for (size_t i = 0; i < 64; i += bits_) {
+        field_mask_ |= uint64_t(1) << i;
+    }
+
+    a_lo_ = prng_() | 1;
+    a_hi_ = prng_() | 1;
+    c_ = prng_();
+    probe_seed_ = prng_();
+
+    ids_.clear();
+    id2index_.clear();
+    sigs_.clear();
+    keys_.clear();
+    buckets_.clear();
+    buckets_.resize(L_);
+}
+
+template <typename ID>
+void MinHashSpace<ID>::Clear() {
+    Config(ndim_, nb_hashes_, L_, bits_, search_k_);
+}
+
+template <typename ID>
+size_t MinHashSpace<ID>::Size() const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    return ids_.size();
+}
+
+template <typename ID>
+uint64_t MinHashSpace<ID>::_Mix(uint64_t x) {
+    // splitmix64 finalizer
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+template <typename ID>
+uint32_t MinHashSpace<ID>::_Hash(uint64_t elem) const {
+    // Multiply-shift over the two halves of the element: two multiplies
+    // per element, and universal.
+    return (a_lo_ * (elem & 0xFFFFFFFFull) + a_hi_ * (elem >> 32) + c_) >> 32;
+}
+
+template <typename ID>
+bool MinHashSpace<ID>::_Sketch(const uint64_t* elems, size_t nb_elems,
+                               uint64_t* sig, uint64_t* keys) const {
+    if (nb_elems == 0) {
+        return false;
+    }
+    const uint64_t empty = std::numeric_limits<uint64_t>::max();
+    vector<uint64_t> bins(nb_hashes_, empty);
+    for (size_t i = 0; i < nb_elems; ++i) {
+        uint32_t h = _Hash(elems[i]);
+        // The high bits pick the bin, so the smallest hash of a bin is
+        // also the smallest of its low bits.
+        size_t bin = (uint64_t(h) * nb_hashes_) >> 32;
+        bins[bin] = std::min<uint64_t>(bins[bin], h);
+    }
+
+    vector<uint64_t> values(bins);
+    for (size_t i = 0; i < nb_hashes_; ++i) {
+        for (uint64_t attempt = 1; values[i] == empty; ++attempt) {
+            size_t j = _Mix(probe_seed_ ^ (uint64_t(i) << 32) ^ attempt) % nb_hashes_;
+            values[i] = bins[j];
+        }
+    }
+
+    // Band keys use the full values, signatures only their low bits.
+    for (size_t t = 0; t < L_; ++t) {
+        uint64_t key = 0;
+        for (size_t r = t * rows_; r < (t + 1) * rows_; ++r) {
+            key = _Mix(key ^ values[r]);
+        }
+        keys[t] = key;
+    }
+    uint64_t value_mask = (uint64_t(1) << bits_) - 1;
+    std::fill(sig, sig + sig_words_, 0);
+    for (size_t i = 0; i < nb_hashes_; ++i) {
+        size_t bit = i * bits_;
+        sig[bit >> 6] |= (values[i] & value_mask) << (bit & 63);
+    }
+    return true;
+}
+
+template <typename ID>
+void MinHashSpace<ID>::_SetOf(const float* point, vector<uint64_t>& elems) const {
+    elems.clear();
+    for (size_t i = 0; i < ndim_; ++i) {
+        if (point[i] != 0.0) {
+            elems.emplace_back(i);
+        }
+    }
+}
+
+template <typename ID>
+float MinHashSpace<ID>::_Similarity(const uint64_t* sig1, const uint64_t* sig2) const {
+    // Count differing fields: fold each field onto its lowest bit.
+    size_t differ = 0;
+    for (size_t w = 0; w < sig_words_; ++w) {
+        uint64_t x = sig1[w] ^ sig2[w];
+        for (size_t shift = bits_ / 2; shift > 0; shift /= 2) {
+            x |= x >> shift;
+        }
+        differ += __builtin_popcountll(x & field_mask_);
+    }
+    float agree = 1.0 - (float) differ / nb_hashes_;
+    float chance = 1.0 / (float) (uint64_t(1) << bits_);
+    float jaccard = (agree - chance) / (1.0 - chance);
+    return std::min(std::max(jaccard, 0.0f), 1.0f);
+}
+
+template <typename ID>
+void MinHashSpace<ID>::_AddToBuckets(const ID& id, const uint64_t* keys) {
+    for (size_t t = 0; t < L_; ++t) {
+        const std::string key(reinterpret_cast<const char*>(&keys[t]), sizeof(uint64_t));
+        buckets_[t][key].insert(id);
+    }
+}
+
+template <typename ID>
+void MinHashSpace<ID>::_RemoveFromBuckets(const ID& id, const uint64_t* keys) {
+    for (size_t t = 0; t < L_; ++t) {
+        const std::string key(reinterpret_cast<const char*>(&keys[t]), sizeof(uint64_t));
+        auto it = buckets_[t].find(key);
+        if (it != buckets_[t].end()) {
+            it->second.erase(id);
+            if (it->second.empty()) {
+                buckets_[t].erase(it);
+            }
+        }
+    }
+}
+
+template <typename ID>
+unsigned int MinHashSpace<ID>::Delete(const ID& id) {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    auto it = id2index_.find(id);
+    if (it == id2index_.end()) {
+        return 0;
+    }
+    size_t slot = it->second;
+    size_t last = ids_.size() - 1;
+    _RemoveFromBuckets(id, &keys_[slot * L_]);
+    if (slot != last) {
+        std::copy(&sigs_[last * sig_words_], &sigs_[(last + 1) * sig_words_],
+                  &sigs_[slot * sig_words_]);
+        std::copy(&keys_[last * L_], &keys_[(last + 1) * L_], &keys_[slot * L_]);
+        ids_[slot] = ids_[last];
+        id2index_[ids_[slot]] = slot;
+    }
+    ids_.pop_back();
+    sigs_.resize(ids_.size() * sig_words_);
+    keys_.resize(ids_.size() * L_);
+    id2index_.erase(id);
+    return 1;
+}
+
+template <typename ID>
+unsigned int MinHashSpace<ID>::UpsertSet(const SetInput<ID>& input) {
+    vector<uint64_t> sig(sig_words_);
+    vector<uint64_t> keys(L_);
+    if (!_Sketch(input.elems, input.nb_elems, sig.data(), keys.data())) {
+        return 0;
+    }
+
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    size_t slot;
+    auto it = id2index_.find(input.id);
+    if (it != id2index_.end()) {
+        slot = it->second;
+        _RemoveFromBuckets(input.id, &keys_[slot * L_]);
+    }
+    else {
+        slot = ids_.size();
+        ids_.emplace_back(input.id);
+        id2index_[input.id] = slot;
+        sigs_.resize(ids_.size() * sig_words_);
+        keys_.resize(ids_.size() * L_);
+    }
+    std::copy(sig.begin(), sig.end(), &sigs_[slot * sig_words_]);
+    std::copy(keys.begin(), keys.end(), &keys_[slot * L_]);
+    _AddToBuckets(input.id, keys.data());
+    return 1;
+}
+
+template <typename ID>
+unsigned int MinHashSpace<ID>::Upsert(const SpaceInput<ID>& input) {
+    // Reject NaN entries.
+    if (!isfinite_xf(input.point, ndim_)) {
+        return 0;
+    }
+    vector<uint64_t> elems;
+    _SetOf(input.point, elems);
+    SetInput<ID> set;
+    set.id = input.id;
+    set.elems = elems.data();
+    set.nb_elems = elems.size();
+    return UpsertSet(set);
+}
+
+template <typename ID>
+void MinHashSpace<ID>::_Search(const uint64_t* sig, const uint64_t* keys, size_t nb_results,
+                               vector<SpaceResult<ID>>& results) const {
+    results.clear();
+    unordered_map<ID, uint32_t> counter;
+    for (size_t t = 0; t < L_; ++t) {
+        const std::string key(reinterpret_cast<const char*>(&keys[t]), sizeof(uint64_t));
+        auto it = buckets_[t].find(key);
+        if (it != buckets_[t].end()) {
+            for (auto& id : it->second) {
+                counter[id]++;
+            }
+        }
+    }
+
+    // Rank the items sharing the most buckets by estimated similarity.
+    std::multimap<uint32_t, ID> by_count = flip_map(counter);
+    size_t search_k = (search_k_ == 0) ? L_ * nb_results : search_k_;
+    auto it = by_count.rbegin();
+    for (size_t i = 0; i < search_k && it != by_count.rend(); ++i, ++it) {
+        size_t slot = id2index_.at(it->second);
+        SpaceResult<ID> r;
+        r.id = it->second;
+        r.dist = 1.0 - _Similarity(sig, &sigs_[slot * sig_words_]);
+        PushTopK(results, r, nb_results);
+    }
+    std::sort_heap(results.begin(), results.end());
+}
+
+template <typename ID>
+void MinHashSpace<ID>::GetNeighborsSet(const uint64_t* elems, size_t nb_elems,
+        size_t nb_results, vector<SpaceResult<ID>>& results) const
+{
+    vector<uint64_t> sig(sig_words_);
+    vector<uint64_t> keys(L_);
+    if (!_Sketch(elems, nb_elems, sig.data(), keys.data())) {
+        results.clear();
+        return;
+    }
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    _Search(sig.data(), keys.data(), nb_results, results);
+}
+
+template <typename ID>
+void MinHashSpace<ID>::GetNeighbors(const float* point, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    vector<uint64_t> elems;
+    _SetOf(point, elems);
+    GetNeighborsSet(elems.data(), elems.size(), nb_results, results);
+}
+
+template <typename ID>
+void MinHashSpace<ID>::GetNeighbors(const ID& id, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    auto it = id2index_.find(id);
+    if (it == id2index_.end()) {
+        results.clear();
+        return;
+    }
+    size_t slot = it->second;
+    _Search(&sigs_[slot * sig_words_], &keys_[slot * L_], nb_results, results);
+}
+
+template <typename ID>
+float MinHashSpace<ID>::Jaccard(const ID& id1, const ID& id2) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    auto it1 = id2index_.find(id1);
+    auto it2 = id2index_.find(id2);
+    if (it1 == id2index_.end() || it2 == id2index_.end()) {
+        return -1.0;
+    }
+    return _Similarity(&sigs_[it1->second * sig_words_], &sigs_[it2->second * sig_words_]);
+}
+
+template <typename ID>
+void MinHashSpace<ID>::GetIds(vector<ID>& ids) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    ids = ids_;
+}
+
+template <typename ID>
+void MinHashSpace<ID>::Info(FILE* log, size_t indent, size_t indent_incr) const {
+    Space<ID>::Info(log, indent, indent_incr);
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    string zero(indent, ' ');
+    fprintf(log, "%shashes: %zu of %zu bits (%zu bytes per signature)\n", zero.c_str(),
+            nb_hashes_, bits_, sig_words_ * 8);
+    fprintf(log, "%sbands: %zu of %zu rows\n", zero.c_str(), L_, rows_);
+    size_t largest = 0;
+    for (auto& bucket : buckets_) {
+        for (auto& entry : bucket) {
+            largest = std::max(largest, entry.second.size());
+        }
+    }
+    fprintf(log, "%slargest bucket: %zu\n", zero.c_str(), largest);
+}
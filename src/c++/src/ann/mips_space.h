@@ -0,0 +1,296 @@
+#pragma once
+
+// Maximum inner product search over any nearest-neighbor space.
+//
+// Items x are stored in an inner space of nb_dims + 1 dimensions as
+// (x, sqrt(M^2 - |x|^2)), where M bounds the item norms, and queries q as
+// (q, 0).  All augmented items have norm M, so both the cosine and the
+// Euclidean distance between them and a query are monotone in <x, q>,
+// and the inner space's nearest neighbors are the items with the largest
+// inner products (Neyshabur & Srebro, "On symmetric and asymmetric LSHs
+// for inner product search", 2015).  Results are reported with distance
+// -<x, q>, as with InnerProductMetric.
+//
+// M is tracked as items come: when one exceeds it, M grows to headroom
+// times its norm and the stored items are augmented again.  Build()
+// shrinks M back to the largest norm seen, which keeps the angles between
+// augmented items as wide as possible.
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+
+#include "common/ann_util.h"
+#include "ann/metric.h"
+#include "ann/space.h"
+
+using std::vector;
+using ann::util::ProgressBar;
+
+template <typename ID>
+class MIPSSpace : public Space<ID> {
+  public:
+    // make_inner returns an empty space ready for nb_dims inputs (one more
+    // than this space's); it is called by Config and Clear.
+    explicit MIPSSpace(const std::function<Space<ID>*(size_t nb_dims)>& make_inner)
+        : make_inner_(make_inner)
+    {};
+    ~MIPSSpace() {}
+
+    void Init(size_t nb_dims) override;
+
+    // max_norm: initial bound on item norms (grown as needed)
+    // headroom: factor applied to the norm of an item exceeding the bound
+    void Config(size_t nb_dims, float max_norm=0.0, float headroom=1.1);
+
+    void Clear() override;
+
+    // Shrink the norm bound to the largest norm seen, then build the
+    // inner space.
+    bool Build() override;
+
+    unsigned int Delete(const ID& id) override;
+
+    unsigned int Upsert(const SpaceInput<ID>& input) override;
+
+    void GetNeighbors(const float* point, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    void GetNeighbors(const ID& id, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    // Copy the point as given to Upsert (up to rounding).
+    bool GetPoint(const ID& id, float* point) const override;
+
+    void GetIds(vector<ID>& ids) const override;
+
+    // Get the number of elements stored.
+    size_t Size() const override;
+
+    // Get Dimensionality
+    size_t Dim() const override { return ndim_; }
+
+    const char* MetricName() const override { return InnerProductMetric::Name(); }
+
+    // Current bound on item norms.
+    float MaxNorm() const;
+
+    void Info(FILE* log, size_t indent=2, size_t indent_incr=4) const override;
+
+  private:
+    void _Augment(const float* point, float* augmented) const;
+    bool _GetPoint(const ID& id, float* point) const;
+    void _Reindex(float max_norm);
+
+    std::function<Space<ID>*(size_t nb_dims)> make_inner_;
+    std::unique_ptr<Space<ID>> inner_;
+    size_t ndim_ = 0;
+
+    // inner distances are mapped back to inner products by metric name
+    bool inner_l2_ = false;
+    bool inner_ip_ = false;
+
+    // M, and the largest norm upserted since the last Clear
+    float max_norm_ = 0.0;
+    float largest_norm_ = 0.0;
+
+    // constructor params
+    float initial_max_norm_ = 0.0;
+    float headroom_ = 1.1;
+
+    mutable std::shared_timed_mutex mutex_;
+};
+
+template <typename ID>
+void MIPSSpace<ID>::Init(size_t nb_dims) {
+    Config(nb_dims);
+}
+
+template <typename ID>
+void MIPSSpace<ID>::Config(size_t nb_dims, float max_norm, float headroom) {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    ndim_ = nb_dims;
+    initial_max_norm_ = std::max(max_norm, 0.0f);
+    headroom_ = std::max(headroom, 1.0f);
+    inner_.reset(make_inner_(ndim_ + 1));
+    inner_l2_ = !strcmp(inner_->MetricName(), EuclideanMetric::Name());
+    inner_ip_ = !strcmp(inner_->MetricName(), InnerProductMetric::Name());
+    max_norm_ = initial_max_norm_;
+    largest_norm_ = 0.0;
+}
+
+template <typename ID>
+void MIPSSpace<ID>::Clear() {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    inner_.reset(make_inner_(ndim_ + 1));
+    max_norm_ = initial_max_norm_;
+    largest_norm_ = 0.0;
+}
+
+template <typename ID>
+void MIPSSpace<ID>::_Augment(const float* point, float* augmented) const {
+    std::copy(point, point + ndim_, augmented);
+    float sq = DotProduct(point, point, ndim_);
+    augmented[ndim_] = std::sqrt(std::max(0.0f, max_norm_ * max_norm_ - sq));
+}
+
+template <typename ID>
+bool MIPSSpace<ID>::_GetPoint(const ID& id, float* point) const {
+    // The inner space may have rescaled the augmented point (cosine
+    // normalizes it), but its norm was max_norm_ when it was given.
+    float augmented[ndim_ + 1];
+    if (!inner_->GetPoint(id, augmented)) {
+        return false;
+    }
+    float augmented_norm = norm(augmented, ndim_ + 1);
+    float scale = (augmented_norm > 0.0) ? max_norm_ / augmented_norm : 0.0;
+    for (size_t i = 0; i < ndim_; ++i) {
+        point[i] = augmented[i] * scale;
+    }
+    return true;
+}
+
+template <typename ID>
+void MIPSSpace<ID>::_Reindex(float max_norm) {
+    vector<ID> ids;
+    inner_->GetIds(ids);
+    vector<float> points(ids.size() * ndim_);
+    for (size_t i = 0; i < ids.size(); ++i) {
+        _GetPoint(ids[i], &points[i * ndim_]);
+    }
+    max_norm_ = max_norm;
+
+    vector<float> augmented(ids.size() * (ndim_ + 1));
+    vector<SpaceInput<ID>> inputs(ids.size());
+    for (size_t i = 0; i < ids.size(); ++i) {
+        _Augment(&points[i * ndim_], &augmented[i * (ndim_ + 1)]);
+        inputs[i].id = ids[i];
+        inputs[i].point = &augmented[i * (ndim_ + 1)];
+    }
+    inner_->UpsertMany(inputs);
+}
+
+template <typename ID>
+bool MIPSSpace<ID>::Build() {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    if (largest_norm_ < max_norm_ && inner_->Size() > 0) {
+        _Reindex(largest_norm_);
+    }
+    return inner_->Build();
+}
+
+template <typename ID>
+unsigned int MIPSSpace<ID>::Delete(const ID& id) {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    return inner_->Delete(id);
+}
+
+template <typename ID>
+unsigned int MIPSSpace<ID>::Upsert(const SpaceInput<ID>& input) {
+    // Reject NaN entries.
+    if (!isfinite_xf(input.point, ndim_)) {
+        return 0;
+    }
+
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    float point_norm = norm(input.point, ndim_);
+    largest_norm_ = std::max(largest_norm_, point_norm);
+    if (point_norm > max_norm_) {
+        _Reindex(point_norm * headroom_);
+    }
+
+    float augmented[ndim_ + 1];
+    _Augment(input.point, augmented);
+    SpaceInput<ID> inner_input;
+    inner_input.id = input.id;
+    inner_input.point = augmented;
+    return inner_->Upsert(inner_input);
+}
+
+template <typename ID>
+void MIPSSpace<ID>::GetNeighbors(const float* point, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    results.clear();
+    float point_norm = norm(point, ndim_);
+    if (!std::isfinite(point_norm) || point_norm == 0.0) {
+        return;
+    }
+    float augmented[ndim_ + 1];
+    std::copy(point, point + ndim_, augmented);
+    augmented[ndim_] = 0.0;
+
+    // Query into a fresh vector and cap it: wrapped spaces may append to
+    // their output or return extra results.
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    vector<SpaceResult<ID>> found;
+    inner_->GetNeighbors(augmented, nb_results, found);
+    if (found.size() > nb_results) {
+        found.resize(nb_results);
+    }
+    results.swap(found);
+
+    // Map the inner distances, monotone in <x, q>, back to -<x, q>.
+    float sq_max = max_norm_ * max_norm_;
+    float sq_point = point_norm * point_norm;
+    for (auto& r : results) {
+        if (inner_ip_) {
+            continue;
+        } else if (inner_l2_) {
+            r.dist = -(sq_max + sq_point - r.dist * r.dist) / 2;
+        } else {
+            r.dist = -(1.0 - r.dist) * max_norm_ * point_norm;
+        }
+    }
+}
+
+template <typename ID>
+void MIPSSpace<ID>::GetNeighbors(const ID& id, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    vector<float> point(ndim_);
+    if (GetPoint(id, point.data())) {
+        GetNeighbors(point.data(), nb_results, results);
+    } else {
+        results.clear();
+    }
+}
+
+template <typename ID>
+bool MIPSSpace<ID>::GetPoint(const ID& id, float* point) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    return _GetPoint(id, point);
+}
+
+template <typename ID>
+void MIPSSpace<ID>::GetIds(vector<ID>& ids) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    inner_->GetIds(ids);
+}
+
+template <typename ID>
+size_t MIPSSpace<ID>::Size() const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    return inner_->Size();
+}
+
+template <typename ID>
+float MIPSSpace<ID>::MaxNorm() const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    return max_norm_;
+}
+
+template <typename ID>
+void MIPSSpace<ID>::Info(FILE* log, size_t indent, size_t indent_incr) const {
+    Space<ID>::Info(log, indent, indent_incr);
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    string zero(indent, ' ');
+    fprintf(log, "%smax norm: %g (largest seen %g)\n", zero.c_str(), max_norm_, largest_norm_);
+    fprintf(log, "%sinner:\n", zero.c_str());
+    inner_->Info(log, indent + indent_incr, indent_incr);
+}
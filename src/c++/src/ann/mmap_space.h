@@ -0,0 +1,713 @@
+#pragma once
+
+// Exact linear scan over vectors stored in an on-disk file.
+//
+// Rows are kept normalized as raw float32 records in `<path>`, and their IDs
+// in `<path>.ids`.  The file stays mapped read-only, and queries scan it in
+// chunks; each worker thread asks the kernel to read ahead the chunk it will
+// process next, so that I/O for one chunk overlaps with compute on another.
+//
+// Upserts append a row and deletes only mark it, so once dead rows exceed
+// max_dead_ratio of the file (and fill a chunk), live rows are copied to a
+// new file that replaces the old one.
+//
+// Only IDs are kept in memory.  They are looked up by binary search over
+// row numbers sorted by ID; rows appended since the last sort go to a hash
+// map until it grows past an eighth of the sorted ones.
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// unix headers
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <Eigen/Dense>
+
+#include "common/ann_util.h"
+#include "ann/space.h"
+
+using std::unordered_map;
+using std::vector;
+using ann::util::ProgressBar;
+
+const size_t kMmapNoRow = (size_t)-1;
+
+// tail_index_ is merged into the sorted rows beyond this size.
+const size_t kMmapMinTail = 65536;
+
+// Bytes of the score tile each query thread fills: chunks are scored a
+// block of rows at a time, so that memory does not grow with chunk_rows
+// times the number of queries in a batch.
+const size_t kMmapTileBytes = 4 << 20;
+
+template <typename ID>
+class MmapLinearSpace : public Space<ID> {
+  public:
+    MmapLinearSpace();
+    ~MmapLinearSpace();
+
+    // Store vectors in an anonymous temporary file.
+    void Init(size_t nb_dims) override;
+
+    // Create (or truncate) the vector file at path.  Returns false if the
+    // files could not be opened.
+    bool Config(size_t nb_dims, const std::string& path, size_t chunk_rows=65536,
+                float max_dead_ratio=0.25);
+
+    // Attach to a vector file previously written by Config/Upsert.
+    bool Open(size_t nb_dims, const std::string& path, size_t chunk_rows=65536,
+              float max_dead_ratio=0.25);
+
+    void Clear() override;
+
+    // Rewrite the file without deleted and superseded rows.  Returns false
+    // (leaving the file as it was) on I/O errors.
+    bool Compact();
+
+    // Deleted rows stay in the file, skipped by scans, until compaction.
+    unsigned int Delete(const ID& id) override;
+
+    unsigned int Upsert(const SpaceInput<ID>& input) override;
+
+    void GetNeighbors(const float* point, size_t nb_results,
+                   vector<SpaceResult<ID>>& results) const override;
+
+    void GetNeighbors(const ID& id, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    bool GetPoint(const ID& id, float* point) const override;
+
+    void GetIds(vector<ID>& ids) const override;
+
+    // Answer nb_points queries (stored row after row) with a single pass
+    // over the file.
+    void GetNeighborsBatch(const float* points, size_t nb_points, size_t nb_results,
+            vector<vector<SpaceResult<ID>>>& results) const;
+
+    void GraphToStream(std::ostream& out, size_t nb_results) const override;
+
+    // Get the number of elements stored.
+    size_t Size() const override;
+
+    // Get Dimensionality
+    size_t Dim() const override { return ndim_; }
+
+  private:
+    bool _OpenFiles(const std::string& path, int flags);
+    void _CloseFiles();
+    // Make the mapping cover nb_rows rows, growing it geometrically.
+    bool _Map(size_t nb_rows);
+    void _Unmap();
+    const float* _Row(size_t row) const { return map_ + row * ndim_; }
+    // Live row of id, or kMmapNoRow.
+    size_t _Find(const ID& id) const;
+    // Sort all live rows by ID and empty tail_index_.
+    void _SortRows();
+    void _MergeTail();
+    bool _Compact();
+    void _MaybeCompact();
+    void _GetNeighborsBatch(const float* points, size_t nb_points, size_t nb_results,
+            vector<vector<SpaceResult<ID>>>& results) const;
+
+    size_t ndim_ = 0;
+    size_t chunk_rows_ = 65536;
+    float max_dead_ratio_ = 0.25;
+    std::string path_;
+    int fd_ = -1;
+    std::ofstream ids_out_;
+    const float* map_ = nullptr;
+    size_t map_bytes_ = 0;
+
+    vector<ID> ids_;
+    vector<uint64_t> deleted_;
+    size_t nb_deleted_ = 0;
+
+    // Live rows before nb_sorted_, ordered by ID; live rows from nb_sorted_
+    // on are in tail_index_.
+    vector<size_t> sorted_rows_;
+    size_t nb_sorted_ = 0;
+    unordered_map<ID, size_t> tail_index_;
+
+    // queries per pass over the file in GraphToStream
+    size_t graph_batch_ = 1024;
+
+    mutable std::shared_timed_mutex mutex_;
+};
+
+template <typename ID>
+MmapLinearSpace<ID>::MmapLinearSpace() {
+}
+
+template <typename ID>
+MmapLinearSpace<ID>::~MmapLinearSpace() {
+    _CloseFiles();
+}
+
+template <typename ID>
+void MmapLinearSpace<ID>::_CloseFiles() {
+    _Unmap();
+    if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+    }
+    if (ids_out_.is_open()) {
+        ids_out_.close();
+    }
+    ids_.clear();
+    deleted_.clear();
+    nb_deleted_ = 0;
+    sorted_rows_.clear();
+    nb_sorted_ = 0;
+    tail_index_.clear();
+}
+
+template <typename ID>
+bool MmapLinearSpace<ID>::_Map(size_t nb_rows) {
+    size_t bytes = nb_rows * ndim_ * sizeof(float);
+    if (bytes <= map_bytes_) {
+        return true;
+    }
+    // Pages past the end of the file are never read, so the mapping can
+    // run ahead of it.
+    bytes = std::max(bytes, 2 * map_bytes_);
+    _Unmap();
+    void* addr = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd_, 0);
+    if (addr == MAP_FAILED) {
+        std::cerr << "mmap: " << strerror(errno) << std::endl;
+        return false;
+    }
+    madvise(addr, bytes, MADV_SEQUENTIAL);
+    map_ = static_cast<const float*>(addr);
+    map_bytes_ = bytes;
+    return true;
+}
+
+template <typename ID>
+void MmapLinearSpace<ID>::_Unmap() {
+    if (map_) {
+        munmap(const_cast<float*>(map_), map_bytes_);
+        map_ = nullptr;
+        map_bytes_ = 0;
+    }
+}
+
+template <typename ID>
+size_t MmapLinearSpace<ID>::_Find(const ID& id) const {
+    auto it = tail_index_.find(id);
+    if (it != tail_index_.end()) {
+        return it->second;
+    }
+    // Rows deleted since the sort still appear here, possibly next to a
+    // live row with the same ID.
+    auto row = std::lower_bound(sorted_rows_.begin(), sorted_rows_.end(), id,
+            [this] (size_t row, const ID& id) { return ids_[row] < id; });
+    for (; row != sorted_rows_.end() && ids_[*row] == id; ++row) {
+        if (!TestBit(deleted_, *row)) {
+            return *row;
+        }
+    }
+    return kMmapNoRow;
+}
+
+template <typename ID>
+void MmapLinearSpace<ID>::_SortRows() {
+    sorted_rows_.clear();
+    for (size_t i = 0; i < ids_.size(); ++i) {
+        if (!TestBit(deleted_, i)) {
+            sorted_rows_.emplace_back(i);
+        }
+    }
+    std::sort(sorted_rows_.begin(), sorted_rows_.end(),
+            [this] (size_t a, size_t b) { return ids_[a] < ids_[b]; });
+    nb_sorted_ = ids_.size();
+    tail_index_.clear();
+}
+
+template <typename ID>
+void MmapLinearSpace<ID>::_MergeTail() {
+    auto by_id = [this] (size_t a, size_t b) { return ids_[a] < ids_[b]; };
+    sorted_rows_.erase(std::remove_if(sorted_rows_.begin(), sorted_rows_.end(),
+            [this] (size_t row) { return TestBit(deleted_, row); }), sorted_rows_.end());
+    size_t mid = sorted_rows_.size();
+    for (auto& it : tail_index_) {
+        sorted_rows_.emplace_back(it.second);
+    }
+    std::sort(sorted_rows_.begin() + mid, sorted_rows_.end(), by_id);
+    std::inplace_merge(sorted_rows_.begin(), sorted_rows_.begin() + mid, sorted_rows_.end(), by_id);
+    nb_sorted_ = ids_.size();
+    tail_index_.clear();
+}
+
+template <typename ID>
+bool MmapLinearSpace<ID>::_Compact() {
+    if (fd_ < 0 || nb_deleted_ == 0) {
+        return true;
+    }
+
+    // Write the live rows to a new file, anonymous like the current one
+    // if it has no path.
+    std::string tmp_path = path_ + ".compact";
+    int fd;
+    if (path_.empty()) {
+        char tmpl[] = "/tmp/ann_vectors.XXXXXX";
+        fd = mkstemp(tmpl);
+        tmp_path = tmpl;
+        if (fd >= 0) {
+            unlink(tmpl);
+        }
+    } else {
+        fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fd < 0) {
+        std::cerr << tmp_path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    auto fail = [&] () {
+        std::cerr << tmp_path << ": " << strerror(errno) << std::endl;
+        close(fd);
+        if (!path_.empty()) {
+            unlink(tmp_path.c_str());
+            unlink((tmp_path + ".ids").c_str());
+        }
+        return false;
+    };
+
+    size_t total = ids_.size();
+    size_t row_bytes = ndim_ * sizeof(float);
+    vector<ID> ids;
+    ids.reserve(total - nb_deleted_);
+    vector<float> buffer;
+    for (size_t begin = 0; begin < total; begin += chunk_rows_) {
+        size_t end = std::min(total, begin + chunk_rows_);
+        buffer.clear();
+        for (size_t i = begin; i < end; ++i) {
+            if (!TestBit(deleted_, i)) {
+                buffer.insert(buffer.end(), _Row(i), _Row(i) + ndim_);
+            }
+        }
+        size_t bytes = buffer.size() * sizeof(float);
+        if (pwrite(fd, buffer.data(), bytes, ids.size() * row_bytes) != (ssize_t)bytes) {
+            return fail();
+        }
+        for (size_t i = begin; i < end; ++i) {
+            if (!TestBit(deleted_, i)) {
+                ids.emplace_back(ids_[i]);
+            }
+        }
+    }
+
+    if (!path_.empty()) {
+        std::ofstream ids_out(tmp_path + ".ids", std::ofstream::binary | std::ofstream::trunc);
+        ids_out.write(reinterpret_cast<const char*>(ids.data()), ids.size() * sizeof(ID));
+        ids_out.close();
+        if (!ids_out.good()) {
+            return fail();
+        }
+        if (rename(tmp_path.c_str(), path_.c_str()) != 0) {
+            return fail();
+        }
+        // Failing (or crashing) here leaves files Open rejects as
+        // mismatched rather than wrong rows.
+        if (rename((tmp_path + ".ids").c_str(), (path_ + ".ids").c_str()) != 0) {
+            std::cerr << path_ << ".ids: " << strerror(errno) << std::endl;
+        }
+        ids_out_.close();
+        ids_out_.open(path_ + ".ids", std::ofstream::binary | std::ofstream::app);
+    }
+
+    _Unmap();
+    close(fd_);
+    fd_ = fd;
+    ids_.swap(ids);
+    deleted_.assign(BitWords(ids_.size()), 0);
+    nb_deleted_ = 0;
+    _SortRows();
+    return _Map(ids_.size());
+}
+
+template <typename ID>
+void MmapLinearSpace<ID>::_MaybeCompact() {
+    if (nb_deleted_ >= chunk_rows_ && nb_deleted_ > max_dead_ratio_ * ids_.size()) {
+        _Compact();
+    }
+}
+
+template <typename ID>
+bool MmapLinearSpace<ID>::_OpenFiles(const std::string& path, int flags) {
+    fd_ = open(path.c_str(), O_RDWR | flags, 0644);
+    if (fd_ < 0) {
+        std::cerr << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    path_ = path;
+    return true;
+}
+
+template <typename ID>
+void MmapLinearSpace<ID>::Init(size_t nb_dims) {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    _CloseFiles();
+    ndim_ = nb_dims;
+    char tmpl[] = "/tmp/ann_vectors.XXXXXX";
+    fd_ = mkstemp(tmpl);
+    if (fd_ < 0) {
+        std::cerr << tmpl << ": " << strerror(errno) << std::endl;
+        return;
+    }
+    // The file lives as long as the descriptor does.
+    unlink(tmpl);
+    path_.clear();
+}
+
+template <typename ID>
+bool MmapLinearSpace<ID>::Config(size_t nb_dims, const std::string& path, size_t chunk_rows,
+                                 float max_dead_ratio) {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    _CloseFiles();
+    ndim_ = nb_dims;
+    chunk_rows_ = std::max<size_t>(chunk_rows, 1);
+    max_dead_ratio_ = max_dead_ratio;
+    if (!_OpenFiles(path, O_CREAT | O_TRUNC)) {
+        return false;
+    }
+    ids_out_.open(path + ".ids", std::ofstream::binary | std::ofstream::trunc);
+    return ids_out_.good();
+}
+
+template <typename ID>
+bool MmapLinearSpace<ID>::Open(size_t nb_dims, const std::string& path, size_t chunk_rows,
+                               float max_dead_ratio) {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    _CloseFiles();
+    ndim_ = nb_dims;
+    chunk_rows_ = std::max<size_t>(chunk_rows, 1);
+    max_dead_ratio_ = max_dead_ratio;
+    if (!_OpenFiles(path, 0)) {
+        return false;
+    }
+
+    std::ifstream ids_in(path + ".ids", std::ifstream::binary);
+    ID id;
+    while (ids_in.read(reinterpret_cast<char*>(&id), sizeof(ID))) {
+        ids_.emplace_back(id);
+    }
+    deleted_.assign(BitWords(ids_.size()), 0);
+
+    struct stat st;
+    if (fstat(fd_, &st) != 0 || (size_t)st.st_size != ids_.size() * ndim_ * sizeof(float)) {
+        std::cerr << path << ": vector file does not match its ID file" << std::endl;
+        _CloseFiles();
+        return false;
+    }
+
+    // A later row supersedes earlier ones with the same ID.
+    vector<size_t> rows(ids_.size());
+    for (size_t i = 0; i < rows.size(); ++i) {
+        rows[i] = i;
+    }
+    std::stable_sort(rows.begin(), rows.end(),
+            [this] (size_t a, size_t b) { return ids_[a] < ids_[b]; });
+    for (size_t i = 0; i + 1 < rows.size(); ++i) {
+        if (ids_[rows[i]] == ids_[rows[i + 1]]) {
+            SetBit(deleted_, rows[i]);
+            nb_deleted_++;
+        }
+    }
+    _SortRows();
+    if (!_Map(ids_.size())) {
+        _CloseFiles();
+        return false;
+    }
+    ids_out_.open(path + ".ids", std::ofstream::binary | std::ofstream::app);
+    _MaybeCompact();
+    return true;
+}
+
+template <typename ID>
+void MmapLinearSpace<ID>::Clear() {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    _Unmap();
+    if (fd_ >= 0 && ftruncate(fd_, 0) != 0) {
+        std::cerr << path_ << ": " << strerror(errno) << std::endl;
+    }
+    if (ids_out_.is_open()) {
+        ids_out_.close();
+        ids_out_.open(path_ + ".ids", std::ofstream::binary | std::ofstream::trunc);
+    }
+    ids_.clear();
+    deleted_.clear();
+    nb_deleted_ = 0;
+    sorted_rows_.clear();
+    nb_sorted_ = 0;
+    tail_index_.clear();
+}
+
+template <typename ID>
+bool MmapLinearSpace<ID>::Compact() {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    return _Compact();
+}
+
+template <typename ID>
+size_t MmapLinearSpace<ID>::Size() const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    return ids_.size() - nb_deleted_;
+}
+
+template <typename ID>
+unsigned int MmapLinearSpace<ID>::Delete(const ID& id) {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    size_t row = _Find(id);
+    if (row == kMmapNoRow) {
+        return 0;
+    }
+    SetBit(deleted_, row);
+    nb_deleted_++;
+    if (row >= nb_sorted_) {
+        tail_index_.erase(id);
+    }
+    _MaybeCompact();
+    return 1;
+}
+
+template <typename ID>
+unsigned int MmapLinearSpace<ID>::Upsert(const SpaceInput<ID>& input) {
+    // Reject NaN entries.
+    if (!isfinite_xf(input.point, ndim_)) {
+        return 0;
+    }
+
+    float tmp[ndim_];
+
+    // Reject inputs whose norm equals zero
+    if (!normalize(tmp, input.point, ndim_)) {
+        return 0;
+    }
+
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    if (fd_ < 0) {
+        return 0;
+    }
+
+    size_t row_bytes = ndim_ * sizeof(float);
+    size_t idx = ids_.size();
+    if (!_Map(idx + 1)) {
+        return 0;
+    }
+    if (pwrite(fd_, tmp, row_bytes, idx * row_bytes) != (ssize_t)row_bytes) {
+        std::cerr << path_ << ": " << strerror(errno) << std::endl;
+        return 0;
+    }
+    if (ids_out_.is_open()) {
+        ids_out_.write(reinterpret_cast<const char*>(&input.id), sizeof(ID));
+    }
+
+    size_t old = _Find(input.id);
+    ids_.emplace_back(input.id);
+    deleted_.resize(BitWords(ids_.size()));
+    if (old != kMmapNoRow) {
+        SetBit(deleted_, old);
+        nb_deleted_++;
+    }
+    tail_index_[input.id] = idx;
+    if (tail_index_.size() > std::max(kMmapMinTail, sorted_rows_.size() / 8)) {
+        _MergeTail();
+    }
+    _MaybeCompact();
+    return 1;
+}
+
+template <typename ID>
+void MmapLinearSpace<ID>::_GetNeighborsBatch(const float* points, size_t nb_points,
+        size_t nb_results, vector<vector<SpaceResult<ID>>>& results) const
+{
+    typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrixXf;
+
+    results.clear();
+    results.resize(nb_points);
+    size_t total = ids_.size();
+    if (total == 0 || nb_points == 0) {
+        return;
+    }
+
+    size_t row_bytes = ndim_ * sizeof(float);
+    const float* base = map_;
+
+    // Normalize the queries once.
+    RowMatrixXf queries(nb_points, ndim_);
+    for (size_t q = 0; q < nb_points; ++q) {
+        if (!normalize(queries.row(q).data(), points + q * ndim_, ndim_)) {
+            queries.row(q).setZero();
+        }
+    }
+
+    size_t nb_chunks = (total + chunk_rows_ - 1) / chunk_rows_;
+    size_t nb_threads = std::min<size_t>(std::thread::hardware_concurrency(), nb_chunks);
+    nb_threads = std::max<size_t>(nb_threads, 1);
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    // madvise wants page-aligned ranges.
+    auto advise = [base, total, row_bytes, page, this] (size_t chunk, int advice) {
+        size_t begin = chunk * chunk_rows_ * row_bytes;
+        size_t end = std::min(total, (chunk + 1) * chunk_rows_) * row_bytes;
+        if (begin >= end) {
+            return;
+        }
+        size_t aligned = begin / page * page;
+        madvise((char*)base + aligned, end - aligned, advice);
+    };
+
+    std::atomic<size_t> next_chunk(0);
+    vector<vector<vector<SpaceResult<ID>>>> heaps_per_thread(nb_threads);
+    vector<std::thread> threads;
+    for (size_t t = 0; t < nb_threads; ++t) {
+        threads.emplace_back([&, t] {
+            auto& heaps = heaps_per_thread[t];
+            heaps.resize(nb_points);
+            size_t tile_rows = std::max<size_t>(1, kMmapTileBytes / (nb_points * sizeof(float)));
+            Eigen::MatrixXf tile;
+            size_t chunk = next_chunk++;
+            if (chunk < nb_chunks) {
+                advise(chunk, MADV_WILLNEED);
+            }
+            while (chunk < nb_chunks) {
+                // Chunks are handed out in order, so this thread's next one
+                // is about nb_threads ahead.
+                advise(chunk + nb_threads, MADV_WILLNEED);
+
+                size_t chunk_end = std::min(total, (chunk + 1) * chunk_rows_);
+                for (size_t begin = chunk * chunk_rows_; begin < chunk_end; begin += tile_rows) {
+                    size_t nb_rows = std::min(tile_rows, chunk_end - begin);
+                    Eigen::Map<const RowMatrixXf> rows(base + begin * ndim_, nb_rows, ndim_);
+                    tile.noalias() = rows * queries.transpose();
+                    for (size_t i = 0; i < nb_rows; ++i) {
+                        if (TestBit(deleted_, begin + i)) {
+                            continue;
+                        }
+                        for (size_t q = 0; q < nb_points; ++q) {
+                            SpaceResult<ID> r;
+                            r.id = ids_[begin + i];
+                            r.dist = 1.0 - tile(i, q);
+                            PushTopK(heaps[q], r, nb_results);
+                        }
+                    }
+                }
+                advise(chunk, MADV_DONTNEED);
+                chunk = next_chunk++;
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    for (size_t q = 0; q < nb_points; ++q) {
+        auto& merged = results[q];
+        for (auto& heaps : heaps_per_thread) {
+            for (auto& r : heaps[q]) {
+                PushTopK(merged, r, nb_results);
+            }
+        }
+        std::sort_heap(merged.begin(), merged.end());
+    }
+}
+
+template <typename ID>
+void MmapLinearSpace<ID>::GetNeighborsBatch(const float* points, size_t nb_points,
+        size_t nb_results, vector<vector<SpaceResult<ID>>>& results) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    _GetNeighborsBatch(points, nb_points, nb_results, results);
+}
+
+template <typename ID>
+void MmapLinearSpace<ID>::GetNeighbors(const float* point, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    vector<vector<SpaceResult<ID>>> batch;
+    GetNeighborsBatch(point, 1, nb_results, batch);
+    results.swap(batch[0]);
+}
+
+template <typename ID>
+void MmapLinearSpace<ID>::GetNeighbors(const ID& id, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    size_t row = _Find(id);
+    if (row == kMmapNoRow) {
+        return;
+    }
+    vector<float> vec(_Row(row), _Row(row) + ndim_);
+    vector<vector<SpaceResult<ID>>> batch;
+    _GetNeighborsBatch(vec.data(), 1, nb_results, batch);
+    results.swap(batch[0]);
+}
+
+template <typename ID>
+bool MmapLinearSpace<ID>::GetPoint(const ID& id, float* point) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    size_t row = _Find(id);
+    if (row == kMmapNoRow) {
+        return false;
+    }
+    std::copy(_Row(row), _Row(row) + ndim_, point);
+    return true;
+}
+
+template <typename ID>
+void MmapLinearSpace<ID>::GetIds(vector<ID>& ids) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    ids.clear();
+    ids.reserve(ids_.size() - nb_deleted_);
+    for (size_t i = 0; i < ids_.size(); ++i) {
+        if (!TestBit(deleted_, i)) {
+            ids.emplace_back(ids_[i]);
+        }
+    }
+}
+
+template <typename ID>
+void MmapLinearSpace<ID>::GraphToStream(std::ostream& out, size_t nb_results) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    size_t total = ids_.size();
+    auto progBar = ProgressBar(std::max<size_t>(total, 1));
+
+    // Each pass over the file answers a batch of stored rows.
+    vector<float> batch;
+    vector<ID> batch_ids;
+    vector<vector<SpaceResult<ID>>> results;
+    for (size_t begin = 0; begin < total; begin += graph_batch_) {
+        size_t end = std::min(total, begin + graph_batch_);
+        // Leave out dead rows.
+        batch.clear();
+        batch_ids.clear();
+        for (size_t i = begin; i < end; ++i) {
+            if (TestBit(deleted_, i)) {
+                continue;
+            }
+            batch.insert(batch.end(), _Row(i), _Row(i) + ndim_);
+            batch_ids.emplace_back(ids_[i]);
+        }
+
+        _GetNeighborsBatch(batch.data(), batch_ids.size(), nb_results, results);
+        for (size_t i = 0; i < batch_ids.size(); ++i) {
+            WriteResults(out, batch_ids[i], results[i]);
+        }
+        progBar.update(end - begin);
+    }
+}
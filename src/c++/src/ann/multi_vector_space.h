@@ -0,0 +1,415 @@
+#pragma once
+
+// Items made of several vectors (per locale, per modality...) over any
+// nearest-neighbor space.
+//
+// Every vector is stored in an inner space under an internal key, and
+// queries collapse the inner results by item before taking the top k, so
+// that an item with many vectors close to the query takes a single result
+// slot.  Items are scored from the similarities of (query vector, item
+// vector) pairs, aggregated as:
+//
+//   kMax  the most similar pair: the item's distance is the smallest pair
+//         distance.  Inner results are fetched until nb_results distinct
+//         items are found, so the results are exact when the inner space
+//         is.
+//   kSum  all pairs: the item's distance is minus the summed similarity
+//         (cos for cosine, minus the distance for other metrics).  Items
+//         found among the nearest vectors of each query vector (at least
+//         candidates of them) are scored exactly with all their vectors,
+//         read back from the inner space.  This suits cosine and inner
+//         product; under l2, sums favor items with few vectors.
+//
+// Upserts replace all the vectors of an item, and Delete removes them,
+// while queries are locked out, so queries never see part of an item.
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "common/ann_util.h"
+#include "ann/metric.h"
+#include "ann/space.h"
+
+using std::unordered_map;
+using std::vector;
+using ann::util::ProgressBar;
+
+template <typename ID>
+class MultiVectorSpace : public Space<ID> {
+  public:
+    enum Aggregation { kMax, kSum };
+
+    // make_inner returns an empty space ready for nb_dims inputs; it is
+    // called by Config and Clear.  Its IDs are internal keys 0, 1, 2...
+    explicit MultiVectorSpace(const std::function<Space<ID>*(size_t nb_dims)>& make_inner)
+        : make_inner_(make_inner)
+    {};
+    ~MultiVectorSpace() {}
+
+    void Init(size_t nb_dims) override;
+
+    // aggregation: how pair similarities make an item's score
+    // candidates: items scored exactly with kSum (if 0, 4 * nb_results)
+    void Config(size_t nb_dims, Aggregation aggregation=kMax, size_t candidates=0);
+
+    void Clear() override;
+
+    bool Build() override;
+
+    // Remove all the vectors of an item.
+    unsigned int Delete(const ID& id) override;
+
+    // Replace the vectors of an item by a single one.
+    unsigned int Upsert(const SpaceInput<ID>& input) override;
+
+    // Replace the vectors of an item by nb_points points, stored one after
+    // the other.  Returns 0, leaving the item unchanged, if any point is
+    // rejected.
+    unsigned int UpsertMulti(const ID& id, const float* points, size_t nb_points);
+
+    void GetNeighbors(const float* point, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    // Query with all the vectors of an item.
+    void GetNeighbors(const ID& id, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    // Query with nb_points points at once, scoring all their pairs with
+    // item vectors.
+    void GetNeighborsMulti(const float* points, size_t nb_points, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const;
+
+    // Copy the first vector of an item.
+    bool GetPoint(const ID& id, float* point) const override;
+
+    // Copy all the vectors of an item, one after the other.
+    bool GetPoints(const ID& id, vector<float>& points) const;
+
+    void GetIds(vector<ID>& ids) const override;
+
+    // Get the number of items stored.
+    size_t Size() const override;
+
+    // Get the number of vectors stored.
+    size_t NbVectors() const;
+
+    // Get Dimensionality
+    size_t Dim() const override { return ndim_; }
+
+    const char* MetricName() const override { return inner_->MetricName(); }
+
+    void Info(FILE* log, size_t indent=2, size_t indent_incr=4) const override;
+
+  private:
+    unsigned int _Delete(const ID& id);
+    bool _GetPoints(const ID& id, vector<float>& points) const;
+    // Best pair distance of the items among the nearest vectors of point,
+    // fetching until nb_items items are found.
+    void _Collect(const float* point, size_t nb_items, unordered_map<ID, float>& best) const;
+    void _Search(const float* points, size_t nb_points, size_t nb_results,
+                 vector<SpaceResult<ID>>& results) const;
+    bool _Prepare(float* dst, const float* src) const;
+    float _Similarity(const float* a, const float* b) const;
+
+    std::function<Space<ID>*(size_t nb_dims)> make_inner_;
+    std::unique_ptr<Space<ID>> inner_;
+    size_t ndim_ = 0;
+    Aggregation aggregation_ = kMax;
+    size_t candidates_ = 0;
+
+    // exact pair similarities use the inner metric, by name
+    bool inner_l2_ = false;
+    bool inner_ip_ = false;
+
+    // keys of each item, and item of each key; freed keys are reused
+    unordered_map<ID, vector<ID>> item2keys_;
+    vector<ID> key_items_;
+    vector<ID> free_keys_;
+    size_t nb_vectors_ = 0;
+
+    mutable std::shared_timed_mutex mutex_;
+};
+
+template <typename ID>
+void MultiVectorSpace<ID>::Init(size_t nb_dims) {
+    Config(nb_dims);
+}
+
+template <typename ID>
+void MultiVectorSpace<ID>::Config(size_t nb_dims, Aggregation aggregation, size_t candidates) {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    ndim_ = nb_dims;
+    aggregation_ = aggregation;
+    candidates_ = candidates;
+    inner_.reset(make_inner_(ndim_));
+    inner_l2_ = !strcmp(inner_->MetricName(), EuclideanMetric::Name());
+    inner_ip_ = !strcmp(inner_->MetricName(), InnerProductMetric::Name());
+    item2keys_.clear();
+    key_items_.clear();
+    free_keys_.clear();
+    nb_vectors_ = 0;
+}
+
+template <typename ID>
+void MultiVectorSpace<ID>::Clear() {
+    Config(ndim_, aggregation_, candidates_);
+}
+
+template <typename ID>
+bool MultiVectorSpace<ID>::Build() {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    return inner_->Build();
+}
+
+template <typename ID>
+unsigned int MultiVectorSpace<ID>::_Delete(const ID& id) {
+    auto it = item2keys_.find(id);
+    if (it == item2keys_.end()) {
+        return 0;
+    }
+    inner_->DeleteMany(it->second);
+    free_keys_.insert(free_keys_.end(), it->second.begin(), it->second.end());
+    nb_vectors_ -= it->second.size();
+    item2keys_.erase(it);
+    return 1;
+}
+
+template <typename ID>
+unsigned int MultiVectorSpace<ID>::Delete(const ID& id) {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    return _Delete(id);
+}
+
+template <typename ID>
+unsigned int MultiVectorSpace<ID>::UpsertMulti(const ID& id, const float* points,
+                                               size_t nb_points) {
+    // Reject NaN entries.
+    if (nb_points == 0 || !isfinite_xf(points, nb_points * ndim_)) {
+        return 0;
+    }
+
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+
+    // Store the new vectors under fresh keys before dropping the old
+    // ones, so that a rejected point leaves the item as it was.
+    vector<ID> keys;
+    vector<SpaceInput<ID>> inputs(nb_points);
+    for (size_t i = 0; i < nb_points; ++i) {
+        if (free_keys_.empty()) {
+            free_keys_.emplace_back(ID(key_items_.size()));
+            key_items_.emplace_back();
+        }
+        keys.emplace_back(free_keys_.back());
+        free_keys_.pop_back();
+        key_items_[keys.back()] = id;
+        inputs[i].id = keys.back();
+        inputs[i].point = points + i * ndim_;
+    }
+    if (inner_->UpsertMany(inputs) != nb_points) {
+        inner_->DeleteMany(keys);
+        free_keys_.insert(free_keys_.end(), keys.begin(), keys.end());
+        return 0;
+    }
+    _Delete(id);
+    item2keys_[id] = keys;
+    nb_vectors_ += nb_points;
+    return 1;
+}
+
+template <typename ID>
+unsigned int MultiVectorSpace<ID>::Upsert(const SpaceInput<ID>& input) {
+    return UpsertMulti(input.id, input.point, 1);
+}
+
+template <typename ID>
+void MultiVectorSpace<ID>::_Collect(const float* point, size_t nb_items,
+                                    unordered_map<ID, float>& best) const {
+    best.clear();
+    if (nb_vectors_ == 0) {
+        return;
+    }
+    // Start with enough vectors for nb_items items of average size.
+    size_t per_item = (nb_vectors_ + item2keys_.size() - 1) / item2keys_.size();
+    size_t fetch = std::min(nb_vectors_, nb_items * per_item);
+    vector<SpaceResult<ID>> hits;
+    while (true) {
+        inner_->GetNeighbors(point, fetch, hits);
+        best.clear();
+        for (auto& hit : hits) {
+            auto it = best.emplace(key_items_[hit.id], hit.dist).first;
+            it->second = std::min(it->second, hit.dist);
+        }
+        if (best.size() >= nb_items || hits.size() < fetch || fetch == nb_vectors_) {
+            return;
+        }
+        fetch = std::min(nb_vectors_, 2 * fetch);
+    }
+}
+
+template <typename ID>
+bool MultiVectorSpace<ID>::_Prepare(float* dst, const float* src) const {
+    if (inner_l2_) {
+        return EuclideanMetric::Prepare(dst, src, ndim_);
+    }
+    if (inner_ip_) {
+        return InnerProductMetric::Prepare(dst, src, ndim_);
+    }
+    return CosineMetric::Prepare(dst, src, ndim_);
+}
+
+template <typename ID>
+float MultiVectorSpace<ID>::_Similarity(const float* a, const float* b) const {
+    if (inner_l2_) {
+        return -EuclideanMetric::Distance(a, b, ndim_);
+    }
+    if (inner_ip_) {
+        return -InnerProductMetric::Distance(a, b, ndim_);
+    }
+    return 1.0 - CosineMetric::Distance(a, b, ndim_);
+}
+
+template <typename ID>
+void MultiVectorSpace<ID>::_Search(const float* points, size_t nb_points, size_t nb_results,
+                                   vector<SpaceResult<ID>>& results) const {
+    results.clear();
+    size_t nb_items = nb_results;
+    if (aggregation_ == kSum) {
+        nb_items = (candidates_ == 0) ? 4 * nb_results : std::max(candidates_, nb_results);
+    }
+    unordered_map<ID, float> found;
+    unordered_map<ID, float> best;
+    for (size_t q = 0; q < nb_points; ++q) {
+        _Collect(points + q * ndim_, nb_items, best);
+        for (auto& item : best) {
+            auto it = found.emplace(item).first;
+            it->second = std::min(it->second, item.second);
+        }
+    }
+
+    if (aggregation_ == kSum) {
+        // Score candidates with all pairs.
+        vector<float> queries(nb_points * ndim_);
+        size_t nb_queries = 0;
+        for (size_t q = 0; q < nb_points; ++q) {
+            nb_queries += _Prepare(&queries[nb_queries * ndim_], points + q * ndim_);
+        }
+        vector<float> stored;
+        vector<float> vec(ndim_);
+        for (auto& item : found) {
+            _GetPoints(item.first, stored);
+            float sum = 0.0;
+            for (size_t v = 0; v * ndim_ < stored.size(); ++v) {
+                if (!_Prepare(vec.data(), &stored[v * ndim_])) {
+                    continue;
+                }
+                for (size_t q = 0; q < nb_queries; ++q) {
+                    sum += _Similarity(&queries[q * ndim_], vec.data());
+                }
+            }
+            item.second = -sum;
+        }
+    }
+
+    for (auto& item : found) {
+        SpaceResult<ID> r;
+        r.id = item.first;
+        r.dist = item.second;
+        PushTopK(results, r, nb_results);
+    }
+    std::sort_heap(results.begin(), results.end());
+}
+
+template <typename ID>
+void MultiVectorSpace<ID>::GetNeighborsMulti(const float* points, size_t nb_points,
+        size_t nb_results, vector<SpaceResult<ID>>& results) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    _Search(points, nb_points, nb_results, results);
+}
+
+template <typename ID>
+void MultiVectorSpace<ID>::GetNeighbors(const float* point, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    GetNeighborsMulti(point, 1, nb_results, results);
+}
+
+template <typename ID>
+void MultiVectorSpace<ID>::GetNeighbors(const ID& id, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    vector<float> points;
+    if (!_GetPoints(id, points)) {
+        results.clear();
+        return;
+    }
+    _Search(points.data(), points.size() / ndim_, nb_results, results);
+}
+
+template <typename ID>
+bool MultiVectorSpace<ID>::_GetPoints(const ID& id, vector<float>& points) const {
+    points.clear();
+    auto it = item2keys_.find(id);
+    if (it == item2keys_.end()) {
+        return false;
+    }
+    points.resize(it->second.size() * ndim_);
+    size_t nb_points = 0;
+    for (auto& key : it->second) {
+        nb_points += inner_->GetPoint(key, &points[nb_points * ndim_]);
+    }
+    points.resize(nb_points * ndim_);
+    return nb_points > 0;
+}
+
+template <typename ID>
+bool MultiVectorSpace<ID>::GetPoints(const ID& id, vector<float>& points) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    return _GetPoints(id, points);
+}
+
+template <typename ID>
+bool MultiVectorSpace<ID>::GetPoint(const ID& id, float* point) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    auto it = item2keys_.find(id);
+    return it != item2keys_.end() && inner_->GetPoint(it->second[0], point);
+}
+
+template <typename ID>
+void MultiVectorSpace<ID>::GetIds(vector<ID>& ids) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    ids.clear();
+    for (auto& item : item2keys_) {
+        ids.emplace_back(item.first);
+    }
+}
+
+template <typename ID>
+size_t MultiVectorSpace<ID>::Size() const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    return item2keys_.size();
+}
+
+template <typename ID>
+size_t MultiVectorSpace<ID>::NbVectors() const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    return nb_vectors_;
+}
+
+template <typename ID>
+void MultiVectorSpace<ID>::Info(FILE* log, size_t indent, size_t indent_incr) const {
+    Space<ID>::Info(log, indent, indent_incr);
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    string zero(indent, ' ');
+    fprintf(log, "%saggregation: %s\n", zero.c_str(), (aggregation_ == kSum) ? "sum" : "max");
+    fprintf(log, "%svectors: %zu\n", zero.c_str(), nb_vectors_);
+    fprintf(log, "%sinner:\n", zero.c_str());
+    inner_->Info(log, indent + indent_incr, indent_incr);
+}
@@ -0,0 +1,222 @@
+#pragma once
+
+// Approximate kNN graph construction by NN-Descent.
+//
+// Dong, Charikar & Li, "Efficient k-nearest neighbor graph construction
+// for generic similarity measures" (2011).
+//
+// Starting from an initial graph, every round joins each node's neighbors
+// and reverse neighbors pairwise: a neighbor of a neighbor is likely to be
+// a neighbor.  Only pairs involving at least one entry that is new since
+// the last round are compared, and the loop stops once a round changes
+// fewer than delta * n * k entries.
+//
+// The initial graph is seeded from random-hyperplane hashes: rows are
+// sorted by their hash and linked to the rows next to them in that order,
+// then topped up with random rows.
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <boost/random.hpp>
+#include <boost/random/normal_distribution.hpp>
+
+#include "common/ann_util.h"
+#include "ann/metric.h"
+#include "ann/space.h"
+
+using std::vector;
+using ann::util::ProgressBar;
+
+struct NNDescentEntry {
+    float dist;
+    uint32_t row;
+    bool is_new;
+    bool operator<(const NNDescentEntry& o) const { return dist < o.dist; }
+};
+
+// Offer row to the bounded max-heap of neighbors.  Returns 1 if it was
+// kept.
+inline size_t NNDescentPush(vector<NNDescentEntry>& heap, uint32_t row, float dist, size_t k) {
+    if (heap.size() == k && !(dist < heap.front().dist)) {
+        return 0;
+    }
+    for (auto& e : heap) {
+        if (e.row == row) {
+            return 0;
+        }
+    }
+    if (heap.size() == k) {
+        std::pop_heap(heap.begin(), heap.end());
+        heap.pop_back();
+    }
+    heap.push_back({dist, row, true});
+    std::push_heap(heap.begin(), heap.end());
+    return 1;
+}
+
+// Number of random-hyperplane orders used to seed the graph.
+const size_t kNNDescentSeedOrders = 4;
+
+// Build graph[i], the k nearest rows of row i among n rows of dim floats
+// (prepared by Metric), sorted by distance.  Rows whose bit is set in skip
+// (if given) are left out entirely.  sample_rate bounds the neighbors
+// joined per node and round to sample_rate * k.
+template <typename Metric = CosineMetric>
+void NNDescent(const float* points, size_t n, size_t dim, size_t k,
+                      vector<vector<SpaceResult<uint32_t>>>& graph,
+                      boost::mt19937_64& prng, size_t nb_iters=10,
+                      float sample_rate=0.5, float delta=0.001,
+                      const vector<uint64_t>* skip=nullptr) {
+    graph.clear();
+    graph.resize(n);
+    vector<uint32_t> live;
+    for (size_t i = 0; i < n; ++i) {
+        if (!skip || !TestBit(*skip, i)) {
+            live.emplace_back(i);
+        }
+    }
+    k = std::min(k, live.empty() ? 0 : live.size() - 1);
+    if (k == 0) {
+        return;
+    }
+    auto distance = [points, dim] (uint32_t a, uint32_t b) {
+        return Metric::Distance(points + a * dim, points + b * dim, dim);
+    };
+
+    vector<vector<NNDescentEntry>> heaps(n);
+    vector<std::mutex> locks(4096);
+    auto update = [&] (uint32_t a, uint32_t b, float dist) -> size_t {
+        std::lock_guard<std::mutex> guard(locks[a % locks.size()]);
+        return NNDescentPush(heaps[a], b, dist, k);
+    };
+
+    // Seed: neighbors along a few random-hyperplane hash orders.
+    boost::normal_distribution<float> gauss(0.0, 1.0);
+    boost::variate_generator<boost::mt19937_64&,
+        boost::normal_distribution<float>> rand_var(prng, gauss);
+    size_t window = std::max<size_t>(1, k / (2 * kNNDescentSeedOrders));
+    vector<float> planes(64 * dim);
+    vector<std::pair<uint64_t, uint32_t>> order(live.size());
+    for (size_t s = 0; s < kNNDescentSeedOrders; ++s) {
+        std::generate(planes.begin(), planes.end(), rand_var);
+        #pragma omp parallel for
+        for (size_t p = 0; p < live.size(); ++p) {
+            uint64_t hash = 0;
+            for (size_t b = 0; b < 64; ++b) {
+                float proj = DotProduct(&planes[b * dim], points + live[p] * dim, dim);
+                hash = (hash << 1) | (proj > 0.0);
+            }
+            order[p] = std::make_pair(hash, live[p]);
+        }
+        std::sort(order.begin(), order.end());
+        #pragma omp parallel for
+        for (size_t p = 0; p < order.size(); ++p) {
+            uint32_t a = order[p].second;
+            for (size_t w = 1; w <= window && p + w < order.size(); ++w) {
+                uint32_t b = order[p + w].second;
+                float dist = distance(a, b);
+                update(a, b, dist);
+                update(b, a, dist);
+            }
+        }
+    }
+    boost::uniform_int<size_t> pick(0, live.size() - 1);
+    for (auto a : live) {
+        while (heaps[a].size() < k) {
+            uint32_t b = live[pick(prng)];
+            if (b != a) {
+                NNDescentPush(heaps[a], b, distance(a, b), k);
+            }
+        }
+    }
+
+    size_t nb_samples = std::max<size_t>(1, sample_rate * k);
+    vector<vector<uint32_t>> new_rows(n);
+    vector<vector<uint32_t>> old_rows(n);
+    vector<vector<uint32_t>> rev_new(n);
+    vector<vector<uint32_t>> rev_old(n);
+    auto progBar = ProgressBar(nb_iters);
+    for (size_t iter = 0; iter < nb_iters; ++iter) {
+
+        // Sample new entries (marking them old) and gather reverse lists.
+        for (auto a : live) {
+            new_rows[a].clear();
+            old_rows[a].clear();
+            rev_new[a].clear();
+            rev_old[a].clear();
+        }
+        for (auto a : live) {
+            vector<NNDescentEntry*> fresh;
+            for (auto& e : heaps[a]) {
+                if (e.is_new) {
+                    fresh.emplace_back(&e);
+                } else {
+                    old_rows[a].emplace_back(e.row);
+                    rev_old[e.row].emplace_back(a);
+                }
+            }
+            for (size_t i = 0; i < fresh.size() && i < nb_samples; ++i) {
+                std::swap(fresh[i], fresh[boost::uniform_int<size_t>(i, fresh.size() - 1)(prng)]);
+                fresh[i]->is_new = false;
+                new_rows[a].emplace_back(fresh[i]->row);
+                rev_new[fresh[i]->row].emplace_back(a);
+            }
+        }
+        auto add_sample = [&] (vector<uint32_t>& from, vector<uint32_t>& to) {
+            for (size_t i = 0; i < from.size() && i < nb_samples; ++i) {
+                std::swap(from[i], from[boost::uniform_int<size_t>(i, from.size() - 1)(prng)]);
+                to.emplace_back(from[i]);
+            }
+            std::sort(to.begin(), to.end());
+            to.erase(std::unique(to.begin(), to.end()), to.end());
+        };
+        for (auto a : live) {
+            add_sample(rev_new[a], new_rows[a]);
+            add_sample(rev_old[a], old_rows[a]);
+        }
+
+        // Local joins: new x new, and new x old.
+        size_t nb_updates = 0;
+        #pragma omp parallel for schedule(dynamic, 64) reduction(+:nb_updates)
+        for (size_t p = 0; p < live.size(); ++p) {
+            uint32_t a = live[p];
+            auto& fresh = new_rows[a];
+            auto& stale = old_rows[a];
+            for (size_t i = 0; i < fresh.size(); ++i) {
+                for (size_t j = i + 1; j < fresh.size(); ++j) {
+                    float dist = distance(fresh[i], fresh[j]);
+                    nb_updates += update(fresh[i], fresh[j], dist);
+                    nb_updates += update(fresh[j], fresh[i], dist);
+                }
+                for (auto b : stale) {
+                    if (b == fresh[i]) {
+                        continue;
+                    }
+                    float dist = distance(fresh[i], b);
+                    nb_updates += update(fresh[i], b, dist);
+                    nb_updates += update(b, fresh[i], dist);
+                }
+            }
+        }
+        progBar.update();
+        if (nb_updates < delta * live.size() * k) {
+            break;
+        }
+    }
+
+    for (auto a : live) {
+        auto& heap = heaps[a];
+        std::sort_heap(heap.begin(), heap.end());
+        graph[a].reserve(heap.size());
+        for (auto& e : heap) {
+            SpaceResult<uint32_t> r;
+            r.id = e.row;
+            r.dist = e.dist;
+            graph[a].emplace_back(r);
+        }
+    }
+}
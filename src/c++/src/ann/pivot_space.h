@@ -0,0 +1,331 @@
+#pragma once
+
+// Exact search with pivot-based pruning.
+//
+// Every stored row keeps its angle to a small set of pivot directions.  On
+// normalized vectors the angle is a metric, so for any pivot p
+//
+//     angle(q, x) >= |angle(q, p) - angle(x, p)|
+//
+// and the largest of these gaps over all pivots gives a lower bound on the
+// cosine distance between q and x.  Queries visit rows in order of their
+// bound and stop once the bound exceeds the current k-th distance.
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/align/aligned_allocator.hpp>
+#include <boost/random.hpp>
+#include <boost/random/normal_distribution.hpp>
+
+#include "common/ann_util.h"
+#include "ann/space.h"
+
+using std::unordered_map;
+using std::vector;
+using boost::alignment::aligned_allocator;
+using ann::util::ProgressBar;
+
+template <typename ID>
+class PivotSpace : public Space<ID> {
+  public:
+    PivotSpace(uint64_t seed=0)
+        : prng_(seed)
+    {};
+    ~PivotSpace();
+
+    void Init(size_t nb_dims) override;
+
+    // Start with nb_pivots random directions as pivots.
+    void Config(size_t nb_dims, size_t nb_pivots=32);
+
+    // Replace the pivots by stored rows picked with farthest-first
+    // traversal, which gives tighter bounds on clustered data.
+    void SelectPivots();
+    bool Build() override { SelectPivots(); return true; }
+
+    void Clear() override;
+
+    unsigned int Delete(const ID& id) override;
+
+    unsigned int Upsert(const SpaceInput<ID>& input) override;
+
+    void GetNeighbors(const float* point, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    void GetNeighbors(const ID& id, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    bool GetPoint(const ID& id, float* point) const override;
+
+    void GetIds(vector<ID>& ids) const override;
+
+    void GraphToStream(std::ostream& out, size_t nb_results) const override;
+
+    // Get the number of elements stored.
+    size_t Size() const override { return ids_.size(); }
+
+    // Get Dimensionality
+    size_t Dim() const override { return ndim_; }
+
+  private:
+    void _PivotAngles(const float* point, float* angles) const;
+    void _GetNeighbors(const float* point, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const;
+
+    size_t ndim_;
+    vector<ID> ids_;
+    unordered_map<ID, size_t> id2index_;
+    vector<float, aligned_allocator<float, 32>> point_floats_;
+
+    // nb_pivots_ normalized pivots, and each row's angle to each of them
+    size_t nb_pivots_;
+    vector<float> pivots_;
+    vector<float> angles_;
+
+    boost::mt19937_64 prng_;
+};
+
+template <typename ID>
+PivotSpace<ID>::~PivotSpace() {}
+
+template <typename ID>
+void PivotSpace<ID>::Config(size_t nb_dims, size_t nb_pivots) {
+    ndim_ = nb_dims;
+    nb_pivots_ = nb_pivots;
+    Clear();
+
+    boost::normal_distribution<float> gauss(0.0, 1.0);
+    boost::variate_generator<boost::mt19937_64&,
+        boost::normal_distribution<float>> rand_var(prng_, gauss);
+
+    pivots_.resize(nb_pivots_ * ndim_);
+    vector<float> vec(ndim_);
+    for (size_t p = 0; p < nb_pivots_; ++p) {
+        do {
+            std::generate(vec.begin(), vec.end(), rand_var);
+        } while (!normalize(&pivots_[p * ndim_], vec.data(), ndim_));
+    }
+}
+
+template <typename ID>
+void PivotSpace<ID>::Init(size_t nb_dims) {
+    Config(nb_dims);
+}
+
+template <typename ID>
+void PivotSpace<ID>::Clear() {
+    id2index_.clear();
+    ids_.clear();
+    point_floats_.clear();
+    angles_.clear();
+}
+
+template <typename ID>
+void PivotSpace<ID>::_PivotAngles(const float* point, float* angles) const {
+    for (size_t p = 0; p < nb_pivots_; ++p) {
+        float dot = DotProduct(&pivots_[p * ndim_], point, ndim_);
+        angles[p] = std::acos(std::max(-1.0f, std::min(1.0f, dot)));
+    }
+}
+
+template <typename ID>
+void PivotSpace<ID>::SelectPivots() {
+    size_t total = ids_.size();
+    if (total == 0) {
+        return;
+    }
+    size_t nb_pivots = std::min(nb_pivots_, total);
+
+    // Farthest-first: start from an arbitrary row, then repeatedly take the
+    // row whose smallest distance to the pivots chosen so far is largest.
+    vector<float> min_dist(total, 2.0);
+    size_t next = 0;
+    for (size_t p = 0; p < nb_pivots; ++p) {
+        const float* pivot = &point_floats_[next * ndim_];
+        std::copy(pivot, pivot + ndim_, &pivots_[p * ndim_]);
+        size_t farthest = 0;
+        for (size_t i = 0; i < total; ++i) {
+            float dist = 1.0 - DotProduct(&point_floats_[i * ndim_], pivot, ndim_);
+            min_dist[i] = std::min(min_dist[i], dist);
+            if (min_dist[i] > min_dist[farthest]) {
+                farthest = i;
+            }
+        }
+        next = farthest;
+    }
+
+    #pragma omp parallel for
+    for (size_t i = 0; i < total; ++i) {
+        _PivotAngles(&point_floats_[i * ndim_], &angles_[i * nb_pivots_]);
+    }
+}
+
+template <typename ID>
+unsigned int PivotSpace<ID>::Delete(const ID& id) {
+
+    // Look up the ID.
+    auto it = id2index_.find(id);
+    if (it == id2index_.end()) {
+        return 0;
+    }
+
+    // Swap with the end and resize by one.
+    size_t index = it->second;
+    size_t last = ids_.size() - 1;
+    id2index_[ids_[last]] = index;
+    id2index_.erase(id);
+
+    ids_[index] = ids_[last];
+    ids_.resize(last);
+
+    std::copy(point_floats_.begin() + last * ndim_,
+              point_floats_.begin() + (last + 1) * ndim_,
+              point_floats_.begin() + index * ndim_);
+    point_floats_.resize(last * ndim_);
+
+    std::copy(angles_.begin() + last * nb_pivots_,
+              angles_.begin() + (last + 1) * nb_pivots_,
+              angles_.begin() + index * nb_pivots_);
+    angles_.resize(last * nb_pivots_);
+    return 1;
+}
+
+template <typename ID>
+unsigned int PivotSpace<ID>::Upsert(const SpaceInput<ID>& input) {
+    Delete(input.id);
+
+    // Reject NaN entries.
+    if (!isfinite_xf(input.point, ndim_)) {
+        return 0;
+    }
+
+    float tmp[ndim_];
+
+    // Reject inputs whose norm equals zero
+    if (!normalize(tmp, input.point, ndim_)) {
+        return 0;
+    }
+
+    size_t idx = ids_.size();
+    ids_.emplace_back(input.id);
+    id2index_[input.id] = idx;
+
+    point_floats_.insert(point_floats_.end(), tmp, tmp + ndim_);
+    angles_.resize((idx + 1) * nb_pivots_);
+    _PivotAngles(tmp, &angles_[idx * nb_pivots_]);
+    return 1;
+}
+
+// acos is ill-conditioned near 0 and pi: float rounding in a dot product
+// close to 1 moves the angle by up to ~5e-4, so bounds are loosened a bit.
+const float kAngleSlack = 1e-3;
+
+template <typename ID>
+void PivotSpace<ID>::_GetNeighbors(const float* point, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    results.clear();
+    size_t total = ids_.size();
+
+    vector<float> query_angles(nb_pivots_);
+    _PivotAngles(point, query_angles.data());
+
+    // Lower bounds on the angle to every row, as (bound, row) pairs.
+    vector<std::pair<float, size_t>> bounds(total);
+    #pragma omp parallel for
+    for (size_t i = 0; i < total; ++i) {
+        const float* angles = &angles_[i * nb_pivots_];
+        float bound = 0.0;
+        for (size_t p = 0; p < nb_pivots_; ++p) {
+            bound = std::max(bound, std::abs(query_angles[p] - angles[p]));
+        }
+        bounds[i] = std::make_pair(std::max(0.0f, bound - kAngleSlack), i);
+    }
+
+    // Visit rows by increasing bound.  Searches usually stop after a small
+    // fraction of the rows, so only the next batch of smallest bounds is
+    // selected and sorted, and batches double while the search goes on.
+    results.reserve(nb_results);
+    size_t batch = std::max<size_t>(4 * nb_results, 64);
+    for (size_t begin = 0; begin < total; begin += batch, batch *= 2) {
+        size_t end = std::min(total, begin + batch);
+        if (end < total) {
+            std::nth_element(bounds.begin() + begin, bounds.begin() + end, bounds.end());
+        }
+        std::sort(bounds.begin() + begin, bounds.begin() + end);
+        for (size_t j = begin; j < end; ++j) {
+            if (results.size() == nb_results &&
+                    1.0 - std::cos(bounds[j].first) > results.front().dist) {
+                // every remaining row has a larger bound
+                std::sort_heap(results.begin(), results.end());
+                return;
+            }
+            size_t i = bounds[j].second;
+            SpaceResult<ID> r;
+            r.id = ids_[i];
+            r.dist = 1.0 - DotProduct(&point_floats_[i * ndim_], point, ndim_);
+            PushTopK(results, r, nb_results);
+        }
+    }
+    std::sort_heap(results.begin(), results.end());
+}
+
+template <typename ID>
+void PivotSpace<ID>::GetNeighbors(const float* point, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    // Pivot angles only bound distances between unit vectors.
+    float tmp[ndim_];
+    if (!normalize(tmp, point, ndim_)) {
+        results.clear();
+        return;
+    }
+    _GetNeighbors(tmp, nb_results, results);
+}
+
+template <typename ID>
+void PivotSpace<ID>::GetNeighbors(const ID& id, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    auto it = id2index_.find(id);
+    if (it != id2index_.end()) {
+        _GetNeighbors(&point_floats_[it->second * ndim_], nb_results, results);
+    }
+}
+
+template <typename ID>
+bool PivotSpace<ID>::GetPoint(const ID& id, float* point) const {
+    auto it = id2index_.find(id);
+    if (it == id2index_.end()) {
+        return false;
+    }
+    std::copy_n(&point_floats_[it->second * ndim_], ndim_, point);
+    return true;
+}
+
+template <typename ID>
+void PivotSpace<ID>::GetIds(vector<ID>& ids) const {
+    ids.assign(ids_.begin(), ids_.end());
+}
+
+template <typename ID>
+void PivotSpace<ID>::GraphToStream(std::ostream& out, size_t nb_results) const {
+    // Iterate over all ids stored
+    size_t total = ids_.size();
+    auto progBar = ProgressBar(total);
+    #pragma omp parallel for shared(progBar)
+    for (size_t i = 0; i < total; ++i) {
+        const ID& id = ids_[i];
+        vector<SpaceResult<ID>> results;
+        _GetNeighbors(&point_floats_[i * ndim_], nb_results, results);
+        #pragma omp critical
+        {
+        progBar.update();
+        WriteResults(out, id, results);
+        }
+    }
+}
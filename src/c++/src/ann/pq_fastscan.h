@@ -0,0 +1,176 @@
+#pragma once
+
+// 4-bit product-quantization "fast scan".
+//
+// With 16 codewords per subspace a query's lookup table for one subspace is
+// 16 bytes once quantized to uint8, which is exactly one pshufb table: a
+// single in-register shuffle looks up 16 (SSSE3), 32 (AVX2) or 64
+// (AVX-512BW) codes at once instead of gathering from memory.  Andre et
+// al., "Cache locality is not enough: high-performance nearest neighbor
+// search with product quantization fast scan" (2015).
+//
+// Codes are packed in blocks of 32 rows.  A block holds 16 bytes for each
+// subspace, and byte r of subspace j carries row r's code in its low nibble
+// and row r + 16's code in its high nibble.  The number of subspaces per
+// block is rounded up to an even count; padding codes are zero and their
+// lookup tables must be zero too.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+// rows per block, and codewords per subspace
+const size_t kPQ4Block = 32;
+const size_t kPQ4Codewords = 16;
+
+// Subspaces stored per block for m sub-codes.
+inline size_t PQ4Subspaces(size_t m) {
+    return (m + 1) & ~size_t(1);
+}
+
+// Bytes needed to store nb_rows codes of m subspaces.
+inline size_t PQ4CodeBytes(size_t nb_rows, size_t m) {
+    size_t nb_blocks = (nb_rows + kPQ4Block - 1) / kPQ4Block;
+    return nb_blocks * PQ4Subspaces(m) * kPQ4Codewords;
+}
+
+inline void PQ4GetCode(const uint8_t* codes, size_t m, size_t row, uint8_t* code) {
+    const uint8_t* block = codes + (row / kPQ4Block) * PQ4Subspaces(m) * kPQ4Codewords;
+    size_t r = row % kPQ4Block;
+    for (size_t j = 0; j < m; ++j) {
+        uint8_t byte = block[j * kPQ4Codewords + (r & 15)];
+        code[j] = (r < 16) ? (byte & 15) : (byte >> 4);
+    }
+}
+
+inline void PQ4SetCode(uint8_t* codes, size_t m, size_t row, const uint8_t* code) {
+    uint8_t* block = codes + (row / kPQ4Block) * PQ4Subspaces(m) * kPQ4Codewords;
+    size_t r = row % kPQ4Block;
+    for (size_t j = 0; j < m; ++j) {
+        uint8_t& byte = block[j * kPQ4Codewords + (r & 15)];
+        if (r < 16) {
+            byte = (byte & 0xf0) | (code[j] & 15);
+        } else {
+            byte = (byte & 0x0f) | (code[j] << 4);
+        }
+    }
+}
+
+// Quantize m tables of 16 float distances to uint8 with one shared scale,
+// so that sums stay comparable across subspaces:
+//
+//     sum_j table[j][c_j] ~= bias + sum_j lut[j][c_j] / scale
+//
+// lut receives PQ4Subspaces(m) tables, padding included.
+inline void PQ4QuantizeTables(const float* table, size_t m, uint8_t* lut,
+                              float& scale, float& bias) {
+    bias = 0.0;
+    float max_range = 0.0;
+    for (size_t j = 0; j < m; ++j) {
+        const float* t = table + j * kPQ4Codewords;
+        float lo = *std::min_element(t, t + kPQ4Codewords);
+        float hi = *std::max_element(t, t + kPQ4Codewords);
+        bias += lo;
+        max_range = std::max(max_range, hi - lo);
+    }
+    scale = (max_range > 0.0) ? 255.0 / max_range : 1.0;
+    std::memset(lut, 0, PQ4Subspaces(m) * kPQ4Codewords);
+    for (size_t j = 0; j < m; ++j) {
+        const float* t = table + j * kPQ4Codewords;
+        float lo = *std::min_element(t, t + kPQ4Codewords);
+        for (size_t c = 0; c < kPQ4Codewords; ++c) {
+            float q = std::round((t[c] - lo) * scale);
+            lut[j * kPQ4Codewords + c] = std::min(255.0f, q);
+        }
+    }
+}
+
+// Sum the quantized tables over every row of nb_blocks blocks, writing
+// 32 saturated uint16 sums per block to dists.
+inline void PQ4FastScan(const uint8_t* codes, size_t nb_blocks, size_t m,
+                        const uint8_t* lut, uint16_t* dists) {
+    size_t nb_sub = PQ4Subspaces(m);
+#if defined(__AVX512BW__)
+    // Two subspaces per step; lanes hold (j low, j high, j+1 low, j+1 high).
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    for (size_t b = 0; b < nb_blocks; ++b) {
+        const uint8_t* block = codes + b * nb_sub * kPQ4Codewords;
+        __m512i acc = _mm512_setzero_si512();
+        for (size_t j = 0; j < nb_sub; j += 2) {
+            __m256i c = _mm256_loadu_si256((const __m256i*) (block + j * kPQ4Codewords));
+            __m256i lo = _mm256_and_si256(c, mask);
+            __m256i hi = _mm256_and_si256(_mm256_srli_epi16(c, 4), mask);
+            __m512i idx = _mm512_inserti64x4(
+                _mm512_castsi256_si512(_mm256_permute2x128_si256(lo, hi, 0x20)),
+                _mm256_permute2x128_si256(lo, hi, 0x31), 1);
+            __m512i t = _mm512_castsi256_si512(
+                _mm256_loadu_si256((const __m256i*) (lut + j * kPQ4Codewords)));
+            t = _mm512_shuffle_i64x2(t, t, _MM_SHUFFLE(1, 1, 0, 0));
+            __m512i v = _mm512_shuffle_epi8(t, idx);
+            acc = _mm512_adds_epu16(acc, _mm512_cvtepu8_epi16(_mm512_castsi512_si256(v)));
+            acc = _mm512_adds_epu16(acc, _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(v, 1)));
+        }
+        _mm512_storeu_si512((__m512i*) (dists + b * kPQ4Block), acc);
+    }
+#elif defined(__AVX2__)
+    // One subspace per step; lanes hold (low nibbles, high nibbles).
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    for (size_t b = 0; b < nb_blocks; ++b) {
+        const uint8_t* block = codes + b * nb_sub * kPQ4Codewords;
+        __m256i acc_lo = _mm256_setzero_si256();
+        __m256i acc_hi = _mm256_setzero_si256();
+        for (size_t j = 0; j < nb_sub; ++j) {
+            __m128i c = _mm_loadu_si128((const __m128i*) (block + j * kPQ4Codewords));
+            __m256i idx = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_and_si128(c, mask)),
+                _mm_and_si128(_mm_srli_epi16(c, 4), mask), 1);
+            __m256i t = _mm256_broadcastsi128_si256(
+                _mm_loadu_si128((const __m128i*) (lut + j * kPQ4Codewords)));
+            __m256i v = _mm256_shuffle_epi8(t, idx);
+            acc_lo = _mm256_adds_epu16(acc_lo, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+            acc_hi = _mm256_adds_epu16(acc_hi, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+        }
+        _mm256_storeu_si256((__m256i*) (dists + b * kPQ4Block), acc_lo);
+        _mm256_storeu_si256((__m256i*) (dists + b * kPQ4Block + 16), acc_hi);
+    }
+#elif defined(__SSSE3__)
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    const __m128i zero = _mm_setzero_si128();
+    for (size_t b = 0; b < nb_blocks; ++b) {
+        const uint8_t* block = codes + b * nb_sub * kPQ4Codewords;
+        __m128i acc[4] = {zero, zero, zero, zero};
+        for (size_t j = 0; j < nb_sub; ++j) {
+            __m128i c = _mm_loadu_si128((const __m128i*) (block + j * kPQ4Codewords));
+            __m128i t = _mm_loadu_si128((const __m128i*) (lut + j * kPQ4Codewords));
+            __m128i lo = _mm_shuffle_epi8(t, _mm_and_si128(c, mask));
+            __m128i hi = _mm_shuffle_epi8(t, _mm_and_si128(_mm_srli_epi16(c, 4), mask));
+            acc[0] = _mm_adds_epu16(acc[0], _mm_unpacklo_epi8(lo, zero));
+            acc[1] = _mm_adds_epu16(acc[1], _mm_unpackhi_epi8(lo, zero));
+            acc[2] = _mm_adds_epu16(acc[2], _mm_unpacklo_epi8(hi, zero));
+            acc[3] = _mm_adds_epu16(acc[3], _mm_unpackhi_epi8(hi, zero));
+        }
+        for (size_t k = 0; k < 4; ++k) {
+            _mm_storeu_si128((__m128i*) (dists + b * kPQ4Block + 8 * k), acc[k]);
+        }
+    }
+#else
+    for (size_t b = 0; b < nb_blocks; ++b) {
+        const uint8_t* block = codes + b * nb_sub * kPQ4Codewords;
+        uint16_t* out = dists + b * kPQ4Block;
+        std::fill(out, out + kPQ4Block, 0);
+        for (size_t j = 0; j < nb_sub; ++j) {
+            const uint8_t* c = block + j * kPQ4Codewords;
+            const uint8_t* t = lut + j * kPQ4Codewords;
+            for (size_t r = 0; r < 16; ++r) {
+                out[r] = std::min(65535, out[r] + t[c[r] & 15]);
+                out[r + 16] = std::min(65535, out[r + 16] + t[c[r] >> 4]);
+            }
+        }
+    }
+#endif
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+// Fixed pool of threads serving batches of positional reads.
+//
+// A caller hands over a batch of (fd, offset, length, buffer) requests and
+// blocks until all of them completed, so that one query can keep several
+// reads in flight on an SSD without asynchronous I/O support in the kernel
+// interface.
+
+#include <condition_variable>
+#include <cerrno>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// unix headers
+#include <sys/types.h>
+#include <unistd.h>
+
+using std::vector;
+
+struct ReadRequest {
+    int fd;
+    off_t offset;
+    size_t length;
+    void* buffer;
+};
+
+class ReadPool {
+  public:
+    explicit ReadPool(size_t nb_threads=8) {
+        for (size_t t = 0; t < nb_threads; ++t) {
+            threads_.emplace_back([this] { this->_Serve(); });
+        }
+    }
+
+    ~ReadPool() {
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            stopping_ = true;
+        }
+        ready_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    // Issue every request and wait for all of them.  Returns false if any
+    // read failed or hit the end of the file.
+    bool Read(const vector<ReadRequest>& requests) {
+        Batch batch;
+        batch.remaining = requests.size();
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            for (auto& request : requests) {
+                queue_.emplace_back(&request, &batch);
+            }
+        }
+        ready_.notify_all();
+
+        std::unique_lock<std::mutex> lock(batch.mutex);
+        batch.done.wait(lock, [&batch] { return batch.remaining == 0; });
+        return batch.ok;
+    }
+
+  private:
+    struct Batch {
+        std::mutex mutex;
+        std::condition_variable done;
+        size_t remaining;
+        bool ok = true;
+    };
+
+    void _Serve() {
+        while (true) {
+            std::pair<const ReadRequest*, Batch*> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                ready_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+                if (queue_.empty()) {
+                    return;
+                }
+                task = queue_.front();
+                queue_.pop_front();
+            }
+            bool ok = _ReadFully(*task.first);
+            Batch* batch = task.second;
+            std::lock_guard<std::mutex> guard(batch->mutex);
+            batch->ok = batch->ok && ok;
+            if (--batch->remaining == 0) {
+                batch->done.notify_all();
+            }
+        }
+    }
+
+    static bool _ReadFully(const ReadRequest& request) {
+        char* buffer = static_cast<char*>(request.buffer);
+        size_t done = 0;
+        while (done < request.length) {
+            ssize_t got = pread(request.fd, buffer + done, request.length - done,
+                                request.offset + done);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                return false;
+            }
+            done += got;
+        }
+        return true;
+    }
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<std::pair<const ReadRequest*, Batch*>> queue_;
+    bool stopping_ = false;
+    vector<std::thread> threads_;
+};
@@ -0,0 +1,682 @@
+#pragma once
+
+// Forest of random-projection trees (as in Annoy).
+//
+// Each tree recursively splits the rows by a hyperplane until leaves hold
+// at most leaf_size of them.  As in Annoy, the plane is the one halfway
+// between two centers found by a few steps of 2-means seeded with two
+// random rows, which balances the split better than the rows alone.  A
+// query walks all trees at once with a priority queue keyed by the
+// smallest margin to any splitting plane on the path, collecting leaf rows
+// until search_k candidates are found, then ranks them exactly.
+//
+// Trees live in flat arrays of nodes, planes and leaf items, so a forest
+// written by Save() can be mapped read-only by Load() and shared between
+// processes.  Rows upserted after Build() are scanned exactly until the
+// next Build(); deleted rows are skipped.
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// unix headers
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/align/aligned_allocator.hpp>
+#include <boost/random.hpp>
+
+#include "common/ann_util.h"
+#include "ann/space.h"
+
+using std::unordered_map;
+using std::vector;
+using boost::alignment::aligned_allocator;
+using ann::util::ProgressBar;
+
+// Internal nodes point to a plane and the children holding the rows below
+// it (negative dot product) and above it; leaves (below == kRPLeaf) to
+// count rows starting at begin in the item array.
+struct RPNode {
+    uint32_t below;
+    uint32_t above;
+    uint32_t begin;
+    uint32_t count;
+};
+
+const uint32_t kRPLeaf = 0xffffffff;
+
+template <typename ID>
+class RPForestSpace : public Space<ID> {
+  public:
+    RPForestSpace(uint64_t seed=0)
+        : prng_(seed), map_(nullptr), map_bytes_(0)
+    {};
+    ~RPForestSpace();
+
+    void Init(size_t nb_dims) override;
+
+    // nb_trees: number of trees
+    // leaf_size: largest number of rows in a leaf
+    // search_k: candidates ranked per query (if 0, nb_trees * nb_results)
+    // path: if set, Build() also saves the forest there
+    void Config(size_t nb_dims, size_t nb_trees=10, size_t leaf_size=32, size_t search_k=0,
+                const std::string& path="");
+
+    // Drop deleted rows and build the trees over all rows, one tree per
+    // thread.
+    bool Build() override;
+
+    // Write the forest to path, building it first if rows changed since
+    // the last Build().  Returns false on I/O errors.
+    bool Save(const std::string& path);
+
+    // Map a forest written by Save().  The space is read-only afterwards.
+    bool Load(const std::string& path);
+
+    void Clear() override;
+
+    unsigned int Delete(const ID& id) override;
+
+    unsigned int Upsert(const SpaceInput<ID>& input) override;
+
+    void GetNeighbors(const float* point, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    void GetNeighbors(const ID& id, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    bool GetPoint(const ID& id, float* point) const override;
+
+    void GetIds(vector<ID>& ids) const override;
+
+    void GraphToStream(std::ostream& out, size_t nb_results) const override;
+
+    // Get the number of elements stored.
+    size_t Size() const override { return id2index_.size(); }
+
+    // Get Dimensionality
+    size_t Dim() const override { return ndim_; }
+
+    void Info(FILE* log, size_t indent=2, size_t indent_incr=4) const override;
+
+  private:
+    size_t _NbRows() const { return map_ ? nb_indexed_ : ids_.size(); }
+    const ID& _Id(size_t row) const { return map_ ? ids_view_[row] : ids_[row]; }
+    const float* _Point(size_t row) const {
+        return map_ ? points_view_ + row * ndim_ : &point_floats_[row * ndim_];
+    }
+
+    void _Build();
+    uint32_t _BuildTree(vector<uint32_t>& rows, size_t begin, size_t end,
+            boost::mt19937_64& prng, vector<RPNode>& nodes,
+            vector<float>& planes, vector<uint32_t>& items) const;
+    void _Unmap();
+    void _GetNeighbors(const float* point, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const;
+
+    size_t ndim_;
+
+    // rows [0, nb_indexed_) are in the trees, the rest are scanned
+    unordered_map<ID, size_t> id2index_;
+    vector<ID> ids_;
+    vector<float, aligned_allocator<float, 32>> point_floats_;
+    vector<uint64_t> deleted_;
+    size_t nb_deleted_;
+    size_t nb_indexed_;
+
+    vector<uint32_t> roots_;
+    vector<RPNode> nodes_;
+    vector<float> planes_;
+    vector<uint32_t> items_;
+
+    // arrays read by queries, owned above or mapped from a file
+    const uint32_t* roots_view_;
+    const RPNode* nodes_view_;
+    const float* planes_view_;
+    const uint32_t* items_view_;
+    const ID* ids_view_;
+    const float* points_view_;
+    size_t nb_nodes_;
+
+    // constructor params
+    size_t nb_trees_;
+    size_t leaf_size_;
+    size_t search_k_;
+    std::string path_;
+
+    boost::mt19937_64 prng_;
+    void* map_;
+    size_t map_bytes_;
+};
+
+template <typename ID>
+RPForestSpace<ID>::~RPForestSpace() {
+    _Unmap();
+}
+
+template <typename ID>
+void RPForestSpace<ID>::Config(size_t nb_dims, size_t nb_trees, size_t leaf_size, size_t search_k,
+                               const std::string& path) {
+    ndim_ = nb_dims;
+    nb_trees_ = std::max<size_t>(nb_trees, 1);
+    leaf_size_ = std::max<size_t>(leaf_size, 1);
+    search_k_ = search_k;
+    path_ = path;
+    Clear();
+}
+
+template <typename ID>
+void RPForestSpace<ID>::Init(size_t nb_dims) {
+    Config(nb_dims);
+}
+
+template <typename ID>
+void RPForestSpace<ID>::_Unmap() {
+    if (map_) {
+        munmap(map_, map_bytes_);
+        map_ = nullptr;
+        map_bytes_ = 0;
+    }
+}
+
+template <typename ID>
+void RPForestSpace<ID>::Clear() {
+    _Unmap();
+    id2index_.clear();
+    ids_.clear();
+    point_floats_.clear();
+    deleted_.clear();
+    nb_deleted_ = 0;
+    nb_indexed_ = 0;
+    roots_.clear();
+    nodes_.clear();
+    planes_.clear();
+    items_.clear();
+    roots_view_ = nullptr;
+    nodes_view_ = nullptr;
+    planes_view_ = nullptr;
+    items_view_ = nullptr;
+    ids_view_ = nullptr;
+    points_view_ = nullptr;
+    nb_nodes_ = 0;
+}
+
+template <typename ID>
+unsigned int RPForestSpace<ID>::Delete(const ID& id) {
+    if (map_) {
+        std::cerr << "RPForestSpace: mapped forest is read-only" << std::endl;
+        return 0;
+    }
+
+    // Look up the ID.
+    auto it = id2index_.find(id);
+    if (it == id2index_.end()) {
+        return 0;
+    }
+
+    // Rows are referenced by the trees, so only mark them.
+    SetBit(deleted_, it->second);
+    ++nb_deleted_;
+    id2index_.erase(it);
+    return 1;
+}
+
+template <typename ID>
+unsigned int RPForestSpace<ID>::Upsert(const SpaceInput<ID>& input) {
+    if (map_) {
+        std::cerr << "RPForestSpace: mapped forest is read-only" << std::endl;
+        return 0;
+    }
+    Delete(input.id);
+
+    // Reject NaN entries.
+    if (!isfinite_xf(input.point, ndim_)) {
+        return 0;
+    }
+
+    float tmp[ndim_];
+
+    // Reject inputs whose norm equals zero
+    if (!normalize(tmp, input.point, ndim_)) {
+        return 0;
+    }
+
+    size_t row = ids_.size();
+    ids_.emplace_back(input.id);
+    id2index_[input.id] = row;
+    point_floats_.insert(point_floats_.end(), tmp, tmp + ndim_);
+    deleted_.resize(BitWords(row + 1), 0);
+    return 1;
+}
+
+// Attempts at finding a plane that splits a node before falling back to an
+// arbitrary split (all rows may be identical).
+const size_t kRPSplitAttempts = 3;
+
+// Online 2-means steps per split.
+const size_t kRPTwoMeansIters = 200;
+
+template <typename ID>
+uint32_t RPForestSpace<ID>::_BuildTree(vector<uint32_t>& rows, size_t begin, size_t end,
+        boost::mt19937_64& prng, vector<RPNode>& nodes,
+        vector<float>& planes, vector<uint32_t>& items) const
+{
+    uint32_t index = nodes.size();
+    nodes.emplace_back();
+    size_t count = end - begin;
+    if (count <= leaf_size_) {
+        nodes[index] = {kRPLeaf, kRPLeaf, (uint32_t) items.size(), (uint32_t) count};
+        items.insert(items.end(), rows.begin() + begin, rows.begin() + end);
+        return index;
+    }
+
+    // On unit vectors, the plane through the origin normal to a - b is
+    // equidistant from a and b.  Like Annoy, a and b start at two random
+    // rows and are refined by a few online 2-means steps, which balances
+    // the split.
+    vector<float> normal(ndim_, 0.0);
+    vector<float> a(ndim_);
+    vector<float> b(ndim_);
+    boost::uniform_int<size_t> pick(begin, end - 1);
+    size_t middle = begin;
+    for (size_t attempt = 0; attempt < kRPSplitAttempts; ++attempt) {
+        const float* pa = _Point(rows[pick(prng)]);
+        const float* pb = _Point(rows[pick(prng)]);
+        a.assign(pa, pa + ndim_);
+        b.assign(pb, pb + ndim_);
+        size_t na = 1;
+        size_t nb = 1;
+        for (size_t iter = 0; iter < kRPTwoMeansIters; ++iter) {
+            const float* p = _Point(rows[pick(prng)]);
+            bool closer_to_a = DotProduct(a.data(), p, ndim_) / na >
+                               DotProduct(b.data(), p, ndim_) / nb;
+            vector<float>& center = closer_to_a ? a : b;
+            for (size_t i = 0; i < ndim_; ++i) {
+                center[i] += p[i];
+            }
+            ++(closer_to_a ? na : nb);
+        }
+        normalize(a.data(), a.data(), ndim_);
+        normalize(b.data(), b.data(), ndim_);
+        for (size_t i = 0; i < ndim_; ++i) {
+            normal[i] = a[i] - b[i];
+        }
+        auto is_above = [&] (uint32_t row) {
+            return DotProduct(normal.data(), _Point(row), ndim_) > 0.0;
+        };
+        middle = std::partition(rows.begin() + begin, rows.begin() + end, is_above) - rows.begin();
+        if (middle != begin && middle != end) {
+            break;
+        }
+    }
+    if (middle == begin || middle == end) {
+        // A zero plane sends queries down both sides.
+        std::fill(normal.begin(), normal.end(), 0.0);
+        middle = begin + count / 2;
+    }
+
+    uint32_t plane = planes.size() / ndim_;
+    planes.insert(planes.end(), normal.begin(), normal.end());
+    // partition put the rows above the plane first
+    uint32_t above = _BuildTree(rows, begin, middle, prng, nodes, planes, items);
+    uint32_t below = _BuildTree(rows, middle, end, prng, nodes, planes, items);
+    nodes[index] = {below, above, plane, (uint32_t) count};
+    return index;
+}
+
+template <typename ID>
+bool RPForestSpace<ID>::Build() {
+    if (map_) {
+        std::cerr << "RPForestSpace: mapped forest is read-only" << std::endl;
+        return false;
+    }
+    _Build();
+    return path_.empty() || Save(path_);
+}
+
+template <typename ID>
+void RPForestSpace<ID>::_Build() {
+    // Compact away deleted rows.
+    if (nb_deleted_ > 0) {
+        size_t kept = 0;
+        for (size_t row = 0; row < ids_.size(); ++row) {
+            if (TestBit(deleted_, row)) {
+                continue;
+            }
+            ids_[kept] = ids_[row];
+            id2index_[ids_[kept]] = kept;
+            std::copy(point_floats_.begin() + row * ndim_,
+                      point_floats_.begin() + (row + 1) * ndim_,
+                      point_floats_.begin() + kept * ndim_);
+            ++kept;
+        }
+        ids_.resize(kept);
+        point_floats_.resize(kept * ndim_);
+        deleted_.assign(BitWords(kept), 0);
+        nb_deleted_ = 0;
+    }
+    size_t total = ids_.size();
+
+    // Trees are built independently, then concatenated.
+    vector<uint64_t> seeds(nb_trees_);
+    for (auto& seed : seeds) {
+        seed = prng_();
+    }
+    vector<vector<RPNode>> tree_nodes(nb_trees_);
+    vector<vector<float>> tree_planes(nb_trees_);
+    vector<vector<uint32_t>> tree_items(nb_trees_);
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t t = 0; t < nb_trees_; ++t) {
+        boost::mt19937_64 prng(seeds[t]);
+        vector<uint32_t> rows(total);
+        for (size_t i = 0; i < total; ++i) {
+            rows[i] = i;
+        }
+        _BuildTree(rows, 0, total, prng, tree_nodes[t], tree_planes[t], tree_items[t]);
+    }
+
+    roots_.clear();
+    nodes_.clear();
+    planes_.clear();
+    items_.clear();
+    for (size_t t = 0; t < nb_trees_; ++t) {
+        uint32_t node_base = nodes_.size();
+        uint32_t plane_base = planes_.size() / ndim_;
+        uint32_t item_base = items_.size();
+        roots_.emplace_back(node_base);
+        for (auto node : tree_nodes[t]) {
+            if (node.below == kRPLeaf) {
+                node.begin += item_base;
+            } else {
+                node.below += node_base;
+                node.above += node_base;
+                node.begin += plane_base;
+            }
+            nodes_.emplace_back(node);
+        }
+        planes_.insert(planes_.end(), tree_planes[t].begin(), tree_planes[t].end());
+        items_.insert(items_.end(), tree_items[t].begin(), tree_items[t].end());
+    }
+    roots_view_ = roots_.data();
+    nodes_view_ = nodes_.data();
+    planes_view_ = planes_.data();
+    items_view_ = items_.data();
+    nb_nodes_ = nodes_.size();
+    nb_indexed_ = total;
+}
+
+// File layout: a header, then roots, nodes, planes, items, ids and points,
+// each section starting on a 64-byte boundary.
+struct RPForestHeader {
+    char magic[8];
+    uint64_t ndim;
+    uint64_t nb_rows;
+    uint64_t nb_trees;
+    uint64_t nb_nodes;
+    uint64_t nb_planes;
+    uint64_t nb_items;
+    uint64_t id_size;
+};
+
+const char kRPForestMagic[8] = {'A', 'N', 'N', 'R', 'P', 'F', '1', '\0'};
+
+inline size_t RPForestAlign(size_t offset) {
+    return (offset + 63) & ~size_t(63);
+}
+
+// Section offsets of a forest file, followed by its total size.
+inline vector<size_t> RPForestSections(const RPForestHeader& h) {
+    vector<size_t> offsets;
+    size_t offset = sizeof(RPForestHeader);
+    for (size_t bytes : {h.nb_trees * sizeof(uint32_t),
+                         h.nb_nodes * sizeof(RPNode),
+                         h.nb_planes * h.ndim * sizeof(float),
+                         h.nb_items * sizeof(uint32_t),
+                         h.nb_rows * h.id_size,
+                         h.nb_rows * h.ndim * sizeof(float)}) {
+        offset = RPForestAlign(offset);
+        offsets.emplace_back(offset);
+        offset += bytes;
+    }
+    offsets.emplace_back(offset);
+    return offsets;
+}
+
+template <typename ID>
+bool RPForestSpace<ID>::Save(const std::string& path) {
+    if (!map_ && (nb_indexed_ != ids_.size() || nb_deleted_ > 0 || nodes_.empty())) {
+        _Build();
+    }
+
+    RPForestHeader header;
+    std::memcpy(header.magic, kRPForestMagic, sizeof(header.magic));
+    header.ndim = ndim_;
+    header.nb_rows = nb_indexed_;
+    header.nb_trees = nb_trees_;
+    header.nb_nodes = nb_nodes_;
+    header.nb_planes = 0;
+    for (size_t n = 0; n < nb_nodes_; ++n) {
+        if (nodes_view_[n].below != kRPLeaf) {
+            header.nb_planes = std::max<uint64_t>(header.nb_planes, nodes_view_[n].begin + 1);
+        }
+    }
+    header.nb_items = 0;
+    for (size_t n = 0; n < nb_nodes_; ++n) {
+        if (nodes_view_[n].below == kRPLeaf) {
+            header.nb_items += nodes_view_[n].count;
+        }
+    }
+    header.id_size = sizeof(ID);
+    vector<size_t> offsets = RPForestSections(header);
+
+    std::ofstream out(path, std::ofstream::binary | std::ofstream::trunc);
+    if (!out) {
+        std::cerr << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    vector<std::pair<const void*, size_t>> sections = {
+        {roots_view_, header.nb_trees * sizeof(uint32_t)},
+        {nodes_view_, header.nb_nodes * sizeof(RPNode)},
+        {planes_view_, header.nb_planes * ndim_ * sizeof(float)},
+        {items_view_, header.nb_items * sizeof(uint32_t)},
+        {map_ ? ids_view_ : ids_.data(), header.nb_rows * sizeof(ID)},
+        {map_ ? points_view_ : point_floats_.data(), header.nb_rows * ndim_ * sizeof(float)}};
+    for (size_t s = 0; s < sections.size(); ++s) {
+        size_t pad = offsets[s] - out.tellp();
+        out.write(string(pad, '\0').data(), pad);
+        if (sections[s].second > 0) {
+            out.write(static_cast<const char*>(sections[s].first), sections[s].second);
+        }
+    }
+    if (!out) {
+        std::cerr << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+template <typename ID>
+bool RPForestSpace<ID>::Load(const std::string& path) {
+    Clear();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(RPForestHeader)) {
+        std::cerr << path << ": not a forest file" << std::endl;
+        close(fd);
+        return false;
+    }
+    void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        std::cerr << "mmap: " << strerror(errno) << std::endl;
+        return false;
+    }
+    map_ = addr;
+    map_bytes_ = st.st_size;
+
+    const char* base = static_cast<const char*>(map_);
+    RPForestHeader header;
+    std::memcpy(&header, base, sizeof(header));
+    vector<size_t> offsets = RPForestSections(header);
+    if (std::memcmp(header.magic, kRPForestMagic, sizeof(header.magic)) != 0 ||
+            header.ndim != ndim_ || header.id_size != sizeof(ID) ||
+            offsets.back() > map_bytes_) {
+        std::cerr << path << ": forest file does not match this space" << std::endl;
+        _Unmap();
+        return false;
+    }
+
+    nb_trees_ = header.nb_trees;
+    nb_nodes_ = header.nb_nodes;
+    nb_indexed_ = header.nb_rows;
+    roots_view_ = reinterpret_cast<const uint32_t*>(base + offsets[0]);
+    nodes_view_ = reinterpret_cast<const RPNode*>(base + offsets[1]);
+    planes_view_ = reinterpret_cast<const float*>(base + offsets[2]);
+    items_view_ = reinterpret_cast<const uint32_t*>(base + offsets[3]);
+    ids_view_ = reinterpret_cast<const ID*>(base + offsets[4]);
+    points_view_ = reinterpret_cast<const float*>(base + offsets[5]);
+    for (size_t row = 0; row < nb_indexed_; ++row) {
+        id2index_[ids_view_[row]] = row;
+    }
+    return true;
+}
+
+template <typename ID>
+void RPForestSpace<ID>::_GetNeighbors(const float* point, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    results.clear();
+
+    // Best-first descent of all trees; a node's priority is the smallest
+    // margin by which the query fell on its side of any plane above it.
+    size_t search_k = (search_k_ == 0) ? nb_trees_ * nb_results : search_k_;
+    vector<uint32_t> candidates;
+    if (nb_nodes_ > 0) {
+        std::priority_queue<std::pair<float, uint32_t>> queue;
+        for (size_t t = 0; t < nb_trees_; ++t) {
+            queue.emplace(std::numeric_limits<float>::max(), roots_view_[t]);
+        }
+        while (!queue.empty() && candidates.size() < search_k) {
+            float priority = queue.top().first;
+            const RPNode& node = nodes_view_[queue.top().second];
+            queue.pop();
+            if (node.below == kRPLeaf) {
+                candidates.insert(candidates.end(), items_view_ + node.begin,
+                                  items_view_ + node.begin + node.count);
+                continue;
+            }
+            float margin = DotProduct(planes_view_ + node.begin * ndim_, point, ndim_);
+            queue.emplace(std::min(priority, margin), node.above);
+            queue.emplace(std::min(priority, -margin), node.below);
+        }
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+    }
+
+    // Rows added since the last Build() are not in the trees.
+    for (size_t row = nb_indexed_; row < _NbRows(); ++row) {
+        candidates.emplace_back(row);
+    }
+
+    for (auto row : candidates) {
+        if (!map_ && TestBit(deleted_, row)) {
+            continue;
+        }
+        SpaceResult<ID> r;
+        r.id = _Id(row);
+        r.dist = 1.0 - DotProduct(_Point(row), point, ndim_);
+        PushTopK(results, r, nb_results);
+    }
+    std::sort_heap(results.begin(), results.end());
+}
+
+template <typename ID>
+void RPForestSpace<ID>::GetNeighbors(const float* point, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    float tmp[ndim_];
+    if (!normalize(tmp, point, ndim_)) {
+        results.clear();
+        return;
+    }
+    _GetNeighbors(tmp, nb_results, results);
+}
+
+template <typename ID>
+void RPForestSpace<ID>::GetNeighbors(const ID& id, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    auto it = id2index_.find(id);
+    if (it != id2index_.end()) {
+        _GetNeighbors(_Point(it->second), nb_results, results);
+    }
+}
+
+template <typename ID>
+bool RPForestSpace<ID>::GetPoint(const ID& id, float* point) const {
+    auto it = id2index_.find(id);
+    if (it == id2index_.end()) {
+        return false;
+    }
+    std::copy_n(_Point(it->second), ndim_, point);
+    return true;
+}
+
+template <typename ID>
+void RPForestSpace<ID>::GetIds(vector<ID>& ids) const {
+    ids.clear();
+    ids.reserve(id2index_.size());
+    for (size_t row = 0; row < _NbRows(); ++row) {
+        if (map_ || !TestBit(deleted_, row)) {
+            ids.emplace_back(_Id(row));
+        }
+    }
+}
+
+template <typename ID>
+void RPForestSpace<ID>::GraphToStream(std::ostream& out, size_t nb_results) const {
+    // Iterate over all rows, skipping deleted ones
+    size_t total = _NbRows();
+    auto progBar = ProgressBar(id2index_.size());
+    #pragma omp parallel for shared(progBar)
+    for (size_t row = 0; row < total; ++row) {
+        if (!map_ && TestBit(deleted_, row)) {
+            continue;
+        }
+        vector<SpaceResult<ID>> results;
+        _GetNeighbors(_Point(row), nb_results, results);
+        #pragma omp critical
+        {
+        progBar.update();
+        WriteResults(out, _Id(row), results);
+        }
+    }
+}
+
+template <typename ID>
+void RPForestSpace<ID>::Info(FILE* log, size_t indent, size_t indent_incr) const {
+    Space<ID>::Info(log, indent, indent_incr);
+    string zero(indent, ' ');
+    fprintf(log, "%strees: %zu\n", zero.c_str(), nb_trees_);
+    fprintf(log, "%snodes: %zu\n", zero.c_str(), nb_nodes_);
+    fprintf(log, "%sunindexed rows: %zu\n", zero.c_str(), _NbRows() - nb_indexed_);
+    fprintf(log, "%smapped: %s\n", zero.c_str(), map_ ? "yes" : "no");
+}
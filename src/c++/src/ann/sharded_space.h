@@ -0,0 +1,301 @@
+#pragma once
+
+// Composite space splitting its items over independent sub-spaces.
+//
+// Every ID lives in exactly one shard, picked by hashing it, so writes to
+// different shards never contend.  Queries run on all shards in parallel
+// and the per-shard results, already sorted, are k-way merged.  Shards can
+// use any algorithm; this is also how engines without intra-query
+// parallelism (such as LSHSpace) get parallel queries.
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+
+#include "common/ann_util.h"
+#include "ann/space.h"
+
+using std::vector;
+using ann::util::ProgressBar;
+
+template <typename ID>
+class ShardedSpace : public Space<ID> {
+  public:
+    // Build nb_shards shards with make_shard.  They must share the same
+    // dimensionality: either configure them in make_shard, or call Init to
+    // reset them all to their defaults.
+    ShardedSpace(size_t nb_shards, const std::function<Space<ID>*()>& make_shard);
+    ~ShardedSpace();
+
+    void Init(size_t nb_dims) override;
+
+    void Clear() override;
+
+    // Build all shards in parallel.
+    bool Build() override;
+
+    unsigned int Delete(const ID& id) override;
+    unsigned int DeleteMany(const vector<ID>& ids) override;
+
+    unsigned int Upsert(const SpaceInput<ID>& input) override;
+    unsigned int UpsertMany(const vector<SpaceInput<ID>>& inputs) override;
+
+    void GetNeighbors(const float* point, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    void GetNeighbors(const ID& id, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    // Each shard applies the filter to its own items.
+    void GetNeighborsFiltered(const float* point, size_t nb_results,
+            const SpaceFilter<ID>& filter, vector<SpaceResult<ID>>& results) const override;
+
+    void GetNeighborsWithin(const float* point, float max_dist,
+            vector<SpaceResult<ID>>& results) const override;
+
+    bool GetPoint(const ID& id, float* point) const override;
+
+    void GetIds(vector<ID>& ids) const override;
+
+    // Get the number of elements stored.
+    size_t Size() const override;
+
+    // Get Dimensionality
+    size_t Dim() const override { return shards_[0]->Dim(); }
+
+    const char* MetricName() const override { return shards_[0]->MetricName(); }
+
+    // Get the shard an ID is routed to.
+    size_t ShardOf(const ID& id) const;
+
+    void Info(FILE* log, size_t indent=2, size_t indent_incr=4) const override;
+
+  private:
+    void _Merge(const vector<vector<SpaceResult<ID>>>& partial, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const;
+
+    vector<std::unique_ptr<Space<ID>>> shards_;
+
+    // Queries hold a shard's lock shared, writes hold it exclusively.
+    mutable vector<std::shared_timed_mutex> locks_;
+};
+
+template <typename ID>
+ShardedSpace<ID>::ShardedSpace(size_t nb_shards,
+                               const std::function<Space<ID>*()>& make_shard)
+    : locks_(std::max<size_t>(nb_shards, 1))
+{
+    for (size_t s = 0; s < locks_.size(); ++s) {
+        shards_.emplace_back(make_shard());
+    }
+}
+
+template <typename ID>
+ShardedSpace<ID>::~ShardedSpace() {}
+
+template <typename ID>
+void ShardedSpace<ID>::Init(size_t nb_dims) {
+    for (size_t s = 0; s < shards_.size(); ++s) {
+        std::unique_lock<std::shared_timed_mutex> lock(locks_[s]);
+        shards_[s]->Init(nb_dims);
+    }
+}
+
+template <typename ID>
+void ShardedSpace<ID>::Clear() {
+    for (size_t s = 0; s < shards_.size(); ++s) {
+        std::unique_lock<std::shared_timed_mutex> lock(locks_[s]);
+        shards_[s]->Clear();
+    }
+}
+
+template <typename ID>
+bool ShardedSpace<ID>::Build() {
+    bool ok = true;
+    #pragma omp parallel for schedule(dynamic, 1) reduction(&&:ok)
+    for (size_t s = 0; s < shards_.size(); ++s) {
+        std::unique_lock<std::shared_timed_mutex> lock(locks_[s]);
+        ok = shards_[s]->Build() && ok;
+    }
+    return ok;
+}
+
+template <typename ID>
+size_t ShardedSpace<ID>::ShardOf(const ID& id) const {
+    // Fibonacci hashing, so that sequential integer IDs (for which
+    // std::hash is the identity) spread evenly.
+    uint64_t h = std::hash<ID>()(id) * 0x9E3779B97F4A7C15ull;
+    return (h >> 32) % shards_.size();
+}
+
+template <typename ID>
+unsigned int ShardedSpace<ID>::Delete(const ID& id) {
+    size_t s = ShardOf(id);
+    std::unique_lock<std::shared_timed_mutex> lock(locks_[s]);
+    return shards_[s]->Delete(id);
+}
+
+template <typename ID>
+unsigned int ShardedSpace<ID>::DeleteMany(const vector<ID>& ids) {
+    vector<vector<ID>> per_shard(shards_.size());
+    for (auto& id : ids) {
+        per_shard[ShardOf(id)].emplace_back(id);
+    }
+    unsigned int count = 0;
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+:count)
+    for (size_t s = 0; s < shards_.size(); ++s) {
+        if (!per_shard[s].empty()) {
+            std::unique_lock<std::shared_timed_mutex> lock(locks_[s]);
+            count += shards_[s]->DeleteMany(per_shard[s]);
+        }
+    }
+    return count;
+}
+
+template <typename ID>
+unsigned int ShardedSpace<ID>::Upsert(const SpaceInput<ID>& input) {
+    size_t s = ShardOf(input.id);
+    std::unique_lock<std::shared_timed_mutex> lock(locks_[s]);
+    return shards_[s]->Upsert(input);
+}
+
+template <typename ID>
+unsigned int ShardedSpace<ID>::UpsertMany(const vector<SpaceInput<ID>>& inputs) {
+    vector<vector<SpaceInput<ID>>> per_shard(shards_.size());
+    for (auto& input : inputs) {
+        per_shard[ShardOf(input.id)].emplace_back(input);
+    }
+    unsigned int count = 0;
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+:count)
+    for (size_t s = 0; s < shards_.size(); ++s) {
+        if (!per_shard[s].empty()) {
+            std::unique_lock<std::shared_timed_mutex> lock(locks_[s]);
+            count += shards_[s]->UpsertMany(per_shard[s]);
+        }
+    }
+    return count;
+}
+
+template <typename ID>
+void ShardedSpace<ID>::GetNeighbors(const float* point, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    vector<vector<SpaceResult<ID>>> partial(shards_.size());
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (size_t s = 0; s < shards_.size(); ++s) {
+        std::shared_lock<std::shared_timed_mutex> lock(locks_[s]);
+        shards_[s]->GetNeighbors(point, nb_results, partial[s]);
+    }
+    _Merge(partial, nb_results, results);
+}
+
+template <typename ID>
+void ShardedSpace<ID>::GetNeighborsFiltered(const float* point, size_t nb_results,
+        const SpaceFilter<ID>& filter, vector<SpaceResult<ID>>& results) const
+{
+    vector<vector<SpaceResult<ID>>> partial(shards_.size());
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (size_t s = 0; s < shards_.size(); ++s) {
+        std::shared_lock<std::shared_timed_mutex> lock(locks_[s]);
+        shards_[s]->GetNeighborsFiltered(point, nb_results, filter, partial[s]);
+    }
+    _Merge(partial, nb_results, results);
+}
+
+template <typename ID>
+void ShardedSpace<ID>::GetNeighborsWithin(const float* point, float max_dist,
+        vector<SpaceResult<ID>>& results) const
+{
+    vector<vector<SpaceResult<ID>>> partial(shards_.size());
+    size_t total = 0;
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+:total)
+    for (size_t s = 0; s < shards_.size(); ++s) {
+        std::shared_lock<std::shared_timed_mutex> lock(locks_[s]);
+        shards_[s]->GetNeighborsWithin(point, max_dist, partial[s]);
+        total += partial[s].size();
+    }
+    _Merge(partial, total, results);
+}
+
+template <typename ID>
+void ShardedSpace<ID>::_Merge(const vector<vector<SpaceResult<ID>>>& partial,
+        size_t nb_results, vector<SpaceResult<ID>>& results) const
+{
+    // k-way merge of the sorted per-shard results, smallest head on top.
+    typedef std::pair<SpaceResult<ID>, size_t> Head;
+    auto later = [] (const Head& a, const Head& b) { return b.first < a.first; };
+    vector<Head> heads;
+    vector<size_t> next(shards_.size(), 1);
+    for (size_t s = 0; s < shards_.size(); ++s) {
+        if (!partial[s].empty()) {
+            heads.emplace_back(partial[s][0], s);
+        }
+    }
+    std::make_heap(heads.begin(), heads.end(), later);
+    results.clear();
+    while (!heads.empty() && results.size() < nb_results) {
+        std::pop_heap(heads.begin(), heads.end(), later);
+        size_t s = heads.back().second;
+        results.emplace_back(heads.back().first);
+        heads.pop_back();
+        if (next[s] < partial[s].size()) {
+            heads.emplace_back(partial[s][next[s]++], s);
+            std::push_heap(heads.begin(), heads.end(), later);
+        }
+    }
+}
+
+template <typename ID>
+void ShardedSpace<ID>::GetNeighbors(const ID& id, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    vector<float> point(Dim());
+    if (GetPoint(id, point.data())) {
+        GetNeighbors(point.data(), nb_results, results);
+    }
+}
+
+template <typename ID>
+bool ShardedSpace<ID>::GetPoint(const ID& id, float* point) const {
+    size_t s = ShardOf(id);
+    std::shared_lock<std::shared_timed_mutex> lock(locks_[s]);
+    return shards_[s]->GetPoint(id, point);
+}
+
+template <typename ID>
+void ShardedSpace<ID>::GetIds(vector<ID>& ids) const {
+    ids.clear();
+    vector<ID> shard_ids;
+    for (size_t s = 0; s < shards_.size(); ++s) {
+        std::shared_lock<std::shared_timed_mutex> lock(locks_[s]);
+        shards_[s]->GetIds(shard_ids);
+        ids.insert(ids.end(), shard_ids.begin(), shard_ids.end());
+    }
+}
+
+template <typename ID>
+size_t ShardedSpace<ID>::Size() const {
+    size_t total = 0;
+    for (size_t s = 0; s < shards_.size(); ++s) {
+        std::shared_lock<std::shared_timed_mutex> lock(locks_[s]);
+        total += shards_[s]->Size();
+    }
+    return total;
+}
+
+template <typename ID>
+void ShardedSpace<ID>::Info(FILE* log, size_t indent, size_t indent_incr) const {
+    Space<ID>::Info(log, indent, indent_incr);
+    string zero(indent, ' ');
+    fprintf(log, "%sshards: %zu\n", zero.c_str(), shards_.size());
+    for (size_t s = 0; s < shards_.size(); ++s) {
+        std::shared_lock<std::shared_timed_mutex> lock(locks_[s]);
+        fprintf(log, "%sshard %zu:\n", zero.c_str(), s);
+        shards_[s]->Info(log, indent + indent_incr, indent_incr);
+    }
+}
@@ -28,28 +28,46 @@ namespace spark {
         return false;
     }
 
+    // Lines are handed to the space in batches so that engines that
+    // override UpsertMany can insert in parallel.
+    const size_t kLoadBatch = 4096;
+
     void LoadFile(std::istream& infile, Space<AnyID>* space)
     {
         std::string line;
         size_t num_parsed = 0;
         size_t num_loaded = 0;
+        std::vector<unsigned int> rids;
+        std::vector<std::vector<float>> vecs;
+        auto flush = [&] () {
+            std::vector<SpaceInput<unsigned int>> inputs;
+            for (size_t i = 0; i < rids.size(); ++i) {
+                SpaceInput<unsigned int> si = {rids[i], vecs[i].data()};
+                inputs.emplace_back(si);
+            }
+            num_loaded += space->UpsertMany(inputs);
+            rids.clear();
+            vecs.clear();
+        };
         for(size_t line_id = 0; std::getline(infile, line); line_id++) {
             unsigned int rid;
             std::vector<float> v;
             bool ok = parse_SparkLine(line, rid, v);
             if (ok) {
                 // we have item id and item embedding at this point
-                // 1) create a SpaceInput struct
-                //
-                SpaceInput<unsigned int> si = {rid, v.data()};
-                num_loaded += space->Upsert(si);
+                rids.emplace_back(rid);
+                vecs.emplace_back(std::move(v));
                 num_parsed++;
+                if (rids.size() == kLoadBatch) {
+                    flush();
+                }
             } else {
                 // report that the match didn't succeed
                 std::cerr << "Failed at line " << line_id << ": " << line << std::endl;
                 break;
             }
         }
+        flush();
         std::cerr << "(" << num_parsed << " lines parsed, "
             << num_parsed - num_loaded << " skipped)" << std::endl;
     }
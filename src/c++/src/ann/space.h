@@ -1,13 +1,18 @@
 #pragma once
 
+#include <algorithm>
 #include <cmath>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <fstream>
 #include <iostream>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include <string>
 
+#include "common/ann_util.h"
 
 using std::string;
 using std::vector;
@@ -41,7 +46,14 @@ bool SpaceResult<ID>::operator==(const SpaceResult<ID>& o) const {
 }
 /* end SpaceResult<ID> */
 
+template <typename ID>
+class SpaceFilter;
+
 /* beghin Space<ID> */
+
+// Engines that allow queries to run alongside mutations guard their state
+// with a std::shared_timed_mutex, held shared by queries and exclusively
+// by mutations.
 template <typename ID>
 class Space {
   public:
@@ -54,6 +66,11 @@ class Space {
     // Remove all elements.
     virtual void Clear() = 0;
 
+    // Finish a bulk load.  Engines that build static structures over the
+    // stored rows do it here; the others index as they go.  Returns false
+    // on errors.
+    virtual bool Build() { return true; }
+
     // Remove an ID.
     virtual unsigned int Delete(const ID& id) = 0;
     virtual unsigned int DeleteMany(const vector<ID>& ids);
@@ -69,7 +86,34 @@ class Space {
     virtual void GetNeighbors(const ID& id, size_t nb_results,
             vector<SpaceResult<ID>>& results) const = 0;
 
-    virtual void GraphToStream(std::ostream& out, size_t nb_results) const = 0;
+    // Get the nearest neighbors of a point among the items the filter
+    // allows.  By default this over-fetches from GetNeighbors, widening the
+    // fetch until enough allowed items come back.
+    virtual void GetNeighborsFiltered(const float* point, size_t nb_results,
+            const SpaceFilter<ID>& filter, vector<SpaceResult<ID>>& results) const;
+
+    // Get all items within max_dist of a point, by increasing distance.  By
+    // default this doubles a GetNeighbors fetch until it reaches past
+    // max_dist.
+    virtual void GetNeighborsWithin(const float* point, float max_dist,
+            vector<SpaceResult<ID>>& results) const;
+
+    // Copy the stored (normalized) point of an ID.  Returns false if the ID
+    // is not stored.
+    virtual bool GetPoint(const ID& id, float* point) const = 0;
+
+    // Whether GetPoint returns the points stored, at full precision and
+    // as the metric prepares them.  Wrappers rebuild and query their
+    // sub-spaces through it, so they require it.
+    virtual bool KeepsPoints() const { return true; }
+
+    // List the IDs stored.
+    virtual void GetIds(vector<ID>& ids) const = 0;
+
+    // Write the nb_results nearest neighbors of every stored item, one
+    // "id,neighbor,distance" line each.  By default this queries
+    // GetNeighbors for every ID from GetIds, in parallel.
+    virtual void GraphToStream(std::ostream& out, size_t nb_results) const;
 
     virtual void GraphToPath(const std::string& path, size_t nb_results) const;
 
@@ -79,6 +123,9 @@ class Space {
     // Get Dimensionality
     virtual size_t Dim() const = 0;
 
+    // Name of the distance metric (see metric.h).
+    virtual const char* MetricName() const { return "cosine"; }
+
     // Dump statistics about internals.
     virtual void Info(FILE* log, size_t indent=2,
                       size_t indent_incr=4) const;
@@ -86,8 +133,8 @@ class Space {
 
 template <typename ID>
 void Space<ID>::Info(FILE* log, size_t indent, size_t indent_incr) const {
-    const char* zero = string(indent, ' ').c_str();
-    fprintf(log, "%sitems: %zu\n", zero, Size());
+    string zero(indent, ' ');
+    fprintf(log, "%sitems: %zu\n", zero.c_str(), Size());
 }
 
 template <typename ID>
@@ -129,10 +176,91 @@ inline void WriteResults(std::ostream& out, const ID& id, const vector<SpaceResu
     }
 }
 
+template <typename ID>
+void Space<ID>::GraphToStream(std::ostream& out, size_t nb_results) const {
+    vector<ID> ids;
+    GetIds(ids);
+    size_t total = ids.size();
+    auto progBar = ann::util::ProgressBar(total);
+    #pragma omp parallel for shared(progBar)
+    for (size_t i = 0; i < total; ++i) {
+        vector<SpaceResult<ID>> results;
+        GetNeighbors(ids[i], nb_results, results);
+        #pragma omp critical
+        {
+        progBar.update();
+        WriteResults(out, ids[i], results);
+        }
+    }
+}
+
+// Offer a result to a bounded max-heap holding the nb_results best seen so
+// far.  Returns true if the result was kept.
+template <typename ID>
+inline bool PushTopK(vector<SpaceResult<ID>>& heap, const SpaceResult<ID>& r,
+                     size_t nb_results) {
+    if (heap.size() < nb_results) {
+        heap.emplace_back(r);
+        std::push_heap(heap.begin(), heap.end());
+        return true;
+    }
+    if (nb_results == 0 || !(r < heap.front())) {
+        return false;
+    }
+    std::pop_heap(heap.begin(), heap.end());
+    heap.back() = r;
+    std::push_heap(heap.begin(), heap.end());
+    return true;
+}
+
+// Dense bitsets over internal slots are stored as vectors of 64-bit words.
+inline size_t BitWords(size_t nb_bits) {
+    return (nb_bits + 63) / 64;
+}
+
+inline bool TestBit(const vector<uint64_t>& bits, size_t i) {
+    return (bits[i >> 6] >> (i & 63)) & 1;
+}
+
+inline void SetBit(vector<uint64_t>& bits, size_t i) {
+    bits[i >> 6] |= uint64_t(1) << (i & 63);
+}
+
+inline void ClearBit(vector<uint64_t>& bits, size_t i) {
+    bits[i >> 6] &= ~(uint64_t(1) << (i & 63));
+}
+
+inline size_t CountBits(const vector<uint64_t>& bits) {
+    size_t count = 0;
+    for (auto word : bits) {
+        count += __builtin_popcountll(word);
+    }
+    return count;
+}
+
+// Pack the sign of each component into a bit code of BitWords(dim) words.
+template <typename Float>
+inline void SignBits(uint64_t* dst, const Float* src, size_t dim) {
+    std::fill(dst, dst + BitWords(dim), 0);
+    for (size_t i = 0; i < dim; ++i) {
+        if (src[i] > 0) {
+            dst[i >> 6] |= uint64_t(1) << (i & 63);
+        }
+    }
+}
+
+inline uint32_t HammingDistance(const uint64_t* a, const uint64_t* b, size_t words) {
+    uint32_t result = 0;
+    for (size_t i = 0; i < words; ++i) {
+        result += __builtin_popcountll(a[i] ^ b[i]);
+    }
+    return result;
+}
+
 template <typename Float>
 inline Float EuclideanDistance(const Float* a, const Float* b, size_t dim) {
     Float result = 0.0;
-    #pragma omp simd reduction(+:result) aligned(a:32)
+    #pragma omp simd reduction(+:result)
     for (size_t i = 0; i < dim; ++i) {
         Float d = a[i] - b[i];
         result += d * d;
@@ -140,6 +268,17 @@ inline Float EuclideanDistance(const Float* a, const Float* b, size_t dim) {
     return (Float)sqrt(result);
 }
 
+// Dot product without alignment requirements, for partial rows.
+template <typename Float>
+inline Float DotProduct(const Float* a, const Float* b, size_t dim) {
+    Float result = 0.0;
+    #pragma omp simd reduction(+:result)
+    for (size_t i = 0; i < dim; ++i) {
+        result += a[i] * b[i];
+    }
+    return result;
+}
+
 template <typename Float>
 inline Float CosineDistance(const Float* a, const Float* b, size_t dim) {
     Float result = 0.0;
@@ -186,7 +325,145 @@ bool normalize(Float* dst, const Float* src, size_t dim) {
     return true;
 }
 
+/* begin SpaceFilter<ID> */
+
+// Restricts a query to some of the items: those of a list of IDs, or
+// those whose bit is set in a dense bitset indexed by ID (integer IDs
+// only), or with exclude, all items but those.  Engines turn it into a
+// bitset over their internal slots, or test it while counting candidates.
+template <typename ID>
+class SpaceFilter {
+  public:
+    // Allow every item.
+    SpaceFilter() {}
+
+    SpaceFilter(vector<ID> ids, bool exclude=false)
+        : mode_(kIds), exclude_(exclude), ids_(std::move(ids))
+    {
+        std::sort(ids_.begin(), ids_.end());
+        ids_.erase(std::unique(ids_.begin(), ids_.end()), ids_.end());
+    }
+
+    static SpaceFilter Bits(vector<uint64_t> bits, bool exclude=false) {
+        SpaceFilter filter;
+        filter.mode_ = kBits;
+        filter.exclude_ = exclude;
+        filter.bits_ = std::move(bits);
+        filter.nb_bits_set_ = CountBits(filter.bits_);
+        return filter;
+    }
+
+    bool Allows(const ID& id) const {
+        switch (mode_) {
+          case kIds:
+            return std::binary_search(ids_.begin(), ids_.end(), id) != exclude_;
+          case kBits:
+            return ((size_t)id < bits_.size() * 64 && TestBit(bits_, id)) != exclude_;
+          default:
+            return true;
+        }
+    }
+
+    // Upper bound on the number of items allowed out of nb_items.
+    size_t NbAllowed(size_t nb_items) const {
+        size_t listed = (mode_ == kIds) ? ids_.size() : nb_bits_set_;
+        if (mode_ == kAll || exclude_) {
+            return nb_items;
+        }
+        return std::min(listed, nb_items);
+    }
+
+    // Call func(slot) for every allowed slot of a space storing ids[slot],
+    // where id2index maps the IDs of live slots to their slot.  Dead slots
+    // may be visited unless the filter lists its IDs.
+    template <typename Func>
+    void ForEachSlot(const vector<ID>& ids, const std::unordered_map<ID, size_t>& id2index,
+                     Func func) const {
+        if (mode_ == kIds && !exclude_) {
+            for (auto& id : ids_) {
+                auto it = id2index.find(id);
+                if (it != id2index.end()) {
+                    func(it->second);
+                }
+            }
+            return;
+        }
+        for (size_t slot = 0; slot < ids.size(); ++slot) {
+            if (Allows(ids[slot])) {
+                func(slot);
+            }
+        }
+    }
+
+    // Dense bitset of the allowed slots, see ForEachSlot.
+    vector<uint64_t> SlotBits(const vector<ID>& ids,
+                              const std::unordered_map<ID, size_t>& id2index) const {
+        vector<uint64_t> bits(BitWords(ids.size()), 0);
+        ForEachSlot(ids, id2index, [&bits] (size_t slot) { SetBit(bits, slot); });
+        return bits;
+    }
+
+  private:
+    enum Mode { kAll, kIds, kBits };
+    Mode mode_ = kAll;
+    bool exclude_ = false;
+    vector<ID> ids_;
+    vector<uint64_t> bits_;
+    size_t nb_bits_set_ = 0;
+};
+
+/* end SpaceFilter<ID> */
+
+template <typename ID>
+void Space<ID>::GetNeighborsFiltered(const float* point, size_t nb_results,
+        const SpaceFilter<ID>& filter, vector<SpaceResult<ID>>& results) const
+{
+    // Start from the fetch that would be enough if allowed items were
+    // spread evenly, then double it until enough pass or all were seen.
+    results.clear();
+    size_t total = Size();
+    size_t allowed = filter.NbAllowed(total);
+    if (nb_results == 0 || allowed == 0) {
+        return;
+    }
+    size_t fetch = std::min(total, nb_results * total / allowed);
+    vector<SpaceResult<ID>> found;
+    while (true) {
+        GetNeighbors(point, fetch, found);
+        results.clear();
+        for (auto& r : found) {
+            if (filter.Allows(r.id)) {
+                results.emplace_back(r);
+                if (results.size() == nb_results) {
+                    return;
+                }
+            }
+        }
+        if (found.size() < fetch || fetch >= total) {
+            return;
+        }
+        fetch = std::min(total, 2 * fetch);
+    }
+}
+
+template <typename ID>
+void Space<ID>::GetNeighborsWithin(const float* point, float max_dist,
+        vector<SpaceResult<ID>>& results) const
+{
+    size_t total = Size();
+    size_t fetch = std::min<size_t>(total, 16);
+    while (true) {
+        GetNeighbors(point, fetch, results);
+        if (results.size() < fetch || fetch >= total || results.back().dist > max_dist) {
+            break;
+        }
+        fetch = std::min(total, 2 * fetch);
+    }
+    auto past = std::find_if(results.begin(), results.end(),
+                             [max_dist] (const SpaceResult<ID>& r) { return r.dist > max_dist; });
+    results.erase(past, results.end());
+}
+
 // ----------------------------
 
 typedef uint32_t AnyID;
-void MakeSpace(const string& space_algo, Space<AnyID>** space, size_t nb_dims);
@@ -0,0 +1,509 @@
+#pragma once
+
+// Registry of engines, built from compact spec strings:
+//
+//     name[:key=value[,key=value...]][+inner spec]
+//
+// for example "lsh:L=8,k=16", "ivf:nlist=4096,pq=16x8" or
+// "sharded:shards=8+hnsw:M=32".  Wrappers (sharded, tiered, mips, multi)
+// build their sub-spaces from the inner spec; each sub-space gets its own
+// files, with ".<n>" appended to any path it reads (so "sharded:shards=2+
+// mmap:path=v.bin" writes v.bin.0 and v.bin.1).  Values may contain '/'
+// (for paths) but not ',' or '+'.  Each engine's maker reads and validates
+// its own parameters; keys it never reads are reported as errors, along
+// with the keys it accepts.  Engines registered with RegisterSpace become
+// available to the CLI and the Python bindings without changing either.
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ann/disk_graph_space.h"
+#include "ann/gauss_lsh.h"
+#include "ann/hamming_space.h"
+#include "ann/hnsw_space.h"
+#include "ann/ivf_pq_space.h"
+#include "ann/ivf_space.h"
+#include "ann/kd_tree_space.h"
+#include "ann/linear_space.h"
+#include "ann/metric.h"
+#include "ann/minhash_space.h"
+#include "ann/mips_space.h"
+#include "ann/mmap_space.h"
+#include "ann/multi_vector_space.h"
+#include "ann/pivot_space.h"
+#include "ann/rp_forest_space.h"
+#include "ann/sharded_space.h"
+#include "ann/space.h"
+#include "ann/sparse_space.h"
+#include "ann/tiered_space.h"
+
+using std::string;
+using std::vector;
+
+// Parameters of one engine in a spec string.  Values are checked as they
+// are read; Ok() reports everything that went wrong.
+class SpaceSpec {
+  public:
+    // Split "name:key=value,...+inner".  Returns false on syntax errors.
+    bool Parse(const string& spec) {
+        spec_ = spec;
+        size_t plus = spec.find('+');
+        string head = spec.substr(0, plus);
+        inner_ = (plus == string::npos) ? "" : spec.substr(plus + 1);
+        size_t colon = head.find(':');
+        name_ = head.substr(0, colon);
+        if (name_.empty()) {
+            std::cerr << spec_ << ": missing space name" << std::endl;
+            return false;
+        }
+        if (colon == string::npos) {
+            return true;
+        }
+        string rest = head.substr(colon + 1);
+        size_t begin = 0;
+        while (begin <= rest.size()) {
+            size_t end = rest.find(',', begin);
+            if (end == string::npos) {
+                end = rest.size();
+            }
+            string item = rest.substr(begin, end - begin);
+            size_t eq = item.find('=');
+            if (eq == string::npos || eq == 0 || eq + 1 == item.size()) {
+                std::cerr << spec_ << ": expected key=value, got \"" << item << "\"" << std::endl;
+                return false;
+            }
+            if (!params_.emplace(item.substr(0, eq), item.substr(eq + 1)).second) {
+                std::cerr << spec_ << ": " << item.substr(0, eq) << " given twice" << std::endl;
+                return false;
+            }
+            begin = end + 1;
+        }
+        return true;
+    }
+
+    const string& Name() const { return name_; }
+
+    // Spec of the sub-spaces of a wrapper (empty if none).
+    const string& Inner() const { return inner_; }
+
+    size_t Uint(const string& key, size_t dflt, size_t min=0, size_t max=SIZE_MAX) {
+        string value;
+        if (!_Get(key, value)) {
+            return dflt;
+        }
+        char* end;
+        errno = 0;
+        unsigned long long result = std::strtoull(value.c_str(), &end, 10);
+        if (*end || errno || value[0] == '-') {
+            Error(key + " must be a non-negative integer, got \"" + value + "\"");
+            return dflt;
+        }
+        if (result < min || result > max) {
+            Error(key + " must be " + ((max == SIZE_MAX) ? "at least " + std::to_string(min) :
+                  "between " + std::to_string(min) + " and " + std::to_string(max)));
+            return dflt;
+        }
+        return result;
+    }
+
+    float Float(const string& key, float dflt, float min, float max) {
+        string value;
+        if (!_Get(key, value)) {
+            return dflt;
+        }
+        char* end;
+        errno = 0;
+        float result = std::strtof(value.c_str(), &end);
+        if (*end || errno) {
+            Error(key + " must be a number, got \"" + value + "\"");
+            return dflt;
+        }
+        if (!(result >= min && result <= max)) {
+            Error(key + " must be between " + std::to_string(min) + " and " + std::to_string(max));
+            return dflt;
+        }
+        return result;
+    }
+
+    string Str(const string& key, const string& dflt) {
+        string value;
+        return _Get(key, value) ? value : dflt;
+    }
+
+    // A file path, made distinct for each sub-space of a wrapper.  An
+    // empty path (no file) stays empty.
+    string Path(const string& key, const string& dflt) {
+        string path = Str(key, dflt);
+        return path.empty() ? path : path + path_suffix_;
+    }
+
+    // Appended to the paths of this space; set by the wrapper building it.
+    const string& PathSuffix() const { return path_suffix_; }
+    void SetPathSuffix(const string& suffix) { path_suffix_ = suffix; }
+
+    // A pair written "AxB", such as pq=16x8.  Returns false if the key is
+    // absent or malformed.
+    bool UintPair(const string& key, size_t& first, size_t& second) {
+        string value;
+        if (!_Get(key, value)) {
+            return false;
+        }
+        size_t x = value.find('x');
+        char* end1;
+        char* end2;
+        string a = value.substr(0, x);
+        string b = (x == string::npos) ? "" : value.substr(x + 1);
+        first = std::strtoull(a.c_str(), &end1, 10);
+        second = std::strtoull(b.c_str(), &end2, 10);
+        if (a.empty() || b.empty() || *end1 || *end2 || a[0] == '-' || b[0] == '-') {
+            Error(key + " must look like AxB, got \"" + value + "\"");
+            return false;
+        }
+        return true;
+    }
+
+    void Error(const string& message) {
+        errors_.emplace_back(message);
+    }
+
+    // Report invalid values and keys the engine did not read.  Returns
+    // false if there were any.
+    bool Ok() const {
+        for (auto& error : errors_) {
+            std::cerr << spec_ << ": " << error << std::endl;
+        }
+        bool ok = errors_.empty();
+        for (auto& param : params_) {
+            if (!read_.count(param.first)) {
+                std::cerr << spec_ << ": unknown parameter " << param.first
+                          << " for " << name_ << " (expected one of:";
+                for (auto& key : read_) {
+                    std::cerr << " " << key;
+                }
+                std::cerr << ")" << std::endl;
+                ok = false;
+            }
+        }
+        return ok;
+    }
+
+  private:
+    bool _Get(const string& key, string& value) {
+        read_.insert(key);
+        auto it = params_.find(key);
+        if (it == params_.end()) {
+            return false;
+        }
+        value = it->second;
+        return true;
+    }
+
+    string spec_;
+    string name_;
+    string inner_;
+    string path_suffix_;
+    std::map<string, string> params_;
+    std::set<string> read_;
+    vector<string> errors_;
+};
+
+// Build a configured space from its parameters, or return nullptr.
+template <typename ID>
+using SpaceMaker = std::function<Space<ID>*(SpaceSpec& spec, size_t nb_dims)>;
+
+template <typename ID>
+std::map<string, SpaceMaker<ID>> BuiltinSpaces();
+
+template <typename ID>
+std::map<string, SpaceMaker<ID>>& SpaceRegistry() {
+    static std::map<string, SpaceMaker<ID>> registry = BuiltinSpaces<ID>();
+    return registry;
+}
+
+// Add (or replace) an engine.
+template <typename ID>
+void RegisterSpace(const string& name, const SpaceMaker<ID>& maker) {
+    SpaceRegistry<ID>()[name] = maker;
+}
+
+// Build the space described by spec for nb_dims inputs.  On errors,
+// reports them, sets *space to nullptr and returns false.  path_suffix
+// is appended to the paths the space reads (see SpaceSpec::Path).
+template <typename ID>
+bool MakeSpace(const string& spec, Space<ID>** space, size_t nb_dims,
+               const string& path_suffix="") {
+    *space = nullptr;
+    SpaceSpec parsed;
+    if (!parsed.Parse(spec)) {
+        return false;
+    }
+    parsed.SetPathSuffix(path_suffix);
+    auto& registry = SpaceRegistry<ID>();
+    auto it = registry.find(parsed.Name());
+    if (it == registry.end()) {
+        std::cerr << spec << ": unknown space " << parsed.Name() << " (expected one of:";
+        for (auto& entry : registry) {
+            std::cerr << " " << entry.first;
+        }
+        std::cerr << ")" << std::endl;
+        return false;
+    }
+    std::unique_ptr<Space<ID>> made(it->second(parsed, nb_dims));
+    if (!parsed.Ok() || !made) {
+        return false;
+    }
+    *space = made.release();
+    return true;
+}
+
+// Make the sub-spaces of a wrapper from its inner spec.  The first one is
+// built right away so that errors surface before the wrapper exists,
+// including an inner space that cannot return its points.
+// The n-th sub-space made gets path suffix ".<n % nb_paths>", so
+// nb_paths must exceed the number of sub-spaces alive at once: the shard
+// count for sharded, 2 for wrappers that build a replacement before
+// dropping the sub-space it replaces.
+template <typename ID>
+std::function<Space<ID>*()> InnerSpaceMaker(SpaceSpec& spec, size_t nb_dims, size_t nb_paths) {
+    if (spec.Inner().empty()) {
+        spec.Error(spec.Name() + " needs an inner spec, as in " + spec.Name() + "+lsh");
+        return nullptr;
+    }
+    string inner = spec.Inner();
+    string suffix = spec.PathSuffix() + ".";
+    Space<ID>* first;
+    if (!MakeSpace(inner, &first, nb_dims, suffix + "0")) {
+        return nullptr;
+    }
+    if (!first->KeepsPoints()) {
+        spec.Error(spec.Name() + " needs an inner space that keeps its points, which "
+                   + inner.substr(0, inner.find_first_of(":+")) + " does not");
+        delete first;
+        return nullptr;
+    }
+    auto pending = std::make_shared<std::unique_ptr<Space<ID>>>(first);
+    auto nb_made = std::make_shared<size_t>(1);
+    return [pending, nb_made, inner, suffix, nb_dims, nb_paths] () {
+        if (*pending) {
+            return pending->release();
+        }
+        Space<ID>* space;
+        MakeSpace(inner, &space, nb_dims, suffix + std::to_string((*nb_made)++ % nb_paths));
+        return space;
+    };
+}
+
+// Whether metric names a policy of metric.h (cosine, ip or l2).
+inline bool IsMetricName(const string& metric) {
+    return metric == CosineMetric::Name() || metric == InnerProductMetric::Name() ||
+           metric == EuclideanMetric::Name();
+}
+
+// Call make with the metric policy named metric, for engines templated on
+// it.  Returns a null result for names that are not cosine, ip or l2.
+template <typename Make>
+auto DispatchMetric(const string& metric, Make make) -> decltype(make(CosineMetric())) {
+    if (metric == CosineMetric::Name()) {
+        return make(CosineMetric());
+    }
+    if (metric == InnerProductMetric::Name()) {
+        return make(InnerProductMetric());
+    }
+    if (metric == EuclideanMetric::Name()) {
+        return make(EuclideanMetric());
+    }
+    return nullptr;
+}
+
+// Same, with the metric named by the "metric" key.
+template <typename Make>
+auto WithMetric(SpaceSpec& spec, Make make) -> decltype(make(CosineMetric())) {
+    string metric = spec.Str("metric", CosineMetric::Name());
+    if (!IsMetricName(metric)) {
+        spec.Error("metric must be cosine, ip or l2, got \"" + metric + "\"");
+        return nullptr;
+    }
+    return DispatchMetric(metric, make);
+}
+
+// IVF-Flat, or IVF-PQ if pq=MxB is given (or with_pq, which defaults it
+// to 16x8).
+template <typename ID>
+Space<ID>* MakeIVF(SpaceSpec& spec, size_t nb_dims, bool with_pq) {
+    uint64_t seed = spec.Uint("seed", 0);
+    size_t nlist = spec.Uint("nlist", 1024, 1);
+    size_t nprobe = spec.Uint("nprobe", 8, 1, nlist);
+    size_t train_size = spec.Uint("train_size", 0);
+    size_t m = 16;
+    size_t nbits = 8;
+    if (!spec.UintPair("pq", m, nbits) && !with_pq) {
+        auto space = new IVFSpace<ID>(seed);
+        space->Config(nb_dims, nlist, nprobe, train_size);
+        return space;
+    }
+    if (m < 1 || m > nb_dims) {
+        spec.Error("pq sub-codes must be between 1 and " + std::to_string(nb_dims));
+    }
+    if (nbits != 4 && nbits != 8) {
+        spec.Error("pq bits must be 4 or 8");
+    }
+    size_t rerank = spec.Uint("rerank", 0);
+    auto space = new IVFPQSpace<ID>(seed);
+    space->Config(nb_dims, nlist, nprobe, m, rerank, train_size, nbits);
+    return space;
+}
+
+template <typename ID>
+std::map<string, SpaceMaker<ID>> BuiltinSpaces() {
+    std::map<string, SpaceMaker<ID>> makers;
+
+    makers["lsh"] = [] (SpaceSpec& spec, size_t nb_dims) -> Space<ID>* {
+        auto space = new LSHSpace<ID>(spec.Uint("seed", 0));
+        space->Config(nb_dims, spec.Uint("L", 15, 1), spec.Uint("k", 32, 1),
+                      spec.Float("w", 0.5, 1e-6, 1e6), spec.Uint("search_k", 0));
+        return space;
+    };
+    makers["linear"] = [] (SpaceSpec& spec, size_t nb_dims) -> Space<ID>* {
+        return WithMetric(spec, [&] (auto metric) -> Space<ID>* {
+            auto space = new LinearSpace<ID, decltype(metric)>();
+            space->Config(nb_dims, spec.Uint("tombstones", 0, 0, 1),
+                          spec.Float("max_dead_ratio", 0.25, 0.0, 1.0),
+                          spec.Uint("shortlist", 0), spec.Uint("abandon_block", 0, 0, nb_dims),
+                          spec.Uint("descent_iters", 0));
+            return space;
+        });
+    };
+    makers["mmap"] = [] (SpaceSpec& spec, size_t nb_dims) -> Space<ID>* {
+        std::unique_ptr<MmapLinearSpace<ID>> space(new MmapLinearSpace<ID>());
+        string path = spec.Path("path", "vectors.bin");
+        size_t chunk_rows = spec.Uint("chunk_rows", 65536, 1);
+        float max_dead_ratio = spec.Float("max_dead_ratio", 0.25, 0.0, 1.0);
+        if (!space->Config(nb_dims, path, chunk_rows, max_dead_ratio)) {
+            return nullptr;
+        }
+        return space.release();
+    };
+    makers["pivot"] = [] (SpaceSpec& spec, size_t nb_dims) -> Space<ID>* {
+        auto space = new PivotSpace<ID>(spec.Uint("seed", 0));
+        space->Config(nb_dims, spec.Uint("pivots", 32, 1));
+        return space;
+    };
+    makers["hnsw"] = [] (SpaceSpec& spec, size_t nb_dims) -> Space<ID>* {
+        return WithMetric(spec, [&] (auto metric) -> Space<ID>* {
+            auto space = new HNSWSpace<ID, decltype(metric)>(spec.Uint("seed", 0));
+            space->Config(nb_dims, spec.Uint("M", 16, 2), spec.Uint("ef_construction", 200, 1),
+                          spec.Uint("ef_search", 50, 1));
+            return space;
+        });
+    };
+    makers["ivf"] = [] (SpaceSpec& spec, size_t nb_dims) -> Space<ID>* {
+        return MakeIVF<ID>(spec, nb_dims, false);
+    };
+    makers["ivfpq"] = [] (SpaceSpec& spec, size_t nb_dims) -> Space<ID>* {
+        return MakeIVF<ID>(spec, nb_dims, true);
+    };
+    makers["rpforest"] = [] (SpaceSpec& spec, size_t nb_dims) -> Space<ID>* {
+        auto space = new RPForestSpace<ID>(spec.Uint("seed", 0));
+        space->Config(nb_dims, spec.Uint("trees", 10, 1), spec.Uint("leaf_size", 32, 1),
+                      spec.Uint("search_k", 0), spec.Path("path", ""));
+        return space;
+    };
+    makers["disk"] = [] (SpaceSpec& spec, size_t nb_dims) -> Space<ID>* {
+        auto space = new DiskGraphSpace<ID>(spec.Uint("seed", 0));
+        space->Config(nb_dims, spec.Uint("R", 64, 1), spec.Uint("L_build", 100, 1),
+                      spec.Float("alpha", 1.2, 1.0, 10.0), spec.Uint("pq_m", 32, 1, nb_dims),
+                      spec.Uint("L_search", 100, 1), spec.Uint("beam_width", 4, 1),
+                      spec.Uint("io_threads", 8), spec.Path("path", "graph.bin"));
+        return space;
+    };
+    makers["kdtree"] = [] (SpaceSpec& spec, size_t nb_dims) -> Space<ID>* {
+        return WithMetric(spec, [&] (auto metric) -> Space<ID>* {
+            auto space = new KDTreeSpace<ID, decltype(metric)>();
+            space->Config(nb_dims, spec.Uint("leaf_size", 16, 1));
+            return space;
+        });
+    };
+    makers["hamming"] = [] (SpaceSpec& spec, size_t nb_dims) -> Space<ID>* {
+        auto space = new HammingSpace<ID>();
+        space->Config(nb_dims, spec.Uint("tables", 0, 0, nb_dims));
+        return space;
+    };
+    makers["minhash"] = [] (SpaceSpec& spec, size_t nb_dims) -> Space<ID>* {
+        auto space = new MinHashSpace<ID>(spec.Uint("seed", 0));
+        size_t nb_hashes = spec.Uint("hashes", 128, 1);
+        space->Config(nb_dims, nb_hashes, spec.Uint("L", 32, 1, nb_hashes),
+                      spec.Uint("b", 8, 1, 32), spec.Uint("search_k", 0));
+        return space;
+    };
+    makers["sparse"] = [] (SpaceSpec& spec, size_t nb_dims) -> Space<ID>* {
+        auto space = new SparseSpace<ID>();
+        space->Config(nb_dims, spec.Uint("block", 64, 1));
+        return space;
+    };
+    makers["sharded"] = [] (SpaceSpec& spec, size_t nb_dims) -> Space<ID>* {
+        size_t nb_shards = spec.Uint("shards", 4, 1, 4096);
+        auto make_shard = InnerSpaceMaker<ID>(spec, nb_dims, nb_shards);
+        if (!make_shard) {
+            return nullptr;
+        }
+        return new ShardedSpace<ID>(nb_shards, make_shard);
+    };
+    makers["tiered"] = [] (SpaceSpec& spec, size_t nb_dims) -> Space<ID>* {
+        size_t max_delta = spec.Uint("max_delta", 4096, 1);
+        auto make_main = InnerSpaceMaker<ID>(spec, nb_dims, 2);
+        if (!make_main) {
+            return nullptr;
+        }
+        // The delta uses the metric of the main index.
+        auto first = std::make_shared<std::unique_ptr<Space<ID>>>(make_main());
+        string main_metric = (*first)->MetricName();
+        if (!IsMetricName(main_metric)) {
+            spec.Error("tiered needs a cosine, ip or l2 main index, not " + main_metric);
+            return nullptr;
+        }
+        auto make = [first, make_main] (size_t) {
+            return *first ? first->release() : make_main();
+        };
+        return DispatchMetric(main_metric, [&] (auto metric) -> Space<ID>* {
+            auto space = new TieredSpace<ID, decltype(metric)>(make);
+            space->Config(nb_dims, max_delta);
+            return space;
+        });
+    };
+    makers["mips"] = [] (SpaceSpec& spec, size_t nb_dims) -> Space<ID>* {
+        float max_norm = spec.Float("max_norm", 0.0, 0.0, 1e30);
+        float headroom = spec.Float("headroom", 1.1, 1.0, 100.0);
+        auto make_inner = InnerSpaceMaker<ID>(spec, nb_dims + 1, 2);
+        if (!make_inner) {
+            return nullptr;
+        }
+        auto space = new MIPSSpace<ID>([make_inner] (size_t) { return make_inner(); });
+        space->Config(nb_dims, max_norm, headroom);
+        return space;
+    };
+    makers["multi"] = [] (SpaceSpec& spec, size_t nb_dims) -> Space<ID>* {
+        string agg = spec.Str("agg", "max");
+        if (agg != "max" && agg != "sum") {
+            spec.Error("agg must be max or sum, got \"" + agg + "\"");
+        }
+        size_t candidates = spec.Uint("candidates", 0);
+        auto make_inner = InnerSpaceMaker<ID>(spec, nb_dims, 2);
+        if (!make_inner) {
+            return nullptr;
+        }
+        auto space = new MultiVectorSpace<ID>([make_inner] (size_t) { return make_inner(); });
+        space->Config(nb_dims, (agg == "sum") ? MultiVectorSpace<ID>::kSum
+                                              : MultiVectorSpace<ID>::kMax, candidates);
+        return space;
+    };
+    return makers;
+}
@@ -0,0 +1,626 @@
+#pragma once
+
+// Cosine search over sparse vectors, such as TF-IDF.
+//
+// Items are stored as their normalized non-zero (dimension, value) pairs,
+// and every dimension keeps a posting list of the items using it.  Lists
+// are sorted by slot: slots only grow, and the ones freed by Delete are
+// reclaimed by renumbering once they make up half of them.  Posting slots
+// and values are kept in separate arrays, and every block_size postings
+// the list records the largest and smallest value of the block.
+//
+// Queries are evaluated term at a time over windows of 4096 slots, with
+// the MaxScore split of query dimensions (Turtle & Flood, "Query
+// evaluation: strategies and optimizations", 1995).  Dimensions are
+// sorted by the most they can add to a score; the ones whose bounds
+// together cannot lift an item into the current top k are non-essential.
+// In each window, the postings of the essential lists are added into a
+// dense accumulator, and the items reached are completed in slot order by
+// probing the non-essential lists, largest bound first, while their block
+// bounds leave the item a chance (Ding & Suel, "Faster top-k document
+// retrieval using block-max indexes", 2011).  Windows whose overlapping
+// blocks cannot beat the current top k are skipped.  Only items sharing
+// a non-zero dimension with the query are ranked.
+//
+// The dense interface of Space<ID> works as well: points are converted
+// from and to their non-zero entries.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "common/ann_util.h"
+#include "ann/space.h"
+
+using std::vector;
+using std::unordered_map;
+using ann::util::ProgressBar;
+
+// A sparse point: nnz (index, value) pairs, in any order.
+template <typename ID>
+struct SparseInput {
+    ID id;
+    const uint32_t* indices;
+    const float* values;
+    size_t nnz;
+};
+
+template <typename ID>
+class SparseSpace : public Space<ID> {
+  public:
+    SparseSpace() {};
+    ~SparseSpace() {}
+
+    void Init(size_t nb_dims) override;
+
+    // block_size: postings per block of the block-max bounds
+    void Config(size_t nb_dims, size_t block_size=64);
+
+    void Clear() override;
+
+    unsigned int Delete(const ID& id) override;
+
+    // Store the non-zero entries of a dense point.
+    unsigned int Upsert(const SpaceInput<ID>& input) override;
+
+    // Repeated indices are summed.  Returns 0 if an index is out of range
+    // or the point is zero or not finite.
+    unsigned int UpsertSparse(const SparseInput<ID>& input);
+
+    void GetNeighbors(const float* point, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    void GetNeighbors(const ID& id, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    void GetNeighborsSparse(const uint32_t* indices, const float* values, size_t nnz,
+            size_t nb_results, vector<SpaceResult<ID>>& results) const;
+
+    bool GetPoint(const ID& id, float* point) const override;
+
+    // Copy the stored (normalized) non-zero entries of an ID, by increasing
+    // index.  Returns false if the ID is not stored.
+    bool GetSparse(const ID& id, vector<uint32_t>& indices, vector<float>& values) const;
+
+    void GetIds(vector<ID>& ids) const override;
+
+    // Get the number of elements stored.
+    size_t Size() const override;
+
+    // Get Dimensionality
+    size_t Dim() const override { return ndim_; }
+
+    void Info(FILE* log, size_t indent=2, size_t indent_incr=4) const override;
+
+  private:
+    typedef vector<std::pair<uint32_t, float>> Entries;
+
+    struct Postings {
+        vector<uint32_t> slots;
+        vector<float> values;
+        // per block: last slot, largest and smallest value
+        vector<uint32_t> block_last;
+        vector<float> block_max;
+        vector<float> block_min;
+        // over the whole list
+        float max_value = 0.0;
+        float min_value = 0.0;
+    };
+
+    bool _Prepare(const uint32_t* indices, const float* values, size_t nnz,
+                  Entries& entries) const;
+    void _Search(const Entries& query, size_t nb_results,
+                 vector<SpaceResult<ID>>& results) const;
+    unsigned int _Delete(const ID& id);
+    void _Compact();
+    // Recompute the blocks of a list from block first on.
+    void _UpdateBlocks(Postings& list, size_t first);
+
+    size_t ndim_ = 0;
+    size_t block_size_ = 64;
+
+    // per dimension
+    vector<Postings> postings_;
+
+    // per slot; rows_ is empty for freed slots
+    vector<ID> ids_;
+    vector<Entries> rows_;
+    unordered_map<ID, uint32_t> id2slot_;
+    size_t nb_free_ = 0;
+
+    mutable std::shared_timed_mutex mutex_;
+};
+
+template <typename ID>
+void SparseSpace<ID>::Init(size_t nb_dims) {
+    Config(nb_dims);
+}
+
+template <typename ID>
+void SparseSpace<ID>::Config(size_t nb_dims, size_t block_size) {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    ndim_ = nb_dims;
+    block_size_ = std::max<size_t>(block_size, 1);
+    postings_.clear();
+    postings_.resize(ndim_);
+    ids_.clear();
+    rows_.clear();
+    id2slot_.clear();
+    nb_free_ = 0;
+}
+
+template <typename ID>
+void SparseSpace<ID>::Clear() {
+    Config(ndim_, block_size_);
+}
+
+template <typename ID>
+size_t SparseSpace<ID>::Size() const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    return id2slot_.size();
+}
+
+template <typename ID>
+bool SparseSpace<ID>::_Prepare(const uint32_t* indices, const float* values, size_t nnz,
+                               Entries& entries) const {
+    entries.clear();
+    entries.reserve(nnz);
+    for (size_t i = 0; i < nnz; ++i) {
+        if (indices[i] >= ndim_ || !std::isfinite(values[i])) {
+            return false;
+        }
+        entries.emplace_back(indices[i], values[i]);
+    }
+    std::sort(entries.begin(), entries.end());
+
+    // Sum repeated indices and drop zeros.
+    size_t kept = 0;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (kept > 0 && entries[kept - 1].first == entries[i].first) {
+            entries[kept - 1].second += entries[i].second;
+        } else {
+            entries[kept++] = entries[i];
+        }
+    }
+    entries.resize(kept);
+    entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                 [] (const std::pair<uint32_t, float>& e) { return e.second == 0.0; }),
+                  entries.end());
+
+    float sq = 0.0;
+    for (auto& e : entries) {
+        sq += e.second * e.second;
+    }
+    float length = std::sqrt(sq);
+    if (!std::isfinite(length) || length == 0.0) {
+        return false;
+    }
+    for (auto& e : entries) {
+        e.second /= length;
+    }
+    return true;
+}
+
+template <typename ID>
+void SparseSpace<ID>::_UpdateBlocks(Postings& list, size_t first) {
+    size_t nb_blocks = (list.slots.size() + block_size_ - 1) / block_size_;
+    list.block_last.resize(nb_blocks);
+    list.block_max.resize(nb_blocks);
+    list.block_min.resize(nb_blocks);
+    for (size_t b = first; b < nb_blocks; ++b) {
+        size_t begin = b * block_size_;
+        size_t end = std::min(list.slots.size(), begin + block_size_);
+        auto range = std::minmax_element(list.values.begin() + begin, list.values.begin() + end);
+        list.block_last[b] = list.slots[end - 1];
+        list.block_min[b] = *range.first;
+        list.block_max[b] = *range.second;
+    }
+    list.max_value = 0.0;
+    list.min_value = 0.0;
+    if (nb_blocks > 0) {
+        list.max_value = *std::max_element(list.block_max.begin(), list.block_max.end());
+        list.min_value = *std::min_element(list.block_min.begin(), list.block_min.end());
+    }
+}
+
+template <typename ID>
+unsigned int SparseSpace<ID>::Delete(const ID& id) {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    unsigned int count = _Delete(id);
+    if (2 * nb_free_ > ids_.size()) {
+        _Compact();
+    }
+    return count;
+}
+
+template <typename ID>
+unsigned int SparseSpace<ID>::_Delete(const ID& id) {
+    auto it = id2slot_.find(id);
+    if (it == id2slot_.end()) {
+        return 0;
+    }
+    uint32_t slot = it->second;
+    // Erasing costs the length of each list the item is in.
+    for (auto& e : rows_[slot]) {
+        auto& list = postings_[e.first];
+        size_t pos = std::lower_bound(list.slots.begin(), list.slots.end(), slot) - list.slots.begin();
+        list.slots.erase(list.slots.begin() + pos);
+        list.values.erase(list.values.begin() + pos);
+        _UpdateBlocks(list, pos / block_size_);
+    }
+    Entries().swap(rows_[slot]);
+    id2slot_.erase(it);
+    ++nb_free_;
+    return 1;
+}
+
+template <typename ID>
+void SparseSpace<ID>::_Compact() {
+    // Renumbering keeps slots in order, so lists stay sorted.
+    vector<uint32_t> renumber(ids_.size());
+    uint32_t next = 0;
+    for (size_t slot = 0; slot < ids_.size(); ++slot) {
+        if (!rows_[slot].empty()) {
+            renumber[slot] = next;
+            ids_[next] = ids_[slot];
+            rows_[next].swap(rows_[slot]);
+            id2slot_[ids_[next]] = next;
+            ++next;
+        }
+    }
+    ids_.resize(next);
+    rows_.resize(next);
+    nb_free_ = 0;
+    for (auto& list : postings_) {
+        for (auto& slot : list.slots) {
+            slot = renumber[slot];
+        }
+        for (size_t b = 0; b < list.block_last.size(); ++b) {
+            list.block_last[b] = renumber[list.block_last[b]];
+        }
+    }
+}
+
+template <typename ID>
+unsigned int SparseSpace<ID>::UpsertSparse(const SparseInput<ID>& input) {
+    Entries entries;
+    if (!_Prepare(input.indices, input.values, input.nnz, entries)) {
+        return 0;
+    }
+
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    _Delete(input.id);
+    uint32_t slot = ids_.size();
+    for (auto& e : entries) {
+        auto& list = postings_[e.first];
+        list.slots.emplace_back(slot);
+        list.values.emplace_back(e.second);
+        if (list.slots.size() % block_size_ == 1 || block_size_ == 1) {
+            list.block_last.emplace_back(slot);
+            list.block_max.emplace_back(e.second);
+            list.block_min.emplace_back(e.second);
+        } else {
+            list.block_last.back() = slot;
+            list.block_max.back() = std::max(list.block_max.back(), e.second);
+            list.block_min.back() = std::min(list.block_min.back(), e.second);
+        }
+        list.max_value = std::max(list.max_value, e.second);
+        list.min_value = std::min(list.min_value, e.second);
+    }
+    ids_.emplace_back(input.id);
+    rows_.emplace_back(std::move(entries));
+    id2slot_[input.id] = slot;
+    if (2 * nb_free_ > ids_.size()) {
+        _Compact();
+    }
+    return 1;
+}
+
+template <typename ID>
+unsigned int SparseSpace<ID>::Upsert(const SpaceInput<ID>& input) {
+    vector<uint32_t> indices;
+    vector<float> values;
+    for (size_t i = 0; i < ndim_; ++i) {
+        if (input.point[i] != 0.0) {
+            indices.emplace_back(i);
+            values.emplace_back(input.point[i]);
+        }
+    }
+    SparseInput<ID> sparse = {input.id, indices.data(), values.data(), indices.size()};
+    return UpsertSparse(sparse);
+}
+
+namespace {
+
+// Most a posting of value in [min_value, max_value] adds to a score, with
+// 0 for items not in the list.
+inline float SparseBound(float weight, float min_value, float max_value) {
+    return std::max(0.0f, std::max(weight * min_value, weight * max_value));
+}
+
+}  // namespace
+
+template <typename ID>
+void SparseSpace<ID>::_Search(const Entries& query, size_t nb_results,
+                              vector<SpaceResult<ID>>& results) const {
+    results.clear();
+    if (nb_results == 0) {
+        return;
+    }
+
+    struct Term {
+        const Postings* list;
+        float weight;
+        float bound;
+        size_t pos;    // next posting
+        size_t block;  // block of the last probe
+    };
+    vector<Term> terms;
+    for (auto& e : query) {
+        auto& list = postings_[e.first];
+        if (!list.slots.empty()) {
+            terms.push_back({&list, e.second, SparseBound(e.second, list.min_value, list.max_value), 0, 0});
+        }
+    }
+    std::sort(terms.begin(), terms.end(),
+              [] (const Term& a, const Term& b) { return a.bound < b.bound; });
+    // prefix[i]: most terms[0..i] add together
+    vector<float> prefix(terms.size());
+    float sum = 0.0;
+    for (size_t i = 0; i < terms.size(); ++i) {
+        sum += terms[i].bound;
+        prefix[i] = sum;
+    }
+
+    // Min-heap of (score, slot); threshold is the score to beat once full.
+    typedef std::pair<float, uint32_t> Scored;
+    vector<Scored> heap;
+    heap.reserve(nb_results + 1);
+    float threshold = -std::numeric_limits<float>::infinity();
+    size_t nb_lazy = 0;  // terms[0..nb_lazy) are non-essential
+
+    // Essential lists are added up a window of slots at a time, and the
+    // items they reach are then completed in slot order.
+    const size_t window = 4096;
+    vector<float> acc(window, 0.0);
+    vector<uint64_t> touched(BitWords(window), 0);
+
+    while (true) {
+        // Start at the next posting of an essential list.
+        uint64_t begin = std::numeric_limits<uint64_t>::max();
+        for (size_t i = nb_lazy; i < terms.size(); ++i) {
+            auto& t = terms[i];
+            if (t.pos < t.list->slots.size()) {
+                begin = std::min<uint64_t>(begin, t.list->slots[t.pos]);
+            }
+        }
+        if (begin == std::numeric_limits<uint64_t>::max()) {
+            break;
+        }
+        uint64_t end = begin + window;
+
+        // Skip the window if the blocks it overlaps cannot beat the
+        // threshold.
+        if (heap.size() == nb_results) {
+            float bound = (nb_lazy > 0) ? prefix[nb_lazy - 1] : 0.0;
+            for (size_t i = nb_lazy; i < terms.size(); ++i) {
+                auto& t = terms[i];
+                auto& list = *t.list;
+                float most = 0.0;
+                for (size_t b = t.pos / block_size_;
+                        b < list.block_last.size() && list.slots[b * block_size_] < end; ++b) {
+                    most = std::max(most, SparseBound(t.weight, list.block_min[b], list.block_max[b]));
+                }
+                bound += most;
+            }
+            if (bound <= threshold) {
+                for (size_t i = nb_lazy; i < terms.size(); ++i) {
+                    auto& slots = terms[i].list->slots;
+                    terms[i].pos = std::lower_bound(slots.begin() + terms[i].pos, slots.end(), end)
+                                   - slots.begin();
+                }
+                continue;
+            }
+        }
+
+        for (size_t i = nb_lazy; i < terms.size(); ++i) {
+            auto& t = terms[i];
+            auto& slots = t.list->slots;
+            auto& values = t.list->values;
+            size_t p = t.pos;
+            for (; p < slots.size() && slots[p] < end; ++p) {
+                size_t offset = slots[p] - begin;
+                acc[offset] += t.weight * values[p];
+                SetBit(touched, offset);
+            }
+            t.pos = p;
+        }
+
+        // Lists turning non-essential during the window were added up
+        // already.
+        size_t nb_probed = nb_lazy;
+        for (size_t w = 0; w < touched.size(); ++w) {
+            uint64_t bits = touched[w];
+            touched[w] = 0;
+            for (; bits != 0; bits &= bits - 1) {
+                size_t offset = w * 64 + __builtin_ctzll(bits);
+                uint32_t slot = begin + offset;
+                float score = acc[offset];
+                acc[offset] = 0.0;
+
+                // Probe the non-essential lists, largest bound first.
+                bool pruned = false;
+                for (size_t i = nb_probed; i-- > 0; ) {
+                    if (score + prefix[i] <= threshold) {
+                        pruned = true;
+                        break;
+                    }
+                    auto& t = terms[i];
+                    auto& list = *t.list;
+                    while (t.block < list.block_last.size() && list.block_last[t.block] < slot) {
+                        ++t.block;
+                    }
+                    if (t.block == list.block_last.size()) {
+                        continue;
+                    }
+                    float rest = (i > 0) ? prefix[i - 1] : 0.0;
+                    if (score + SparseBound(t.weight, list.block_min[t.block], list.block_max[t.block])
+                            + rest <= threshold) {
+                        pruned = true;
+                        break;
+                    }
+                    size_t first = std::max(t.pos, t.block * block_size_);
+                    size_t last = std::min(list.slots.size(), (t.block + 1) * block_size_);
+                    if (first >= last) {
+                        continue;
+                    }
+                    t.pos = std::lower_bound(list.slots.begin() + first, list.slots.begin() + last, slot)
+                            - list.slots.begin();
+                    if (t.pos < list.slots.size() && list.slots[t.pos] == slot) {
+                        score += t.weight * list.values[t.pos++];
+                    }
+                }
+                if (pruned) {
+                    continue;
+                }
+
+                if (heap.size() < nb_results) {
+                    heap.emplace_back(score, slot);
+                    std::push_heap(heap.begin(), heap.end(), std::greater<Scored>());
+                } else if (score > heap.front().first) {
+                    std::pop_heap(heap.begin(), heap.end(), std::greater<Scored>());
+                    heap.back() = Scored(score, slot);
+                    std::push_heap(heap.begin(), heap.end(), std::greater<Scored>());
+                } else {
+                    continue;
+                }
+                if (heap.size() == nb_results) {
+                    threshold = heap.front().first;
+                    while (nb_lazy < terms.size() && prefix[nb_lazy] <= threshold) {
+                        terms[nb_lazy].block = terms[nb_lazy].pos / block_size_;
+                        ++nb_lazy;
+                    }
+                }
+            }
+        }
+    }
+
+    std::sort_heap(heap.begin(), heap.end(), std::greater<Scored>());
+    results.reserve(heap.size());
+    for (auto& s : heap) {
+        SpaceResult<ID> r;
+        r.id = ids_[s.second];
+        r.dist = 1.0 - s.first;
+        results.emplace_back(r);
+    }
+}
+
+template <typename ID>
+void SparseSpace<ID>::GetNeighborsSparse(const uint32_t* indices, const float* values, size_t nnz,
+        size_t nb_results, vector<SpaceResult<ID>>& results) const
+{
+    Entries query;
+    if (!_Prepare(indices, values, nnz, query)) {
+        results.clear();
+        return;
+    }
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    _Search(query, nb_results, results);
+}
+
+template <typename ID>
+void SparseSpace<ID>::GetNeighbors(const float* point, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    vector<uint32_t> indices;
+    vector<float> values;
+    for (size_t i = 0; i < ndim_; ++i) {
+        if (point[i] != 0.0) {
+            indices.emplace_back(i);
+            values.emplace_back(point[i]);
+        }
+    }
+    GetNeighborsSparse(indices.data(), values.data(), indices.size(), nb_results, results);
+}
+
+template <typename ID>
+void SparseSpace<ID>::GetNeighbors(const ID& id, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    auto it = id2slot_.find(id);
+    if (it == id2slot_.end()) {
+        results.clear();
+        return;
+    }
+    _Search(rows_[it->second], nb_results, results);
+}
+
+template <typename ID>
+bool SparseSpace<ID>::GetPoint(const ID& id, float* point) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    auto it = id2slot_.find(id);
+    if (it == id2slot_.end()) {
+        return false;
+    }
+    std::fill(point, point + ndim_, 0.0);
+    for (auto& e : rows_[it->second]) {
+        point[e.first] = e.second;
+    }
+    return true;
+}
+
+template <typename ID>
+bool SparseSpace<ID>::GetSparse(const ID& id, vector<uint32_t>& indices,
+                                vector<float>& values) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    indices.clear();
+    values.clear();
+    auto it = id2slot_.find(id);
+    if (it == id2slot_.end()) {
+        return false;
+    }
+    for (auto& e : rows_[it->second]) {
+        indices.emplace_back(e.first);
+        values.emplace_back(e.second);
+    }
+    return true;
+}
+
+template <typename ID>
+void SparseSpace<ID>::GetIds(vector<ID>& ids) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    ids.clear();
+    ids.reserve(id2slot_.size());
+    for (size_t slot = 0; slot < ids_.size(); ++slot) {
+        if (!rows_[slot].empty()) {
+            ids.emplace_back(ids_[slot]);
+        }
+    }
+}
+
+template <typename ID>
+void SparseSpace<ID>::Info(FILE* log, size_t indent, size_t indent_incr) const {
+    Space<ID>::Info(log, indent, indent_incr);
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    size_t nb_lists = 0;
+    size_t nb_postings = 0;
+    size_t longest = 0;
+    for (auto& list : postings_) {
+        nb_lists += !list.slots.empty();
+        nb_postings += list.slots.size();
+        longest = std::max(longest, list.slots.size());
+    }
+    string zero(indent, ' ');
+    fprintf(log, "%sdimensions used: %zu of %zu\n", zero.c_str(), nb_lists, ndim_);
+    fprintf(log, "%spostings: %zu (%.1f per item, longest list %zu)\n", zero.c_str(), nb_postings,
+            id2slot_.empty() ? 0.0 : (double) nb_postings / id2slot_.size(), longest);
+    fprintf(log, "%sfree slots: %zu\n", zero.c_str(), nb_free_);
+}
@@ -0,0 +1,456 @@
+#pragma once
+
+// LSM-style tiered space: a small mutable delta over a frozen main index.
+//
+// Upserts go to a brute-force delta segment and never touch the main
+// index, which is built once and only read afterwards.  Deletes and
+// updates shadow older copies through a per-segment tombstone set that
+// queries filter with.  Once the delta grows past max_delta rows it is
+// frozen (still searched) and a background merge builds a new main index
+// from the live rows of the old one plus the frozen delta, then swaps it
+// in.  Readers and writers are blocked only while segments are swapped.
+//
+// Segments are rebuilt from GetPoint, so the main index should keep exact
+// points (e.g. IVF-PQ with rerank, not plain PQ codes), and it must use
+// the same metric as the delta.
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <boost/align/aligned_allocator.hpp>
+
+#include "common/ann_util.h"
+#include "ann/metric.h"
+#include "ann/space.h"
+
+using std::unordered_map;
+using std::unordered_set;
+using std::vector;
+using boost::alignment::aligned_allocator;
+using ann::util::ProgressBar;
+
+// Brute-force segment of rows prepared by the metric.
+template <typename ID>
+struct TieredDelta {
+    vector<ID> ids;
+    unordered_map<ID, size_t> id2index;
+    vector<float, aligned_allocator<float, 32>> point_floats;
+};
+
+template <typename ID, typename Metric = CosineMetric>
+class TieredSpace : public Space<ID> {
+  public:
+    // make_main returns an empty space ready for nb_dims inputs; it is
+    // called for the initial main index and for every merge.
+    explicit TieredSpace(const std::function<Space<ID>*(size_t nb_dims)>& make_main)
+        : make_main_(make_main)
+    {};
+    ~TieredSpace();
+
+    void Init(size_t nb_dims) override;
+
+    // max_delta: rows in the delta segment that trigger a background merge
+    void Config(size_t nb_dims, size_t max_delta=4096);
+
+    void Clear() override;
+
+    // Fold the delta into a new main index.  Called in the background
+    // once the delta exceeds max_delta rows.
+    void Merge();
+
+    // Merge what is left in the delta.
+    bool Build() override;
+
+    unsigned int Delete(const ID& id) override;
+
+    unsigned int Upsert(const SpaceInput<ID>& input) override;
+
+    void GetNeighbors(const float* point, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    void GetNeighbors(const ID& id, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const override;
+
+    bool GetPoint(const ID& id, float* point) const override;
+
+    void GetIds(vector<ID>& ids) const override;
+
+    // Get the number of elements stored.
+    size_t Size() const override;
+
+    // Get Dimensionality
+    size_t Dim() const override { return ndim_; }
+
+    const char* MetricName() const override { return Metric::Name(); }
+
+    void Info(FILE* log, size_t indent=2, size_t indent_incr=4) const override;
+
+  private:
+    bool _InMain(const ID& id) const;
+    bool _InDelta(const TieredDelta<ID>* delta, const ID& id) const;
+    unsigned int _DeleteDelta(const ID& id);
+    void _ScanDelta(const TieredDelta<ID>& delta, const unordered_set<ID>* dead,
+            const float* point, size_t nb_results, vector<SpaceResult<ID>>& results) const;
+    void _GetNeighborsMain(const float* point, size_t nb_results,
+            vector<SpaceResult<ID>>& results) const;
+    void _JoinMerger();
+
+    std::function<Space<ID>*(size_t nb_dims)> make_main_;
+    size_t ndim_ = 0;
+
+    // newest first: mutable delta, delta being merged, frozen main index
+    std::shared_ptr<TieredDelta<ID>> delta_;
+    std::shared_ptr<TieredDelta<ID>> frozen_;
+    std::shared_ptr<Space<ID>> main_;
+
+    // IDs of frozen_ and main_ that were deleted or upserted again since
+    unordered_set<ID> frozen_dead_;
+    unordered_set<ID> main_dead_;
+
+    // constructor params
+    size_t max_delta_;
+
+    mutable std::shared_timed_mutex mutex_;
+    std::mutex merge_mutex_;
+    std::atomic<bool> merging_{false};
+    std::thread merger_;
+};
+
+template <typename ID, typename Metric>
+TieredSpace<ID, Metric>::~TieredSpace() {
+    _JoinMerger();
+}
+
+template <typename ID, typename Metric>
+void TieredSpace<ID, Metric>::_JoinMerger() {
+    if (merger_.joinable()) {
+        merger_.join();
+    }
+}
+
+template <typename ID, typename Metric>
+void TieredSpace<ID, Metric>::Init(size_t nb_dims) {
+    Config(nb_dims);
+}
+
+template <typename ID, typename Metric>
+void TieredSpace<ID, Metric>::Config(size_t nb_dims, size_t max_delta) {
+    _JoinMerger();
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    ndim_ = nb_dims;
+    max_delta_ = std::max<size_t>(max_delta, 1);
+    delta_ = std::make_shared<TieredDelta<ID>>();
+    frozen_.reset();
+    main_.reset(make_main_(ndim_));
+    frozen_dead_.clear();
+    main_dead_.clear();
+}
+
+template <typename ID, typename Metric>
+void TieredSpace<ID, Metric>::Clear() {
+    _JoinMerger();
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    delta_ = std::make_shared<TieredDelta<ID>>();
+    frozen_.reset();
+    main_.reset(make_main_(ndim_));
+    frozen_dead_.clear();
+    main_dead_.clear();
+}
+
+template <typename ID, typename Metric>
+bool TieredSpace<ID, Metric>::_InMain(const ID& id) const {
+    if (main_dead_.count(id)) {
+        return false;
+    }
+    float tmp[ndim_];
+    return main_->GetPoint(id, tmp);
+}
+
+template <typename ID, typename Metric>
+bool TieredSpace<ID, Metric>::_InDelta(const TieredDelta<ID>* delta, const ID& id) const {
+    return delta && delta->id2index.count(id) && !(delta == frozen_.get() && frozen_dead_.count(id));
+}
+
+template <typename ID, typename Metric>
+unsigned int TieredSpace<ID, Metric>::_DeleteDelta(const ID& id) {
+    auto& delta = *delta_;
+    auto it = delta.id2index.find(id);
+    if (it == delta.id2index.end()) {
+        return 0;
+    }
+
+    // Swap with the end and resize by one.
+    size_t index = it->second;
+    size_t last = delta.ids.size() - 1;
+    delta.id2index.erase(it);
+    if (index != last) {
+        delta.id2index[delta.ids[last]] = index;
+        delta.ids[index] = delta.ids[last];
+        std::copy_n(&delta.point_floats[last * ndim_], ndim_, &delta.point_floats[index * ndim_]);
+    }
+    delta.ids.resize(last);
+    delta.point_floats.resize(last * ndim_);
+    return 1;
+}
+
+template <typename ID, typename Metric>
+unsigned int TieredSpace<ID, Metric>::Delete(const ID& id) {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    unsigned int count = _DeleteDelta(id);
+    if (_InDelta(frozen_.get(), id)) {
+        frozen_dead_.insert(id);
+        count = 1;
+    }
+    if (_InMain(id)) {
+        main_dead_.insert(id);
+        count = 1;
+    }
+    return count;
+}
+
+template <typename ID, typename Metric>
+unsigned int TieredSpace<ID, Metric>::Upsert(const SpaceInput<ID>& input) {
+    // Reject NaN entries.
+    if (!isfinite_xf(input.point, ndim_)) {
+        return 0;
+    }
+
+    float tmp[ndim_];
+
+    // Reject inputs the metric cannot use (zero norm for cosine)
+    if (!Metric::Prepare(tmp, input.point, ndim_)) {
+        return 0;
+    }
+
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    _DeleteDelta(input.id);
+    if (_InDelta(frozen_.get(), input.id)) {
+        frozen_dead_.insert(input.id);
+    }
+    if (_InMain(input.id)) {
+        main_dead_.insert(input.id);
+    }
+
+    auto& delta = *delta_;
+    delta.id2index[input.id] = delta.ids.size();
+    delta.ids.emplace_back(input.id);
+    delta.point_floats.insert(delta.point_floats.end(), tmp, tmp + ndim_);
+
+    if (delta.ids.size() > max_delta_ && !merging_) {
+        merging_ = true;
+        _JoinMerger();
+        merger_ = std::thread([this] {
+            this->Merge();
+            this->merging_ = false;
+        });
+    }
+    return 1;
+}
+
+template <typename ID, typename Metric>
+void TieredSpace<ID, Metric>::Merge() {
+    std::lock_guard<std::mutex> merge_guard(merge_mutex_);
+
+    // Freeze the delta and snapshot the main index.
+    std::shared_ptr<Space<ID>> old_main;
+    std::shared_ptr<TieredDelta<ID>> frozen;
+    unordered_set<ID> main_dead;
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+        if (delta_->ids.empty() && main_dead_.empty()) {
+            return;
+        }
+        frozen_ = delta_;
+        frozen_dead_.clear();
+        delta_ = std::make_shared<TieredDelta<ID>>();
+        frozen = frozen_;
+        old_main = main_;
+        main_dead = main_dead_;
+    }
+
+    // Build the new main index while queries and upserts keep running.
+    // Neither old_main nor frozen is written to from here on.
+    std::shared_ptr<Space<ID>> new_main(make_main_(ndim_));
+    vector<ID> ids;
+    old_main->GetIds(ids);
+    vector<float> point_floats;
+    vector<ID> live;
+    live.reserve(ids.size());
+    point_floats.reserve(ids.size() * ndim_);
+    float tmp[ndim_];
+    for (auto& id : ids) {
+        if (!main_dead.count(id) && old_main->GetPoint(id, tmp)) {
+            live.emplace_back(id);
+            point_floats.insert(point_floats.end(), tmp, tmp + ndim_);
+        }
+    }
+    vector<SpaceInput<ID>> inputs(live.size() + frozen->ids.size());
+    for (size_t i = 0; i < live.size(); ++i) {
+        inputs[i].id = live[i];
+        inputs[i].point = &point_floats[i * ndim_];
+    }
+    for (size_t i = 0; i < frozen->ids.size(); ++i) {
+        inputs[live.size() + i].id = frozen->ids[i];
+        inputs[live.size() + i].point = &frozen->point_floats[i * ndim_];
+    }
+    new_main->UpsertMany(inputs);
+    new_main->Build();
+
+    // Swap it in.  What was deleted or upserted again during the merge is
+    // carried over as tombstones of the new main index.
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+        unordered_set<ID> dead;
+        for (auto& id : main_dead_) {
+            if (!main_dead.count(id)) {
+                dead.insert(id);
+            }
+        }
+        dead.insert(frozen_dead_.begin(), frozen_dead_.end());
+        main_dead_.swap(dead);
+        main_ = new_main;
+        frozen_.reset();
+        frozen_dead_.clear();
+    }
+}
+
+template <typename ID, typename Metric>
+bool TieredSpace<ID, Metric>::Build() {
+    Merge();
+    return true;
+}
+
+template <typename ID, typename Metric>
+void TieredSpace<ID, Metric>::_ScanDelta(const TieredDelta<ID>& delta, const unordered_set<ID>* dead,
+        const float* point, size_t nb_results, vector<SpaceResult<ID>>& results) const
+{
+    for (size_t i = 0; i < delta.ids.size(); ++i) {
+        if (dead && dead->count(delta.ids[i])) {
+            continue;
+        }
+        SpaceResult<ID> r;
+        r.id = delta.ids[i];
+        r.dist = Metric::Distance(&delta.point_floats[i * ndim_], point, ndim_);
+        PushTopK(results, r, nb_results);
+    }
+}
+
+template <typename ID, typename Metric>
+void TieredSpace<ID, Metric>::_GetNeighborsMain(const float* point, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    // Ask for more results until enough survive the tombstones, or the
+    // main index has no more to give.
+    size_t fetch = main_dead_.empty() ? nb_results : 2 * nb_results;
+    vector<SpaceResult<ID>> found;
+    while (true) {
+        found.clear();
+        main_->GetNeighbors(point, fetch, found);
+        results.clear();
+        for (auto& r : found) {
+            if (!main_dead_.count(r.id)) {
+                results.emplace_back(r);
+            }
+        }
+        if (results.size() >= nb_results || found.size() < fetch) {
+            break;
+        }
+        fetch *= 2;
+    }
+}
+
+template <typename ID, typename Metric>
+void TieredSpace<ID, Metric>::GetNeighbors(const float* point, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    float tmp[ndim_];
+    if (!Metric::Prepare(tmp, point, ndim_)) {
+        results.clear();
+        return;
+    }
+
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    vector<SpaceResult<ID>> heap;
+    _ScanDelta(*delta_, nullptr, tmp, nb_results, heap);
+    if (frozen_) {
+        _ScanDelta(*frozen_, &frozen_dead_, tmp, nb_results, heap);
+    }
+    vector<SpaceResult<ID>> main_results;
+    _GetNeighborsMain(tmp, nb_results, main_results);
+    for (auto& r : main_results) {
+        PushTopK(heap, r, nb_results);
+    }
+    std::sort_heap(heap.begin(), heap.end());
+    results.swap(heap);
+}
+
+template <typename ID, typename Metric>
+void TieredSpace<ID, Metric>::GetNeighbors(const ID& id, size_t nb_results,
+        vector<SpaceResult<ID>>& results) const
+{
+    float tmp[ndim_];
+    if (GetPoint(id, tmp)) {
+        GetNeighbors(tmp, nb_results, results);
+    }
+}
+
+template <typename ID, typename Metric>
+bool TieredSpace<ID, Metric>::GetPoint(const ID& id, float* point) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    for (auto delta : {delta_.get(), frozen_.get()}) {
+        if (_InDelta(delta, id)) {
+            std::copy_n(&delta->point_floats[delta->id2index.at(id) * ndim_], ndim_, point);
+            return true;
+        }
+    }
+    return !main_dead_.count(id) && main_->GetPoint(id, point);
+}
+
+template <typename ID, typename Metric>
+void TieredSpace<ID, Metric>::GetIds(vector<ID>& ids) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    main_->GetIds(ids);
+    ids.erase(std::remove_if(ids.begin(), ids.end(),
+                [this] (const ID& id) { return main_dead_.count(id) > 0; }),
+            ids.end());
+    if (frozen_) {
+        for (auto& id : frozen_->ids) {
+            if (!frozen_dead_.count(id)) {
+                ids.emplace_back(id);
+            }
+        }
+    }
+    ids.insert(ids.end(), delta_->ids.begin(), delta_->ids.end());
+}
+
+template <typename ID, typename Metric>
+size_t TieredSpace<ID, Metric>::Size() const {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    size_t total = delta_->ids.size() + main_->Size() - main_dead_.size();
+    if (frozen_) {
+        total += frozen_->ids.size() - frozen_dead_.size();
+    }
+    return total;
+}
+
+template <typename ID, typename Metric>
+void TieredSpace<ID, Metric>::Info(FILE* log, size_t indent, size_t indent_incr) const {
+    Space<ID>::Info(log, indent, indent_incr);
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    string zero(indent, ' ');
+    fprintf(log, "%sdelta: %zu\n", zero.c_str(), delta_->ids.size());
+    if (frozen_) {
+        fprintf(log, "%smerging: %zu (%zu dead)\n", zero.c_str(),
+                frozen_->ids.size(), frozen_dead_.size());
+    }
+    fprintf(log, "%smain: %zu (%zu dead)\n", zero.c_str(), main_->Size(), main_dead_.size());
+    main_->Info(log, indent + indent_incr, indent_incr);
+}
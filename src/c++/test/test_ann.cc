@@ -1,18 +1,41 @@
 #include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <unordered_set>
 #include <vector>
 #include <iterator>
+#include <map>
+#include <sstream>
 
 #include "gtest/gtest.h"
+#include "ann/disk_graph_space.h"
 #include "ann/gauss_lsh.h"
+#include "ann/hamming_space.h"
+#include "ann/hnsw_space.h"
+#include "ann/ivf_pq_space.h"
+#include "ann/ivf_space.h"
+#include "ann/kd_tree_space.h"
 #include "ann/linear_space.h"
+#include "ann/metric.h"
+#include "ann/minhash_space.h"
+#include "ann/mips_space.h"
+#include "ann/mmap_space.h"
+#include "ann/multi_vector_space.h"
+#include "ann/pivot_space.h"
+#include "ann/rp_forest_space.h"
+#include "ann/sharded_space.h"
+#include "ann/space_registry.h"
+#include "ann/sparse_space.h"
+#include "ann/tiered_space.h"
 
 typedef uint32_t ID;
 
 using std::vector;
 
 template<typename _ForwardIterator>
-void RandomFill(_ForwardIterator first, _ForwardIterator last) {
-    boost::mt19937_64 prng_;
+void RandomFill(_ForwardIterator first, _ForwardIterator last, uint64_t seed=0) {
+    boost::mt19937_64 prng_(seed);
     boost::normal_distribution<float> gauss(0.0, 1.0);
     boost::variate_generator<boost::mt19937_64&,
         boost::normal_distribution<float>> rand_var(prng_, gauss);
@@ -21,7 +44,7 @@ void RandomFill(_ForwardIterator first, _ForwardIterator last) {
 
 unsigned int UpsertRandom(Space<ID>& indexer, ID id) {
     vector<float> vec(indexer.Dim());
-    RandomFill(vec.begin(), vec.end());
+    RandomFill(vec.begin(), vec.end(), id);
     SpaceInput<ID> input;
     input.id = id;
     input.point = vec.data();
@@ -65,6 +88,33 @@ TEST(ann_test, lsh_upsert)
     TestUpsert(indexer);
 }
 
+TEST(ann_test, lsh_reused_results)
+{
+    // Each query replaces the results, and returns at most nb_results of
+    // them, whatever the vector held or reserved before.
+    LSHSpace<ID> indexer;
+    indexer.Config(16, 4, 8);
+    for (ID id = 0; id < 500; ++id) {
+        ASSERT_EQ(1, UpsertRandom(indexer, id));
+    }
+    vector<float> vec(16);
+    vector<SpaceResult<ID>> results;
+    SpaceFilter<ID> filter(vector<ID>{1, 2, 3}, true);
+    for (ID id = 0; id < 500; id += 7) {
+        indexer.GetNeighbors(id, 50, results);
+        ASSERT_LE(results.size(), 50);
+        indexer.GetNeighbors(id, 5, results);
+        ASSERT_LE(results.size(), 5);
+        ASSERT_EQ(id, results[0].id);
+        RandomFill(vec.begin(), vec.end(), id);
+        indexer.GetNeighbors(vec.data(), 50, results);
+        indexer.GetNeighborsFiltered(vec.data(), 5, filter, results);
+        ASSERT_LE(results.size(), 5);
+    }
+    indexer.GetNeighbors(ID(1000), 5, results);
+    ASSERT_TRUE(results.empty());
+}
+
 TEST(ann_test, linear_upsert)
 {
     LinearSpace<ID> indexer;
@@ -82,3 +132,1777 @@ TEST(ann_test, lsh_upsert_delete)
     LSHSpace<ID> indexer;
     TestUpsertDelete(indexer);
 }
+
+TEST(ann_test, linear_graph)
+{
+    LinearSpace<ID> indexer;
+    indexer.Init(10);
+    for (ID id = 0; id < 600; ++id) {
+        ASSERT_EQ(1, UpsertRandom(indexer, id));
+    }
+    vector<ID> ids;
+    vector<vector<SpaceResult<ID>>> graph;
+    indexer.BuildGraph(5, ids, graph);
+    ASSERT_EQ(graph.size(), 600);
+    for (size_t row = 0; row < ids.size(); row += 37) {
+        vector<SpaceResult<ID>> results;
+        indexer.GetNeighbors(ids[row], 5, results);
+        ASSERT_EQ(graph[row].size(), results.size());
+        for (size_t i = 0; i < results.size(); ++i) {
+            ASSERT_EQ(graph[row][i].id, results[i].id);
+            ASSERT_NEAR(graph[row][i].dist, results[i].dist, 1e-5);
+        }
+    }
+}
+
+TEST(ann_test, linear_descent_graph)
+{
+    LinearSpace<ID> indexer;
+    indexer.Config(10, true, 1.0, 0, 0, 20);
+    for (ID id = 0; id < 2000; ++id) {
+        ASSERT_EQ(1, UpsertRandom(indexer, id));
+    }
+    for (ID id = 0; id < 2000; id += 4) {
+        ASSERT_EQ(1, indexer.Delete(id));
+    }
+    vector<ID> ids;
+    vector<vector<SpaceResult<ID>>> graph;
+    indexer.BuildGraphDescent(10, ids, graph);
+    vector<ID> exact_ids;
+    vector<vector<SpaceResult<ID>>> exact;
+    indexer.BuildGraph(10, exact_ids, exact);
+    ASSERT_EQ(ids, exact_ids);
+
+    size_t hits = 0;
+    size_t total = 0;
+    for (size_t row = 0; row < ids.size(); ++row) {
+        ASSERT_EQ(graph[row].size(), 10);
+        ASSERT_EQ(graph[row][0].id, ids[row]);
+        for (auto& r : graph[row]) {
+            ASSERT_NE(r.id % 4, 0);
+            for (auto& e : exact[row]) {
+                hits += (e.id == r.id);
+            }
+        }
+        total += exact[row].size();
+    }
+    ASSERT_GT(hits, 0.9 * total);
+}
+
+TEST(ann_test, linear_tombstone_upsert_delete)
+{
+    LinearSpace<ID> indexer;
+    indexer.Config(10, true);
+    TestUpsertDelete(indexer);
+}
+
+TEST(ann_test, linear_tombstone_compact)
+{
+    LinearSpace<ID> indexer;
+    indexer.Config(10, true, 0.5);
+    for (ID id = 0; id < 100; ++id) {
+        ASSERT_EQ(1, UpsertRandom(indexer, id));
+    }
+    for (ID id = 0; id < 100; id += 2) {
+        ASSERT_EQ(1, indexer.Delete(id));
+    }
+    ASSERT_EQ(indexer.Size(), 50);
+    indexer.Compact();
+    ASSERT_EQ(indexer.Size(), 50);
+
+    vector<SpaceResult<ID>> results;
+    indexer.GetNeighbors(ID(1), 100, results);
+    ASSERT_EQ(results.size(), 50);
+    ASSERT_EQ(results[0].id, 1);
+    for (auto& r : results) {
+        ASSERT_EQ(r.id % 2, 1);
+    }
+}
+
+TEST(ann_test, mmap_upsert)
+{
+    MmapLinearSpace<ID> indexer;
+    TestUpsert(indexer);
+}
+
+TEST(ann_test, mmap_upsert_delete)
+{
+    MmapLinearSpace<ID> indexer;
+    TestUpsertDelete(indexer);
+}
+
+TEST(ann_test, mmap_matches_linear)
+{
+    std::string path = testing::TempDir() + "ann_test_vectors.bin";
+    LinearSpace<ID> linear;
+    linear.Init(10);
+    {
+        MmapLinearSpace<ID> writer;
+        ASSERT_TRUE(writer.Config(10, path, 64));
+        for (ID id = 0; id < 500; ++id) {
+            UpsertRandom(linear, id);
+            UpsertRandom(writer, id);
+        }
+    }
+    MmapLinearSpace<ID> indexer;
+    ASSERT_TRUE(indexer.Open(10, path, 64));
+    ASSERT_EQ(indexer.Size(), 500);
+    for (ID id = 0; id < 500; id += 41) {
+        vector<SpaceResult<ID>> expected;
+        linear.GetNeighbors(id, 7, expected);
+        vector<SpaceResult<ID>> results;
+        indexer.GetNeighbors(id, 7, results);
+        ASSERT_EQ(results.size(), expected.size());
+        for (size_t i = 0; i < results.size(); ++i) {
+            ASSERT_EQ(results[i].id, expected[i].id);
+            ASSERT_NEAR(results[i].dist, expected[i].dist, 1e-5);
+        }
+    }
+    std::remove(path.c_str());
+    std::remove((path + ".ids").c_str());
+}
+
+TEST(ann_test, mmap_graph)
+{
+    // Batches of 1024 queries over one large chunk are scored a block of
+    // rows at a time; the graph must match exact neighbors.
+    std::string path = testing::TempDir() + "ann_test_graph.bin";
+    LinearSpace<ID> linear;
+    linear.Init(16);
+    MmapLinearSpace<ID> indexer;
+    ASSERT_TRUE(indexer.Config(16, path));
+    for (ID id = 0; id < 3000; ++id) {
+        UpsertRandom(linear, id);
+        UpsertRandom(indexer, id);
+    }
+    std::stringstream out;
+    indexer.GraphToStream(out, 5);
+    std::map<ID, vector<ID>> graph;
+    ID id;
+    ID neighbor;
+    char comma;
+    float dist;
+    while (out >> id >> comma >> neighbor >> comma >> dist) {
+        graph[id].emplace_back(neighbor);
+    }
+    ASSERT_EQ(3000, graph.size());
+    for (ID id = 0; id < 3000; id += 7) {
+        vector<SpaceResult<ID>> expected;
+        linear.GetNeighbors(id, 5, expected);
+        ASSERT_EQ(expected.size(), graph[id].size());
+        for (size_t i = 0; i < expected.size(); ++i) {
+            ASSERT_EQ(expected[i].id, graph[id][i]);
+        }
+    }
+    std::remove(path.c_str());
+    std::remove((path + ".ids").c_str());
+}
+
+TEST(ann_test, mmap_compact)
+{
+    std::string path = testing::TempDir() + "ann_test_compact.bin";
+    LinearSpace<ID> linear;
+    linear.Init(10);
+    MmapLinearSpace<ID> indexer;
+    ASSERT_TRUE(indexer.Config(10, path, 64, 0.25));
+    for (ID id = 0; id < 300; ++id) {
+        UpsertRandom(linear, id);
+        UpsertRandom(indexer, id);
+    }
+    // Re-upserts and deletes leave dead rows until compaction drops them.
+    vector<float> vec(10);
+    for (ID id = 0; id < 300; id += 2) {
+        RandomFill(vec.begin(), vec.end(), id + 1000);
+        linear.Upsert(SpaceInput<ID>{id, vec.data()});
+        ASSERT_EQ(1, indexer.Upsert(SpaceInput<ID>{id, vec.data()}));
+    }
+    for (ID id = 1; id < 300; id += 3) {
+        linear.Delete(id);
+        ASSERT_EQ(1, indexer.Delete(id));
+    }
+    ASSERT_TRUE(indexer.Compact());
+    struct stat st;
+    ASSERT_EQ(0, stat(path.c_str(), &st));
+    ASSERT_EQ(st.st_size, indexer.Size() * 10 * sizeof(float));
+    ASSERT_EQ(indexer.Size(), linear.Size());
+
+    MmapLinearSpace<ID> reopened;
+    ASSERT_TRUE(reopened.Open(10, path, 64));
+    for (auto space : {&indexer, &reopened}) {
+        ASSERT_EQ(space->Size(), linear.Size());
+        vector<float> expected_point(10);
+        vector<float> point(10);
+        for (ID id = 0; id < 300; ++id) {
+            ASSERT_EQ(linear.GetPoint(id, expected_point.data()), space->GetPoint(id, point.data()));
+            if (id % 3 == 1) {
+                continue;
+            }
+            for (size_t i = 0; i < 10; ++i) {
+                ASSERT_NEAR(point[i], expected_point[i], 1e-6);
+            }
+            vector<SpaceResult<ID>> expected;
+            linear.GetNeighbors(id, 5, expected);
+            vector<SpaceResult<ID>> results;
+            space->GetNeighbors(id, 5, results);
+            ASSERT_EQ(results.size(), expected.size());
+            for (size_t i = 0; i < results.size(); ++i) {
+                ASSERT_EQ(results[i].id, expected[i].id);
+            }
+        }
+    }
+    std::remove(path.c_str());
+    std::remove((path + ".ids").c_str());
+}
+
+TEST(ann_test, linear_shortlist_upsert_delete)
+{
+    LinearSpace<ID> indexer;
+    indexer.Config(10, false, 0.25, 16);
+    TestUpsertDelete(indexer);
+}
+
+TEST(ann_test, linear_shortlist)
+{
+    LinearSpace<ID> exact;
+    exact.Init(64);
+    LinearSpace<ID> full;
+    full.Config(64, false, 0.25, 300);
+    LinearSpace<ID> indexer;
+    indexer.Config(64, false, 0.25, 20);
+    for (ID id = 0; id < 300; ++id) {
+        UpsertRandom(exact, id);
+        UpsertRandom(full, id);
+        UpsertRandom(indexer, id);
+    }
+    ASSERT_EQ(1, indexer.Delete(ID(7)));
+
+    vector<SpaceResult<ID>> expected;
+    exact.GetNeighbors(ID(3), 10, expected);
+    vector<SpaceResult<ID>> results;
+    full.GetNeighbors(ID(3), 10, results);
+    ASSERT_EQ(results.size(), expected.size());
+    for (size_t i = 0; i < results.size(); ++i) {
+        ASSERT_EQ(results[i].id, expected[i].id);
+    }
+
+    indexer.GetNeighbors(ID(3), 10, results);
+    ASSERT_EQ(results.size(), 10);
+    ASSERT_EQ(results[0].id, 3);
+    for (auto& r : results) {
+        ASSERT_NE(r.id, 7);
+    }
+}
+
+TEST(ann_test, linear_abandon_upsert_delete)
+{
+    LinearSpace<ID> indexer;
+    indexer.Config(10, false, 0.25, 0, 4);
+    TestUpsertDelete(indexer);
+}
+
+TEST(ann_test, linear_abandon)
+{
+    LinearSpace<ID> exact;
+    exact.Init(32);
+    LinearSpace<ID> indexer;
+    indexer.Config(32, true, 0.25, 0, 8);
+    for (ID id = 0; id < 400; ++id) {
+        vector<float> vec(32);
+        RandomFill(vec.begin(), vec.end(), id);
+        // skewed spectrum
+        for (size_t i = 0; i < vec.size(); ++i) {
+            vec[i] /= (1 + (i * 7) % 32);
+        }
+        SpaceInput<ID> input = {id, vec.data()};
+        exact.Upsert(input);
+        indexer.Upsert(input);
+    }
+    indexer.ReorderDims();
+
+    vector<float> query(32);
+    RandomFill(query.begin(), query.end(), 1000);
+    for (int pass = 0; pass < 2; ++pass) {
+        vector<SpaceResult<ID>> expected;
+        exact.GetNeighbors(query.data(), 10, expected);
+        vector<SpaceResult<ID>> results;
+        indexer.GetNeighbors(query.data(), 10, results);
+        ASSERT_EQ(results.size(), expected.size());
+        for (size_t i = 0; i < results.size(); ++i) {
+            ASSERT_EQ(results[i].id, expected[i].id);
+            ASSERT_NEAR(results[i].dist, expected[i].dist, 1e-5);
+        }
+        exact.GetNeighbors(ID(5), 10, expected);
+        indexer.GetNeighbors(ID(5), 10, results);
+        ASSERT_EQ(results.size(), expected.size());
+        for (size_t i = 0; i < results.size(); ++i) {
+            ASSERT_EQ(results[i].id, expected[i].id);
+        }
+        // upserts after reordering go through the same permutation
+        UpsertRandom(exact, 5000);
+        UpsertRandom(indexer, 5000);
+        exact.Delete(ID(9));
+        indexer.Delete(ID(9));
+    }
+}
+
+// Check a linear space against brute force with the given distance over
+// the raw points, with and without early abandoning, and its graph.
+template <typename Metric>
+void TestLinearMetric(const std::function<float(const float*, const float*)>& distance)
+{
+    const size_t dim = 16;
+    vector<vector<float>> vecs(300, vector<float>(dim));
+    LinearSpace<ID, Metric> plain;
+    plain.Init(dim);
+    LinearSpace<ID, Metric> abandon;
+    abandon.Config(dim, false, 0.25, 0, 4);
+    for (ID id = 0; id < vecs.size(); ++id) {
+        RandomFill(vecs[id].begin(), vecs[id].end(), id);
+        // spread the norms, which only cosine ignores
+        for (auto& x : vecs[id]) {
+            x *= 1 + id % 5;
+        }
+        SpaceInput<ID> input = {id, vecs[id].data()};
+        ASSERT_EQ(1, plain.Upsert(input));
+        ASSERT_EQ(1, abandon.Upsert(input));
+    }
+
+    vector<float> query(dim);
+    RandomFill(query.begin(), query.end(), 1000);
+    vector<SpaceResult<ID>> expected;
+    for (ID id = 0; id < vecs.size(); ++id) {
+        expected.push_back({id, distance(vecs[id].data(), query.data())});
+    }
+    std::sort(expected.begin(), expected.end());
+    expected.resize(10);
+    for (auto indexer : {&plain, &abandon}) {
+        vector<SpaceResult<ID>> results;
+        indexer->GetNeighbors(query.data(), 10, results);
+        ASSERT_EQ(results.size(), expected.size());
+        for (size_t i = 0; i < results.size(); ++i) {
+            ASSERT_EQ(results[i].id, expected[i].id);
+            ASSERT_NEAR(results[i].dist, expected[i].dist, 1e-3 * (1 + std::abs(expected[i].dist)));
+        }
+    }
+
+    vector<ID> ids;
+    vector<vector<SpaceResult<ID>>> graph;
+    plain.BuildGraph(5, ids, graph);
+    for (size_t i = 0; i < ids.size(); i += 37) {
+        vector<SpaceResult<ID>> results;
+        plain.GetNeighbors(ids[i], 5, results);
+        ASSERT_EQ(graph[i].size(), results.size());
+        for (size_t j = 0; j < results.size(); ++j) {
+            // tiles get L2 from norms and dot products, which loses
+            // precision near zero
+            ASSERT_NEAR(graph[i][j].dist, results[j].dist, 2e-2 * (1 + std::abs(results[j].dist)));
+        }
+    }
+}
+
+TEST(ann_test, linear_metrics)
+{
+    TestLinearMetric<CosineMetric>([] (const float* a, const float* b) {
+        return 1.0f - DotProduct(a, b, 16) / (norm(a, 16) * norm(b, 16));
+    });
+    TestLinearMetric<InnerProductMetric>([] (const float* a, const float* b) {
+        return -DotProduct(a, b, 16);
+    });
+    TestLinearMetric<EuclideanMetric>([] (const float* a, const float* b) {
+        float sq = 0.0;
+        for (size_t i = 0; i < 16; ++i) {
+            sq += (a[i] - b[i]) * (a[i] - b[i]);
+        }
+        return std::sqrt(sq);
+    });
+}
+
+TEST(ann_test, pivot_upsert)
+{
+    PivotSpace<ID> indexer;
+    TestUpsert(indexer);
+}
+
+TEST(ann_test, pivot_upsert_delete)
+{
+    PivotSpace<ID> indexer;
+    TestUpsertDelete(indexer);
+}
+
+TEST(ann_test, pivot_matches_linear)
+{
+    LinearSpace<ID> exact;
+    exact.Init(16);
+    PivotSpace<ID> indexer;
+    indexer.Config(16, 8);
+
+    // a few tight clusters
+    vector<float> center(16);
+    vector<float> vec(16);
+    for (ID id = 0; id < 600; ++id) {
+        if (id % 100 == 0) {
+            RandomFill(center.begin(), center.end(), 10000 + id);
+        }
+        RandomFill(vec.begin(), vec.end(), id);
+        for (size_t i = 0; i < vec.size(); ++i) {
+            vec[i] = center[i] + 0.1 * vec[i];
+        }
+        SpaceInput<ID> input = {id, vec.data()};
+        exact.Upsert(input);
+        indexer.Upsert(input);
+    }
+
+    for (int pass = 0; pass < 2; ++pass) {
+        for (ID id = 0; id < 600; id += 53) {
+            vector<SpaceResult<ID>> expected;
+            exact.GetNeighbors(id, 10, expected);
+            vector<SpaceResult<ID>> results;
+            indexer.GetNeighbors(id, 10, results);
+            ASSERT_EQ(results.size(), expected.size());
+            for (size_t i = 0; i < results.size(); ++i) {
+                ASSERT_EQ(results[i].id, expected[i].id);
+            }
+        }
+        indexer.SelectPivots();
+    }
+}
+
+TEST(ann_test, hnsw_upsert)
+{
+    HNSWSpace<ID> indexer;
+    TestUpsert(indexer);
+}
+
+TEST(ann_test, hnsw_upsert_delete)
+{
+    HNSWSpace<ID> indexer;
+    TestUpsertDelete(indexer);
+}
+
+TEST(ann_test, hnsw_recall)
+{
+    LinearSpace<ID> exact;
+    exact.Init(16);
+    HNSWSpace<ID> indexer;
+    indexer.Config(16, 8, 100, 50);
+
+    vector<vector<float>> vecs(2000, vector<float>(16));
+    vector<SpaceInput<ID>> inputs;
+    for (ID id = 0; id < 2000; ++id) {
+        RandomFill(vecs[id].begin(), vecs[id].end(), id);
+        inputs.push_back({id, vecs[id].data()});
+        exact.Upsert(inputs.back());
+    }
+    ASSERT_EQ(2000, indexer.UpsertMany(inputs));
+    for (ID id = 0; id < 2000; id += 3) {
+        ASSERT_EQ(1, exact.Delete(id));
+        ASSERT_EQ(1, indexer.Delete(id));
+    }
+    ASSERT_EQ(indexer.Size(), exact.Size());
+
+    size_t hits = 0;
+    size_t total = 0;
+    for (ID id = 1; id < 2000; id += 19) {
+        if (id % 3 == 0) {
+            continue;
+        }
+        vector<SpaceResult<ID>> expected;
+        exact.GetNeighbors(id, 10, expected);
+        vector<SpaceResult<ID>> results;
+        indexer.GetNeighbors(id, 10, results);
+        ASSERT_EQ(results.size(), 10);
+        for (auto& r : results) {
+            ASSERT_NE(r.id % 3, 0);
+            for (auto& e : expected) {
+                hits += (e.id == r.id);
+            }
+        }
+        total += expected.size();
+    }
+    ASSERT_GT(hits, 0.9 * total);
+}
+
+TEST(ann_test, hnsw_upsert_all_again)
+{
+    // Replacing every item deletes the entry point and all the nodes it
+    // leads to; the new nodes must stay reachable.
+    HNSWSpace<ID> indexer;
+    indexer.Config(16, 8, 100, 50);
+    vector<vector<float>> vecs(300, vector<float>(16));
+    vector<SpaceInput<ID>> inputs;
+    for (ID id = 0; id < 300; ++id) {
+        RandomFill(vecs[id].begin(), vecs[id].end(), id);
+        inputs.push_back({id, vecs[id].data()});
+    }
+    ASSERT_EQ(300, indexer.UpsertMany(inputs));
+    for (int pass = 0; pass < 2; ++pass) {
+        ASSERT_EQ(300, indexer.UpsertMany(inputs));
+        for (auto& input : inputs) {
+            ASSERT_EQ(1, indexer.Upsert(input));
+        }
+        ASSERT_EQ(300, indexer.Size());
+        vector<SpaceResult<ID>> results;
+        indexer.GetNeighbors(ID(3), 10, results);
+        ASSERT_EQ(10, results.size());
+        ASSERT_EQ(ID(3), results[0].id);
+    }
+}
+
+TEST(ann_test, hnsw_l2_recall)
+{
+    LinearSpace<ID, EuclideanMetric> exact;
+    exact.Init(16);
+    HNSWSpace<ID, EuclideanMetric> indexer;
+    indexer.Config(16, 8, 100, 50);
+
+    vector<vector<float>> vecs(2000, vector<float>(16));
+    vector<SpaceInput<ID>> inputs;
+    for (ID id = 0; id < 2000; ++id) {
+        RandomFill(vecs[id].begin(), vecs[id].end(), id);
+        for (auto& x : vecs[id]) {
+            x *= 1 + id % 7;
+        }
+        inputs.push_back({id, vecs[id].data()});
+        exact.Upsert(inputs.back());
+    }
+    ASSERT_EQ(2000, indexer.UpsertMany(inputs));
+
+    size_t hits = 0;
+    size_t total = 0;
+    for (ID id = 1; id < 2000; id += 19) {
+        vector<SpaceResult<ID>> expected;
+        exact.GetNeighbors(id, 10, expected);
+        vector<SpaceResult<ID>> results;
+        indexer.GetNeighbors(id, 10, results);
+        ASSERT_EQ(results.size(), 10);
+        for (auto& r : results) {
+            for (auto& e : expected) {
+                hits += (e.id == r.id);
+            }
+        }
+        total += expected.size();
+    }
+    ASSERT_GT(hits, 0.9 * total);
+}
+
+TEST(ann_test, ivf_upsert)
+{
+    IVFSpace<ID> indexer;
+    TestUpsert(indexer);
+}
+
+TEST(ann_test, ivf_upsert_delete)
+{
+    IVFSpace<ID> indexer;
+    TestUpsertDelete(indexer);
+}
+
+TEST(ann_test, ivf_recall)
+{
+    LinearSpace<ID> exact;
+    exact.Init(16);
+    IVFSpace<ID> indexer;
+    indexer.Config(16, 16, 4, 500);
+
+    // clustered data, so that a few lists hold most neighbors
+    vector<float> center(16);
+    vector<float> vec(16);
+    for (ID id = 0; id < 2000; ++id) {
+        if (id % 50 == 0) {
+            RandomFill(center.begin(), center.end(), 10000 + id);
+        }
+        RandomFill(vec.begin(), vec.end(), id);
+        for (size_t i = 0; i < vec.size(); ++i) {
+            vec[i] = center[i] + 0.2 * vec[i];
+        }
+        SpaceInput<ID> input = {id, vec.data()};
+        exact.Upsert(input);
+        indexer.Upsert(input);
+    }
+    for (ID id = 0; id < 2000; id += 5) {
+        ASSERT_EQ(1, indexer.Delete(id));
+        exact.Delete(id);
+    }
+    ASSERT_EQ(indexer.Size(), 1600);
+
+    size_t hits = 0;
+    size_t total = 0;
+    for (ID id = 1; id < 2000; id += 37) {
+        if (id % 5 == 0) {
+            continue;
+        }
+        vector<SpaceResult<ID>> expected;
+        exact.GetNeighbors(id, 10, expected);
+        vector<SpaceResult<ID>> results;
+        indexer.GetNeighbors(id, 10, results);
+        ASSERT_FALSE(results.empty());
+        ASSERT_EQ(results[0].id, id);
+        for (auto& r : results) {
+            for (auto& e : expected) {
+                hits += (e.id == r.id);
+            }
+        }
+        total += expected.size();
+    }
+    ASSERT_GT(hits, 0.9 * total);
+}
+
+TEST(ann_test, ivfpq_upsert)
+{
+    IVFPQSpace<ID> indexer;
+    TestUpsert(indexer);
+}
+
+TEST(ann_test, ivfpq_upsert_delete)
+{
+    IVFPQSpace<ID> indexer;
+    TestUpsertDelete(indexer);
+}
+
+TEST(ann_test, ivfpq_recall)
+{
+    LinearSpace<ID> exact;
+    exact.Init(16);
+    IVFPQSpace<ID> coarse;
+    coarse.Config(16, 16, 4, 8, 0, 1000);
+    IVFPQSpace<ID> reranked;
+    reranked.Config(16, 16, 4, 8, 50, 1000);
+
+    // clustered data, so that a few lists hold most neighbors
+    vector<float> center(16);
+    vector<float> vec(16);
+    for (ID id = 0; id < 2000; ++id) {
+        if (id % 50 == 0) {
+            RandomFill(center.begin(), center.end(), 10000 + id);
+        }
+        RandomFill(vec.begin(), vec.end(), id);
+        for (size_t i = 0; i < vec.size(); ++i) {
+            vec[i] = center[i] + 0.2 * vec[i];
+        }
+        SpaceInput<ID> input = {id, vec.data()};
+        exact.Upsert(input);
+        coarse.Upsert(input);
+        reranked.Upsert(input);
+    }
+    for (ID id = 0; id < 2000; id += 5) {
+        ASSERT_EQ(1, coarse.Delete(id));
+        ASSERT_EQ(1, reranked.Delete(id));
+        exact.Delete(id);
+    }
+    ASSERT_EQ(coarse.Size(), 1600);
+
+    size_t coarse_hits = 0;
+    size_t reranked_hits = 0;
+    size_t total = 0;
+    for (ID id = 1; id < 2000; id += 37) {
+        if (id % 5 == 0) {
+            continue;
+        }
+        vector<SpaceResult<ID>> expected;
+        exact.GetNeighbors(id, 10, expected);
+        vector<SpaceResult<ID>> results1;
+        coarse.GetNeighbors(id, 10, results1);
+        vector<SpaceResult<ID>> results2;
+        reranked.GetNeighbors(id, 10, results2);
+        ASSERT_FALSE(results2.empty());
+        ASSERT_EQ(results2[0].id, id);
+        for (auto& e : expected) {
+            for (auto& r : results1) {
+                coarse_hits += (e.id == r.id);
+            }
+            for (auto& r : results2) {
+                reranked_hits += (e.id == r.id);
+            }
+        }
+        total += expected.size();
+    }
+    ASSERT_GT(coarse_hits, 0.5 * total);
+    ASSERT_GT(reranked_hits, 0.9 * total);
+}
+
+TEST(ann_test, pq4_fastscan)
+{
+    // 3 blocks of 7 sub-codes against a plain table lookup
+    size_t m = 7;
+    size_t nb_rows = 3 * kPQ4Block;
+    vector<uint8_t> codes(PQ4CodeBytes(nb_rows, m), 0);
+    vector<uint8_t> expected_codes(nb_rows * m);
+    boost::mt19937_64 prng(1);
+    for (size_t i = 0; i < nb_rows; ++i) {
+        for (size_t j = 0; j < m; ++j) {
+            expected_codes[i * m + j] = prng() % kPQ4Codewords;
+        }
+        PQ4SetCode(codes.data(), m, i, &expected_codes[i * m]);
+    }
+    vector<uint8_t> lut(PQ4Subspaces(m) * kPQ4Codewords, 0);
+    for (size_t j = 0; j < m * kPQ4Codewords; ++j) {
+        lut[j] = prng() % 256;
+    }
+
+    vector<uint16_t> sums(nb_rows);
+    PQ4FastScan(codes.data(), 3, m, lut.data(), sums.data());
+    for (size_t i = 0; i < nb_rows; ++i) {
+        uint8_t code[m];
+        PQ4GetCode(codes.data(), m, i, code);
+        uint16_t expected = 0;
+        for (size_t j = 0; j < m; ++j) {
+            ASSERT_EQ(code[j], expected_codes[i * m + j]);
+            expected += lut[j * kPQ4Codewords + code[j]];
+        }
+        ASSERT_EQ(sums[i], expected);
+    }
+}
+
+TEST(ann_test, ivfpq4_recall)
+{
+    LinearSpace<ID> exact;
+    exact.Init(16);
+    IVFPQSpace<ID> indexer;
+    indexer.Config(16, 16, 4, 8, 50, 1000, 4);
+
+    vector<float> center(16);
+    vector<float> vec(16);
+    for (ID id = 0; id < 2000; ++id) {
+        if (id % 50 == 0) {
+            RandomFill(center.begin(), center.end(), 10000 + id);
+        }
+        RandomFill(vec.begin(), vec.end(), id);
+        for (size_t i = 0; i < vec.size(); ++i) {
+            vec[i] = center[i] + 0.2 * vec[i];
+        }
+        SpaceInput<ID> input = {id, vec.data()};
+        exact.Upsert(input);
+        indexer.Upsert(input);
+    }
+    for (ID id = 0; id < 2000; id += 5) {
+        ASSERT_EQ(1, indexer.Delete(id));
+        exact.Delete(id);
+    }
+    ASSERT_EQ(indexer.Size(), 1600);
+
+    size_t hits = 0;
+    size_t total = 0;
+    for (ID id = 1; id < 2000; id += 37) {
+        if (id % 5 == 0) {
+            continue;
+        }
+        vector<SpaceResult<ID>> expected;
+        exact.GetNeighbors(id, 10, expected);
+        vector<SpaceResult<ID>> results;
+        indexer.GetNeighbors(id, 10, results);
+        ASSERT_FALSE(results.empty());
+        ASSERT_EQ(results[0].id, id);
+        for (auto& r : results) {
+            for (auto& e : expected) {
+                hits += (e.id == r.id);
+            }
+        }
+        total += expected.size();
+    }
+    ASSERT_GT(hits, 0.9 * total);
+}
+
+TEST(ann_test, rpforest_upsert)
+{
+    RPForestSpace<ID> indexer;
+    TestUpsert(indexer);
+}
+
+TEST(ann_test, rpforest_upsert_delete)
+{
+    RPForestSpace<ID> indexer;
+    TestUpsertDelete(indexer);
+}
+
+TEST(ann_test, rpforest_recall)
+{
+    LinearSpace<ID> exact;
+    exact.Init(16);
+    RPForestSpace<ID> indexer;
+    indexer.Config(16, 8, 16, 400);
+    for (ID id = 0; id < 2000; ++id) {
+        UpsertRandom(exact, id);
+        UpsertRandom(indexer, id);
+    }
+    indexer.Build();
+
+    // deletes and upserts after building
+    for (ID id = 0; id < 2000; id += 5) {
+        ASSERT_EQ(1, indexer.Delete(id));
+        exact.Delete(id);
+    }
+    for (ID id = 2000; id < 2100; ++id) {
+        UpsertRandom(exact, id);
+        UpsertRandom(indexer, id);
+    }
+    ASSERT_EQ(indexer.Size(), 1700);
+
+    size_t hits = 0;
+    size_t total = 0;
+    for (ID id = 1; id < 2100; id += 37) {
+        if (id % 5 == 0 && id < 2000) {
+            continue;
+        }
+        vector<SpaceResult<ID>> expected;
+        exact.GetNeighbors(id, 10, expected);
+        vector<SpaceResult<ID>> results;
+        indexer.GetNeighbors(id, 10, results);
+        ASSERT_FALSE(results.empty());
+        ASSERT_EQ(results[0].id, id);
+        for (auto& r : results) {
+            ASSERT_TRUE(r.id >= 2000 || r.id % 5 != 0);
+            for (auto& e : expected) {
+                hits += (e.id == r.id);
+            }
+        }
+        total += expected.size();
+    }
+    ASSERT_GT(hits, 0.9 * total);
+}
+
+TEST(ann_test, rpforest_save_load)
+{
+    RPForestSpace<ID> indexer;
+    indexer.Config(16, 4, 8);
+    for (ID id = 0; id < 500; ++id) {
+        UpsertRandom(indexer, id);
+    }
+    ASSERT_EQ(1, indexer.Delete(7));
+    char path[] = "/tmp/rpforestXXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    ASSERT_TRUE(indexer.Save(path));
+
+    RPForestSpace<ID> mapped;
+    mapped.Config(16);
+    ASSERT_TRUE(mapped.Load(path));
+    unlink(path);
+    ASSERT_EQ(mapped.Size(), 499);
+    ASSERT_EQ(0, UpsertRandom(mapped, 1000));
+    for (ID id = 0; id < 500; id += 13) {
+        vector<SpaceResult<ID>> expected;
+        indexer.GetNeighbors(id, 10, expected);
+        vector<SpaceResult<ID>> results;
+        mapped.GetNeighbors(id, 10, results);
+        ASSERT_EQ(results, expected);
+    }
+}
+
+TEST(ann_test, kdtree_upsert)
+{
+    KDTreeSpace<ID> indexer;
+    TestUpsert(indexer);
+}
+
+TEST(ann_test, kdtree_upsert_delete)
+{
+    KDTreeSpace<ID> indexer;
+    TestUpsertDelete(indexer);
+}
+
+template <typename Metric>
+void TestKDTreeMetric()
+{
+    // Clustered 8-d points, enough for a parallel build; then deleted rows
+    // and rows added after Build.  All searches must match a scan.
+    LinearSpace<ID, Metric> exact;
+    exact.Init(8);
+    KDTreeSpace<ID, Metric> indexer;
+    indexer.Init(8);
+    vector<float> center(8);
+    vector<float> vec(8);
+    auto upsert = [&] (ID id) {
+        if (id % 1000 == 0) {
+            RandomFill(center.begin(), center.end(), 10000 + id);
+        }
+        RandomFill(vec.begin(), vec.end(), id);
+        for (size_t i = 0; i < vec.size(); ++i) {
+            vec[i] = center[i] + 0.05 * vec[i];
+        }
+        SpaceInput<ID> input = {id, vec.data()};
+        ASSERT_EQ(1, exact.Upsert(input));
+        ASSERT_EQ(1, indexer.Upsert(input));
+    };
+    for (ID id = 0; id < 40000; ++id) {
+        upsert(id);
+    }
+    ASSERT_TRUE(indexer.Build());
+    for (ID id = 0; id < 40000; id += 7) {
+        ASSERT_EQ(1, exact.Delete(id));
+        ASSERT_EQ(1, indexer.Delete(id));
+    }
+    for (ID id = 40000; id < 40500; ++id) {
+        upsert(id);
+    }
+    ASSERT_EQ(exact.Size(), indexer.Size());
+
+    auto check = [] (const vector<SpaceResult<ID>>& results,
+                     const vector<SpaceResult<ID>>& expected) {
+        ASSERT_EQ(results.size(), expected.size());
+        for (size_t i = 0; i < results.size(); ++i) {
+            ASSERT_NEAR(results[i].dist, expected[i].dist, 1e-5);
+        }
+    };
+    SpaceFilter<ID> filter = SpaceFilter<ID>::Bits(vector<uint64_t>(BitWords(40500), 0x5555));
+    vector<float> point(8);
+    for (ID id = 1; id < 40500; id += 994) {
+        vector<SpaceResult<ID>> expected;
+        vector<SpaceResult<ID>> results;
+        exact.GetNeighbors(id, 10, expected);
+        indexer.GetNeighbors(id, 10, results);
+        check(results, expected);
+
+        ASSERT_TRUE(indexer.GetPoint(id, point.data()));
+        exact.GetNeighborsFiltered(point.data(), 10, filter, expected);
+        indexer.GetNeighborsFiltered(point.data(), 10, filter, results);
+        check(results, expected);
+
+        float max_dist = expected.back().dist + 1e-4;
+        exact.GetNeighborsWithin(point.data(), max_dist, expected);
+        indexer.GetNeighborsWithin(point.data(), max_dist, results);
+        check(results, expected);
+    }
+}
+
+TEST(ann_test, kdtree_matches_linear)
+{
+    TestKDTreeMetric<CosineMetric>();
+    TestKDTreeMetric<InnerProductMetric>();
+    TestKDTreeMetric<EuclideanMetric>();
+}
+
+TEST(ann_test, disk_upsert)
+{
+    DiskGraphSpace<ID> indexer;
+    TestUpsert(indexer);
+}
+
+TEST(ann_test, disk_upsert_delete)
+{
+    DiskGraphSpace<ID> indexer;
+    TestUpsertDelete(indexer);
+}
+
+TEST(ann_test, disk_build_recall)
+{
+    LinearSpace<ID> exact;
+    exact.Init(16);
+    DiskGraphSpace<ID> indexer;
+    indexer.Config(16, 16, 50, 1.2, 8, 50, 4, 2);
+    for (ID id = 0; id < 2000; ++id) {
+        UpsertRandom(exact, id);
+        UpsertRandom(indexer, id);
+    }
+    for (ID id = 0; id < 2000; id += 5) {
+        ASSERT_EQ(1, indexer.Delete(id));
+        exact.Delete(id);
+    }
+
+    char path[] = "/tmp/diskgraphXXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    ASSERT_TRUE(indexer.Build(path));
+    ASSERT_EQ(indexer.Size(), 1600);
+    ASSERT_EQ(0, UpsertRandom(indexer, 5000));
+
+    // the same file served through mmap
+    DiskGraphSpace<ID> mapped;
+    mapped.Config(16, 16, 50, 1.2, 8, 50, 4, 0);
+    ASSERT_TRUE(mapped.Open(path));
+    unlink(path);
+
+    size_t hits = 0;
+    size_t total = 0;
+    for (ID id = 1; id < 2000; id += 37) {
+        if (id % 5 == 0) {
+            continue;
+        }
+        vector<SpaceResult<ID>> expected;
+        exact.GetNeighbors(id, 10, expected);
+        vector<SpaceResult<ID>> results;
+        indexer.GetNeighbors(id, 10, results);
+        vector<SpaceResult<ID>> mapped_results;
+        mapped.GetNeighbors(id, 10, mapped_results);
+        ASSERT_EQ(results, mapped_results);
+        ASSERT_FALSE(results.empty());
+        ASSERT_EQ(results[0].id, id);
+        for (auto& r : results) {
+            for (auto& e : expected) {
+                hits += (e.id == r.id);
+            }
+        }
+        total += expected.size();
+    }
+    ASSERT_GT(hits, 0.9 * total);
+}
+
+TEST(ann_test, sharded_upsert)
+{
+    ShardedSpace<ID> indexer(4, [] { return new LSHSpace<ID>(); });
+    TestUpsert(indexer);
+}
+
+TEST(ann_test, sharded_upsert_delete)
+{
+    ShardedSpace<ID> indexer(4, [] { return new LSHSpace<ID>(); });
+    TestUpsertDelete(indexer);
+}
+
+TEST(ann_test, sharded_linear)
+{
+    // Sharded exact search must match a single exact index.
+    ShardedSpace<ID> indexer(5, [] { return new LinearSpace<ID>(); });
+    indexer.Init(16);
+    LinearSpace<ID> exact;
+    exact.Init(16);
+    vector<float> points(1000 * 16);
+    RandomFill(points.begin(), points.end());
+    vector<SpaceInput<ID>> inputs(1000);
+    for (ID id = 0; id < 1000; ++id) {
+        inputs[id].id = id;
+        inputs[id].point = &points[id * 16];
+    }
+    ASSERT_EQ(1000, indexer.UpsertMany(inputs));
+    ASSERT_EQ(1000, exact.UpsertMany(inputs));
+    vector<ID> dead;
+    for (ID id = 0; id < 1000; id += 7) {
+        dead.emplace_back(id);
+    }
+    ASSERT_EQ(dead.size(), indexer.DeleteMany(dead));
+    exact.DeleteMany(dead);
+    ASSERT_EQ(indexer.Size(), exact.Size());
+
+    vector<ID> ids;
+    indexer.GetIds(ids);
+    ASSERT_EQ(ids.size(), exact.Size());
+    for (ID id = 1; id < 1000; id += 13) {
+        vector<SpaceResult<ID>> expected;
+        exact.GetNeighbors(id, 10, expected);
+        vector<SpaceResult<ID>> results;
+        indexer.GetNeighbors(id, 10, results);
+        ASSERT_EQ(results.size(), expected.size());
+        for (size_t i = 0; i < results.size(); ++i) {
+            ASSERT_EQ(results[i].id, expected[i].id);
+            ASSERT_NEAR(results[i].dist, expected[i].dist, 1e-5);
+        }
+    }
+}
+
+Space<ID>* MakeLinear(size_t nb_dims) {
+    auto space = new LinearSpace<ID>();
+    space->Init(nb_dims);
+    return space;
+}
+
+TEST(ann_test, tiered_upsert)
+{
+    TieredSpace<ID> indexer(MakeLinear);
+    TestUpsert(indexer);
+}
+
+TEST(ann_test, tiered_upsert_delete)
+{
+    TieredSpace<ID> indexer(MakeLinear);
+    TestUpsertDelete(indexer);
+}
+
+TEST(ann_test, tiered_merge)
+{
+    // Across merges, updates and deletes, results must match a single
+    // exact index.
+    TieredSpace<ID> indexer(MakeLinear);
+    indexer.Config(16, 100);
+    LinearSpace<ID> exact;
+    exact.Init(16);
+    for (ID id = 0; id < 1000; ++id) {
+        ASSERT_EQ(1, UpsertRandom(indexer, id));
+        ASSERT_EQ(1, UpsertRandom(exact, id));
+    }
+    vector<float> vec(16);
+    for (ID id = 0; id < 1000; id += 11) {
+        RandomFill(vec.begin(), vec.end(), id + 5000);
+        SpaceInput<ID> input;
+        input.id = id;
+        input.point = vec.data();
+        ASSERT_EQ(1, indexer.Upsert(input));
+        ASSERT_EQ(1, exact.Upsert(input));
+    }
+    for (ID id = 3; id < 1000; id += 7) {
+        ASSERT_EQ(1, indexer.Delete(id));
+        exact.Delete(id);
+    }
+    ASSERT_EQ(0, indexer.Delete(3));
+
+    auto check = [&] {
+        ASSERT_EQ(indexer.Size(), exact.Size());
+        vector<ID> ids;
+        indexer.GetIds(ids);
+        ASSERT_EQ(ids.size(), exact.Size());
+        for (ID id = 1; id < 1000; id += 13) {
+            vector<SpaceResult<ID>> expected;
+            exact.GetNeighbors(id, 10, expected);
+            vector<SpaceResult<ID>> results;
+            indexer.GetNeighbors(id, 10, results);
+            ASSERT_EQ(results.size(), expected.size());
+            for (size_t i = 0; i < results.size(); ++i) {
+                ASSERT_EQ(results[i].id, expected[i].id);
+                ASSERT_NEAR(results[i].dist, expected[i].dist, 1e-5);
+            }
+        }
+    };
+    check();
+    indexer.Merge();
+    check();
+}
+
+TEST(ann_test, tiered_lsh_tombstones)
+{
+    // Widening the fetch past tombstones must not repeat results, even
+    // through a main index that appends to its output.
+    TieredSpace<ID> indexer([] (size_t nb_dims) -> Space<ID>* {
+        auto space = new LSHSpace<ID>();
+        space->Config(nb_dims, 4, 8);
+        return space;
+    });
+    indexer.Config(16, 100);
+    for (ID id = 0; id < 1000; ++id) {
+        ASSERT_EQ(1, UpsertRandom(indexer, id));
+    }
+    indexer.Merge();
+    for (ID id = 0; id < 1000; id += 2) {
+        ASSERT_EQ(1, indexer.Delete(id));
+    }
+    vector<SpaceResult<ID>> results;
+    for (ID id = 1; id < 1000; id += 5) {
+        indexer.GetNeighbors(id, 10, results);
+        ASSERT_FALSE(results.empty());
+        ASSERT_LE(results.size(), 10);
+        unordered_set<ID> seen;
+        for (auto& r : results) {
+            ASSERT_EQ(1, r.id % 2);
+            ASSERT_TRUE(seen.insert(r.id).second) << r.id;
+        }
+    }
+}
+
+TEST(ann_test, mips_upsert)
+{
+    MIPSSpace<ID> indexer(MakeLinear);
+    TestUpsert(indexer);
+}
+
+TEST(ann_test, mips_upsert_delete)
+{
+    MIPSSpace<ID> indexer(MakeLinear);
+    TestUpsertDelete(indexer);
+}
+
+TEST(ann_test, mips_reused_results)
+{
+    Space<ID>* made;
+    ASSERT_TRUE(MakeSpace("mips+lsh:L=4,k=8", &made, 16));
+    std::unique_ptr<Space<ID>> indexer(made);
+    for (ID id = 0; id < 500; ++id) {
+        ASSERT_EQ(1, UpsertRandom(*indexer, id));
+    }
+    vector<SpaceResult<ID>> results;
+    size_t nb_found = 0;
+    for (ID id = 0; id < 500; id += 7) {
+        indexer->GetNeighbors(id, 50, results);
+        ASSERT_LE(results.size(), 50);
+        indexer->GetNeighbors(id, 5, results);
+        ASSERT_LE(results.size(), 5);
+        nb_found += results.size();
+    }
+    ASSERT_GT(nb_found, 0);
+}
+
+TEST(ann_test, mips_exact)
+{
+    // Over exact inner spaces, results must match an inner product scan,
+    // while norms grow and after Build shrinks the bound.
+    LinearSpace<ID, InnerProductMetric> exact;
+    exact.Init(16);
+    MIPSSpace<ID> cosine(MakeLinear);
+    cosine.Config(16, 0.0, 1.5);
+    Space<ID>* made;
+    ASSERT_TRUE(MakeSpace("mips:headroom=1.5+linear:metric=l2", &made, 16));
+    std::unique_ptr<Space<ID>> l2(made);
+    ASSERT_STREQ("ip", l2->MetricName());
+
+    vector<float> vec(16);
+    float largest = 0.0;
+    for (ID id = 0; id < 500; ++id) {
+        RandomFill(vec.begin(), vec.end(), id);
+        for (auto& x : vec) {
+            x *= 1 + id / 50.0;
+        }
+        largest = std::max(largest, norm(vec.data(), 16));
+        SpaceInput<ID> input = {id, vec.data()};
+        ASSERT_EQ(1, exact.Upsert(input));
+        ASSERT_EQ(1, cosine.Upsert(input));
+        ASSERT_EQ(1, l2->Upsert(input));
+    }
+    for (ID id = 0; id < 500; id += 9) {
+        exact.Delete(id);
+        ASSERT_EQ(1, cosine.Delete(id));
+        ASSERT_EQ(1, l2->Delete(id));
+    }
+    ASSERT_GT(cosine.MaxNorm(), largest);
+
+    vector<float> point(16);
+    ASSERT_TRUE(cosine.GetPoint(ID(499), point.data()));
+    for (size_t i = 0; i < 16; ++i) {
+        ASSERT_NEAR(point[i], vec[i], 1e-4);
+    }
+
+    RandomFill(vec.begin(), vec.end(), 1000);
+    for (int pass = 0; pass < 2; ++pass) {
+        vector<SpaceResult<ID>> expected;
+        exact.GetNeighbors(vec.data(), 10, expected);
+        for (Space<ID>* indexer : {(Space<ID>*)&cosine, l2.get()}) {
+            vector<SpaceResult<ID>> results;
+            indexer->GetNeighbors(vec.data(), 10, results);
+            ASSERT_EQ(results.size(), expected.size());
+            for (size_t i = 0; i < results.size(); ++i) {
+                ASSERT_EQ(results[i].id, expected[i].id);
+                ASSERT_NEAR(results[i].dist, expected[i].dist, 1e-3 * std::abs(expected[i].dist));
+            }
+        }
+        ASSERT_TRUE(cosine.Build());
+        ASSERT_TRUE(l2->Build());
+        ASSERT_NEAR(cosine.MaxNorm(), largest, 1e-3);
+    }
+}
+
+TEST(ann_test, multi_upsert)
+{
+    MultiVectorSpace<ID> indexer(MakeLinear);
+    TestUpsert(indexer);
+}
+
+TEST(ann_test, multi_upsert_delete)
+{
+    MultiVectorSpace<ID> indexer(MakeLinear);
+    TestUpsertDelete(indexer);
+}
+
+TEST(ann_test, multi_exact)
+{
+    // Items of 1 to 4 vectors over an exact inner space: both aggregations
+    // must match a brute-force scoring of all items.
+    MultiVectorSpace<ID> max_sim(MakeLinear);
+    max_sim.Init(16);
+    Space<ID>* made;
+    ASSERT_TRUE(MakeSpace("multi:agg=sum,candidates=1000+linear", &made, 16));
+    std::unique_ptr<Space<ID>> sum_sim(made);
+    auto& sum = dynamic_cast<MultiVectorSpace<ID>&>(*sum_sim);
+
+    vector<vector<float>> items(300);
+    for (ID id = 0; id < 300; ++id) {
+        items[id].resize((1 + id % 4) * 16);
+        RandomFill(items[id].begin(), items[id].end(), id);
+        ASSERT_EQ(1, max_sim.UpsertMulti(id, items[id].data(), 1 + id % 4));
+        ASSERT_EQ(1, sum.UpsertMulti(id, items[id].data(), 1 + id % 4));
+    }
+    for (ID id = 0; id < 300; id += 5) {
+        ASSERT_EQ(1, max_sim.Delete(id));
+        ASSERT_EQ(1, sum.Delete(id));
+        items[id].clear();
+    }
+    ASSERT_EQ(240, max_sim.Size());
+    ASSERT_EQ(600, max_sim.NbVectors());
+
+    // A rejected vector leaves the item as it was.
+    vector<float> bad(items[1].size() + 16, 0.0);
+    ASSERT_EQ(0, max_sim.UpsertMulti(1, bad.data(), 2));
+    vector<float> points;
+    ASSERT_TRUE(max_sim.GetPoints(1, points));
+    ASSERT_EQ(points.size(), items[1].size());
+
+    vector<float> query(2 * 16);
+    vector<float> a(16);
+    vector<float> b(16);
+    for (int pass = 0; pass < 3; ++pass) {
+        RandomFill(query.begin(), query.end(), 1000 + pass);
+        vector<SpaceResult<ID>> max_expected;
+        vector<SpaceResult<ID>> sum_expected;
+        for (ID id = 0; id < 300; ++id) {
+            float best = 2.0;
+            float total = 0.0;
+            for (size_t v = 0; v * 16 < items[id].size(); ++v) {
+                normalize(b.data(), &items[id][v * 16], 16);
+                for (size_t q = 0; q < 2; ++q) {
+                    normalize(a.data(), &query[q * 16], 16);
+                    float dist = 1.0 - DotProduct(a.data(), b.data(), 16);
+                    best = std::min(best, dist);
+                    total += 1.0 - dist;
+                }
+            }
+            if (!items[id].empty()) {
+                max_expected.push_back({id, best});
+                sum_expected.push_back({id, -total});
+            }
+        }
+        std::sort(max_expected.begin(), max_expected.end());
+        std::sort(sum_expected.begin(), sum_expected.end());
+
+        vector<SpaceResult<ID>> results;
+        max_sim.GetNeighborsMulti(query.data(), 2, 10, results);
+        ASSERT_EQ(results.size(), 10);
+        for (size_t i = 0; i < results.size(); ++i) {
+            ASSERT_EQ(results[i].id, max_expected[i].id);
+            ASSERT_NEAR(results[i].dist, max_expected[i].dist, 1e-5);
+        }
+        sum.GetNeighborsMulti(query.data(), 2, 10, results);
+        ASSERT_EQ(results.size(), 10);
+        for (size_t i = 0; i < results.size(); ++i) {
+            ASSERT_EQ(results[i].id, sum_expected[i].id);
+            ASSERT_NEAR(results[i].dist, sum_expected[i].dist, 1e-4);
+        }
+    }
+
+    // Querying with an item finds it first, at distance 0.
+    vector<SpaceResult<ID>> results;
+    max_sim.GetNeighbors(ID(7), 5, results);
+    ASSERT_EQ(results[0].id, 7);
+    ASSERT_NEAR(results[0].dist, 0.0, 1e-5);
+}
+
+TEST(ann_test, sparse_upsert)
+{
+    SparseSpace<ID> indexer;
+    TestUpsert(indexer);
+}
+
+TEST(ann_test, sparse_upsert_delete)
+{
+    SparseSpace<ID> indexer;
+    TestUpsertDelete(indexer);
+}
+
+TEST(ann_test, sparse_exact)
+{
+    // Pruned top-k must match an exhaustive scan among the items sharing
+    // a dimension with the query, through updates and compactions.
+    size_t nb_dims = 300;
+    SparseSpace<ID> indexer;
+    indexer.Config(nb_dims, 8);
+    LinearSpace<ID> exact;
+    exact.Init(nb_dims);
+    boost::mt19937_64 prng(0);
+    vector<float> dense(nb_dims);
+    vector<uint32_t> indices(12);
+    vector<float> values(12);
+    for (ID id = 0; id < 12000; ++id) {
+        ID target = id % 9000;  // the last 3000 replace earlier items
+        RandomFill(values.begin(), values.end(), id);
+        std::fill(dense.begin(), dense.end(), 0.0);
+        for (size_t i = 0; i < indices.size(); ++i) {
+            indices[i] = prng() % nb_dims;
+            dense[indices[i]] += values[i];
+        }
+        SparseInput<ID> input = {target, indices.data(), values.data(), indices.size()};
+        ASSERT_EQ(1, indexer.UpsertSparse(input));
+        SpaceInput<ID> dense_input = {target, dense.data()};
+        ASSERT_EQ(1, exact.Upsert(dense_input));
+    }
+    for (ID id = 0; id < 9000; id += 3) {
+        ASSERT_EQ(1, indexer.Delete(id));
+        exact.Delete(id);
+    }
+    ASSERT_EQ(indexer.Size(), exact.Size());
+
+    for (ID id = 1; id < 9000; id += 129) {
+        vector<SpaceResult<ID>> expected;
+        exact.GetNeighbors(id, 10, expected);
+        vector<SpaceResult<ID>> results;
+        indexer.GetNeighbors(id, 10, results);
+        ASSERT_EQ(results.size(), expected.size());
+        for (size_t i = 0; i < results.size(); ++i) {
+            ASSERT_NEAR(results[i].dist, expected[i].dist, 1e-5);
+        }
+        ASSERT_EQ(results[0].id, id);
+    }
+
+    vector<float> one = {1.0};
+    vector<float> point(nb_dims);
+    ASSERT_TRUE(indexer.GetPoint(ID(1), point.data()));
+    ASSERT_FALSE(indexer.GetPoint(ID(3), point.data()));
+    vector<uint32_t> bad = {uint32_t(nb_dims)};
+    SparseInput<ID> out_of_range = {5000, bad.data(), one.data(), 1};
+    ASSERT_EQ(0, indexer.UpsertSparse(out_of_range));
+}
+
+TEST(ann_test, hamming_upsert)
+{
+    HammingSpace<ID> indexer;
+    TestUpsert(indexer);
+}
+
+TEST(ann_test, hamming_upsert_delete)
+{
+    HammingSpace<ID> indexer;
+    indexer.Config(10, 2);
+    TestUpsertDelete(indexer);
+}
+
+TEST(ann_test, hamming_tables_exact)
+{
+    // Multi-index hashing must match the scan, both for codes near the
+    // stored ones and for far ones that fall back to scanning.
+    size_t nb_bits = 250;
+    size_t words = BitWords(nb_bits);
+    HammingSpace<ID> scan;
+    scan.Config(nb_bits);
+    HammingSpace<ID> tables;
+    tables.Config(nb_bits, 10);
+    boost::mt19937_64 prng(0);
+    vector<uint64_t> centers(20 * words);
+    std::generate(centers.begin(), centers.end(), std::ref(prng));
+    vector<uint64_t> code(words);
+    for (ID id = 0; id < 24000; ++id) {
+        std::copy(&centers[(id % 20) * words], &centers[(id % 20 + 1) * words], code.begin());
+        for (int flip = 0; flip < 6; ++flip) {
+            size_t bit = prng() % nb_bits;
+            code[bit / 64] ^= uint64_t(1) << (bit % 64);
+        }
+        ASSERT_EQ(1, scan.UpsertCode(id % 20000, code.data()));
+        ASSERT_EQ(1, tables.UpsertCode(id % 20000, code.data()));
+    }
+    for (ID id = 0; id < 20000; id += 4) {
+        ASSERT_EQ(1, scan.Delete(id));
+        ASSERT_EQ(1, tables.Delete(id));
+    }
+    ASSERT_EQ(scan.Size(), tables.Size());
+
+    for (ID id = 1; id < 20000; id += 998) {
+        vector<SpaceResult<ID>> expected;
+        scan.GetNeighbors(id, 10, expected);
+        vector<SpaceResult<ID>> results;
+        tables.GetNeighbors(id, 10, results);
+        ASSERT_EQ(results.size(), 10);
+        ASSERT_EQ(results[0].id, id);
+        ASSERT_EQ(results[0].dist, 0);
+        for (size_t i = 0; i < results.size(); ++i) {
+            ASSERT_EQ(results[i].dist, expected[i].dist);
+        }
+    }
+
+    std::generate(code.begin(), code.end(), std::ref(prng));
+    vector<SpaceResult<ID>> expected;
+    scan.GetNeighborsCode(code.data(), 10, expected);
+    vector<SpaceResult<ID>> results;
+    tables.GetNeighborsCode(code.data(), 10, results);
+    ASSERT_EQ(results, expected);
+
+    vector<float> point(nb_bits);
+    ASSERT_TRUE(tables.GetPoint(ID(1), point.data()));
+    ASSERT_EQ(1, tables.Upsert({5000, point.data()}));
+    tables.GetNeighbors(ID(5000), 2, results);
+    ASSERT_EQ(results[0].dist, 0);
+    ASSERT_EQ(results[1].dist, 0);
+}
+
+TEST(ann_test, minhash_upsert)
+{
+    MinHashSpace<ID> indexer;
+    TestUpsert(indexer);
+}
+
+TEST(ann_test, minhash_upsert_delete)
+{
+    MinHashSpace<ID> indexer;
+    TestUpsertDelete(indexer);
+}
+
+TEST(ann_test, minhash_jaccard)
+{
+    // Each set has a variant sharing 80 of its 100 elements (Jaccard 2/3),
+    // which must be its nearest neighbor with a close estimate.
+    MinHashSpace<ID> indexer;
+    indexer.Config(0);
+    boost::mt19937_64 prng(0);
+    vector<vector<uint64_t>> sets(200, vector<uint64_t>(100));
+    for (ID id = 0; id < 200; ++id) {
+        std::generate(sets[id].begin(), sets[id].end(), std::ref(prng));
+        vector<uint64_t> variant(sets[id]);
+        std::generate(variant.begin(), variant.begin() + 20, std::ref(prng));
+        ASSERT_EQ(1, indexer.UpsertSet({id, sets[id].data(), sets[id].size()}));
+        ASSERT_EQ(1, indexer.UpsertSet({id + 1000, variant.data(), variant.size()}));
+    }
+    ASSERT_EQ(0, indexer.UpsertSet({5000, nullptr, 0}));
+    for (ID id = 0; id < 200; id += 2) {
+        ASSERT_EQ(1, indexer.Delete(id + 1000));
+    }
+    ASSERT_EQ(300, indexer.Size());
+
+    size_t found = 0;
+    float error = 0.0;
+    for (ID id = 0; id < 200; ++id) {
+        vector<SpaceResult<ID>> results;
+        indexer.GetNeighborsSet(sets[id].data(), sets[id].size(), 2, results);
+        ASSERT_EQ(results[0].id, id);
+        ASSERT_EQ(results[0].dist, 0);
+        if (id % 2 == 0) {
+            ASSERT_TRUE(results.size() < 2 || results[1].id != id + 1000);
+            continue;
+        }
+        found += (results.size() == 2 && results[1].id == id + 1000);
+        error += std::abs(indexer.Jaccard(id, id + 1000) - 2.0 / 3.0);
+    }
+    ASSERT_GE(found, 98);
+    ASSERT_LT(error / 100, 0.05);
+    ASSERT_EQ(-1.0, indexer.Jaccard(0, 1000));
+}
+
+vector<SpaceFilter<ID>> TestFilters() {
+    // Allow list (with a deleted and an unknown ID), deny list and bitset.
+    vector<ID> some;
+    for (ID id = 0; id < 1000; id += 3) {
+        some.emplace_back(id);
+    }
+    some.emplace_back(5000);
+    vector<uint64_t> bits(BitWords(1000), 0);
+    for (ID id = 0; id < 1000; id += 5) {
+        SetBit(bits, id);
+    }
+    return {SpaceFilter<ID>(some), SpaceFilter<ID>(some, true),
+            SpaceFilter<ID>::Bits(bits), SpaceFilter<ID>({1, 2, 4, 8, 16, 32})};
+}
+
+TEST(ann_test, filtered_exact)
+{
+    // Over exact spaces, filtered results must match a filtered full scan.
+    vector<float> points(1000 * 16);
+    RandomFill(points.begin(), points.end());
+    vector<SpaceInput<ID>> inputs(1000);
+    for (ID id = 0; id < 1000; ++id) {
+        inputs[id].id = id;
+        inputs[id].point = &points[id * 16];
+    }
+    LinearSpace<ID> plain, abandon;
+    plain.Init(16);
+    abandon.Config(16, true, 0.25, 0, 4);
+    ShardedSpace<ID> sharded(3, [] { return new LinearSpace<ID>(); });
+    sharded.Init(16);
+    TieredSpace<ID> tiered(MakeLinear);  // default over-fetching path
+    tiered.Config(16, 200);
+    vector<Space<ID>*> indexers = {&plain, &abandon, &sharded, &tiered};
+    for (auto indexer : indexers) {
+        ASSERT_EQ(1000, indexer->UpsertMany(inputs));
+        for (ID id = 0; id < 1000; id += 7) {
+            ASSERT_EQ(1, indexer->Delete(id));
+        }
+    }
+
+    vector<float> vec(16);
+    RandomFill(vec.begin(), vec.end(), 1000);
+    vector<SpaceResult<ID>> all;
+    plain.GetNeighbors(vec.data(), 1000, all);
+    for (auto& filter : TestFilters()) {
+        vector<SpaceResult<ID>> expected;
+        for (auto& r : all) {
+            if (filter.Allows(r.id) && expected.size() < 10) {
+                expected.emplace_back(r);
+            }
+        }
+        for (auto indexer : indexers) {
+            vector<SpaceResult<ID>> results;
+            indexer->GetNeighborsFiltered(vec.data(), 10, filter, results);
+            ASSERT_EQ(results.size(), expected.size());
+            for (size_t i = 0; i < results.size(); ++i) {
+                ASSERT_EQ(results[i].id, expected[i].id);
+                ASSERT_NEAR(results[i].dist, expected[i].dist, 1e-5);
+            }
+        }
+    }
+}
+
+TEST(ann_test, filtered_approximate)
+{
+    // Approximate spaces may miss neighbors but never return filtered-out
+    // items; a selective filter is answered exactly by LSH.
+    LSHSpace<ID> lsh;
+    lsh.Init(16);
+    LinearSpace<ID> shortlist;
+    shortlist.Config(16, false, 0.25, 50);
+    HNSWSpace<ID> hnsw;
+    hnsw.Init(16);
+    vector<Space<ID>*> indexers = {&lsh, &shortlist, &hnsw};
+    for (auto indexer : indexers) {
+        for (ID id = 0; id < 1000; ++id) {
+            ASSERT_EQ(1, UpsertRandom(*indexer, id));
+        }
+    }
+
+    vector<float> vec(16);
+    RandomFill(vec.begin(), vec.end(), 1000);
+    auto filters = TestFilters();
+    for (auto& filter : filters) {
+        for (auto indexer : indexers) {
+            vector<SpaceResult<ID>> results;
+            indexer->GetNeighborsFiltered(vec.data(), 10, filter, results);
+            for (auto& r : results) {
+                ASSERT_TRUE(filter.Allows(r.id));
+            }
+        }
+    }
+    vector<SpaceResult<ID>> results;
+    lsh.GetNeighborsFiltered(vec.data(), 10, filters.back(), results);
+    ASSERT_EQ(6, results.size());
+    for (size_t i = 1; i < results.size(); ++i) {
+        ASSERT_LE(results[i - 1].dist, results[i].dist);
+    }
+}
+
+TEST(ann_test, range_search)
+{
+    // Exact spaces must return all items within the radius, approximate
+    // ones a subset of them.
+    vector<float> points(1000 * 16);
+    RandomFill(points.begin(), points.end());
+    vector<SpaceInput<ID>> inputs(1000);
+    for (ID id = 0; id < 1000; ++id) {
+        inputs[id].id = id;
+        inputs[id].point = &points[id * 16];
+    }
+    LinearSpace<ID> plain, abandon;
+    plain.Init(16);
+    abandon.Config(16, true, 0.25, 0, 4);
+    abandon.ReorderDims();
+    ShardedSpace<ID> sharded(3, [] { return new LinearSpace<ID>(); });
+    sharded.Init(16);
+    TieredSpace<ID> tiered(MakeLinear);  // default doubling path
+    tiered.Config(16, 200);
+    LSHSpace<ID> lsh;
+    lsh.Config(16, 15, 8);
+    vector<Space<ID>*> exact = {&plain, &abandon, &sharded, &tiered};
+    vector<Space<ID>*> indexers = exact;
+    indexers.emplace_back(&lsh);
+    for (auto indexer : indexers) {
+        ASSERT_EQ(1000, indexer->UpsertMany(inputs));
+        for (ID id = 0; id < 1000; id += 7) {
+            ASSERT_EQ(1, indexer->Delete(id));
+        }
+    }
+
+    vector<SpaceResult<ID>> all;
+    for (float max_dist : {1e-4f, 0.4f, 0.8f}) {
+        plain.GetNeighbors(&points[16], 1000, all);
+        vector<SpaceResult<ID>> expected;
+        for (auto& r : all) {
+            if (r.dist <= max_dist) {
+                expected.emplace_back(r);
+            }
+        }
+        ASSERT_FALSE(expected.empty());
+        for (auto indexer : exact) {
+            vector<SpaceResult<ID>> results;
+            indexer->GetNeighborsWithin(&points[16], max_dist, results);
+            ASSERT_EQ(results.size(), expected.size());
+            for (size_t i = 0; i < results.size(); ++i) {
+                ASSERT_EQ(results[i].id, expected[i].id);
+                ASSERT_NEAR(results[i].dist, expected[i].dist, 1e-5);
+            }
+        }
+        vector<SpaceResult<ID>> results;
+        lsh.GetNeighborsWithin(&points[16], max_dist, results);
+        ASSERT_FALSE(results.empty());
+        ASSERT_LE(results.size(), expected.size());
+        for (size_t i = 0; i < results.size(); ++i) {
+            ASSERT_LE(results[i].dist, max_dist + 1e-5);
+            ASSERT_TRUE(i == 0 || results[i - 1].dist <= results[i].dist);
+        }
+    }
+}
+
+TEST(ann_test, make_space)
+{
+    // Every spec must build an engine that finds at least the query item.
+    const char* specs[] = {
+        "lsh:L=4,k=8", "linear", "linear:tombstones=1,shortlist=4",
+        "pivot:pivots=8", "hnsw:M=8,ef_search=32", "ivf:nlist=8,nprobe=8",
+        "ivf:nlist=8,pq=4x8,rerank=20", "rpforest:trees=4",
+        "sharded:shards=3+linear", "tiered:max_delta=10+hnsw:M=8",
+        "linear:metric=l2", "tiered:max_delta=10+hnsw:metric=l2", "kdtree:leaf_size=4",
+        "multi:agg=sum+hnsw:M=8", "tiered:max_delta=10+ivf:nlist=8,pq=4x8,rerank=20",
+    };
+    for (auto spec : specs) {
+        Space<ID>* space;
+        ASSERT_TRUE(MakeSpace(spec, &space, 16)) << spec;
+        std::unique_ptr<Space<ID>> owner(space);
+        ASSERT_EQ(16, space->Dim()) << spec;
+        ASSERT_EQ(string(strstr(spec, "l2") ? "l2" : "cosine"), space->MetricName()) << spec;
+        for (ID id = 0; id < 100; ++id) {
+            ASSERT_EQ(1, UpsertRandom(*space, id)) << spec;
+        }
+        ASSERT_TRUE(space->Build()) << spec;
+        vector<SpaceResult<ID>> results;
+        space->GetNeighbors(ID(7), 5, results);
+        ASSERT_FALSE(results.empty()) << spec;
+        ASSERT_LE(results.size(), 5) << spec;
+        ASSERT_EQ(ID(7), results[0].id) << spec;
+    }
+}
+
+TEST(ann_test, make_space_errors)
+{
+    const char* specs[] = {
+        "", "foo", "lsh:L", "lsh:L=4,L=5", "lsh:probes=4", "lsh:L=x",
+        "hnsw:M=1", "ivf:pq=4x3", "sharded", "sharded:shards=2+foo",
+        "linear:metric=foo", "minhash:b=64", "minhash:hashes=16,L=32", "multi",
+        "multi:agg=min+linear", "sharded+minhash", "tiered+minhash", "mips+minhash",
+        "multi+sharded+minhash", "tiered+hamming", "mips+hamming", "kdtree:metric=hamming",
+        "tiered+ivf:nlist=8,pq=4x8", "sharded+ivfpq",
+    };
+    for (auto spec : specs) {
+        Space<ID>* space;
+        ASSERT_FALSE(MakeSpace(spec, &space, 16)) << spec;
+        ASSERT_EQ(nullptr, space) << spec;
+    }
+}
+
+TEST(ann_test, make_space_paths)
+{
+    // Each sub-space of a wrapper gets its own file.
+    char dir[] = "/tmp/annpathsXXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir));
+    string path = string(dir) + "/v.bin";
+    string specs[] = {
+        "sharded:shards=3+mmap:chunk_rows=16,path=" + path,
+        "tiered:max_delta=20+mmap:chunk_rows=16,path=" + path,
+        "sharded:shards=2+tiered:max_delta=20+mmap:chunk_rows=16,path=" + path,
+    };
+    LinearSpace<ID> linear;
+    linear.Init(8);
+    for (ID id = 0; id < 200; ++id) {
+        ASSERT_EQ(1, UpsertRandom(linear, id));
+    }
+    for (auto& spec : specs) {
+        Space<ID>* space;
+        ASSERT_TRUE(MakeSpace(spec, &space, 8)) << spec;
+        std::unique_ptr<Space<ID>> owner(space);
+        for (ID id = 0; id < 200; ++id) {
+            ASSERT_EQ(1, UpsertRandom(*space, id)) << spec;
+        }
+        ASSERT_TRUE(space->Build()) << spec;
+        ASSERT_EQ(200, space->Size()) << spec;
+        vector<float> expected(8);
+        vector<float> point(8);
+        for (ID id = 0; id < 200; ++id) {
+            ASSERT_TRUE(linear.GetPoint(id, expected.data()));
+            ASSERT_TRUE(space->GetPoint(id, point.data())) << spec << " " << id;
+            for (size_t i = 0; i < 8; ++i) {
+                ASSERT_NEAR(expected[i], point[i], 1e-5) << spec << " " << id;
+            }
+        }
+    }
+    for (auto suffix : {".0", ".1", ".2", ".0.0", ".0.1", ".1.0", ".1.1"}) {
+        std::remove((path + suffix).c_str());
+        std::remove((path + suffix + ".ids").c_str());
+    }
+    ASSERT_EQ(0, rmdir(dir));
+}
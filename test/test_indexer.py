@@ -51,3 +51,134 @@ class TestLinearIndexer(unittest.TestCase):
         res = indexer.query_id(1)
         self.assertEqual(len(res), 2)
         self.assertSetEqual(set(res[0]), set([1, 2]))
+
+
+class TestHNSWIndexer(unittest.TestCase):
+
+    def test_query_point(self):
+        """query_point method should work
+        """
+        indexer = annx.HNSWIndexer(10)
+        vec = np.random.random(size=(10,)).astype(np.float32)
+        indexer.upsert(1, vec)
+        indexer.upsert(2, vec)
+        res = indexer.query_point(vec)
+        self.assertEqual(len(res), 2)
+        self.assertSetEqual(set(res[0]), set([1, 2]))
+
+    def test_query_id(self):
+        """query_id method should work
+        """
+        indexer = annx.HNSWIndexer(10)
+        vec = np.random.random(size=(10,)).astype(np.float32)
+        indexer.upsert(1, vec)
+        indexer.upsert(2, vec)
+        res = indexer.query_id(1)
+        self.assertEqual(len(res), 2)
+        self.assertSetEqual(set(res[0]), set([1, 2]))
+
+
+class TestSparseIndexer(unittest.TestCase):
+
+    def test_query_sparse(self):
+        """query_sparse method should work
+        """
+        indexer = annx.SparseIndexer(100000)
+        indices = np.array([3, 50000, 99999], dtype=np.uint32)
+        values = np.random.random(size=(3,)).astype(np.float32)
+        indexer.upsert_sparse(1, indices, values)
+        indexer.upsert_sparse(2, indices[:2], values[:2])
+        indexer.upsert_sparse(3, np.array([7], dtype=np.uint32), values[:1])
+        res = indexer.query_sparse(indices, values)
+        self.assertEqual(res[0][0], 1)
+        self.assertSetEqual(set(res[0]), set([1, 2]))
+
+
+class TestHammingIndexer(unittest.TestCase):
+
+    def test_query_code(self):
+        """query_code method should work
+        """
+        indexer = annx.HammingIndexer(100, tables=2)
+        code = np.array([0x0f0f, 0x3], dtype=np.uint64)
+        indexer.upsert_code(1, code)
+        indexer.upsert_code(2, code ^ np.array([1, 0], dtype=np.uint64))
+        indexer.upsert_code(3, ~code & np.array([2 ** 64 - 1, 2 ** 36 - 1], dtype=np.uint64))
+        res = indexer.query_code(code, 2)
+        self.assertEqual(list(res[0]), [1, 2])
+
+
+class TestMinHashIndexer(unittest.TestCase):
+
+    def test_query_set(self):
+        """query_set method should work
+        """
+        indexer = annx.MinHashIndexer()
+        elems = np.arange(100, dtype=np.uint64)
+        indexer.upsert_set(1, elems)
+        indexer.upsert_set(2, elems[:90])
+        indexer.upsert_set(3, elems + 1000)
+        res = indexer.query_set(elems, 2)
+        self.assertEqual(list(res[0]), [1, 2])
+        self.assertAlmostEqual(indexer.jaccard(1, 2), 0.9, delta=0.1)
+
+
+class TestSpaceIndexer(unittest.TestCase):
+
+    def test_query_id(self):
+        """indexers built from a spec should work
+        """
+        indexer = annx.SpaceIndexer(10, "sharded:shards=2+linear")
+        vec = np.random.random(size=(10,)).astype(np.float32)
+        indexer.upsert(1, vec)
+        indexer.upsert(2, vec)
+        indexer.build()
+        res = indexer.query_id(1)
+        self.assertEqual(len(res), 2)
+        self.assertSetEqual(set(res[0]), set([1, 2]))
+
+    def test_query_filtered(self):
+        """query_filtered should only return allowed ids
+        """
+        indexer = annx.SpaceIndexer(10, "linear")
+        for i in range(20):
+            vec = np.random.random(size=(10,)).astype(np.float32)
+            indexer.upsert(i, vec)
+        res = indexer.query_filtered(vec, [3, 5, 7])
+        self.assertSetEqual(set(res[0]), set([3, 5, 7]))
+        res = indexer.query_filtered(vec, [19], n_neighbors=5, exclude=True)
+        self.assertEqual(len(res[0]), 5)
+        self.assertNotIn(19, res[0])
+
+    def test_query_within(self):
+        """query_within should return the items within the radius
+        """
+        indexer = annx.SpaceIndexer(10, "linear")
+        vec = np.random.random(size=(10,)).astype(np.float32)
+        indexer.upsert(1, vec)
+        indexer.upsert(2, 2 * vec)
+        indexer.upsert(3, -vec)
+        res = indexer.query_within(vec, 0.5)
+        self.assertSetEqual(set(res[0]), set([1, 2]))
+
+    def test_bad_spec(self):
+        """bad specs should raise ValueError
+        """
+        with self.assertRaises(ValueError):
+            annx.SpaceIndexer(10, "linear:foo=1")
+
+
+class TestMultiVectorIndexer(unittest.TestCase):
+
+    def test_query_multi(self):
+        """items with several vectors should take one result each
+        """
+        indexer = annx.MultiVectorIndexer(10)
+        vecs = np.random.random(size=(3, 10)).astype(np.float32)
+        indexer.upsert_multi(1, vecs)
+        indexer.upsert_multi(2, -vecs[:1])
+        self.assertEqual(indexer.nb_vectors(), 4)
+        res = indexer.query_multi(vecs[:2])
+        self.assertEqual(list(res[0]), [1, 2])
+        indexer.remove(1)
+        self.assertEqual(indexer.nb_vectors(), 1)